@@ -616,6 +616,225 @@ int asn1EncodeInteger(int value, unsigned char *data, size_t length)
 
 
 
+/**
+ * Decode tag and length of the TLV object at the cursor position
+ *
+ * Tag and length field as well as the value field must fit into the remaining
+ * length of the list. Tags with up to four bytes and length fields with up to three
+ * subsequent bytes are supported. Objects with indefinite length are rejected.
+ *
+ * @param p         The first byte of the tag
+ * @param avail     The number of bytes available
+ * @param tag       Pointer to variable updated with the tag value
+ * @param length    Pointer to variable updated with the length of the value field
+ * @return          The length of tag and length field or -1 if the object is malformed
+ */
+static int asn1DecodeHeader(unsigned char *p, size_t avail, unsigned int *tag, size_t *length)
+{
+	size_t ofs, l;
+	int c;
+
+	if (avail < 2) {		// Object must have at least two bytes
+		return -1;
+	}
+
+	ofs = 0;
+	*tag = p[ofs];
+	if ((p[ofs] & 0x1F) == 0x1F) {
+		do	{				// Decode multi-byte tag
+			ofs++;
+			if ((ofs >= avail) || (ofs > 3)) {
+				return -1;
+			}
+			*tag = (*tag << 8) | p[ofs];
+		} while (p[ofs] & 0x80);
+	}
+	ofs++;
+
+	if (ofs >= avail) {		// Length missing
+		return -1;
+	}
+
+	l = p[ofs++];
+
+	if (l & 0x80) {			// Multi-byte length
+		c = l & 0x7F;
+		if ((c == 0) || (c > 3)) {
+			return -1;
+		}
+		if (ofs + c > avail) {
+			return -1;
+		}
+		l = 0;
+		while (c--) {
+			l = (l << 8) | p[ofs++];
+		}
+	}
+
+	if (l > avail - ofs) {
+		return -1;
+	}
+
+	*length = l;
+	return (int)ofs;
+}
+
+
+
+/**
+ * Initialize a cursor for the list of TLV objects in the given buffer
+ *
+ * The cursor is positioned before the first object. Use asn1CursorNext() to
+ * move to the first object.
+ *
+ * @param cursor    The cursor to initialize
+ * @param data      The first byte of the first object
+ * @param length    The length of the list of objects
+ */
+void asn1InitCursor(struct asn1Cursor *cursor, unsigned char *data, size_t length)
+{
+	cursor->next = data;
+	cursor->remaining = length;
+	cursor->obj = NULL;
+	cursor->tag = 0;
+	cursor->length = 0;
+	cursor->value = NULL;
+}
+
+
+
+/**
+ * Move the cursor to the next TLV object in the list
+ *
+ * After a successful call the fields obj, tag, length and value of the cursor
+ * describe the current object. The complete encoding of the current object
+ * spans from obj to next.
+ *
+ * @param cursor    The cursor
+ * @return          1 if the cursor moved to the next object, 0 at the end of the list or -1 if the object is malformed
+ */
+int asn1CursorNext(struct asn1Cursor *cursor)
+{
+	unsigned int tag;
+	size_t length;
+	int hl;
+
+	if (cursor->remaining == 0) {
+		return 0;
+	}
+
+	hl = asn1DecodeHeader(cursor->next, cursor->remaining, &tag, &length);
+	if (hl < 0) {
+		cursor->remaining = 0;
+		return -1;
+	}
+
+	cursor->obj = cursor->next;
+	cursor->tag = tag;
+	cursor->length = length;
+	cursor->value = cursor->next + hl;
+	cursor->next = cursor->value + length;
+	cursor->remaining -= hl + length;
+	return 1;
+}
+
+
+
+/**
+ * Determine the tag of the next object without moving the cursor
+ *
+ * @param cursor    The cursor
+ * @param tag       Pointer to variable updated with the tag of the next object
+ * @return          1 if a valid object follows, 0 at the end of the list or -1 if the object is malformed
+ */
+int asn1CursorPeek(struct asn1Cursor *cursor, unsigned int *tag)
+{
+	size_t length;
+
+	if (cursor->remaining == 0) {
+		return 0;
+	}
+
+	if (asn1DecodeHeader(cursor->next, cursor->remaining, tag, &length) < 0) {
+		return -1;
+	}
+	return 1;
+}
+
+
+
+/**
+ * Initialize a cursor for the objects contained in the value field of the current object
+ *
+ * @param cursor    The cursor positioned at a constructed object
+ * @param child     The cursor to initialize for the contained objects
+ * @return          0 or -1 if the cursor is not positioned at an object
+ */
+int asn1CursorEnter(struct asn1Cursor *cursor, struct asn1Cursor *child)
+{
+	if (cursor->obj == NULL) {
+		return -1;
+	}
+
+	asn1InitCursor(child, cursor->value, cursor->length);
+	return 0;
+}
+
+
+
+/**
+ * Move the cursor forward to the next object with the given tag
+ *
+ * Objects with a different tag are skipped without looking into their value field.
+ *
+ * @param cursor    The cursor
+ * @param tag       The tag to look for
+ * @return          1 if the object was found, 0 if not found or -1 if a malformed object was encountered
+ */
+int asn1CursorFind(struct asn1Cursor *cursor, unsigned int tag)
+{
+	int rc;
+
+	while ((rc = asn1CursorNext(cursor)) > 0) {
+		if (cursor->tag == tag) {
+			return 1;
+		}
+	}
+	return rc;
+}
+
+
+
+/**
+ * Locate an object along a path of tags in a single pass
+ *
+ * The first tag in the path is located in the list of objects at the cursor position,
+ * each subsequent tag in the value field of the object found for the preceding tag.
+ * If successful, the cursor is positioned at the object found for the last tag in
+ * the path and can be used to iterate over the siblings of that object.
+ *
+ * @param cursor    The cursor
+ * @param path      Path to the desired object (List of tags)
+ * @param level     Number of tags in the path
+ * @return          1 if the object was found, 0 if not found or -1 if a malformed object was encountered
+ */
+int asn1CursorFindPath(struct asn1Cursor *cursor, unsigned char *path, int level)
+{
+	struct asn1Cursor child;
+	int rc;
+
+	rc = asn1CursorFind(cursor, asn1Tag(&path));
+
+	while ((rc > 0) && (--level > 0)) {
+		asn1CursorEnter(cursor, &child);
+		*cursor = child;
+		rc = asn1CursorFind(cursor, asn1Tag(&path));
+	}
+	return rc;
+}
+
+
+
 /**
  * Internal selftest
  */
@@ -638,6 +857,7 @@ void testASN1()
 	unsigned char t15[] = { 0x24, 0x01, 0x01 };
 	unsigned char t16[] = { 0x24, 0x02, 0x01, 0x01 };
 	unsigned char t17[] = { 0x24, 0x06, 0x01, 0x01, 0x01, 0x02, 0x01, 0x01 };
+	struct asn1Cursor cursor, child;
 
 	assert(asn1Validate(t1, 0) == 1);
 	assert(asn1Validate(t1, 1) == 1);
@@ -658,4 +878,31 @@ void testASN1()
 	assert(asn1Validate(t15, sizeof(t15)) == 3);
 	assert(asn1Validate(t16, sizeof(t16)) == 4);
 	assert(asn1Validate(t17, sizeof(t17)) == 0);
+
+	asn1InitCursor(&cursor, t13, sizeof(t13));
+	assert(asn1CursorNext(&cursor) == 1);
+	assert((cursor.tag == 0x24) && (cursor.length == 3) && (cursor.remaining == 0));
+	assert(asn1CursorEnter(&cursor, &child) == 0);
+	assert(asn1CursorNext(&child) == 1);
+	assert((child.tag == 0x01) && (child.length == 1) && (*child.value == 0x01));
+	assert(asn1CursorNext(&child) == 0);
+	assert(asn1CursorNext(&cursor) == 0);
+
+	asn1InitCursor(&cursor, t16, sizeof(t16));
+	assert(asn1CursorNext(&cursor) == 1);
+	asn1CursorEnter(&cursor, &child);
+	assert(asn1CursorNext(&child) == -1);
+
+	asn1InitCursor(&cursor, t10, sizeof(t10));
+	assert(asn1CursorNext(&cursor) == -1);
+	asn1InitCursor(&cursor, t12, sizeof(t12));
+	assert(asn1CursorNext(&cursor) == -1);
+	asn1InitCursor(&cursor, t5, sizeof(t5));
+	assert(asn1CursorNext(&cursor) == -1);
+
+	asn1InitCursor(&cursor, t17, sizeof(t17));
+	assert(asn1CursorFindPath(&cursor, (unsigned char *)"\x24\x02", 2) == 1);
+	assert((cursor.tag == 0x02) && (cursor.length == 1) && (cursor.next == t17 + sizeof(t17)));
+	asn1InitCursor(&cursor, t17, sizeof(t17));
+	assert(asn1CursorFindPath(&cursor, (unsigned char *)"\x24\x03", 2) == 0);
 }
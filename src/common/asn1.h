@@ -51,6 +51,22 @@ extern "C" {
 #define ASN1_UTF8String         0x0C
 #define ASN1_SEQUENCE           0x30
 
+/**
+ * Cursor for the bounded, single pass traversal of a list of TLV objects
+ *
+ * Tag and length of each object are validated against the remaining length of
+ * the enclosing object when the cursor moves to it. Nested objects are only
+ * validated if the cursor descends into them with asn1CursorEnter().
+ */
+struct asn1Cursor {
+	unsigned char *next;		// First byte of the next object
+	size_t remaining;			// Number of bytes remaining in the list
+	unsigned char *obj;			// First byte of the current object
+	unsigned int tag;			// Tag of the current object
+	size_t length;				// Length of the value field of the current object
+	unsigned char *value;		// Value field of the current object
+};
+
 unsigned int    asn1Tag(unsigned char **Ref);
 int             asn1Length(unsigned char **Ref);
 void            asn1StoreTag(unsigned char **Ref, unsigned short Tag);
@@ -67,6 +83,13 @@ void            asn1DecodeFlags(unsigned char *data, size_t length, unsigned lon
 void            asn1EncodeFlags(unsigned long flags, unsigned char *data, size_t length);
 int             asn1DecodeInteger(unsigned char *data, size_t length, int *value);
 int             asn1EncodeInteger(int value, unsigned char *data, size_t length);
+void            asn1InitCursor(struct asn1Cursor *cursor, unsigned char *data, size_t length);
+int             asn1CursorNext(struct asn1Cursor *cursor);
+int             asn1CursorPeek(struct asn1Cursor *cursor, unsigned int *tag);
+int             asn1CursorEnter(struct asn1Cursor *cursor, struct asn1Cursor *child);
+int             asn1CursorFind(struct asn1Cursor *cursor, unsigned int tag);
+int             asn1CursorFindPath(struct asn1Cursor *cursor, unsigned char *path, int level);
+void            testASN1();
 
 /* Support for C++ compiler ----------------------------------------------- */
 
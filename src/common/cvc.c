@@ -33,11 +33,7 @@
 
 #include "cvc.h"
 #include "asn1.h"
-
-
-#ifdef DEBUG
-extern void debug(char *, ...);
-#endif
+#include "debug.h"
 
 
 static struct ec_curve curves[] = {
@@ -212,16 +208,12 @@ int cvcDetermineCurveFromECParam(unsigned char *ecparam, size_t ecparamlen, stru
 	length = (int)ecparamlen;
 
 	if (!asn1Next(&po, &length, &tag, &childrenlen, &children)) {
-#ifdef DEBUG
 		debug("Error decoding ecParameter");
-#endif
 		return -1;
 	}
 
 	if (tag != ASN1_SEQUENCE) {
-#ifdef DEBUG
 		debug("ecParameter not a SEQUENCE");
-#endif
 		return -1;
 	}
 
@@ -230,61 +222,45 @@ int cvcDetermineCurveFromECParam(unsigned char *ecparam, size_t ecparamlen, stru
 
 	// version
 	if (!asn1Next(&po, &length, &tag, &vallen, &val)) {
-#ifdef DEBUG
 		debug("Error decoding version");
-#endif
 		return -1;
 	}
 
 	if ((tag != ASN1_INTEGER) || (vallen != 1) || (*val != 0x01)) {
-#ifdef DEBUG
 		debug("version not INTEGER, length = 1 or value = 1");
-#endif
 return -1;
 	}
 
 	// fieldID
 	if (!asn1Next(&po, &length, &tag, &childrenlen, &children)) {
-#ifdef DEBUG
 		debug("Error decoding fieldID");
-#endif
 		return -1;
 	}
 
 	if (tag != ASN1_SEQUENCE) {
-#ifdef DEBUG
 		debug("fieldID not a SEQUENCE");
-#endif
 		return -1;
 	}
 
 	// fieldType
 	if (!asn1Next(&children, &childrenlen, &tag, &vallen, &val)) {
-#ifdef DEBUG
 		debug("Error decoding fieldType");
-#endif
 		return -1;
 	}
 
 	if ((tag != ASN1_OBJECT_IDENTIFIER) || (vallen != 7) || (*(val + 6) != 0x01)) {
-#ifdef DEBUG
 		debug("fieldType not OBJECT IDENTIFIER, length = 7 or value = prime-field");
-#endif
 		return -1;
 	}
 
 	// prime
 	if (!asn1Next(&children, &childrenlen, &tag, &vallen, &val)) {
-#ifdef DEBUG
 		debug("Error decoding prime");
-#endif
 		return -1;
 	}
 
 	if (tag != ASN1_INTEGER) {
-#ifdef DEBUG
 		debug("prime not INTEGER");
-#endif
 		return -1;
 	}
 
@@ -298,31 +274,23 @@ return -1;
 
 	// curve
 	if (!asn1Next(&po, &length, &tag, &childrenlen, &children)) {
-#ifdef DEBUG
 		debug("Error decoding curve");
-#endif
 		return -1;
 	}
 
 	if (tag != ASN1_SEQUENCE) {
-#ifdef DEBUG
 		debug("curve not a SEQUENCE");
-#endif
 		return -1;
 	}
 
 	// a
 	if (!asn1Next(&children, &childrenlen, &tag, &vallen, &val)) {
-#ifdef DEBUG
 		debug("Error decoding curve parameter a");
-#endif
 		return -1;
 	}
 
 	if (tag != ASN1_OCTET_STRING) {
-#ifdef DEBUG
 		debug("parameter a not OCTET STRING");
-#endif
 		return -1;
 	}
 
@@ -331,16 +299,12 @@ return -1;
 
 	// b
 	if (!asn1Next(&children, &childrenlen, &tag, &vallen, &val)) {
-#ifdef DEBUG
 		debug("Error decoding curve parameter b");
-#endif
 		return -1;
 	}
 
 	if (tag != ASN1_OCTET_STRING) {
-#ifdef DEBUG
 		debug("parameter b not OCTET STRING");
-#endif
 		return -1;
 	}
 
@@ -349,16 +313,12 @@ return -1;
 
 	// base
 	if (!asn1Next(&po, &length, &tag, &vallen, &val)) {
-#ifdef DEBUG
 		debug("Error decoding base");
-#endif
 		return -1;
 	}
 
 	if ((tag != ASN1_OCTET_STRING) || (*val != 0x04)) {
-#ifdef DEBUG
 		debug("parameter base not OCTET STRING or not uncompressed format");
-#endif
 		return -1;
 	}
 
@@ -367,16 +327,12 @@ return -1;
 
 	// order
 	if (!asn1Next(&po, &length, &tag, &vallen, &val)) {
-#ifdef DEBUG
 		debug("Error decoding order");
-#endif
 		return -1;
 	}
 
 	if (tag != ASN1_INTEGER) {
-#ifdef DEBUG
 		debug("parameter order not INTEGER");
-#endif
 		return -1;
 	}
 
@@ -390,16 +346,12 @@ return -1;
 
 	// cofactor
 	if (!asn1Next(&po, &length, &tag, &vallen, &val)) {
-#ifdef DEBUG
 		debug("Error decoding cofactor");
-#endif
 		return -1;
 	}
 
 	if (tag != ASN1_INTEGER) {
-#ifdef DEBUG
 		debug("parameter cofactor not INTEGER");
-#endif
 		return -1;
 	}
 
@@ -416,157 +368,167 @@ return -1;
 
 
 
-int cvcDecode(unsigned char *cert, size_t certlen, struct cvc *cvc)
+/**
+ * Move the cursor to the next object, which must have the given tag
+ *
+ * @param cursor    The cursor
+ * @param tag       The expected tag
+ * @param field     The bytestring receiving the value field or NULL
+ * @return          0 or -1 if the object is missing, malformed or has a different tag
+ */
+static int cvcNextField(struct asn1Cursor *cursor, unsigned int tag, struct bytestring_s *field)
 {
-	int rc, rlen, tag, outertag, length, childrenlen;
-	unsigned char *po, *ppo, *val, *children;
+	if ((asn1CursorNext(cursor) <= 0) || (cursor->tag != tag)) {
+		return -1;
+	}
+
+	if (field != NULL) {
+		field->val = cursor->value;
+		field->len = cursor->length;
+	}
+	return 0;
+}
 
-	memset(cvc, 0, sizeof(struct cvc));
 
-	rc = (int)asn1Validate(cert, certlen);
 
-	if (rc != 0) {
+/**
+ * Decode the next object into field, if it has the given tag
+ *
+ * @param cursor    The cursor
+ * @param tag       The tag of the optional object
+ * @param field     The bytestring receiving the value field
+ * @return          0 or -1 if the next object is malformed
+ */
+static int cvcOptionalField(struct asn1Cursor *cursor, unsigned int tag, struct bytestring_s *field)
+{
+	unsigned int next;
+	int rc;
+
+	rc = asn1CursorPeek(cursor, &next);
+	if (rc < 0) {
 		return -1;
 	}
 
-	po = cert;
-	if (!asn1Next(&cert, (int *)&certlen, &outertag, &childrenlen, &children)) {
+	if ((rc > 0) && (next == tag)) {
+		return cvcNextField(cursor, tag, field);
+	}
+	return 0;
+}
+
+
+
+int cvcDecode(unsigned char *cert, size_t certlen, struct cvc *cvc)
+{
+	struct asn1Cursor outer, cur, body, puk;
+
+	memset(cvc, 0, sizeof(struct cvc));
+
+	asn1InitCursor(&outer, cert, certlen);
+
+	if (asn1CursorNext(&outer) <= 0) {
 		return -1;
 	}
 
-	certlen = cert - po;
+	certlen = outer.next - cert;
 
-	if (outertag == 0x67) {			// CVC Request
-		po = children;
-		rlen = childrenlen;
+	if (outer.tag == 0x67) {			// CVC Request
+		asn1CursorEnter(&outer, &cur);
 
-		if (!asn1Next(&po, &rlen, &outertag, &childrenlen, &children)) {	// Decode later
+		if (asn1CursorNext(&cur) <= 0) {	// Decode later
 			return -1;
 		}
 
-		if (!asn1Next(&po, &rlen, &tag, (int *)&cvc->outer_car.len, &cvc->outer_car.val) || (tag != 0x42)) {
+		outer = cur;
+
+		if (cvcNextField(&cur, 0x42, &cvc->outer_car) < 0) {
 			return -1;
 		}
 
-		if (!asn1Next(&po, &rlen, &tag, (int *)&cvc->outerSignature.len, &cvc->outerSignature.val) || (tag != 0x5F37)) {
+		if (cvcNextField(&cur, 0x5F37, &cvc->outerSignature) < 0) {
 			return -1;
 		}
 
-		if (rlen > 0) {
+		if (cur.remaining > 0) {
 			return -1;
 		}
 	}
 
-	if (outertag != 0x7F21) {
+	if (outer.tag != 0x7F21) {
 		return -1;
 	}
 
-	po = children;
-	rlen = childrenlen;
+	asn1CursorEnter(&outer, &cur);
 
-	if (!asn1Next(&po, &rlen, &tag, &childrenlen, &children) || (tag != 0x7F4E)) {		// Decode later
+	if (cvcNextField(&cur, 0x7F4E, NULL) < 0) {		// Decode later
 		return -1;
 	}
 
-	if (!asn1Next(&po, &rlen, &tag, (int *)&cvc->signature.len, &cvc->signature.val) || (tag != 0x5F37)) {
-		return -1;
-	}
+	asn1CursorEnter(&cur, &body);
 
-	if (rlen > 0) {
+	if (cvcNextField(&cur, 0x5F37, &cvc->signature) < 0) {
 		return -1;
 	}
 
-	po = children;
-	rlen = childrenlen;
-
-	if (!asn1Next(&po, &rlen, &tag, &length, &val) || (tag != 0x5F29) || (*val != 0)) {
+	if (cur.remaining > 0) {
 		return -1;
 	}
 
-	ppo = po;
-	if (asn1Tag(&ppo) == 0x42) {
-		if (!asn1Next(&po, &rlen, &tag, (int *)&cvc->car.len, &cvc->car.val)) {
-			return -1;
-		}
+	if ((cvcNextField(&body, 0x5F29, NULL) < 0) || (body.length < 1) || (*body.value != 0)) {
+		return -1;
 	}
 
-	if (!asn1Next(&po, &rlen, &tag, &childrenlen, &children) || (tag != 0x7F49)) {
+	if (cvcOptionalField(&body, 0x42, &cvc->car) < 0) {
 		return -1;
 	}
 
-	if (!asn1Next(&po, &rlen, &tag, (int *)&cvc->chr.len, &cvc->chr.val) || (tag != 0x5F20)) {
+	if (cvcNextField(&body, 0x7F49, NULL) < 0) {
 		return -1;
 	}
 
-	ppo = po;
-	if ((rlen > 0) && (asn1Tag(&ppo) == 0x7F4C)) {
-		if (!asn1Next(&po, &rlen, &tag, (int *)&cvc->chat.len, &cvc->chat.val)) {
-			return -1;
-		}
-	}
+	asn1CursorEnter(&body, &puk);
 
-	ppo = po;
-	if ((rlen > 0) && (asn1Tag(&ppo) == 0x5F25)) {
-		if (!asn1Next(&po, &rlen, &tag, (int *)&cvc->ced.len, &cvc->ced.val)) {
-			return -1;
-		}
+	if (cvcNextField(&body, 0x5F20, &cvc->chr) < 0) {
+		return -1;
 	}
 
-	ppo = po;
-	if ((rlen > 0) && (asn1Tag(&ppo) == 0x5F24)) {
-		if (!asn1Next(&po, &rlen, &tag, (int *)&cvc->cxd.len, &cvc->cxd.val)) {
-			return -1;
-		}
+	if ((cvcOptionalField(&body, 0x7F4C, &cvc->chat) < 0) ||
+		(cvcOptionalField(&body, 0x5F25, &cvc->ced) < 0) ||
+		(cvcOptionalField(&body, 0x5F24, &cvc->cxd) < 0)) {
+		return -1;
 	}
 
-	if (rlen > 0) {
-		if (!asn1Next(&po, &rlen, &tag, (int *)&cvc->extensions.len, &cvc->extensions.val) || (tag != 0x65)) {
+	if (body.remaining > 0) {
+		if (cvcNextField(&body, 0x65, &cvc->extensions) < 0) {
 			return -1;
 		}
-		if (rlen > 0) {
+		if (body.remaining > 0) {
 			return -1;
 		}
 	}
 
-	po = children;
-	rlen = childrenlen;
+	if (cvcNextField(&puk, 0x06, &cvc->pukoid) < 0) {
+		return -1;
+	}
 
-	if (!asn1Next(&po, &rlen, &tag, (int *)&cvc->pukoid.len, &cvc->pukoid.val) || (tag != 0x06)) {
+	if (cvcOptionalField(&puk, 0x86, &cvc->publicPoint) < 0) {
 		return -1;
 	}
 
-	ppo = po;
-	if ((rlen > 0) && (asn1Tag(&ppo) == 0x86)) {
-		if (!asn1Next(&po, &rlen, &tag, (int *)&cvc->publicPoint.len, &cvc->publicPoint.val) || (tag != 0x86)) {
-			return -1;
-		}
-	} else {
-		if (!asn1Next(&po, &rlen, &tag, (int *)&cvc->primeOrModulus.len, &cvc->primeOrModulus.val) || (tag != 0x81)) {
+	if (cvc->publicPoint.val == NULL) {
+		if (cvcNextField(&puk, 0x81, &cvc->primeOrModulus) < 0) {
 			return -1;
 		}
 
-		if (!asn1Next(&po, &rlen, &tag, (int *)&cvc->coefficientAorExponent.len, &cvc->coefficientAorExponent.val) || (tag != 0x82)) {
+		if (cvcNextField(&puk, 0x82, &cvc->coefficientAorExponent) < 0) {
 			return -1;
 		}
 
-		if (rlen > 0) {
-			if (!asn1Next(&po, &rlen, &tag, (int *)&cvc->coefficientB.len, &cvc->coefficientB.val) || (tag != 0x83)) {
-				return -1;
-			}
-
-			if (!asn1Next(&po, &rlen, &tag, (int *)&cvc->basePointG.len, &cvc->basePointG.val) || (tag != 0x84)) {
-				return -1;
-			}
-
-			if (!asn1Next(&po, &rlen, &tag, (int *)&cvc->order.len, &cvc->order.val) || (tag != 0x85)) {
-				return -1;
-			}
-
-			if (!asn1Next(&po, &rlen, &tag, (int *)&cvc->publicPoint.len, &cvc->publicPoint.val) || (tag != 0x86)) {
-				return -1;
-			}
-
-			if (!asn1Next(&po, &rlen, &tag, (int *)&cvc->cofactor.len, &cvc->cofactor.val) || (tag != 0x87)) {
+		if (puk.remaining > 0) {
+			if ((cvcNextField(&puk, 0x83, &cvc->coefficientB) < 0) ||
+				(cvcNextField(&puk, 0x84, &cvc->basePointG) < 0) ||
+				(cvcNextField(&puk, 0x85, &cvc->order) < 0) ||
+				(cvcNextField(&puk, 0x86, &cvc->publicPoint) < 0) ||
+				(cvcNextField(&puk, 0x87, &cvc->cofactor) < 0)) {
 				return -1;
 			}
 		}
@@ -29,12 +29,26 @@
  * @file    debug.c
  * @author  Frank Thater, Andreas Schwier
  * @brief   Debug and logging functions
+ *
+ * The log level is set at runtime with PKCS11_LOG_LEVEL as number or name
+ * (0/off, 1/error, 2/debug, 3/trace). Builds with DEBUG defined default to trace,
+ * other builds to off. The log is written to PKCS11_LOG_FILE or to a file in the users home
+ * directory named after the module and process id.
+ *
+ * A disabled log level costs a single comparison at the call site. Enabled records are
+ * formatted into a ring buffer owned by the calling thread, without locking or I/O. A
+ * background thread drains all ring buffers periodically and writes records in batches.
+ * If a ring buffer is full, records are dropped and the number of lost records is logged.
+ * Messages longer than a record, like APDU dumps, continue in the following records.
+ *
+ * The minidriver writes records synchronously, because the writer thread could not be
+ * joined safely when the DLL is unloaded.
  */
 
-#ifdef DEBUG
-
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -44,17 +58,49 @@
 #include <windows.h>
 #include <io.h>
 #else
-#include <stdlib.h>
 #include <unistd.h>
-#include <pthread.h>
+#include <sys/time.h>
 #endif
 
+#include "threadring.h"
 #include "debug.h"
 
+#ifdef DEBUG
+#define LOG_LEVEL_DEFAULT	LOG_LEVEL_TRACE
+#else
+#define LOG_LEVEL_DEFAULT	LOG_LEVEL_OFF
+#endif
+
+int logLevel = LOG_LEVEL_DEFAULT;
+
 FILE *debugFileHandle = NULL;
 
 #define bcddigit(x) ((x) >= 10 ? 'A' - 10 + (x) : '0' + (x))
 
+#define LOG_RECORD_SIZE		512		/* Maximum length of a log record including terminator */
+#define LOG_RING_SIZE		512		/* Number of records per thread, must be a power of 2  */
+#define LOG_FLUSH_INTERVAL	100		/* Interval in ms for writing records to the log file  */
+
+
+
+struct logRecord {
+	time_t time;                        /**< Time when the record was created        */
+	int millis;                         /**< Milliseconds                            */
+	int continued;                      /**< Continues the text of the previous record */
+	char text[LOG_RECORD_SIZE];         /**< The formatted message                   */
+};
+
+
+
+static void writeLogRecord(struct threadRingSet *set, struct threadRing *ring, void *entry);
+static void reportLostRecords(struct threadRingSet *set, struct threadRing *ring, unsigned long count);
+static void flushLog(struct threadRingSet *set);
+
+static struct threadRingSet logRings = {
+	sizeof(struct logRecord), LOG_RING_SIZE, 0, LOG_FLUSH_INTERVAL,
+	writeLogRecord, reportLostRecords, flushLog
+};
+
 
 
 /*
@@ -72,10 +118,114 @@ void decodeBCDString(unsigned char *Inbuff, int len, char *Outbuff)
 }
 
 
+
+static void getTime(time_t *t, int *millis)
+{
+#ifdef _WIN32
+	SYSTEMTIME st;
+
+	time(t);
+	GetSystemTime(&st);
+	*millis = st.wMilliseconds;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	*t = tv.tv_sec;
+	*millis = (int)(tv.tv_usec / 1000);
+#endif
+}
+
+
+
+static void writeRecord(time_t t, int millis, unsigned long tid, char *text)
+{
+	static time_t lastTime = 0;
+	static char timestr[64];
+	struct tm loctim;
+
+	// Formatting the time is expensive, so it is done at most once per second
+	if ((t != lastTime) || (timestr[0] == 0)) {
+#ifdef _WIN32
+		localtime_s(&loctim, &t);
+#else
+		localtime_r(&t, &loctim);
+#endif
+		sprintf(timestr, "%02d.%02d.%04d %02d:%02d:%02d",
+				loctim.tm_mday,
+				loctim.tm_mon + 1,
+				loctim.tm_year + 1900,
+				loctim.tm_hour,
+				loctim.tm_min,
+				loctim.tm_sec);
+		lastTime = t;
+	}
+
+	fprintf(debugFileHandle, "%s.%03d [%lu] %s", timestr, millis, tid, text);
+}
+
+
+
+static void writeLogRecord(struct threadRingSet *set, struct threadRing *ring, void *entry)
+{
+	struct logRecord *rec = (struct logRecord *)entry;
+
+	if (rec->continued)
+		fputs(rec->text, debugFileHandle);
+	else
+		writeRecord(rec->time, rec->millis, ring->tid, rec->text);
+}
+
+
+
+static void reportLostRecords(struct threadRingSet *set, struct threadRing *ring, unsigned long count)
+{
+	char scr[64];
+
+	sprintf(scr, "%lu log records lost\n", count);
+	writeRecord(time(NULL), 0, ring->tid, scr);
+}
+
+
+
+static void flushLog(struct threadRingSet *set)
+{
+	fflush(debugFileHandle);
+}
+
+
+
+static int getLevelFromEnvironment()
+{
+	static char *names[] = { "off", "error", "debug", "trace" };
+	char *val;
+	int i;
+
+	val = getenv("PKCS11_LOG_LEVEL");
+
+	if (val == NULL)
+		return LOG_LEVEL_DEFAULT;
+
+	for (i = 0; i < sizeof(names) / sizeof(*names); i++) {
+		if (!strcmp(val, names[i]))
+			return i;
+	}
+
+	i = atoi(val);
+
+	if (i < LOG_LEVEL_OFF)
+		return LOG_LEVEL_OFF;
+	if (i > LOG_LEVEL_TRACE)
+		return LOG_LEVEL_TRACE;
+	return i;
+}
+
+
+
 void initDebug(char *progname)
 {
 	char scr[128];
-	char *home,*prefix;
+	char *home,*prefix,*fn;
 #ifdef WIN32
 	DWORD pid;
 #else
@@ -86,6 +236,12 @@ void initDebug(char *progname)
 		return;
 	}
 
+	logLevel = getLevelFromEnvironment();
+
+	if (logLevel == LOG_LEVEL_OFF) {
+		return;
+	}
+
 #ifdef WIN32
 	home = getenv("HOMEPATH");
 	if (home == NULL)
@@ -100,59 +256,161 @@ void initDebug(char *progname)
 	pid = getpid();
 #endif
 
-	sprintf(scr, "%s%s%s-%d.log", home, prefix, progname, pid);
-	debugFileHandle = fopen(scr, "a+");
+	fn = getenv("PKCS11_LOG_FILE");
 
-	if (debugFileHandle != NULL) {
-		fprintf(debugFileHandle, "Debugging initialized ...\n");
-	} else {
-		fprintf(stderr, "Can't create: '%s'.\n", scr);
+	if (fn == NULL) {
+		sprintf(scr, "%s%s%s-%d.log", home, prefix, progname, pid);
+		fn = scr;
+	}
+
+	debugFileHandle = fopen(fn, "a+");
+
+	if (debugFileHandle == NULL) {
+		fprintf(stderr, "Can't create: '%s'.\n", fn);
+		logLevel = LOG_LEVEL_OFF;
+		return;
+	}
+
+	fprintf(debugFileHandle, "Debugging initialized ...\n");
+
+	// The minidriver writes records synchronously
+#ifdef MINIDRIVER
+	if (initThreadRings(&logRings, 0) != 0) {
+#else
+	if (initThreadRings(&logRings, 1) != 0) {
+#endif
+		fclose(debugFileHandle);
+		debugFileHandle = NULL;
+		logLevel = LOG_LEVEL_OFF;
+		return;
+	}
+}
+
+
+
+/**
+ * Store a message that does not fit into a single record in consecutive records
+ *
+ * The records are published together, so the writer never sees a partial message.
+ */
+static void logLongMessage(struct threadRing *ring, int len, char *format, va_list argptr)
+{
+	struct logRecord *rec;
+	char *text, *pt;
+	int records, i;
+	time_t t;
+	int millis;
+
+	records = (len + LOG_RECORD_SIZE - 2) / (LOG_RECORD_SIZE - 1);
+
+	if (reserveThreadRing(&logRings, ring, records) != 0)
+		return;
+
+	text = (char *)malloc(len + 1);
+
+	if (text == NULL) {
+		ring->dropped++;
+		return;
+	}
+
+	vsnprintf(text, len + 1, format, argptr);
+	getTime(&t, &millis);
+
+	for (i = 0, pt = text; i < records; i++, pt += LOG_RECORD_SIZE - 1) {
+		rec = (struct logRecord *)getThreadRingEntry(&logRings, ring, i);
+		rec->time = t;
+		rec->millis = millis;
+		rec->continued = i > 0;
+		strncpy(rec->text, pt, LOG_RECORD_SIZE - 1);
+		rec->text[LOG_RECORD_SIZE - 1] = 0;
 	}
+
+	free(text);
+
+	publishThreadRing(&logRings, ring, records);
 }
 
 
-void debug(char *format, ...)
+
+void logMessage(int level, char *format, ...)
 {
-	struct tm *loctim;
-	time_t elapsed;
+	struct threadRing *ring;
+	struct logRecord *rec;
+	time_t t;
+	int millis, len;
 	va_list argptr;
-#ifdef WIN32
-	int tid = GetCurrentThreadId();
-#else
-	pthread_t tid = pthread_self();
-#endif
 
 	if (debugFileHandle == NULL) {
 		return;
 	}
 
-	time(&elapsed);
-	loctim = localtime(&elapsed);
+	if (!logRings.writerRunning) {
+		getTime(&t, &millis);
+		mutex_lock(&logRings.mutex);
+		// The log may have been closed since the check above
+		if (debugFileHandle != NULL) {
+			writeRecord(t, millis, getThreadId(), "");
+			va_start(argptr, format);
+			vfprintf(debugFileHandle, format, argptr);
+			va_end(argptr);
+			fflush(debugFileHandle);
+		}
+		mutex_unlock(&logRings.mutex);
+		return;
+	}
+
+	ring = getThreadRing(&logRings);
 
-	fprintf(debugFileHandle, "%02d.%02d.%04d %02d:%02d:%02d [%ld] ",
-			loctim->tm_mday,
-			loctim->tm_mon,
-			loctim->tm_year+1900,
-			loctim->tm_hour,
-			loctim->tm_min,
-			loctim->tm_sec,
-			tid);
+	if (ring == NULL) {
+		return;
+	}
+
+	if (reserveThreadRing(&logRings, ring, 1) != 0) {
+		return;
+	}
+
+	rec = (struct logRecord *)getThreadRingEntry(&logRings, ring, 0);
+	getTime(&rec->time, &rec->millis);
+	rec->continued = 0;
 
 	va_start(argptr, format);
-	vfprintf(debugFileHandle, format, argptr);
-	fflush(debugFileHandle);
+	len = vsnprintf(rec->text, sizeof(rec->text), format, argptr);
 	va_end(argptr);
+
+	if (len >= LOG_RECORD_SIZE) {
+		va_start(argptr, format);
+		logLongMessage(ring, len, format, argptr);
+		va_end(argptr);
+	} else {
+		publishThreadRing(&logRings, ring, 1);
+	}
 }
 
 
+
+/**
+ * Stop the writer thread, write pending records and close the log file
+ *
+ * Logging is disabled first, so that no new records are created. Ring buffers and the
+ * mutex are kept by threadring.c, because a thread may still use them when it passed the
+ * check of the log level just before. The file is closed under the mutex, so that such a
+ * thread writing synchronously finds it closed.
+ */
 void termDebug()
 {
-	if (debugFileHandle != NULL) {
-		fprintf(debugFileHandle, "Debugging terminated ...\n");
-		fflush(debugFileHandle);
-		fclose(debugFileHandle);
-		debugFileHandle = NULL;
+	if (debugFileHandle == NULL) {
+		return;
 	}
-}
 
-#endif /* DEBUG */
+	logLevel = LOG_LEVEL_OFF;
+	MEMORY_BARRIER();
+
+	termThreadRings(&logRings);
+
+	mutex_lock(&logRings.mutex);
+	fprintf(debugFileHandle, "Debugging terminated ...\n");
+	fflush(debugFileHandle);
+	fclose(debugFileHandle);
+	debugFileHandle = NULL;
+	mutex_unlock(&logRings.mutex);
+}
@@ -34,33 +34,55 @@
 #ifndef ___DEBUG_H_INC___
 #define ___DEBUG_H_INC___
 
-#ifdef DEBUG
+#include "trace.h"
+
+#define LOG_LEVEL_OFF		0
+#define LOG_LEVEL_ERROR		1	/**< Failing functions                                   */
+#define LOG_LEVEL_DEBUG		2	/**< Diagnostic messages and APDU traces                 */
+#define LOG_LEVEL_TRACE		3	/**< Function entry and exit                             */
+
+extern int logLevel;
+
+#define LOG_ENABLED(level)	(logLevel >= (level))
 
 void decodeBCDString(unsigned char *Inbuff, int len, char *Outbuff);
 void initDebug(char *module);
-void debug(char *log, ...);
+void logMessage(int level, char *format, ...);
 void termDebug();
 
+#define debug(...) do { \
+		if (LOG_ENABLED(LOG_LEVEL_DEBUG)) \
+			logMessage(LOG_LEVEL_DEBUG, __VA_ARGS__); \
+} while (0)
+
 #define FUNC_CALLED() do { \
-		debug("Function %s called.\n", __FUNCTION__); \
+		if (traceEnabled && TRACE_ENTRY_POINT(__FUNCTION__)) \
+			traceRecord('B', __FUNCTION__, TRACE_ARGS_NONE, 0, 0, 0, 0, 0, 0); \
+		if (LOG_ENABLED(LOG_LEVEL_TRACE)) \
+			logMessage(LOG_LEVEL_TRACE, "Function %s called.\n", __FUNCTION__); \
 } while (0)
 
+/*
+ * The return value is evaluated exactly once, so that it can be the result of a function call
+ */
 #define FUNC_RETURNS(rc) do { \
-		debug("Function %s completes with rc=%d.\n", __FUNCTION__, (rc)); \
-		return rc; \
+		long _func_rc = (long)(rc); \
+		if (traceEnabled && TRACE_ENTRY_POINT(__FUNCTION__)) \
+			traceRecord('E', __FUNCTION__, TRACE_ARGS_NONE, 0, 0, 0, 0, 0, 0); \
+		if (LOG_ENABLED(LOG_LEVEL_TRACE)) \
+			logMessage(LOG_LEVEL_TRACE, "Function %s completes with rc=%ld.\n", __FUNCTION__, _func_rc); \
+		return _func_rc; \
 } while (0)
 
 #define FUNC_FAILS(rc, msg) do { \
-		debug("Function %s fails with rc=%d \"%s\"\n", __FUNCTION__, (rc), (msg)); \
-		return rc; \
+		long _func_rc = (long)(rc); \
+		if (traceEnabled && TRACE_ENTRY_POINT(__FUNCTION__)) \
+			traceRecord('E', __FUNCTION__, TRACE_ARGS_NONE, 0, 0, 0, 0, 0, 0); \
+		if (LOG_ENABLED(LOG_LEVEL_ERROR)) \
+			logMessage(LOG_LEVEL_ERROR, "Function %s fails with rc=%ld \"%s\"\n", __FUNCTION__, _func_rc, (msg)); \
+		return _func_rc; \
 } while (0)
 
 #define NULLSTR(p) ( (p) == NULL ? "NULL" : (p))
-#else
-#define FUNC_CALLED()
-#define FUNC_RETURNS(rc) return (rc)
-#define FUNC_FAILS(rc, msg) return (rc)
-#endif
 
 #endif /* ___DEBUG_H_INC___ */
-
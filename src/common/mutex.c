@@ -31,6 +31,12 @@
  * @brief Defines procedures for cross platform mutex handling
  */
 
+#include <stdlib.h>
+#ifndef _WIN32
+#include <time.h>
+#include <sys/time.h>
+#endif
+
 #include "mutex.h"
 
 
@@ -73,3 +79,199 @@ int mutex_destroy(MUTEX *mutex) {
 	return pthread_mutex_destroy(mutex);
 #endif
 }
+
+
+
+/**
+ * Initialize an auto-reset event used to wake up a single waiting thread
+ */
+int event_init(EVENT *event) {
+#ifdef _WIN32
+	*event = CreateEvent(0, FALSE, FALSE, 0);
+	return (*event == 0 ? -1 : 0);
+#else
+	event->signaled = 0;
+	if (pthread_mutex_init(&event->mutex, NULL) != 0)
+		return -1;
+	if (pthread_cond_init(&event->cond, NULL) != 0) {
+		pthread_mutex_destroy(&event->mutex);
+		return -1;
+	}
+	return 0;
+#endif
+}
+
+
+
+/**
+ * Wait until the event is set and reset it
+ */
+int event_wait(EVENT *event) {
+#ifdef _WIN32
+	return (WaitForSingleObject(*event, INFINITE) == WAIT_FAILED ? -1 : 0);
+#else
+	pthread_mutex_lock(&event->mutex);
+	while (!event->signaled)
+		pthread_cond_wait(&event->cond, &event->mutex);
+	event->signaled = 0;
+	pthread_mutex_unlock(&event->mutex);
+	return 0;
+#endif
+}
+
+
+
+/**
+ * Wait until the event is set or the timeout in milliseconds expired and reset it
+ *
+ * @return 0 if the event was set, 1 on timeout or -1 on error
+ */
+int event_wait_timeout(EVENT *event, int millis) {
+#ifdef _WIN32
+	DWORD rc;
+
+	rc = WaitForSingleObject(*event, millis);
+	if (rc == WAIT_FAILED)
+		return -1;
+	return (rc == WAIT_TIMEOUT ? 1 : 0);
+#else
+	struct timespec ts;
+	int rc = 0;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += millis / 1000;
+	ts.tv_nsec += (millis % 1000) * 1000000L;
+	if (ts.tv_nsec >= 1000000000L) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&event->mutex);
+	while (!event->signaled && (rc == 0))
+		rc = pthread_cond_timedwait(&event->cond, &event->mutex, &ts);
+	if (event->signaled) {
+		event->signaled = 0;
+		rc = 0;
+	} else {
+		rc = 1;
+	}
+	pthread_mutex_unlock(&event->mutex);
+	return rc;
+#endif
+}
+
+
+
+int event_set(EVENT *event) {
+#ifdef _WIN32
+	return (SetEvent(*event) == 0 ? -1 : 0);
+#else
+	pthread_mutex_lock(&event->mutex);
+	event->signaled = 1;
+	pthread_cond_signal(&event->cond);
+	pthread_mutex_unlock(&event->mutex);
+	return 0;
+#endif
+}
+
+
+
+int event_destroy(EVENT *event) {
+#ifdef _WIN32
+	return (CloseHandle(*event) == 0 ? -1 : 0);
+#else
+	pthread_cond_destroy(&event->cond);
+	return pthread_mutex_destroy(&event->mutex);
+#endif
+}
+
+
+
+struct threadStart {
+	void (*func)(void *);
+	void *arg;
+};
+
+
+
+#ifdef _WIN32
+static DWORD WINAPI threadMain(LPVOID param) {
+#else
+static void *threadMain(void *param) {
+#endif
+	struct threadStart start = *(struct threadStart *)param;
+
+	free(param);
+	start.func(start.arg);
+	return 0;
+}
+
+
+
+/**
+ * Start a thread running func(arg). The thread must be joined with thread_join()
+ */
+int thread_create(THREAD *thread, void (*func)(void *), void *arg) {
+	struct threadStart *start;
+
+	start = (struct threadStart *)malloc(sizeof(struct threadStart));
+	if (start == NULL)
+		return -1;
+
+	start->func = func;
+	start->arg = arg;
+
+#ifdef _WIN32
+	*thread = CreateThread(0, 0, threadMain, start, 0, 0);
+	if (*thread == 0) {
+#else
+	if (pthread_create(thread, NULL, threadMain, start) != 0) {
+#endif
+		free(start);
+		return -1;
+	}
+	return 0;
+}
+
+
+
+/**
+ * Wait for the thread to terminate and release its resources
+ */
+int thread_join(THREAD *thread) {
+#ifdef _WIN32
+	if (WaitForSingleObject(*thread, INFINITE) == WAIT_FAILED)
+		return -1;
+	return (CloseHandle(*thread) == 0 ? -1 : 0);
+#else
+	return pthread_join(*thread, NULL);
+#endif
+}
+
+
+
+/**
+ * Return a monotonic time stamp in microseconds
+ */
+unsigned long long getMicroseconds() {
+#ifdef _WIN32
+	LARGE_INTEGER cnt, freq;
+
+	QueryPerformanceCounter(&cnt);
+	QueryPerformanceFrequency(&freq);
+	return (unsigned long long)(cnt.QuadPart / freq.QuadPart) * 1000000 +
+		(unsigned long long)(cnt.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+#endif
+}
@@ -43,8 +43,19 @@
 
 #ifdef _WIN32
 #define MUTEX HANDLE
+#define EVENT HANDLE
+#define THREAD HANDLE
+#define MEMORY_BARRIER()	MemoryBarrier()
 #else
 #define MUTEX pthread_mutex_t
+#define THREAD pthread_t
+#define MEMORY_BARRIER()	__sync_synchronize()
+
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int signaled;
+} EVENT;
 #endif
 
 int mutex_init(MUTEX *mutex);
@@ -52,4 +63,15 @@ int mutex_lock(MUTEX *mutex);
 int mutex_unlock(MUTEX *mutex);
 int mutex_destroy(MUTEX *mutex);
 
+int event_init(EVENT *event);
+int event_wait(EVENT *event);
+int event_wait_timeout(EVENT *event, int millis);
+int event_set(EVENT *event);
+int event_destroy(EVENT *event);
+
+int thread_create(THREAD *thread, void (*func)(void *), void *arg);
+int thread_join(THREAD *thread);
+
+unsigned long long getMicroseconds();
+
 #endif
@@ -40,25 +40,86 @@
 
 
 
-static int decodeCommonObjectAttributes(unsigned char *coa, int coalen, struct p15CommonObjectAttributes *p15)
+/**
+ * Allocate zeroed memory from the arena or from the heap if no arena is given
+ *
+ * @param arena     The arena or NULL
+ * @param size      The number of bytes required
+ * @return          Pointer to the memory or NULL if the arena is exhausted
+ */
+static void *p15Alloc(struct p15Arena *arena, size_t size)
+{
+	size_t pad;
+	void *p;
+
+	if (arena == NULL) {
+		return calloc(1, size);
+	}
+
+	// Keep allocations aligned for the description structures
+	pad = (sizeof(void *) - ((size_t)(arena->base + arena->used) & (sizeof(void *) - 1))) & (sizeof(void *) - 1);
+
+	if ((arena->used + pad > arena->size) || (size > arena->size - arena->used - pad)) {
+		return NULL;
+	}
+
+	p = arena->base + arena->used + pad;
+	arena->used += pad + size;
+	memset(p, 0, size);
+	return p;
+}
+
+
+
+/**
+ * Initialize an arena for decoding PKCS#15 descriptions into caller supplied memory
+ *
+ * @param arena     The arena to initialize
+ * @param buffer    The memory used for the decoded descriptions
+ * @param size      The size of the memory
+ */
+void p15InitArena(struct p15Arena *arena, unsigned char *buffer, size_t size)
 {
-	int tag,len;
-	unsigned char *po;
+	arena->base = buffer;
+	arena->size = size;
+	arena->used = 0;
+}
+
+
+
+/**
+ * Release all descriptions decoded into the arena in one call
+ *
+ * @param arena     The arena
+ */
+void p15ReleaseArena(struct p15Arena *arena)
+{
+	memset(arena->base, 0, arena->used);
+	arena->used = 0;
+}
+
+
+
+static int decodeCommonObjectAttributes(unsigned char *coa, int coalen, struct p15CommonObjectAttributes *p15, struct p15Arena *arena)
+{
+	struct asn1Cursor cur;
 	char *label;
 
 	if (coalen <= 0)
 		return 0;
 
-	po = coa;
-	tag = asn1Tag(&po);
+	asn1InitCursor(&cur, coa, coalen);
 
-	if (tag == ASN1_UTF8String) {
-		len = asn1Length(&po);
-		label = calloc(len + 1, 1);
+	if (asn1CursorNext(&cur) < 0) {
+		return -1;
+	}
+
+	if (cur.tag == ASN1_UTF8String) {
+		label = p15Alloc(arena, cur.length + 1);
 		if (label == NULL) {
 			return -1;
 		}
-		memcpy(label, po, len);
+		memcpy(label, cur.value, cur.length);
 		p15->label = label;
 	}
 
@@ -78,45 +139,39 @@ static int encodeCommonObjectAttributes(bytebuffer bb, struct p15CommonObjectAtt
 
 
 
-static int decodeCommonKeyAttributes(unsigned char *cka, int ckalen, struct p15PrivateKeyDescription *p15)
+static int decodeCommonKeyAttributes(unsigned char *cka, int ckalen, struct p15PrivateKeyDescription *p15, struct p15Arena *arena)
 {
-	int tag,len;
-	unsigned char *po, *obj, *id;
+	struct asn1Cursor cur;
+	unsigned char *id;
+	int rc;
 
 	if (ckalen <= 0)
 		return 0;
 
-	po = obj = cka;
-	tag = asn1Tag(&po);
-	len = asn1Length(&po);
+	asn1InitCursor(&cur, cka, ckalen);
 
-	if ((tag != ASN1_OCTET_STRING) || (len < 0)) {
+	if ((asn1CursorNext(&cur) <= 0) || (cur.tag != ASN1_OCTET_STRING)) {
 		return -1;
 	}
 
-	id = calloc(len, 1);
+	id = p15Alloc(arena, cur.length);
 	if (id == NULL) {
 		return -1;
 	}
-	memcpy(id, po, len);
+	memcpy(id, cur.value, cur.length);
 	p15->id.val = id;
-	p15->id.len = len;
+	p15->id.len = cur.length;
 
-	po += len;
-
-	if ((po - cka) >= ckalen) {
-		return 0;
+	rc = asn1CursorNext(&cur);
+	if (rc <= 0) {
+		return rc;
 	}
 
-	obj = po;
-	tag = asn1Tag(&po);
-	len = asn1Length(&po);
-
-	if ((tag != ASN1_BIT_STRING) || (len <= 1)) {
+	if ((cur.tag != ASN1_BIT_STRING) || (cur.length <= 1)) {
 		return -1;
 	}
 
-	asn1DecodeFlags(po + 1, len - 1, &p15->usage);
+	asn1DecodeFlags(cur.value + 1, cur.length - 1, &p15->usage);
 	return 0;
 }
 
@@ -145,32 +200,25 @@ static int encodeCommonKeyAttributes(bytebuffer bb, struct p15PrivateKeyDescript
 
 static int decodeKeyAttributes(unsigned char *ka, int kalen, struct p15PrivateKeyDescription *p15)
 {
-	int tag,len;
-	unsigned char *po, *obj;
+	struct asn1Cursor cur;
+	int rc;
 
 	if (kalen <= 0)
 		return 0;
 
-	po = obj = ka;
-	tag = asn1Tag(&po);
-	len = asn1Length(&po);
+	asn1InitCursor(&cur, ka, kalen);
 
-	if ((tag != ASN1_SEQUENCE) || (len <= 0)) {
+	if ((asn1CursorNext(&cur) <= 0) || (cur.tag != ASN1_SEQUENCE) || (cur.length == 0)) {
 		return -1;
 	}
 
-	po += len;
-
-	if ((po - ka) >= kalen) {
-		return 0;
+	rc = asn1CursorNext(&cur);
+	if (rc <= 0) {
+		return rc;
 	}
 
-	obj = po;
-	tag = asn1Tag(&po);
-	len = asn1Length(&po);
-
-	if ((tag == ASN1_INTEGER) && (len > 0)) {
-		if (asn1DecodeInteger(po, len, &p15->keysize) < 0) {
+	if ((cur.tag == ASN1_INTEGER) && (cur.length > 0)) {
+		if (asn1DecodeInteger(cur.value, cur.length, &p15->keysize) < 0) {
 			return -1;
 		}
 	} else {
@@ -201,28 +249,23 @@ static int encodeKeyAttributes(bytebuffer bb, struct p15PrivateKeyDescription *p
 
 static int decodeCommonSecretKeyAttributes(unsigned char *ska, int skalen, struct p15SecretKeyDescription *p15)
 {
-	int tag,len;
-	unsigned char *po;
-
-	po = ska;
+	struct asn1Cursor cur;
 
 	if (skalen <= 0) {
 		return 0;
 	}
 
-	tag = asn1Tag(&po);
+	asn1InitCursor(&cur, ska, skalen);
 
-	if (tag != ASN1_INTEGER) {
+	if ((asn1CursorNext(&cur) <= 0) || (cur.tag != ASN1_INTEGER)) {
 		return -1;
 	}
 
-	len = asn1Length(&po);
-
-	if (len <= 0) {
+	if (cur.length == 0) {
 		return 0;
 	}
 
-	return asn1DecodeInteger(po, len, &p15->keysize);
+	return asn1DecodeInteger(cur.value, cur.length, &p15->keysize);
 }
 
 
@@ -240,80 +283,63 @@ static int encodeCommonSecretKeyAttributes(bytebuffer bb, struct p15SecretKeyDes
 
 
 
-static int decodePrivateKeyAttributes(unsigned char *prkd, int prkdlen, struct p15PrivateKeyDescription *p15)
+static int decodePrivateKeyAttributes(unsigned char *prkd, int prkdlen, struct p15PrivateKeyDescription *p15, struct p15Arena *arena)
 {
-	int rc,tag,len;
-	unsigned char *po, *obj;
+	struct asn1Cursor cur, ka;
+	int rc;
 
 	if (prkdlen <= 0) {				// Nothing to decode
 		return 0;
 	}
 
-	po = obj = prkd;
+	asn1InitCursor(&cur, prkd, prkdlen);
 
-	tag = asn1Tag(&po);
-	if (tag != ASN1_SEQUENCE) {
+	if ((asn1CursorNext(&cur) <= 0) || (cur.tag != ASN1_SEQUENCE)) {
 		return -1;
 	}
 
-	len = asn1Length(&po);
-
-	rc = decodeCommonObjectAttributes(po, len, &p15->coa);
+	rc = decodeCommonObjectAttributes(cur.value, (int)cur.length, &p15->coa, arena);
 	if (rc < 0) {
 		return rc;
 	}
 
-	po += len;
-
-	if ((po - prkd) >= prkdlen) {
-		return 0;
+	rc = asn1CursorNext(&cur);
+	if (rc <= 0) {
+		return rc;
 	}
 
-	obj = po;
-	tag = asn1Tag(&po);
-	if (tag != ASN1_SEQUENCE) {
+	if (cur.tag != ASN1_SEQUENCE) {
 		return -1;
 	}
 
-	len = asn1Length(&po);
-
-	rc = decodeCommonKeyAttributes(po, len, p15);
+	rc = decodeCommonKeyAttributes(cur.value, (int)cur.length, p15, arena);
 	if (rc < 0) {
 		return rc;
 	}
 
-	po += len;
-
-	if ((po - prkd) >= prkdlen) {
-		return 0;
+	rc = asn1CursorNext(&cur);
+	if (rc <= 0) {
+		return rc;
 	}
 
-	obj = po;
-	tag = asn1Tag(&po);
-	if (tag == 0xA0) {
-		len = asn1Length(&po);
-		po += len;
-
-		if ((po - prkd) >= prkdlen) {
-			return 0;
+	if (cur.tag == 0xA0) {			// Skip optional subclass attributes
+		rc = asn1CursorNext(&cur);
+		if (rc <= 0) {
+			return rc;
 		}
-		obj = po;
-		tag = asn1Tag(&po);
 	}
 
-	len = asn1Length(&po);
-	if ((tag != 0xA1) || (len <= 0)) {
+	if ((cur.tag != 0xA1) || (cur.length == 0)) {
 		return -1;
 	}
 
-	tag = asn1Tag(&po);
-	len = asn1Length(&po);
+	asn1CursorEnter(&cur, &ka);
 
-	if ((tag != ASN1_SEQUENCE) || (len <= 0)) {
+	if ((asn1CursorNext(&ka) <= 0) || (ka.tag != ASN1_SEQUENCE) || (ka.length == 0)) {
 		return -1;
 	}
 
-	rc = decodeKeyAttributes(po, len, p15);
+	rc = decodeKeyAttributes(ka.value, (int)ka.length, p15);
 	if (rc < 0) {
 		return rc;
 	}
@@ -323,63 +349,50 @@ static int decodePrivateKeyAttributes(unsigned char *prkd, int prkdlen, struct p
 
 
 
-static int decodeSecretKeyAttributes(unsigned char *prkd, int prkdlen, struct p15SecretKeyDescription *p15)
+static int decodeSecretKeyAttributes(unsigned char *prkd, int prkdlen, struct p15SecretKeyDescription *p15, struct p15Arena *arena)
 {
-	int rc,tag,len;
-	unsigned char *po, *obj;
+	struct asn1Cursor cur;
+	int rc;
 
 	if (prkdlen <= 0) {				// Nothing to decode
 		return 0;
 	}
 
-	po = obj = prkd;
+	asn1InitCursor(&cur, prkd, prkdlen);
 
-	tag = asn1Tag(&po);
-	if (tag != ASN1_SEQUENCE) {
+	if ((asn1CursorNext(&cur) <= 0) || (cur.tag != ASN1_SEQUENCE)) {
 		return -1;
 	}
 
-	len = asn1Length(&po);
-
-	rc = decodeCommonObjectAttributes(po, len, &p15->coa);
+	rc = decodeCommonObjectAttributes(cur.value, (int)cur.length, &p15->coa, arena);
 	if (rc < 0) {
 		return rc;
 	}
 
-	po += len;
-
-	if ((po - prkd) >= prkdlen) {
-		return 0;
+	rc = asn1CursorNext(&cur);
+	if (rc <= 0) {
+		return rc;
 	}
 
-	obj = po;
-	tag = asn1Tag(&po);
-	if (tag != ASN1_SEQUENCE) {
+	if (cur.tag != ASN1_SEQUENCE) {
 		return -1;
 	}
 
-	len = asn1Length(&po);
-
-	rc = decodeCommonKeyAttributes(po, len, (struct p15PrivateKeyDescription *)p15);
+	rc = decodeCommonKeyAttributes(cur.value, (int)cur.length, (struct p15PrivateKeyDescription *)p15, arena);
 	if (rc < 0) {
 		return rc;
 	}
 
-	po += len;
-
-	if ((po - prkd) >= prkdlen) {
-		return 0;
+	rc = asn1CursorNext(&cur);
+	if (rc <= 0) {
+		return rc;
 	}
 
-	obj = po;
-	tag = asn1Tag(&po);
-	if (tag != 0xA0) {
+	if (cur.tag != 0xA0) {
 		return -1;
 	}
 
-	len = asn1Length(&po);
-
-	rc = decodeCommonSecretKeyAttributes(po, len, p15);
+	rc = decodeCommonSecretKeyAttributes(cur.value, (int)cur.length, p15);
 	if (rc < 0) {
 		return rc;
 	}
@@ -392,47 +405,62 @@ static int decodeSecretKeyAttributes(unsigned char *prkd, int prkdlen, struct p1
 /**
  * Decode a TLV encoded PKCS#15 secret key description into a structure
  *
- * The caller must use freeSecretKeyDescription() to free the allocated structure
+ * If an arena is given, the structure, label and identifier are allocated from the arena and
+ * released with p15ReleaseArena(). Otherwise the caller must use freeSecretKeyDescription() to free
+ * the allocated structure.
  *
- * @param prkd      The first byte of the encoded structure
- * @param prkdlen   The length of the encoded structure
+ * @param skd       The first byte of the encoded structure
+ * @param skdlen    The length of the encoded structure
+ * @param arena     The arena to allocate from or NULL to allocate from the heap
  * @param p15       Pointer to pointer updated with the newly allocated structure
- * @return          0 if successful, -1 for structural errors
+ * @return          0 if successful, -1 for structural errors or if the arena is exhausted
  */
-int decodeSecretKeyDescription(unsigned char *skd, size_t skdlen, struct p15SecretKeyDescription **p15)
+int decodeSecretKeyDescriptionInArena(unsigned char *skd, size_t skdlen, struct p15Arena *arena, struct p15SecretKeyDescription **p15)
 {
-	int rc,tag,len;
-	unsigned char *po;
+	struct asn1Cursor cur;
+	int rc;
 
-	rc = (int)asn1Validate(skd, skdlen);
+	asn1InitCursor(&cur, skd, skdlen);
 
-	if (rc != 0) {
+	if (asn1CursorNext(&cur) <= 0) {
 		return -1;
 	}
 
-	*p15 = calloc(1, sizeof(struct p15SecretKeyDescription));
+	*p15 = p15Alloc(arena, sizeof(struct p15SecretKeyDescription));
 	if (*p15 == NULL) {
 		return -1;
 	}
 
-	po = skd;
-
-	tag = asn1Tag(&po);
-	if (tag != 0xA8) {
+	if (cur.tag != 0xA8) {
 		return -1;
 	}
 
-	(*p15)->keytype = (int)tag;
-
-	len = asn1Length(&po);
+	(*p15)->keytype = (int)cur.tag;
 
-	rc = decodeSecretKeyAttributes(po, len, *p15);
+	rc = decodeSecretKeyAttributes(cur.value, (int)cur.length, *p15, arena);
 
 	return rc;
 }
 
 
 
+/**
+ * Decode a TLV encoded PKCS#15 secret key description into a structure allocated on the heap
+ *
+ * The caller must use freeSecretKeyDescription() to free the allocated structure
+ *
+ * @param skd       The first byte of the encoded structure
+ * @param skdlen    The length of the encoded structure
+ * @param p15       Pointer to pointer updated with the newly allocated structure
+ * @return          0 if successful, -1 for structural errors
+ */
+int decodeSecretKeyDescription(unsigned char *skd, size_t skdlen, struct p15SecretKeyDescription **p15)
+{
+	return decodeSecretKeyDescriptionInArena(skd, skdlen, NULL, p15);
+}
+
+
+
 /**
  * Encode secret key description into a PKCS#15 structure
  *
@@ -454,46 +482,61 @@ int encodeSecretKeyDescription(bytebuffer bb, struct p15SecretKeyDescription *p1
 /**
  * Decode a TLV encoded PKCS#15 private key description into a structure
  *
- * The caller must use freePrivateKeyDescription() to free the allocated structure
+ * If an arena is given, the structure, label and identifier are allocated from the arena and
+ * released with p15ReleaseArena(). Otherwise the caller must use freePrivateKeyDescription() to free
+ * the allocated structure.
  *
  * @param prkd      The first byte of the encoded structure
  * @param prkdlen   The length of the encoded structure
+ * @param arena     The arena to allocate from or NULL to allocate from the heap
  * @param p15       Pointer to pointer updated with the newly allocated structure
- * @return          0 if successful, -1 for structural errors
+ * @return          0 if successful, -1 for structural errors or if the arena is exhausted
  */
-int decodePrivateKeyDescription(unsigned char *prkd, size_t prkdlen, struct p15PrivateKeyDescription **p15)
+int decodePrivateKeyDescriptionInArena(unsigned char *prkd, size_t prkdlen, struct p15Arena *arena, struct p15PrivateKeyDescription **p15)
 {
-	int rc,tag,len;
-	unsigned char *po;
+	struct asn1Cursor cur;
+	int rc;
 
-	rc = (int)asn1Validate(prkd, prkdlen);
+	asn1InitCursor(&cur, prkd, prkdlen);
 
-	if (rc != 0) {
+	if (asn1CursorNext(&cur) <= 0) {
 		return -1;
 	}
 
-	*p15 = calloc(1, sizeof(struct p15PrivateKeyDescription));
+	*p15 = p15Alloc(arena, sizeof(struct p15PrivateKeyDescription));
 	if (*p15 == NULL) {
 		return -1;
 	}
 
-	po = prkd;
-
-	tag = asn1Tag(&po);
-	len = asn1Length(&po);
-
-	if ((tag != ASN1_SEQUENCE) && (tag != 0xA0)) {
+	if ((cur.tag != ASN1_SEQUENCE) && (cur.tag != 0xA0)) {
 		return -1;
 	}
 
-	(*p15)->keytype = (int)tag;
-	rc = decodePrivateKeyAttributes(po, len, *p15);
+	(*p15)->keytype = (int)cur.tag;
+	rc = decodePrivateKeyAttributes(cur.value, (int)cur.length, *p15, arena);
 
 	return rc;
 }
 
 
 
+/**
+ * Decode a TLV encoded PKCS#15 private key description into a structure allocated on the heap
+ *
+ * The caller must use freePrivateKeyDescription() to free the allocated structure
+ *
+ * @param prkd      The first byte of the encoded structure
+ * @param prkdlen   The length of the encoded structure
+ * @param p15       Pointer to pointer updated with the newly allocated structure
+ * @return          0 if successful, -1 for structural errors
+ */
+int decodePrivateKeyDescription(unsigned char *prkd, size_t prkdlen, struct p15PrivateKeyDescription **p15)
+{
+	return decodePrivateKeyDescriptionInArena(prkd, prkdlen, NULL, p15);
+}
+
+
+
 /**
  * Encode private key description into a PKCS#15 structure
  *
@@ -512,31 +555,27 @@ int encodePrivateKeyDescription(bytebuffer bb, struct p15PrivateKeyDescription *
 
 
 
-static int decodeCommonCertificateAttributes(unsigned char *cca, int ccalen, struct p15CertificateDescription *p15)
+static int decodeCommonCertificateAttributes(unsigned char *cca, int ccalen, struct p15CertificateDescription *p15, struct p15Arena *arena)
 {
-	int tag,len;
-	unsigned char *po, *obj, *id;
+	struct asn1Cursor cur;
+	unsigned char *id;
 
 	if (ccalen <= 0)
 		return 0;
 
-	po = obj = cca;
-	tag = asn1Tag(&po);
-	len = asn1Length(&po);
+	asn1InitCursor(&cur, cca, ccalen);
 
-	if ((tag != ASN1_OCTET_STRING) || (len <= 0)) {
+	if ((asn1CursorNext(&cur) <= 0) || (cur.tag != ASN1_OCTET_STRING) || (cur.length == 0)) {
 		return -1;
 	}
 
-	id = calloc(len, 1);
+	id = p15Alloc(arena, cur.length);
 	if (id == NULL) {
 		return -1;
 	}
-	memcpy(id, po, len);
+	memcpy(id, cur.value, cur.length);
 	p15->id.val = id;
-	p15->id.len = len;
-
-	po += len;
+	p15->id.len = cur.length;
 
 	return 0;
 }
@@ -559,50 +598,40 @@ static int encodeCommonCertificateAttributes(bytebuffer bb, struct p15Certificat
 
 
 
-static int decodeCertificateAttributes(unsigned char *cd, int cdlen, struct p15CertificateDescription *p15)
+static int decodeCertificateAttributes(unsigned char *cd, int cdlen, struct p15CertificateDescription *p15, struct p15Arena *arena)
 {
-	int rc,tag,len;
-	unsigned char *po, *obj;
+	struct asn1Cursor cur;
+	int rc;
 
 	if (cdlen <= 0) {				// Nothing to decode
 		return 0;
 	}
 
-	po = obj = cd;
+	asn1InitCursor(&cur, cd, cdlen);
 
-	tag = asn1Tag(&po);
-	if (tag != ASN1_SEQUENCE) {
+	if ((asn1CursorNext(&cur) <= 0) || (cur.tag != ASN1_SEQUENCE)) {
 		return -1;
 	}
 
-	len = asn1Length(&po);
-
-	rc = decodeCommonObjectAttributes(po, len, &p15->coa);
+	rc = decodeCommonObjectAttributes(cur.value, (int)cur.length, &p15->coa, arena);
 	if (rc < 0) {
 		return rc;
 	}
 
-	po += len;
-
-	if ((po - cd) >= cdlen) {
-		return 0;
+	rc = asn1CursorNext(&cur);
+	if (rc <= 0) {
+		return rc;
 	}
 
-	obj = po;
-	tag = asn1Tag(&po);
-	if (tag != ASN1_SEQUENCE) {
+	if (cur.tag != ASN1_SEQUENCE) {
 		return -1;
 	}
 
-	len = asn1Length(&po);
-
-	rc = decodeCommonCertificateAttributes(po, len, p15);
+	rc = decodeCommonCertificateAttributes(cur.value, (int)cur.length, p15, arena);
 	if (rc < 0) {
 		return rc;
 	}
 
-	po += len;
-
 	return 0;
 }
 
@@ -623,46 +652,61 @@ static int encodeCertificateAttributes(bytebuffer bb, struct p15CertificateDescr
 /**
  * Decode a TLV encoded PKCS#15 certificate description into a structure
  *
- * The caller must use freeCertificateDescription() to free the allocated structure
+ * If an arena is given, the structure, label and identifier are allocated from the arena and
+ * released with p15ReleaseArena(). Otherwise the caller must use freeCertificateDescription() to free
+ * the allocated structure.
  *
  * @param cd        The first byte of the encoded structure
  * @param cdlen     The length of the encoded structure
+ * @param arena     The arena to allocate from or NULL to allocate from the heap
  * @param p15       Pointer to pointer updated with the newly allocated structure
- * @return          0 if successful, -1 for structural errors
+ * @return          0 if successful, -1 for structural errors or if the arena is exhausted
  */
-int decodeCertificateDescription(unsigned char *cd, size_t cdlen, struct p15CertificateDescription **p15)
+int decodeCertificateDescriptionInArena(unsigned char *cd, size_t cdlen, struct p15Arena *arena, struct p15CertificateDescription **p15)
 {
-	int rc,tag,len;
-	unsigned char *po;
+	struct asn1Cursor cur;
+	int rc;
 
-	rc = (int)asn1Validate(cd, cdlen);
+	asn1InitCursor(&cur, cd, cdlen);
 
-	if (rc != 0) {
+	if (asn1CursorNext(&cur) <= 0) {
 		return -1;
 	}
 
-	*p15 = calloc(1, sizeof(struct p15CertificateDescription));
+	*p15 = p15Alloc(arena, sizeof(struct p15CertificateDescription));
 	if (*p15 == NULL) {
 		return -1;
 	}
 
-	po = cd;
-
-	tag = asn1Tag(&po);
-	len = asn1Length(&po);
-
-	if ((tag != ASN1_SEQUENCE) && (tag != 0xA0) && (tag != 0xA5) ) {
+	if ((cur.tag != ASN1_SEQUENCE) && (cur.tag != 0xA0) && (cur.tag != 0xA5) ) {
 		return -1;
 	}
 
-	(*p15)->certtype = (int)tag;
-	rc = decodeCertificateAttributes(po, len, *p15);
+	(*p15)->certtype = (int)cur.tag;
+	rc = decodeCertificateAttributes(cur.value, (int)cur.length, *p15, arena);
 
 	return rc;
 }
 
 
 
+/**
+ * Decode a TLV encoded PKCS#15 certificate description into a structure allocated on the heap
+ *
+ * The caller must use freeCertificateDescription() to free the allocated structure
+ *
+ * @param cd        The first byte of the encoded structure
+ * @param cdlen     The length of the encoded structure
+ * @param p15       Pointer to pointer updated with the newly allocated structure
+ * @return          0 if successful, -1 for structural errors
+ */
+int decodeCertificateDescription(unsigned char *cd, size_t cdlen, struct p15CertificateDescription **p15)
+{
+	return decodeCertificateDescriptionInArena(cd, cdlen, NULL, p15);
+}
+
+
+
 /**
  * Encode certificate description into a PKCS#15 structure
  *
@@ -124,6 +124,24 @@ struct p15CertificateDescription {
 };
 
 
+
+/**
+ * Caller supplied memory for decoding descriptions without heap allocation
+ */
+struct p15Arena {
+	unsigned char  *base;               /**< The first byte of the memory         */
+	size_t          size;               /**< The size of the memory               */
+	size_t          used;               /**< The number of bytes allocated        */
+};
+
+/** Arena size sufficient to decode a description encoded in len bytes */
+#define P15_ARENA_SIZE(len)             ((len) + 256)
+
+void p15InitArena(struct p15Arena *arena, unsigned char *buffer, size_t size);
+void p15ReleaseArena(struct p15Arena *arena);
+int decodePrivateKeyDescriptionInArena(unsigned char *prkd, size_t prkdlen, struct p15Arena *arena, struct p15PrivateKeyDescription **p15);
+int decodeCertificateDescriptionInArena(unsigned char *cd, size_t cdlen, struct p15Arena *arena, struct p15CertificateDescription **p15);
+int decodeSecretKeyDescriptionInArena(unsigned char *skd, size_t skdlen, struct p15Arena *arena, struct p15SecretKeyDescription **p15);
 int decodePrivateKeyDescription(unsigned char *prkd, size_t prkdlen, struct p15PrivateKeyDescription **p15);
 int decodeCertificateDescription(unsigned char *cd, size_t cdlen, struct p15CertificateDescription **p15);
 int decodeSecretKeyDescription(unsigned char *skd, size_t skdlen, struct p15SecretKeyDescription **p15);
@@ -0,0 +1,335 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    threadring.c
+ * @author  Andreas Schwier
+ * @brief   Per-thread ring buffers drained by a background writer
+ *
+ * Used by the log and the trace exporter to record entries without locking or I/O on
+ * the calling thread. Each thread writes fixed size entries into a ring buffer of its
+ * own. A background thread drains all rings periodically and passes the entries to the
+ * write() function of the user. If a ring is full, entries are dropped and the number of
+ * lost entries is passed to lost().
+ *
+ * Rings are assigned to a thread on first use and released when the thread terminates,
+ * so that they can be reused by another thread after the writer has drained them. Rings
+ * and the synchronization objects are never freed, because a thread may still hold its ring
+ * or use the mutex and the event while the set is terminated. They are reset and reused if the set is initialized
+ * again.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include "threadring.h"
+
+
+
+unsigned long getThreadId()
+{
+#ifdef _WIN32
+	return (unsigned long)GetCurrentThreadId();
+#else
+	return (unsigned long)pthread_self();
+#endif
+}
+
+
+
+/**
+ * Pass all pending entries to the writer function
+ *
+ * Must be called with the mutex locked
+ */
+static void drainRings(struct threadRingSet *set)
+{
+	struct threadRing *ring;
+	unsigned int head, tail;
+	unsigned long dropped;
+
+	for (ring = set->list; ring; ring = ring->next) {
+		head = ring->head;
+		tail = ring->tail;
+
+		// Read entries only after they have been completely written
+		MEMORY_BARRIER();
+
+		while (tail != head) {
+			set->write(set, ring, ring->entries + (tail & (set->ringSize - 1)) * set->entrySize);
+			tail++;
+		}
+
+		// Release the entries to the owning thread only after they have been written
+		MEMORY_BARRIER();
+		ring->tail = tail;
+
+		dropped = ring->dropped;
+		if (dropped != ring->reported) {
+			set->lost(set, ring, dropped - ring->reported);
+			ring->reported = dropped;
+		}
+	}
+
+	set->flush(set);
+}
+
+
+
+static void writer(void *arg)
+{
+	struct threadRingSet *set = (struct threadRingSet *)arg;
+
+	while (!set->writerTerminate) {
+		event_wait_timeout(&set->writerEvent, set->flushInterval);
+
+		mutex_lock(&set->mutex);
+		drainRings(set);
+		mutex_unlock(&set->mutex);
+	}
+}
+
+
+
+static void releaseRing(void *ptr)
+{
+	// The ring is reused by another thread after the writer has drained it
+	((struct threadRing *)ptr)->inUse = 0;
+}
+
+
+
+#ifdef _WIN32
+static VOID WINAPI threadTerminated(PVOID ptr)
+{
+	if (ptr != NULL)
+		releaseRing(ptr);
+}
+#endif
+
+
+
+/**
+ * Initialize the set and start the writer thread
+ *
+ * Rings left from a previous initialization are reused. Without the writer thread, the
+ * user writes its entries synchronously under the mutex.
+ *
+ * @param set           The set with entrySize, ringSize, stateSize, flushInterval and
+ *                      the functions initialized
+ * @param startWriter   Start the writer thread, which is required to use rings
+ * @return              0 or -1 if the mutex or event could not be created
+ */
+int initThreadRings(struct threadRingSet *set, int startWriter)
+{
+	if (!set->created) {
+		if (mutex_init(&set->mutex) != 0)
+			return -1;
+		if (event_init(&set->writerEvent) != 0) {
+			mutex_destroy(&set->mutex);
+			return -1;
+		}
+		set->created = 1;
+	}
+
+	set->writerRunning = 0;
+
+	if (!startWriter)
+		return 0;
+
+#ifdef _WIN32
+	set->ringKey = FlsAlloc(threadTerminated);
+	if (set->ringKey == FLS_OUT_OF_INDEXES)
+		return 0;
+#else
+	if (pthread_key_create(&set->ringKey, releaseRing) != 0)
+		return 0;
+#endif
+
+	set->writerTerminate = 0;
+	if (thread_create(&set->writerThread, writer, set) == 0) {
+		set->writerRunning = 1;
+		return 0;
+	}
+
+#ifdef _WIN32
+	FlsFree(set->ringKey);
+#else
+	pthread_key_delete(set->ringKey);
+#endif
+	return 0;
+}
+
+
+
+/**
+ * Return the ring buffer of the calling thread, allocating or reusing one on first use
+ *
+ * Must only be called while the writer thread is running.
+ *
+ * @param set       The set
+ * @return          The ring or NULL if out of memory
+ */
+struct threadRing *getThreadRing(struct threadRingSet *set)
+{
+	struct threadRing *ring;
+
+#ifdef _WIN32
+	ring = (struct threadRing *)FlsGetValue(set->ringKey);
+#else
+	ring = (struct threadRing *)pthread_getspecific(set->ringKey);
+#endif
+
+	if (ring != NULL)
+		return ring;
+
+	mutex_lock(&set->mutex);
+
+	for (ring = set->list; ring && (ring->inUse || (ring->head != ring->tail)); ring = ring->next);
+
+	if (ring == NULL) {
+		ring = (struct threadRing *)calloc(1, sizeof(struct threadRing) + set->stateSize + set->ringSize * set->entrySize);
+		if (ring == NULL) {
+			mutex_unlock(&set->mutex);
+			return NULL;
+		}
+		ring->state = (unsigned char *)(ring + 1);
+		ring->entries = (unsigned char *)(ring + 1) + set->stateSize;
+		ring->next = set->list;
+		set->list = ring;
+	}
+
+	ring->tid = getThreadId();
+	memset(ring->state, 0, set->stateSize);
+	ring->inUse = 1;
+
+	mutex_unlock(&set->mutex);
+
+#ifdef _WIN32
+	FlsSetValue(set->ringKey, ring);
+#else
+	pthread_setspecific(set->ringKey, ring);
+#endif
+	return ring;
+}
+
+
+
+/**
+ * Check that count entries are free in the ring of the calling thread
+ *
+ * @return          0 or -1 if the entries are dropped
+ */
+int reserveThreadRing(struct threadRingSet *set, struct threadRing *ring, unsigned int count)
+{
+	if (ring->head - ring->tail + count > set->ringSize) {
+		ring->dropped++;
+		return -1;
+	}
+	return 0;
+}
+
+
+
+/**
+ * Return an entry reserved with reserveThreadRing()
+ *
+ * @param index     The index of the entry, starting with 0 for the next entry
+ */
+void *getThreadRingEntry(struct threadRingSet *set, struct threadRing *ring, unsigned int index)
+{
+	return ring->entries + ((ring->head + index) & (set->ringSize - 1)) * set->entrySize;
+}
+
+
+
+/**
+ * Make entries visible to the writer thread
+ *
+ * The writer is woken up early if the ring is filling up.
+ */
+void publishThreadRing(struct threadRingSet *set, struct threadRing *ring, unsigned int count)
+{
+	unsigned int head = ring->head;
+
+	// Make the entries visible to the writer only after they have been completely written
+	MEMORY_BARRIER();
+	ring->head = head + count;
+
+	if ((head - ring->tail < set->ringSize / 2) && (head + count - ring->tail >= set->ringSize / 2))
+		event_set(&set->writerEvent);
+}
+
+
+
+/**
+ * Pass all pending entries to the writer function
+ */
+void drainThreadRings(struct threadRingSet *set)
+{
+	mutex_lock(&set->mutex);
+	drainRings(set);
+	mutex_unlock(&set->mutex);
+}
+
+
+
+/**
+ * Stop the writer thread and pass all pending entries to the writer function
+ *
+ * The user must disable recording before. Entries recorded after draining are discarded.
+ * The per-thread state of the rings is left for the user to complete its output.
+ */
+void termThreadRings(struct threadRingSet *set)
+{
+	struct threadRing *ring;
+
+	if (set->writerRunning) {
+		set->writerTerminate = 1;
+		event_set(&set->writerEvent);
+		thread_join(&set->writerThread);
+		set->writerRunning = 0;
+
+		drainRings(set);
+
+#ifdef _WIN32
+		FlsFree(set->ringKey);
+#else
+		pthread_key_delete(set->ringKey);
+#endif
+	}
+
+	for (ring = set->list; ring; ring = ring->next) {
+		ring->tail = ring->head;
+		ring->reported = ring->dropped;
+		ring->inUse = 0;
+	}
+}
@@ -0,0 +1,93 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    threadring.h
+ * @author  Andreas Schwier
+ * @brief   Per-thread ring buffers drained by a background writer
+ */
+
+#ifndef ___THREADRING_H_INC___
+#define ___THREADRING_H_INC___
+
+#include "mutex.h"
+
+struct threadRingSet;
+
+
+
+struct threadRing {
+	volatile unsigned int head;         /**< Next entry written by the owning thread  */
+	volatile unsigned int tail;         /**< Next entry read by the writer thread     */
+	volatile unsigned long dropped;     /**< Entries lost due to a full ring          */
+	unsigned long reported;             /**< Lost entries already reported            */
+	unsigned long tid;                  /**< Id of the owning thread                  */
+	volatile int inUse;                 /**< The ring is assigned to a running thread */
+	void *state;                        /**< Per-thread state of the user, cleared when assigned */
+	unsigned char *entries;             /**< ringSize entries of entrySize bytes      */
+	struct threadRing *next;            /**< Next ring                                */
+};
+
+
+
+struct threadRingSet {
+	int entrySize;                      /**< Size of an entry in bytes                */
+	unsigned int ringSize;              /**< Number of entries per ring, must be a power of 2 */
+	int stateSize;                      /**< Size of the per-thread state in bytes    */
+	int flushInterval;                  /**< Interval in ms for draining the rings    */
+
+	/**< Write an entry, called with the mutex locked                                   */
+	void (*write)(struct threadRingSet *set, struct threadRing *ring, void *entry);
+	/**< Report entries lost since the last call, called with the mutex locked          */
+	void (*lost)(struct threadRingSet *set, struct threadRing *ring, unsigned long count);
+	/**< Complete a batch of entries, called with the mutex locked                      */
+	void (*flush)(struct threadRingSet *set);
+
+	MUTEX mutex;                        /**< Guards the list and the output of the user */
+	int created;                        /**< Mutex and event are kept for the life of the process */
+	struct threadRing *list;            /**< All rings, kept until the process exits  */
+	THREAD writerThread;
+	EVENT writerEvent;
+	volatile int writerRunning;         /**< The writer thread drains the rings       */
+	volatile int writerTerminate;
+#ifdef _WIN32
+	DWORD ringKey;
+#else
+	pthread_key_t ringKey;
+#endif
+};
+
+unsigned long getThreadId();
+int initThreadRings(struct threadRingSet *set, int startWriter);
+struct threadRing *getThreadRing(struct threadRingSet *set);
+int reserveThreadRing(struct threadRingSet *set, struct threadRing *ring, unsigned int count);
+void *getThreadRingEntry(struct threadRingSet *set, struct threadRing *ring, unsigned int index);
+void publishThreadRing(struct threadRingSet *set, struct threadRing *ring, unsigned int count);
+void drainThreadRings(struct threadRingSet *set);
+void termThreadRings(struct threadRingSet *set);
+
+#endif /* ___THREADRING_H_INC___ */
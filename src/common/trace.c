@@ -0,0 +1,326 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    trace.c
+ * @author  Andreas Schwier
+ * @brief   Export of PKCS#11 calls and APDUs in the trace event format
+ *
+ * If PKCS11_TRACE_FILE is set, begin and end events for PKCS#11 entry points, APDUs,
+ * slot locks and the global mutex are written to that file in the JSON trace event
+ * format, which can be loaded into chrome://tracing or Perfetto. A %p in the file name
+ * is replaced by the process id. APDUs are traced with CLA, INS, P1, P2 and lengths only,
+ * command and response data are never written.
+ *
+ * Timestamps are taken from a monotonic clock in microseconds. Events are stored in binary
+ * form in a ring buffer owned by the calling thread, without locking or formatting. A
+ * background thread drains all ring buffers periodically and writes the JSON records. If a
+ * ring buffer is full, events are dropped and an instant event with the number of lost
+ * events is written.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "threadring.h"
+#include "trace.h"
+
+int traceEnabled = 0;
+
+#define TRACE_RING_SIZE		2048	/* Number of events per thread, must be a power of 2   */
+#define TRACE_MAX_DEPTH		16		/* Maximum nesting of spans per thread                 */
+#define TRACE_FLUSH_INTERVAL	100		/* Interval in ms for writing events to the trace file */
+
+
+
+struct traceEvent {
+	unsigned long long ts;              /**< Monotonic time stamp in microseconds    */
+	const char *name;                   /**< Static name of the span                 */
+	char phase;                         /**< 'B' for begin or 'E' for end            */
+	char argType;                       /**< One of the TRACE_ARGS_ constants        */
+	int args[6];
+};
+
+
+
+struct traceState {
+	int depth;                          /**< Number of open spans                    */
+	const char *stack[TRACE_MAX_DEPTH]; /**< Names of open spans                     */
+};
+
+
+
+static void writeTraceEvent(struct threadRingSet *set, struct threadRing *ring, void *entry);
+static void reportLostEvents(struct threadRingSet *set, struct threadRing *ring, unsigned long count);
+static void flushTrace(struct threadRingSet *set);
+
+static FILE *traceFileHandle = NULL;
+static unsigned long pid;
+static int firstEvent;
+
+static struct threadRingSet traceRings = {
+	sizeof(struct traceEvent), TRACE_RING_SIZE, sizeof(struct traceState), TRACE_FLUSH_INTERVAL,
+	writeTraceEvent, reportLostEvents, flushTrace
+};
+
+
+
+static void writeArgs(struct traceEvent *ev)
+{
+	switch(ev->argType) {
+	case TRACE_ARGS_COMMAND:
+		fprintf(traceFileHandle, ",\"args\":{\"header\":\"%02X %02X %02X %02X\",\"Lc\":%d,\"Le\":%d}",
+			ev->args[0], ev->args[1], ev->args[2], ev->args[3], ev->args[4], ev->args[5]);
+		break;
+	case TRACE_ARGS_RESPONSE:
+		fprintf(traceFileHandle, ",\"args\":{\"Lr\":%d,\"SW1SW2\":\"%04X\"}", ev->args[0], ev->args[1]);
+		break;
+	case TRACE_ARGS_SLOT:
+		fprintf(traceFileHandle, ",\"args\":{\"slot\":%d}", ev->args[0]);
+		break;
+	}
+}
+
+
+
+static void writeEvent(unsigned long tid, struct traceEvent *ev)
+{
+	fprintf(traceFileHandle, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":%lu,\"tid\":%lu",
+		firstEvent ? "" : ",\n", ev->name, ev->phase, ev->ts, pid, tid);
+	writeArgs(ev);
+	fputs("}", traceFileHandle);
+	firstEvent = 0;
+}
+
+
+
+static void writeTraceEvent(struct threadRingSet *set, struct threadRing *ring, void *entry)
+{
+	writeEvent(ring->tid, (struct traceEvent *)entry);
+}
+
+
+
+static void reportLostEvents(struct threadRingSet *set, struct threadRing *ring, unsigned long count)
+{
+	fprintf(traceFileHandle, ",\n{\"name\":\"events lost\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,\"pid\":%lu,\"tid\":%lu,\"args\":{\"count\":%lu}}",
+		getMicroseconds(), pid, ring->tid, count);
+}
+
+
+
+static void flushTrace(struct threadRingSet *set)
+{
+	fflush(traceFileHandle);
+}
+
+
+
+/**
+ * Store an event in the ring buffer
+ */
+static void putEvent(struct threadRing *ring, unsigned long long ts, char phase, const char *name, int argType, int a0, int a1, int a2, int a3, int a4, int a5)
+{
+	struct traceEvent *ev;
+
+	if (reserveThreadRing(&traceRings, ring, 1) != 0)
+		return;
+
+	ev = (struct traceEvent *)getThreadRingEntry(&traceRings, ring, 0);
+	ev->ts = ts;
+	ev->name = name;
+	ev->phase = phase;
+	ev->argType = (char)argType;
+	ev->args[0] = a0;
+	ev->args[1] = a1;
+	ev->args[2] = a2;
+	ev->args[3] = a3;
+	ev->args[4] = a4;
+	ev->args[5] = a5;
+
+	publishThreadRing(&traceRings, ring, 1);
+}
+
+
+
+/**
+ * Record the begin or end of a span
+ *
+ * The name must be a static string. An end event closes the innermost open span with
+ * that name and any span opened within. End events without a matching begin are ignored,
+ * so that spans are always properly nested in the trace.
+ *
+ * @param phase     'B' for begin or 'E' for end
+ * @param name      The name of the span
+ * @param argType   One of the TRACE_ARGS_ constants, defining the meaning of a0 to a5
+ */
+void traceRecord(char phase, const char *name, int argType, int a0, int a1, int a2, int a3, int a4, int a5)
+{
+	struct threadRing *ring;
+	struct traceState *state;
+	unsigned long long ts;
+	int i;
+
+	if (!traceEnabled)
+		return;
+
+	ring = getThreadRing(&traceRings);
+
+	if (ring == NULL)
+		return;
+
+	state = (struct traceState *)ring->state;
+
+	ts = getMicroseconds();
+
+	if (phase == 'B') {
+		if (state->depth < TRACE_MAX_DEPTH)
+			state->stack[state->depth] = name;
+		state->depth++;
+		putEvent(ring, ts, phase, name, argType, a0, a1, a2, a3, a4, a5);
+		return;
+	}
+
+	for (i = state->depth - 1; i >= 0; i--) {
+		if ((i < TRACE_MAX_DEPTH) && ((state->stack[i] == name) || !strcmp(state->stack[i], name)))
+			break;
+	}
+
+	if (i < 0)
+		return;
+
+	while (state->depth > i + 1) {
+		state->depth--;
+		putEvent(ring, ts, 'E', state->depth < TRACE_MAX_DEPTH ? state->stack[state->depth] : "", TRACE_ARGS_NONE, 0, 0, 0, 0, 0, 0);
+	}
+
+	state->depth--;
+	putEvent(ring, ts, phase, name, argType, a0, a1, a2, a3, a4, a5);
+}
+
+
+
+/**
+ * Open the trace file and start the writer thread, if PKCS11_TRACE_FILE is set
+ */
+void initTrace(char *module)
+{
+	char fn[512], *val, *po;
+	int len;
+
+	if (traceFileHandle != NULL)
+		return;
+
+	val = getenv("PKCS11_TRACE_FILE");
+	if (val == NULL)
+		return;
+
+#ifdef _WIN32
+	pid = (unsigned long)GetCurrentProcessId();
+#else
+	pid = (unsigned long)getpid();
+#endif
+
+	po = strstr(val, "%p");
+	if (po != NULL) {
+		len = (int)(po - val);
+		snprintf(fn, sizeof(fn), "%.*s%lu%s", len, val, pid, po + 2);
+	} else {
+		snprintf(fn, sizeof(fn), "%s", val);
+	}
+
+	traceFileHandle = fopen(fn, "w");
+
+	if (traceFileHandle == NULL)
+		return;
+
+	if (initThreadRings(&traceRings, 1) != 0) {
+		fclose(traceFileHandle);
+		traceFileHandle = NULL;
+		return;
+	}
+
+	if (!traceRings.writerRunning) {
+		termThreadRings(&traceRings);
+		fclose(traceFileHandle);
+		traceFileHandle = NULL;
+		return;
+	}
+
+	fprintf(traceFileHandle, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%lu,\"args\":{\"name\":\"%s\"}}", pid, module);
+	firstEvent = 0;
+
+	traceEnabled = 1;
+}
+
+
+
+/**
+ * Stop the writer thread, close spans still open and complete the trace file
+ *
+ * Ring buffers are not freed, because a thread may still hold its ring when it passed the
+ * check of traceEnabled just before. They are kept in the list and reused if tracing is
+ * initialized again, otherwise they are released at process exit.
+ */
+void termTrace()
+{
+	struct threadRing *ring;
+	struct traceState *state;
+	struct traceEvent ev;
+
+	if (traceFileHandle == NULL)
+		return;
+
+	traceEnabled = 0;
+	MEMORY_BARRIER();
+
+	termThreadRings(&traceRings);
+
+	memset(&ev, 0, sizeof(ev));
+	ev.phase = 'E';
+	ev.ts = getMicroseconds();
+
+	for (ring = traceRings.list; ring; ring = ring->next) {
+		state = (struct traceState *)ring->state;
+		while (state->depth > 0) {
+			state->depth--;
+			ev.name = state->depth < TRACE_MAX_DEPTH ? state->stack[state->depth] : "";
+			writeEvent(ring->tid, &ev);
+		}
+	}
+
+	fputs("\n]\n", traceFileHandle);
+	fclose(traceFileHandle);
+	traceFileHandle = NULL;
+}
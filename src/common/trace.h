@@ -0,0 +1,68 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    trace.h
+ * @author  Andreas Schwier
+ * @brief   Export of PKCS#11 calls and APDUs in the trace event format
+ */
+
+#ifndef ___TRACE_H_INC___
+#define ___TRACE_H_INC___
+
+#define TRACE_ARGS_NONE		0
+#define TRACE_ARGS_COMMAND	1	/**< CLA, INS, P1, P2, Lc and Le of a command APDU       */
+#define TRACE_ARGS_RESPONSE	2	/**< Length of response data and SW1/SW2                 */
+#define TRACE_ARGS_SLOT		3	/**< Slot id                                             */
+
+extern int traceEnabled;
+
+void initTrace(char *module);
+void traceRecord(char phase, const char *name, int argType, int a0, int a1, int a2, int a3, int a4, int a5);
+void termTrace();
+
+#define TRACE_BEGIN(name) do { \
+		if (traceEnabled) \
+			traceRecord('B', (name), TRACE_ARGS_NONE, 0, 0, 0, 0, 0, 0); \
+} while (0)
+
+#define TRACE_END(name) do { \
+		if (traceEnabled) \
+			traceRecord('E', (name), TRACE_ARGS_NONE, 0, 0, 0, 0, 0, 0); \
+} while (0)
+
+#define TRACE_BEGIN_SLOT(name, id) do { \
+		if (traceEnabled) \
+			traceRecord('B', (name), TRACE_ARGS_SLOT, (int)(id), 0, 0, 0, 0, 0); \
+} while (0)
+
+/**
+ * Only PKCS#11 entry points are traced by FUNC_CALLED(), FUNC_RETURNS() and FUNC_FAILS()
+ */
+#define TRACE_ENTRY_POINT(name)	((name)[0] == 'C' && (name)[1] == '_')
+
+#endif /* ___TRACE_H_INC___ */
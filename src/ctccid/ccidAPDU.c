@@ -49,6 +49,9 @@
 /**
  * Process a APDU using the CCID APDU transfer mode
  *
+ * Command and response are split into blocks of the maximum message size supported by
+ * the reader. Response data is copied directly from the USB receive buffer.
+ *
  * @param ctx Reader context
  * @param lc Length of command APDU
  * @param cmd Command APDU
@@ -63,21 +66,25 @@ static int ccidAPDUProcess (struct scr *ctx,
 				   unsigned char *rsp)
 {
 	int rc,r,maxlr;
-	unsigned int len;
-	unsigned char buf[BUFFMAX],*po,status,error,chain;
+	unsigned int len, maxblock;
+	unsigned char *po,*data,status,error,chain;
 	unsigned short level = 0;
 
+	maxblock = RDR_MaxXfrBlock(ctx);
+
 	maxlr = *lr;
 	*lr = 0;
 	po = cmd;
+	len = 0;
+	data = NULL;
 	while (lc > 0) {
 		len = lc;
-		if (lc > BUFFMAX) {
+		if (lc > maxblock) {
 			if (level)
 				level = 3;			// Intermediate extended command
 			else
 				level = 1;			// First extended command
-			len = BUFFMAX;
+			len = maxblock;
 		} else {
 			if (level)
 				level = 2;			// Final extended command
@@ -85,17 +92,14 @@ static int ccidAPDUProcess (struct scr *ctx,
 
 		rc = PC_to_RDR_XfrBlock(ctx, len, po, level);
 		if (rc < 0) {
-			memset_s(buf, sizeof(buf), 0, sizeof(buf));
 			return -1;
 		}
 
 		lc -= len;
 		po += len;
 
-		len = BUFFMAX;
-		rc = RDR_to_PC_DataBlock(ctx, &len, buf, &status, &error, &chain);
+		rc = RDR_to_PC_DataBlockInPlace(ctx, &len, &data, &status, &error, &chain);
 		if (rc < 0) {
-			memset_s(buf, sizeof(buf), 0, sizeof(buf));
 			return -1;
 		}
 	}
@@ -107,7 +111,8 @@ static int ccidAPDUProcess (struct scr *ctx,
 			r = ERR_MEMORY;
 		}
 
-		memcpy(rsp, buf, len);
+		memcpy(rsp, data, len);
+		memset_s(data, len, 0, len);
 		rsp += len;
 		maxlr -= len;
 		*lr += len;
@@ -115,13 +120,10 @@ static int ccidAPDUProcess (struct scr *ctx,
 		if ((chain == 1) || (chain == 3)) {
 			rc = PC_to_RDR_XfrBlock(ctx, 0, NULL, 0x10);
 			if (rc < 0) {
-				memset_s(buf, sizeof(buf), 0, sizeof(buf));
 				return -1;
 			}
-			len = BUFFMAX;
-			rc = RDR_to_PC_DataBlock(ctx, &len, buf, &status, &error, &chain);
+			rc = RDR_to_PC_DataBlockInPlace(ctx, &len, &data, &status, &error, &chain);
 			if (rc < 0) {
-				memset_s(buf, sizeof(buf), 0, sizeof(buf));
 				return -1;
 			}
 			continue;
@@ -129,7 +131,6 @@ static int ccidAPDUProcess (struct scr *ctx,
 		break;
 	}
 
-	memset_s(buf, sizeof(buf), 0, sizeof(buf));
 	return r;
 }
 
@@ -55,6 +55,7 @@ void ccidT1InitProtocol(scr_t *ctx)
 	ctx->t1->BlockWaitTime = 200 + (1 << ctx->BWI) * 100 + 11000 / ctx->Baud;
 	ctx->t1->WorkBWT = ctx->t1->BlockWaitTime;
 	ctx->t1->IFSC = ctx->IFSC;
+	ctx->t1->IFSD = BLEN;
 	ctx->t1->SSequenz = 0;
 	ctx->t1->RSequenz = 0;
 }
@@ -138,6 +139,9 @@ void ccidT1BlockInfo(unsigned char Nad, unsigned char Pcb, int InBuffLength, uns
  * Receive a block in T=1 protocol
  *
  * @param ctx Reader context
+ * A block with an information field larger than the IFSD or a length not matching the
+ * received data is invalid and treated like a transmission error.
+ *
  * @return 0 on success, -1 or \ref ERR_EDC on error
  */
 int ccidT1ReceiveBlock(scr_t *ctx)
@@ -176,6 +180,14 @@ int ccidT1ReceiveBlock(scr_t *ctx)
 		}
 	}
 
+	if ((len < 4) || (buf[2] > ctx->t1->IFSD) || (len != (unsigned int)buf[2] + 4)) {
+#ifdef DEBUG
+		ctccid_debug("Invalid block length %d, IFSD is %d\n", len < 3 ? -1 : buf[2], ctx->t1->IFSD);
+#endif
+		memset_s(buf, sizeof(buf), 0, sizeof(buf));
+		return -1;
+	}
+
 	ctx->t1->Nad = buf[0];
 	ctx->t1->Pcb = buf[1];
 	ctx->t1->InBuffLength = buf[2];
@@ -246,6 +258,57 @@ int ccidT1SendBlock(scr_t *ctx,
 
 
 
+/**
+ * Request the card to send blocks with up to ifsd bytes in the information field
+ *
+ * The initial IFSD of 32 splits a large response into many blocks, each requiring a
+ * round trip to the reader. If the card does not confirm the request, then the
+ * initial IFSD remains in effect.
+ *
+ * @param ctx Reader context
+ * @param SrcNode Source node
+ * @param DestNode Destination node
+ * @param ifsd Requested IFSD
+ * @return 0 on success, -1 on error
+ */
+int ccidT1NegotiateIFSD(scr_t *ctx, int SrcNode, int DestNode, int ifsd)
+{
+	int ret,retry;
+	unsigned char inf;
+
+	inf = (unsigned char)ifsd;
+	retry = RETRY;
+
+	while (retry--) {
+		ret = ccidT1SendBlock(ctx,
+							  CODENAD(SrcNode, DestNode),
+							  CODESBLOCK(IFSREQ),
+							  &inf, 1);
+
+		if (ret < 0) {
+			return -1;
+		}
+
+		ret = ccidT1ReceiveBlock(ctx);
+
+		if (!ret &&
+				ISSBLOCK(ctx->t1->Pcb) &&
+				(SBLOCKFUNC(ctx->t1->Pcb) == IFSRES) &&
+				(ctx->t1->InBuffLength == 1) &&
+				(ctx->t1->InBuff[0] == inf)) {
+			ctx->t1->IFSD = inf;
+#ifdef DEBUG
+			ctccid_debug("New IFSD: %d unsigned chars.\n", ctx->t1->IFSD);
+#endif
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+
+
 /**
  * Synchronize sequence counter in both sender and receiver after a transmission error has occurred
  *
@@ -276,6 +339,8 @@ int ccidT1Resynch(scr_t *ctx, int SrcNode, int DestNode)
 				ISSBLOCK(ctx->t1->Pcb) &&
 				(SBLOCKFUNC(ctx->t1->Pcb) == RESYNCHRES)) {
 			ccidT1InitProtocol(ctx);
+			/* Resynchronization restores the initial IFSD */
+			ccidT1NegotiateIFSD(ctx, SrcNode, DestNode, RDR_MaxIFSD(ctx));
 			return 0;
 		}
 	}
@@ -377,7 +442,9 @@ int ccidT1GetBlock(scr_t *ctx, int SrcNode, int DestNode)
 								CODESBLOCK(IFSRES),
 								ctx->t1->InBuff,
 								1);
-				ctx->t1->IFSC = (int)ctx->t1->InBuff[0];
+				if ((ctx->t1->InBuff[0] > 0) && (ctx->t1->InBuff[0] < 0xFF)) {
+					ctx->t1->IFSC = (int)ctx->t1->InBuff[0];
+				}
 
 #ifdef DEBUG
 				ctccid_debug("New IFSC: %d unsigned chars.\n", ctx->t1->IFSC);
@@ -706,5 +773,8 @@ int ccidT1Init (struct scr *ctx)
 
 	ccidT1InitProtocol(ctx);
 
+	/* Not fatal if the card does not support a larger IFSD */
+	ccidT1NegotiateIFSD(ctx, 0, 0, RDR_MaxIFSD(ctx));
+
 	return 0;
 }
@@ -54,6 +54,8 @@ typedef struct ccidT1 {
 	long             WorkBWT;
 	/** Maximum length of INF field       */
 	unsigned char   IFSC;
+	/** Maximum length of received INF field */
+	unsigned char   IFSD;
 	/** Receiver sequence number          */
 	int              RSequenz;
 	/** Transmitter sequence number       */
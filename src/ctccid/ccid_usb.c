@@ -107,6 +107,7 @@ int PC_to_RDR_IccPowerOn(scr_t *ctx)
 
         memset(msg, 0, 10);
         msg[0] = MSG_TYPE_PC_to_RDR_IccPowerOn;
+        ctx->SlotStatusValid = 0;
 
 #ifdef DEBUG
         CCIDDump(msg, 10);
@@ -236,7 +237,11 @@ int DecodeATRValues(scr_t *ctx)
 
                         if (i > 2) {
                                 temp = ctx->ATR[atrp++];
-                                ctx->IFSC = temp;
+
+                                /* 0x00 and 0xFF are reserved, keep the default */
+                                if ((temp > 0) && (temp < 0xFF)) {
+                                        ctx->IFSC = temp;
+                                }
                         }
                 }
 
@@ -278,17 +283,93 @@ int DecodeATRValues(scr_t *ctx)
 
 
 
+/**
+ * Return the exchange level supported by the reader
+ *
+ * @param ctx Reader context
+ * @return \ref CCID_LEVEL_EXTENDED_APDU, \ref CCID_LEVEL_SHORT_APDU or \ref CCID_LEVEL_TPDU
+ */
+int RDR_ExchangeLevel(scr_t *ctx)
+{
+	unsigned char const *desc;
+	int length;
+
+	USB_GetCCIDDescriptor(ctx->device, &desc, &length);
+
+	if (length != 54)
+		return CCID_LEVEL_TPDU;
+
+	if (desc[42] & CCID_LEVEL_EXTENDED_APDU)
+		return CCID_LEVEL_EXTENDED_APDU;
+
+	if (desc[42] & CCID_LEVEL_SHORT_APDU)
+		return CCID_LEVEL_SHORT_APDU;
+
+	return CCID_LEVEL_TPDU;
+}
+
+
+
+/**
+ * Return true if the reader exchanges APDUs rather than TPDUs
+ *
+ * APDU level exchange is used for readers supporting extended APDUs, as the reader handles
+ * the T=1 block framing and chaining without a USB round trip per block.
+ *
+ * Readers with short APDU level use the TPDU path. They can not transfer extended APDUs,
+ * which the SmartCard-HSM requires e.g. for reading large files. Switching to TPDU for such
+ * APDUs is not possible either, because the reader keeps its own T=1 block sequence
+ * numbers while exchanging APDUs.
+ *
+ * @param ctx Reader context
+ */
 int RDR_APDUTransferMode(scr_t *ctx)
+{
+	return RDR_ExchangeLevel(ctx) == CCID_LEVEL_EXTENDED_APDU;
+}
+
+
+
+/**
+ * Return the maximum IFSD supported by the reader, limited to 254
+ *
+ * @param ctx Reader context
+ */
+int RDR_MaxIFSD(scr_t *ctx)
 {
 	unsigned char const *desc;
-	int length, apdu_transfer = 0;
+	int length, ifsd;
 
 	USB_GetCCIDDescriptor(ctx->device, &desc, &length);
 
-	if (length == 54)
-		apdu_transfer = desc[42] & 0x04;
+	if (length != 54)
+		return 254;
+
+	ifsd = desc[28] | (desc[29] << 8) | (desc[30] << 16) | (desc[31] << 24);
 
-	return apdu_transfer;
+	if ((ifsd <= 0) || (ifsd > 254))
+		ifsd = 254;
+
+	return ifsd;
+}
+
+
+
+/**
+ * Return the maximum size of data in a single XfrBlock
+ *
+ * @param ctx Reader context
+ */
+int RDR_MaxXfrBlock(scr_t *ctx)
+{
+	int max;
+
+	max = ctx->device->max_message_length - 10;
+
+	if (max > MAX_XFRBLOCK)
+		max = MAX_XFRBLOCK;
+
+	return max;
 }
 
 
@@ -394,6 +475,68 @@ int PC_to_RDR_GetSlotStatus(scr_t *ctx)
 
 
 
+/**
+ * Get the state of the reader slot without bus traffic if possible
+ *
+ * If the reader reports slot changes via the interrupt endpoint, then a removed card is
+ * reported immediately and the status of a present card is queried only once after each
+ * change or power on/off.
+ *
+ * @param ctx Reader context
+ * @return \ref ICC_PRESENT_AND_INACTIVE, \ref ICC_PRESENT_AND_ACTIVE, \ref NO_ICC_PRESENT or -1 on error
+ */
+int GetSlotStatusCached(scr_t *ctx)
+{
+
+        unsigned int changes;
+        int present, status;
+
+        present = USB_GetPresence(ctx->device, &changes);
+
+        if (present == 0) {
+                ctx->SlotStatusValid = 0;
+                return NO_ICC_PRESENT;
+        }
+
+        if ((present == 1) && ctx->SlotStatusValid && (ctx->SlotChanges == changes)) {
+                return ctx->SlotStatus;
+        }
+
+        status = PC_to_RDR_GetSlotStatus(ctx);
+
+        if ((present == -1) && (status >= 0)) {
+                present = USB_SeedPresence(ctx->device, changes, status != NO_ICC_PRESENT);
+        }
+
+        if ((present == 1) && (status >= 0) && (status != NO_ICC_PRESENT)) {
+                ctx->SlotStatus = status;
+                ctx->SlotChanges = changes;
+                ctx->SlotStatusValid = 1;
+        }
+
+        return status;
+}
+
+
+
+/**
+ * Wait for a slot change notification or the timeout
+ *
+ * Readers without interrupt endpoint just wait for the timeout.
+ *
+ * @param ctx Reader context
+ * @param timeout Timeout in milliseconds
+ */
+void WaitForSlotChange(scr_t *ctx, int timeout)
+{
+
+        if (USB_WaitForPresenceChange(ctx->device, timeout) < 0) {
+                usleep(timeout * 1000);
+        }
+}
+
+
+
 /**
  * Power off the ICC in the reader
  *
@@ -410,6 +553,7 @@ int PC_to_RDR_IccPowerOff(scr_t *ctx)
 
         memset(msg, 0, 10);
         msg[0] = MSG_TYPE_PC_to_RDR_IccPowerOff;
+        ctx->SlotStatusValid = 0;
 
 #ifdef DEBUG
         CCIDDump(msg, 10);
@@ -454,11 +598,11 @@ int PC_to_RDR_XfrBlock(scr_t *ctx, unsigned int outlen, unsigned char *outbuf, u
 {
 
         int rc;
-        unsigned char msg[10 + BUFFMAX];
+        unsigned char msg[10 + MAX_XFRBLOCK];
 
-        if (outlen > BUFFMAX) {
+        if ((outlen > MAX_XFRBLOCK) || (outlen > ctx->device->max_message_length - 10)) {
 #ifdef DEBUG
-                ctccid_debug("PC_to_RDR_XfrBlock outlen > BUFFMAX\n");
+                ctccid_debug("PC_to_RDR_XfrBlock outlen > maximum message length\n");
 #endif
                 return -1;
         }
@@ -488,30 +632,24 @@ int PC_to_RDR_XfrBlock(scr_t *ctx, unsigned int outlen, unsigned char *outbuf, u
 
 
 /**
- * Exchange data block between reader and PC
+ * Receive data block from the reader without copying
+ *
+ * The returned buffer belongs to the USB device and is valid until the next exchange with the reader.
  *
  * @param ctx Reader context
- * @param inlen Length of data buffer/actual length of incoming data
- * @param inbuf Incoming data buffer
+ * @param inlen Length of incoming data
+ * @param inbuf Pointer updated with the address of the incoming data
  * @return 0 on success, negative value otherwise
  */
-int RDR_to_PC_DataBlock(scr_t *ctx, unsigned int *inlen, unsigned char *inbuf, unsigned char *status, unsigned char *error, unsigned char *chain)
+int RDR_to_PC_DataBlockInPlace(scr_t *ctx, unsigned int *inlen, unsigned char **inbuf, unsigned char *status, unsigned char *error, unsigned char *chain)
 {
 
         unsigned int l;
-        unsigned char msg[10 + BUFFMAX];
+        unsigned char *msg;
         int rc;
 
-        if (*inlen > BUFFMAX) {
-#ifdef DEBUG
-                ctccid_debug("RDR_to_PC_DataBlock *inlen > BUFFMAX\n");
-#endif
-                return -1;
-        }
-
         while (1) {
-                l = sizeof(msg);
-                rc = USB_Read(ctx->device, &l, msg);
+                rc = USB_ReadInPlace(ctx->device, &l, &msg);
 
                 if (rc < 0) {
                         *inlen = 0;
@@ -540,13 +678,56 @@ int RDR_to_PC_DataBlock(scr_t *ctx, unsigned int *inlen, unsigned char *inbuf, u
                 *error = msg[8];
         if (chain)
                 *chain = msg[9];
+
+        *inlen = (l - 10);
+        *inbuf = msg + 10;
+
+        return 0;
+}
+
+
+
+/**
+ * Exchange data block between reader and PC
+ *
+ * @param ctx Reader context
+ * @param inlen Length of data buffer/actual length of incoming data
+ * @param inbuf Incoming data buffer
+ * @return 0 on success, negative value otherwise
+ */
+int RDR_to_PC_DataBlock(scr_t *ctx, unsigned int *inlen, unsigned char *inbuf, unsigned char *status, unsigned char *error, unsigned char *chain)
+{
+
+        unsigned int l;
+        unsigned char *data;
+        int rc;
+
+        if (*inlen > BUFFMAX) {
 #ifdef DEBUG
-        memset(inbuf, 0x00, BUFFMAX);
+                ctccid_debug("RDR_to_PC_DataBlock *inlen > BUFFMAX\n");
 #endif
+                return -1;
+        }
 
-        *inlen = (l - 10);
+        rc = RDR_to_PC_DataBlockInPlace(ctx, &l, &data, status, error, chain);
+
+        if (rc < 0) {
+                *inlen = 0;
+                return rc;
+        }
+
+#ifdef DEBUG
+        memset(inbuf, 0x00, *inlen);
+#endif
+
+        if (l > *inlen) {
+                *inlen = 0;
+                return -1;
+        }
+
+        *inlen = l;
 
-        memcpy(inbuf, msg + 10, *inlen);
+        memcpy(inbuf, data, *inlen);
 
         return 0;
 }
@@ -42,6 +42,18 @@
  */
 #define BUFFMAX    261
 
+/**
+ * Maximum size of data exchanged in a single XfrBlock in APDU transfer mode
+ */
+#define MAX_XFRBLOCK    4098
+
+/**
+ * Exchange levels from dwFeatures in the CCID descriptor
+ */
+#define CCID_LEVEL_TPDU				0x00
+#define CCID_LEVEL_SHORT_APDU		0x02
+#define CCID_LEVEL_EXTENDED_APDU	0x04
+
 #define ERR_ICC_MUTE				0xFE
 #define ERR_XFR_OVERRUN				0xFC
 #define ERR_HW_ERROR				0xFB
@@ -68,12 +80,24 @@ int PC_to_RDR_IccPowerOff(scr_t *ctx);
 
 int RDR_APDUTransferMode(scr_t *ctx);
 
+int RDR_ExchangeLevel(scr_t *ctx);
+
+int RDR_MaxIFSD(scr_t *ctx);
+
+int RDR_MaxXfrBlock(scr_t *ctx);
+
 int PC_to_RDR_XfrBlock(scr_t *ctx, unsigned int outlen, unsigned char *outbuf, unsigned char level);
 
 int RDR_to_PC_DataBlock(scr_t *ctx, unsigned int *inlen, unsigned char *inbuf, unsigned char *status, unsigned char *error, unsigned char *chain);
 
+int RDR_to_PC_DataBlockInPlace(scr_t *ctx, unsigned int *inlen, unsigned char **inbuf, unsigned char *status, unsigned char *error, unsigned char *chain);
+
 int PC_to_RDR_GetSlotStatus(scr_t *ctx);
 
+int GetSlotStatusCached(scr_t *ctx);
+
+void WaitForSlotChange(scr_t *ctx, int timeout);
+
 int DetermineBaudrate(int F, int D);
 
 int DecodeATRValues(scr_t *ctx);
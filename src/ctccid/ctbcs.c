@@ -150,7 +150,8 @@ int ResetCard(struct scr *ctx, unsigned int lc, unsigned char *cmd,
 int RequestICC(struct scr *ctx, unsigned int lc, unsigned char *cmd,
 			   unsigned int *lr, unsigned char *rsp)
 {
-	int status, timeout;
+	unsigned long long deadline, now;
+	int status, timeout, wait;
 
 	if ((lc > 4) && (cmd[4] == 1)) {
 		timeout = cmd[5];
@@ -158,7 +159,7 @@ int RequestICC(struct scr *ctx, unsigned int lc, unsigned char *cmd,
 		timeout = 0;
 	}
 
-	status = PC_to_RDR_GetSlotStatus(ctx);
+	status = GetSlotStatusCached(ctx);
 
 	if (status < 0) {
 		rsp[0] = HIGH(NOT_SUCCESSFUL);
@@ -167,11 +168,12 @@ int RequestICC(struct scr *ctx, unsigned int lc, unsigned char *cmd,
 		return ERR_CT;
 	}
 
-	timeout *= 4;
+	/* The timeout is given in seconds and measured as elapsed time, not in loop iterations */
+	deadline = getMicroseconds() + (unsigned long long)timeout * 1000000;
 
-	do {
+	while (1) {
 
-		status = PC_to_RDR_GetSlotStatus(ctx);
+		status = GetSlotStatusCached(ctx);
 
 		if (status < 0) {
 			rsp[0] = HIGH(NOT_SUCCESSFUL);
@@ -180,13 +182,20 @@ int RequestICC(struct scr *ctx, unsigned int lc, unsigned char *cmd,
 			return ERR_CT;
 		}
 
-		if ((status == ICC_PRESENT_AND_INACTIVE) || !timeout) {
+		if (status == ICC_PRESENT_AND_INACTIVE) {
 			break;
 		}
 
-		usleep(250000);
-		timeout--;
-	} while (timeout);
+		now = getMicroseconds();
+
+		if (now >= deadline) {
+			timeout = 0;
+			break;
+		}
+
+		wait = (int)((deadline - now) / 1000);
+		WaitForSlotChange(ctx, wait < 250 ? wait + 1 : 250);
+	}
 
 	if (!timeout && (status == NO_ICC_PRESENT)) {
 		rsp[0] = HIGH(W_NO_CARD_PRESENTED);
@@ -257,7 +266,7 @@ int EjectICC(struct scr *ctx, unsigned int lc, unsigned char *cmd,
 	if (save_timeout > 0) {
 		do {
 
-			status = PC_to_RDR_GetSlotStatus(ctx);
+			status = GetSlotStatusCached(ctx);
 
 			if (status < 0) {
 				rsp[0] = HIGH(NOT_SUCCESSFUL);
@@ -270,7 +279,7 @@ int EjectICC(struct scr *ctx, unsigned int lc, unsigned char *cmd,
 				break;
 			}
 
-			usleep(250000);
+			WaitForSlotChange(ctx, 250);
 
 		} while (--save_timeout);
 
@@ -311,7 +320,7 @@ int GetICCStatus(struct scr *ctx, unsigned int *lr, unsigned char *rsp)
 {
 	int status;
 
-	status = PC_to_RDR_GetSlotStatus(ctx);
+	status = GetSlotStatusCached(ctx);
 
 	if (status < 0) {
 		rsp[0] = HIGH(NOT_SUCCESSFUL);
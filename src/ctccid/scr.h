@@ -107,6 +107,12 @@ struct scr {
 	unsigned char     IFSC;
 	/** Current baudrate                   */
 	int               Baud;
+	/** Last slot status from the reader   */
+	int               SlotStatus;
+	/** SlotStatus is valid                */
+	int               SlotStatusValid;
+	/** Slot changes seen for SlotStatus   */
+	unsigned int      SlotChanges;
 
 	CTModFunc_t       CTModFunc; /* response */
 
@@ -29,9 +29,24 @@
  * @file usb_device.c
  * @author Frank Thater
  * @brief Simple abstraction layer for USB devices
+ *
+ * Bulk transfers use the asynchronous libusb API. Each device owns a preallocated transfer
+ * and event for bulk in and bulk out as well as a receive buffer sized from the
+ * dwMaxCCIDMessageLength in the CCID descriptor. A single event thread, started with the
+ * first and stopped with the last open device, handles completions for all devices.
+ *
+ * USB_Write() submits the bulk in transfer for the response together with the command,
+ * so that the response is received as soon as the reader sends it. USB_Read() and
+ * USB_ReadInPlace() wait for the completion of that transfer. USB_ReadInPlace() returns
+ * a pointer into the receive buffer, saving the copy to the caller's buffer.
+ *
+ * If the reader has an interrupt in endpoint, a transfer is kept submitted on it to
+ * receive RDR_to_PC_NotifySlotChange messages. The reported card presence is available
+ * via USB_GetPresence() without any traffic on the bus.
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <malloc.h>
 
@@ -108,6 +123,311 @@ static libusb_context *context = NULL;
  */
 static int refcnt = 0;
 
+/*
+ * Number of open devices served by the event thread
+ */
+static int opencnt = 0;
+
+/*
+ * Thread handling libusb events for all open devices
+ */
+static THREAD eventThread;
+
+/*
+ * Cleared to stop the event thread
+ */
+static volatile int eventThreadRunning = 0;
+
+
+
+/**
+ * Completion callback for all transfers, called in the event thread
+ */
+static void LIBUSB_CALL transferCompleted(struct libusb_transfer *transfer)
+{
+	event_set((EVENT *)transfer->user_data);
+}
+
+
+
+/**
+ * Handle libusb events until stopped
+ */
+static void eventLoop(void *arg)
+{
+	struct timeval tv;
+
+	while (eventThreadRunning) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 100000;
+		libusb_handle_events_timeout_completed(context, &tv, NULL);
+	}
+}
+
+
+
+static int startEventThread()
+{
+	eventThreadRunning = 1;
+
+	if (thread_create(&eventThread, eventLoop, NULL) != 0) {
+		eventThreadRunning = 0;
+		return ERR_USB;
+	}
+
+	return USB_OK;
+}
+
+
+
+static void stopEventThread()
+{
+	eventThreadRunning = 0;
+	thread_join(&eventThread);
+}
+
+
+
+/**
+ * Completion callback for the interrupt in transfer, called in the event thread
+ *
+ * Records the card presence from RDR_to_PC_NotifySlotChange and resubmits the transfer.
+ */
+static void LIBUSB_CALL interruptCompleted(struct libusb_transfer *transfer)
+{
+	usb_device_t *device = (usb_device_t *)transfer->user_data;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		if ((transfer->actual_length >= 2) && (transfer->buffer[0] == MSG_TYPE_RDR_to_PC_NotifySlotChange)) {
+			device->icc_present = transfer->buffer[1] & 0x01;
+			MEMORY_BARRIER();
+			device->icc_changes++;
+#ifdef DEBUG
+			ctccid_debug("NotifySlotChange: ICC %s\n", device->icc_present ? "present" : "absent");
+#endif
+			event_set(&device->icc_changed);
+		}
+
+		if (eventThreadRunning && (libusb_submit_transfer(transfer) == LIBUSB_SUCCESS)) {
+			return;
+		}
+	}
+
+	/* Cancelled, device removed or resubmission failed: presence is no longer tracked */
+	device->icc_present = -1;
+	MEMORY_BARRIER();
+	device->interrupt_active = 0;
+	event_set(&device->icc_changed);
+}
+
+
+
+/**
+ * Start listening for slot change notifications on the interrupt endpoint
+ */
+static void startInterrupt(usb_device_t *device)
+{
+	device->icc_present = -1;
+
+	if (!device->interrupt_in || (device->interrupt_transfer == NULL)) {
+		return;
+	}
+
+	libusb_fill_interrupt_transfer(device->interrupt_transfer, device->handle, device->interrupt_in,
+			device->interrupt_buffer, sizeof(device->interrupt_buffer),
+			interruptCompleted, device, 0);
+
+	device->interrupt_active = 1;
+	if (libusb_submit_transfer(device->interrupt_transfer) != LIBUSB_SUCCESS) {
+#ifdef DEBUG
+		ctccid_debug("Can not listen on interrupt endpoint\n");
+#endif
+		device->interrupt_active = 0;
+	}
+}
+
+
+
+/**
+ * Cancel the interrupt in transfer and wait for its termination
+ */
+static void stopInterrupt(usb_device_t *device)
+{
+	if (!device->interrupt_active) {
+		return;
+	}
+
+	/* Repeat the cancellation in case the transfer was resubmitted concurrently */
+	while (device->interrupt_active) {
+		libusb_cancel_transfer(device->interrupt_transfer);
+		event_wait_timeout(&device->icc_changed, 100);
+	}
+}
+
+
+
+/**
+ * Determine the maximum message length from the CCID descriptor
+ */
+static int getMaxMessageLength(usb_device_t *device)
+{
+	const unsigned char *desc;
+	int len;
+
+	desc = device->configuration_descriptor->interface->altsetting->extra;
+
+	if (device->configuration_descriptor->interface->altsetting->extra_length < 48) {
+		return USB_DEFAULT_MESSAGE_LENGTH;
+	}
+
+	len = desc[44] | (desc[45] << 8) | (desc[46] << 16) | (desc[47] << 24);
+
+	if (len < USB_DEFAULT_MESSAGE_LENGTH) {
+		len = USB_DEFAULT_MESSAGE_LENGTH;
+	}
+
+	if (len > USB_MAX_MESSAGE_LENGTH) {
+		len = USB_MAX_MESSAGE_LENGTH;
+	}
+
+	return len;
+}
+
+
+
+/**
+ * Allocate transfers, events and receive buffer for the device
+ */
+static int allocateTransfers(usb_device_t *device)
+{
+	device->max_message_length = getMaxMessageLength(device);
+
+	/* Round up to a multiple of the maximum packet size of high speed bulk endpoints to prevent overflows */
+	device->read_buffer_size = (device->max_message_length + 511) & ~511;
+	device->read_buffer = malloc(device->read_buffer_size);
+	device->write_transfer = libusb_alloc_transfer(0);
+	device->read_transfer = libusb_alloc_transfer(0);
+	device->interrupt_transfer = libusb_alloc_transfer(0);
+
+	if ((device->read_buffer == NULL) || (device->write_transfer == NULL) ||
+		(device->read_transfer == NULL) || (device->interrupt_transfer == NULL)) {
+		goto failed;
+	}
+
+	if (event_init(&device->write_done) != 0) {
+		goto failed;
+	}
+
+	if (event_init(&device->read_done) != 0) {
+		event_destroy(&device->write_done);
+		goto failed;
+	}
+
+	if (event_init(&device->icc_changed) != 0) {
+		event_destroy(&device->write_done);
+		event_destroy(&device->read_done);
+		goto failed;
+	}
+
+	return USB_OK;
+
+failed:
+	libusb_free_transfer(device->write_transfer);
+	libusb_free_transfer(device->read_transfer);
+	libusb_free_transfer(device->interrupt_transfer);
+	free(device->read_buffer);
+	return ERR_USB;
+}
+
+
+
+static void freeTransfers(usb_device_t *device)
+{
+	event_destroy(&device->write_done);
+	event_destroy(&device->read_done);
+	event_destroy(&device->icc_changed);
+	libusb_free_transfer(device->write_transfer);
+	libusb_free_transfer(device->read_transfer);
+	libusb_free_transfer(device->interrupt_transfer);
+	free(device->read_buffer);
+}
+
+
+
+/**
+ * Submit the bulk in transfer into the receive buffer, unless already pending
+ */
+static int submitRead(usb_device_t *device)
+{
+	int rc;
+
+	if (device->read_pending) {
+		return USB_OK;
+	}
+
+	libusb_fill_bulk_transfer(device->read_transfer, device->handle, device->bulk_in,
+			device->read_buffer, device->read_buffer_size,
+			transferCompleted, &device->read_done, USB_READ_TIMEOUT);
+
+	rc = libusb_submit_transfer(device->read_transfer);
+
+	if (rc != LIBUSB_SUCCESS) {
+#ifdef DEBUG
+		ctccid_debug("libusb_submit_transfer (read) failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
+#endif
+		return ERR_USB;
+	}
+
+	device->read_pending = 1;
+	return USB_OK;
+}
+
+
+
+/**
+ * Cancel a pending bulk in transfer and wait for its completion
+ */
+static void cancelRead(usb_device_t *device)
+{
+	if (!device->read_pending) {
+		return;
+	}
+
+	libusb_cancel_transfer(device->read_transfer);
+	event_wait(&device->read_done);
+	device->read_pending = 0;
+}
+
+
+
+/**
+ * Wait for the bulk in transfer, submitting it if not yet pending
+ *
+ * @return Number of bytes received or \ref ERR_USB
+ */
+static int waitRead(usb_device_t *device)
+{
+	int rc;
+
+	rc = submitRead(device);
+
+	if (rc < 0) {
+		return rc;
+	}
+
+	event_wait(&device->read_done);
+	device->read_pending = 0;
+
+	if (device->read_transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+#ifdef DEBUG
+		ctccid_debug("Bulk transfer (read) failed. status = %i\n", device->read_transfer->status);
+#endif
+		return ERR_USB;
+	}
+
+	return device->read_transfer->actual_length;
+}
+
 
 
 int isSupported(struct libusb_device_descriptor *desc)
@@ -389,8 +709,13 @@ int USB_Open(unsigned short pn, usb_device_t **device)
 			if ((*device)->configuration_descriptor->interface->altsetting->endpoint[i].bmAttributes
 					== LIBUSB_TRANSFER_TYPE_INTERRUPT) {
 				/*
-				 * Ignore the interrupt endpoint
+				 * Interrupt endpoint for RDR_to_PC_NotifySlotChange
 				 */
+				bEndpointAddress = (*device)->configuration_descriptor->interface->altsetting->endpoint[i].bEndpointAddress;
+
+				if ((bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN) {
+					(*device)->interrupt_in = bEndpointAddress;
+				}
 				continue;
 			}
 
@@ -413,7 +738,36 @@ int USB_Open(unsigned short pn, usb_device_t **device)
 			}
 		}
 
-		rc = USB_OK;
+		rc = allocateTransfers(*device);
+
+		if ((rc == USB_OK) && (opencnt == 0)) {
+			rc = startEventThread();
+
+			if (rc != USB_OK) {
+				freeTransfers(*device);
+			}
+		}
+
+		if (rc != USB_OK) {
+#ifdef DEBUG
+			ctccid_debug("Allocating transfers failed\n");
+#endif
+			libusb_release_interface((*device)->handle, (*device)->configuration_descriptor->interface->altsetting->bInterfaceNumber);
+			libusb_free_config_descriptor((*device)->configuration_descriptor);
+			libusb_close((*device)->handle);
+			free(*device);
+			libusb_free_device_list(devs, 1);
+			refcnt--;
+			if (refcnt == 0) {
+				libusb_exit(context);
+				context = NULL;
+			}
+			return ERR_USB;
+		}
+
+		opencnt++;
+
+		startInterrupt(*device);
 
 	} else { /* no reader found */
 		rc = ERR_NO_READER;
@@ -461,6 +815,9 @@ int USB_Close(usb_device_t **device)
 
 	int rc;
 
+	cancelRead(*device);
+	stopInterrupt(*device);
+
 	rc = libusb_release_interface((*device)->handle,
 								  (*device)->configuration_descriptor->interface->altsetting->bInterfaceNumber);
 
@@ -473,6 +830,13 @@ int USB_Close(usb_device_t **device)
 
 	libusb_free_config_descriptor((*device)->configuration_descriptor);
 	libusb_close((*device)->handle);
+
+	opencnt--;
+	if (opencnt == 0) {
+		stopEventThread();
+	}
+
+	freeTransfers(*device);
 	free(*device);
 	*device = NULL;
 
@@ -490,6 +854,8 @@ int USB_Close(usb_device_t **device)
 /**
  * Write data block to specified USB device using bulk transfer
  *
+ * The bulk in transfer for the response is submitted together with the command.
+ *
  * @param device Device specific data
  * @param length Length of data to write
  * @param buffer Data buffer
@@ -498,17 +864,32 @@ int USB_Close(usb_device_t **device)
 int USB_Write(usb_device_t *device, unsigned int length, unsigned char *buffer)
 {
 	int rc;
-	int send;
 
-	rc = libusb_bulk_transfer(device->handle, device->bulk_out, buffer, length, &send, USB_WRITE_TIMEOUT);
+	libusb_fill_bulk_transfer(device->write_transfer, device->handle, device->bulk_out,
+			buffer, length, transferCompleted, &device->write_done, USB_WRITE_TIMEOUT);
+
+	rc = libusb_submit_transfer(device->write_transfer);
 
-	if (rc != LIBUSB_SUCCESS || (send != length)) {
+	if (rc != LIBUSB_SUCCESS) {
 #ifdef DEBUG
-		ctccid_debug("libusb_bulk_transfer (write) failed. rc = %i (%s), send=%i, length=%i\n", rc, libusb_error_to_string(rc), send, length);
+		ctccid_debug("libusb_submit_transfer (write) failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
 #endif
 		return ERR_USB;
 	}
 
+	/* Failing here is not fatal, USB_Read() submits again */
+	submitRead(device);
+
+	event_wait(&device->write_done);
+
+	if ((device->write_transfer->status != LIBUSB_TRANSFER_COMPLETED) || (device->write_transfer->actual_length != length)) {
+#ifdef DEBUG
+		ctccid_debug("Bulk transfer (write) failed. status = %i, send=%i, length=%i\n", device->write_transfer->status, device->write_transfer->actual_length, length);
+#endif
+		cancelRead(device);
+		return ERR_USB;
+	}
+
 	return USB_OK;
 }
 
@@ -525,19 +906,118 @@ int USB_Write(usb_device_t *device, unsigned int length, unsigned char *buffer)
 int USB_Read(usb_device_t *device, unsigned int *length, unsigned char *buffer)
 {
 	int rc;
-	int read;
 
-	rc = libusb_bulk_transfer(device->handle, device->bulk_in, buffer, *length, &read, USB_READ_TIMEOUT);
+	rc = waitRead(device);
 
-	if (rc != LIBUSB_SUCCESS) {
+	if ((rc < 0) || (rc > *length)) {
 		*length = 0;
-#ifdef DEBUG
-		ctccid_debug("libusb_bulk_transfer (read) failed. rc = %i (%s)\n", rc, libusb_error_to_string(rc));
-#endif
 		return ERR_USB;
 	}
 
-	*length = read;
+	memcpy(buffer, device->read_buffer, rc);
+	*length = rc;
 
 	return USB_OK;
 }
+
+
+
+/**
+ * Read data block from specified USB device using bulk transfer without copying
+ *
+ * The returned buffer belongs to the device and remains valid until the next call
+ * to USB_Write(), USB_Read(), USB_ReadInPlace() or USB_Close() for the device.
+ *
+ * @param device Device specific data
+ * @param length Length of data received
+ * @param buffer Pointer updated with the address of the received data
+ * @return Status code \ref USB_OK, \ref ERR_USB
+ */
+int USB_ReadInPlace(usb_device_t *device, unsigned int *length, unsigned char **buffer)
+{
+	int rc;
+
+	rc = waitRead(device);
+
+	if (rc < 0) {
+		*length = 0;
+		return ERR_USB;
+	}
+
+	*buffer = device->read_buffer;
+	*length = rc;
+
+	return USB_OK;
+}
+
+
+
+/**
+ * Return the card presence reported by the reader via the interrupt endpoint
+ *
+ * @param device Device specific data
+ * @param changes Updated with the number of slot change notifications received so far, may be NULL
+ * @return 1 if a card is present, 0 if not and -1 if the presence is not tracked
+ */
+int USB_GetPresence(usb_device_t *device, unsigned int *changes)
+{
+	int present;
+
+	present = device->icc_present;
+	MEMORY_BARRIER();
+
+	if (changes) {
+		*changes = device->icc_changes;
+	}
+
+	return present;
+}
+
+
+
+/**
+ * Seed the card presence with the result of a GetSlotStatus
+ *
+ * Readers only notify changes, so a card that is present when the device is opened is
+ * never reported via the interrupt endpoint. If a notification arrived since changes was
+ * obtained from USB_GetPresence(), the presence remains untracked until the next call.
+ *
+ * @param device Device specific data
+ * @param changes The number of notifications returned by USB_GetPresence() before the GetSlotStatus
+ * @param present 1 if the GetSlotStatus found a card, 0 if not
+ * @return The seeded presence or -1 if the presence is not tracked
+ */
+int USB_SeedPresence(usb_device_t *device, unsigned int changes, int present)
+{
+	if (!device->interrupt_active) {
+		return -1;
+	}
+
+	device->icc_present = present;
+	MEMORY_BARRIER();
+
+	if ((device->icc_changes != changes) || !device->interrupt_active) {
+		device->icc_present = -1;
+		return -1;
+	}
+
+	return present;
+}
+
+
+
+/**
+ * Wait for a slot change notification from the reader
+ *
+ * @param device Device specific data
+ * @param timeout Timeout in milliseconds
+ * @return 0 if a notification was received, 1 on timeout, -1 if the presence is not tracked
+ */
+int USB_WaitForPresenceChange(usb_device_t *device, int timeout)
+{
+	if (!device->interrupt_active) {
+		return -1;
+	}
+
+	return event_wait_timeout(&device->icc_changed, timeout);
+}
@@ -36,6 +36,8 @@
 
 #include <stdint.h>
 
+#include <common/mutex.h>
+
 /**
  * Vendor ID for SCM Microsystems
  */
@@ -66,6 +68,21 @@
  */
 #define USB_READ_TIMEOUT  (3 * 1000)
 
+/**
+ * Size of the receive buffer if the CCID descriptor does not define dwMaxCCIDMessageLength
+ */
+#define USB_DEFAULT_MESSAGE_LENGTH	(10 + 261)
+
+/**
+ * Upper limit for the receive buffer allocated per device
+ */
+#define USB_MAX_MESSAGE_LENGTH		(10 + 65536 + 2)
+
+/**
+ * CCID message type received on the interrupt endpoint when a card is inserted or removed
+ */
+#define MSG_TYPE_RDR_to_PC_NotifySlotChange	0x50
+
 #define USB_OK               0             /* Successful completion           */
 #define ERR_NO_READER       -1             /* Reader not found                */
 #define ERR_USB             -2             /* USB error                       */
@@ -97,6 +114,82 @@ typedef struct usb_device {
          */
         uint8_t bulk_out;
 
+        /**
+         * ID of interrupt in or 0 if the reader has no interrupt endpoint
+         */
+        uint8_t interrupt_in;
+
+        /**
+         * Preallocated transfer for bulk out
+         */
+        struct libusb_transfer *write_transfer;
+
+        /**
+         * Preallocated transfer for bulk in
+         */
+        struct libusb_transfer *read_transfer;
+
+        /**
+         * Preallocated receive buffer used by the bulk in transfer
+         */
+        unsigned char *read_buffer;
+
+        /**
+         * Size of the receive buffer
+         */
+        int read_buffer_size;
+
+        /**
+         * Maximum length of a CCID message supported by the reader
+         */
+        int max_message_length;
+
+        /**
+         * Bulk in transfer submitted, but result not yet consumed
+         */
+        int read_pending;
+
+        /**
+         * Signaled by the event thread when the bulk out transfer completed
+         */
+        EVENT write_done;
+
+        /**
+         * Signaled by the event thread when the bulk in transfer completed
+         */
+        EVENT read_done;
+
+        /**
+         * Permanently submitted transfer for interrupt in
+         */
+        struct libusb_transfer *interrupt_transfer;
+
+        /**
+         * Receive buffer for interrupt in
+         */
+        unsigned char interrupt_buffer[64];
+
+        /**
+         * Interrupt in transfer is submitted
+         */
+        volatile int interrupt_active;
+
+        /**
+         * Card presence from the last RDR_to_PC_NotifySlotChange, -1 if unknown
+         */
+        volatile int icc_present;
+
+        /**
+         * Number of RDR_to_PC_NotifySlotChange messages received
+         */
+        volatile unsigned int icc_changes;
+
+        /**
+         * Signaled by the event thread for each RDR_to_PC_NotifySlotChange and when the
+         * interrupt in transfer terminates
+         */
+        EVENT icc_changed;
+
 } usb_device_t;
 
 int USB_Enumerate(unsigned char *readers, int *len, int options);
@@ -105,6 +198,10 @@ int USB_Close(usb_device_t **device);
 void USB_GetCCIDDescriptor(usb_device_t *device, unsigned char const **desc, int *length);
 int USB_Write(usb_device_t *device, unsigned int length, unsigned char *buffer);
 int USB_Read(usb_device_t *device, unsigned int *length, unsigned char *buffer);
+int USB_ReadInPlace(usb_device_t *device, unsigned int *length, unsigned char **buffer);
+int USB_GetPresence(usb_device_t *device, unsigned int *changes);
+int USB_SeedPresence(usb_device_t *device, unsigned int changes, int present);
+int USB_WaitForPresenceChange(usb_device_t *device, int timeout);
 
 #endif
 
@@ -1190,7 +1190,7 @@ static DWORD WINAPI CardRSADecrypt(__in PCARD_DATA pCardData,
 	copyInverted(cryptogram, pInfo->pbData, pInfo->cbData);
 	plainlen = sizeof(plain);
 
-	rc = p11prikey->C_Decrypt(p11prikey, mech.mechanism, cryptogram, pInfo->cbData, plain, &plainlen);
+	rc = p11prikey->C_Decrypt(p11prikey, NULL, mech.mechanism, cryptogram, pInfo->cbData, plain, &plainlen);
 
 	if (rc != CKR_OK) {
 		dwret = mapError(rc);
@@ -87,99 +87,181 @@ int createCertificateObject(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, struct
 
 
 /**
- * Populate the attribute CKA_ISSUER, CKA_SUBJECT and CKA_SERIAL from certificate
+ * Store the location of the object at the cursor position in the field
  */
-int populateIssuerSubjectSerial(struct p11Object_t *pObject)
+static void setField(struct p11CertificateField *field, unsigned char *cert, unsigned char *obj, unsigned char *end)
 {
-	CK_ATTRIBUTE attr = { CKA_VALUE, NULL, 0 };
-	struct p11Attribute_t *pattr;
-	int tag, length, buflen;
-	unsigned char *value, *cursor, *obj;
+	field->offset = (unsigned int)(obj - cert);
+	field->length = (unsigned int)(end - obj);
+}
 
-	if (findAttribute(pObject, CKA_VALUE, &pattr) < 0) {
+
+
+/**
+ * Parse X.509 certificate and determine the location of relevant fields
+ *
+ * @param cert      The encoded certificate
+ * @param certlen   The length of the encoded certificate
+ * @param index     The table receiving the field locations
+ * @return          0 or -1 if the certificate is malformed
+ */
+static int indexCertificate(unsigned char *cert, size_t certlen, struct p11CertificateIndex *index)
+{
+	struct asn1Cursor cur, tbs, spki, alg;
+
+	memset(index, 0, sizeof(*index));
+	index->cert = cert;
+
+	asn1InitCursor(&cur, cert, certlen);
+
+	// Outer SEQUENCE and TBS SEQUENCE
+	if (asn1CursorFindPath(&cur, (unsigned char *)"\x30\x30", 2) <= 0) {
 		return -1;
 	}
 
-	cursor = pattr->attrData.pValue;
-	buflen = pattr->attrData.ulValueLen;
+	setField(&index->tbs, cert, cur.obj, cur.next);
+	asn1CursorEnter(&cur, &tbs);
 
-	if (asn1Validate(cursor, buflen)) {
+	if (asn1CursorNext(&tbs) <= 0) {
 		return -1;
 	}
 
-	// Outer SEQUENCE
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
+	if (tbs.tag == 0xA0) {				// Skip optional cert type
+		if (asn1CursorNext(&tbs) <= 0) {
+			return -1;
+		}
+	}
+
+	if (tbs.tag != ASN1_INTEGER) {
 		return -1;
 	}
 
-	cursor = value;
-	buflen = length;
+	setField(&index->serial, cert, tbs.obj, tbs.next);
 
-	// TBS SEQUENCE
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
+	if (asn1CursorNext(&tbs) <= 0) {	// Skip SignatureAlgorithm
 		return -1;
 	}
 
-	cursor = value;
-	buflen = length;
-
-	obj = cursor;
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
+	if ((asn1CursorNext(&tbs) <= 0) || (tbs.tag != ASN1_SEQUENCE)) {	// Issuer
 		return -1;
 	}
 
-	if (tag == 0xA0) {				// Skip optional cert type
-		obj = cursor;
-		if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-			return -1;
-		}
+	setField(&index->issuer, cert, tbs.obj, tbs.next);
+
+	if (asn1CursorNext(&tbs) <= 0) {	// Skip validity dates
+		return -1;
 	}
 
-	if (tag != ASN1_INTEGER) {
+	if ((asn1CursorNext(&tbs) <= 0) || (tbs.tag != ASN1_SEQUENCE)) {	// Subject
 		return -1;
 	}
 
-	attr.type = CKA_SERIAL_NUMBER;
-	attr.pValue = obj;
-	attr.ulValueLen = (CK_ULONG)(cursor - obj);
+	setField(&index->subject, cert, tbs.obj, tbs.next);
 
-	addAttribute(pObject, &attr);
+	if ((asn1CursorNext(&tbs) <= 0) || (tbs.tag != ASN1_SEQUENCE)) {	// SubjectPublicKeyInfo
+		return -1;
+	}
+
+	setField(&index->spki, cert, tbs.obj, tbs.next);
+	asn1CursorEnter(&tbs, &spki);
 
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {	// Skip SignatureAlgorithm
+	if ((asn1CursorNext(&spki) <= 0) || (spki.tag != ASN1_SEQUENCE)) {	// AlgorithmIdentifier
 		return -1;
 	}
 
-	obj = cursor;
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {	// Decode Issuer
+	asn1CursorEnter(&spki, &alg);
+
+	if ((asn1CursorNext(&alg) <= 0) || (alg.tag != ASN1_OBJECT_IDENTIFIER)) {
 		return -1;
 	}
 
-	if (tag != ASN1_SEQUENCE) {
+	if (asn1CursorNext(&alg) > 0) {		// Optional parameters
+		setField(&index->parameters, cert, alg.obj, alg.next);
+	}
+
+	if ((asn1CursorNext(&spki) <= 0) || (spki.tag != ASN1_BIT_STRING)) {	// subjectPublicKey
 		return -1;
 	}
 
-	attr.type = CKA_ISSUER;
-	attr.pValue = obj;
-	attr.ulValueLen = (CK_ULONG)(cursor - obj);
+	setField(&index->publicKey, cert, spki.value, spki.next);
 
-	addAttribute(pObject, &attr);
+	// Skip optional issuerUniqueID and subjectUniqueID
+	if (asn1CursorFind(&tbs, 0xA3) > 0) {
+		setField(&index->extensions, cert, tbs.value, tbs.next);
+	}
+
+	return 0;
+}
+
+
+
+/**
+ * Get the field index for the X.509 certificate in CKA_VALUE
+ *
+ * The certificate is parsed on the first call and the index retained with the object.
+ *
+ * @param pObject   The certificate object
+ * @param index     Pointer to variable receiving the index
+ * @return          0 or -1 if the certificate can not be parsed
+ */
+int getCertificateIndex(struct p11Object_t *pObject, struct p11CertificateIndex **index)
+{
+	struct p11Attribute_t *pattr;
+	struct p11CertificateIndex *idx;
 
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {	// Skip validity dates
+	if (pObject->certIndex != NULL) {
+		*index = pObject->certIndex;
+		return 0;
+	}
+
+	if (findAttribute(pObject, CKA_VALUE, &pattr) < 0) {
+		return -1;
+	}
+
+	idx = calloc(1, sizeof(struct p11CertificateIndex));
+	if (idx == NULL) {
 		return -1;
 	}
 
-	obj = cursor;
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {	// Decode Subject
+	if (indexCertificate(pattr->attrData.pValue, pattr->attrData.ulValueLen, idx) < 0) {
+		free(idx);
 		return -1;
 	}
 
-	if (tag != ASN1_SEQUENCE) {
+	pObject->certIndex = idx;
+	*index = idx;
+	return 0;
+}
+
+
+
+/**
+ * Populate the attribute CKA_ISSUER, CKA_SUBJECT and CKA_SERIAL from certificate
+ */
+int populateIssuerSubjectSerial(struct p11Object_t *pObject)
+{
+	CK_ATTRIBUTE attr = { CKA_VALUE, NULL, 0 };
+	struct p11CertificateIndex *index;
+
+	if (getCertificateIndex(pObject, &index) < 0) {
 		return -1;
 	}
 
+	attr.type = CKA_SERIAL_NUMBER;
+	attr.pValue = index->cert + index->serial.offset;
+	attr.ulValueLen = (CK_ULONG)index->serial.length;
+
+	addAttribute(pObject, &attr);
+
+	attr.type = CKA_ISSUER;
+	attr.pValue = index->cert + index->issuer.offset;
+	attr.ulValueLen = (CK_ULONG)index->issuer.length;
+
+	addAttribute(pObject, &attr);
+
 	attr.type = CKA_SUBJECT;
-	attr.pValue = obj;
-	attr.ulValueLen = (CK_ULONG)(cursor - obj);
+	attr.pValue = index->cert + index->subject.offset;
+	attr.ulValueLen = (CK_ULONG)index->subject.length;
 
 	addAttribute(pObject, &attr);
 
@@ -260,261 +342,81 @@ int populateCVCAttributes(struct p11Object_t *pObject)
 
 
 
-int getSubjectPublicKeyInfo(struct p11Object_t *pObject, unsigned char **spki)
-{
-	struct p11Attribute_t *pattr;
-	int tag, length, buflen;
-	unsigned char *value, *cursor;
-
-	if (findAttribute(pObject, CKA_VALUE, &pattr) < 0) {
-		return -1;
-	}
-
-	cursor = pattr->attrData.pValue;
-	buflen = pattr->attrData.ulValueLen;
-
-	if (asn1Validate(cursor, buflen)) {
-		return -1;
-	}
-
-	// Outer SEQUENCE
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
-
-	cursor = value;
-	buflen = length;
-
-	// TBS SEQUENCE
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
-
-	cursor = value;
-	buflen = length;
-
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
-
-	if (tag == 0xA0) {				// Skip optional cert type
-		if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-			return -1;
-		}
-	}
-
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {	// Skip SignatureAlgorithm
-		return -1;
-	}
-
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {	// Skip Issuer
-		return -1;
-	}
-
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {	// Skip validity dates
-		return -1;
-	}
-
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {	// Skip Subject
-		return -1;
-	}
-
-	*spki =cursor;
-
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {	// Skip SubjectPublicKeyInfo
-		return -1;
-	}
-
-	if (tag != ASN1_SEQUENCE) {
-		return -1;
-	}
-
-	return 0;
-}
-
-
-
-int decodeModulusExponentFromSPKI(unsigned char *spki,
+int decodeModulusExponentFromSPKI(struct p11CertificateIndex *index,
                                  CK_ATTRIBUTE_PTR modulus,
                                  CK_ATTRIBUTE_PTR exponent)
 {
-	int tag, length, buflen;
-	unsigned char *value, *cursor;
-
-	cursor = spki;				// spk is ASN.1 validated before, not need to check again
-
-	// subjectPublicKeyInfo
-	tag = asn1Tag(&cursor);
-
-	if (tag != ASN1_SEQUENCE) {
-		return -1;
-	}
-
-	buflen = asn1Length(&cursor);
-
-	// algorithm
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
+	struct asn1Cursor cur, rsa;
+	unsigned char *value;
+	size_t length;
 
-	if (tag != ASN1_SEQUENCE) {
+	// subjectPublicKey without the unused bits indicator
+	if (index->publicKey.length < 6) {
 		return -1;
 	}
 
-	// subjectPublicKey
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
-
-	if (tag != ASN1_BIT_STRING) {
-		return -1;
-	}
-
-	if (length < 6) {
-		return -1;
-	}
-
-	cursor = value + 1;
-	buflen = length - 1;
-
-	if (asn1Validate(cursor, buflen) != 0) {
-		return -1;
-	}
+	asn1InitCursor(&cur, index->cert + index->publicKey.offset + 1, index->publicKey.length - 1);
 
 	// Outer SEQUENCE
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
+	if ((asn1CursorNext(&cur) <= 0) || (cur.tag != ASN1_SEQUENCE)) {
 		return -1;
 	}
 
-	if (tag != ASN1_SEQUENCE) {
-		return -1;
-	}
-
-	cursor = value;
-	buflen = length;
+	asn1CursorEnter(&cur, &rsa);
 
 	// Modulus
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
+	if ((asn1CursorNext(&rsa) <= 0) || (rsa.tag != ASN1_INTEGER) || (rsa.length == 0)) {
 		return -1;
 	}
 
-	if (tag != ASN1_INTEGER) {
-		return -1;
-	}
+	value = rsa.value;
+	length = rsa.length;
 
-	if (*value == 0) {
+	if ((*value == 0) && (length > 1)) {
 		value++;
 		length--;
 	}
 
 	modulus->type = CKA_MODULUS;
 	modulus->pValue = value;
-	modulus->ulValueLen = length;
+	modulus->ulValueLen = (CK_ULONG)length;
 
 	// Exponent
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
-
-	if (tag != ASN1_INTEGER) {
+	if ((asn1CursorNext(&rsa) <= 0) || (rsa.tag != ASN1_INTEGER)) {
 		return -1;
 	}
 
 	exponent->type = CKA_PUBLIC_EXPONENT;
-	exponent->pValue = value;
-	exponent->ulValueLen = length;
+	exponent->pValue = rsa.value;
+	exponent->ulValueLen = (CK_ULONG)rsa.length;
 
 	return 0;
 }
 
 
 
-int decodeECParamsFromSPKI(unsigned char *spki,
+int decodeECParamsFromSPKI(struct p11CertificateIndex *index,
                            CK_ATTRIBUTE_PTR ecparams)
 {
-	int tag, length, buflen;
-	unsigned char *value, *cursor;
-
-	cursor = spki;				// spk is ASN.1 validated before, not need to check again
-
-	// subjectPublicKeyInfo
-	tag = asn1Tag(&cursor);
-
-	if (tag != ASN1_SEQUENCE) {
-		return -1;
-	}
-
-	buflen = asn1Length(&cursor);
-
-	// algorithm
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
-
-	if (tag != ASN1_SEQUENCE) {
-		return -1;
-	}
-
-	cursor = value;
-	buflen = length;
-
-	// algorithm
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
-
-	if (tag != ASN1_OBJECT_IDENTIFIER) {
+	if (index->parameters.length == 0) {
 		return -1;
 	}
 
 	ecparams->type = CKA_EC_PARAMS;
-	ecparams->pValue = cursor;
-
-	// parameters
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
-
-	ecparams->ulValueLen = (CK_ULONG)(cursor - (unsigned char *)ecparams->pValue);
+	ecparams->pValue = index->cert + index->parameters.offset;
+	ecparams->ulValueLen = (CK_ULONG)index->parameters.length;
 
 	return 0;
 }
 
 
 
-int decodeECPointFromSPKI(unsigned char *spki, CK_ATTRIBUTE_PTR point, unsigned char *encappuk, size_t encappuklen)
+int decodeECPointFromSPKI(struct p11CertificateIndex *index, CK_ATTRIBUTE_PTR point, unsigned char *encappuk, size_t encappuklen)
 {
-	int tag, length, buflen;
-	unsigned char *value, *cursor;
-
-	cursor = spki;				// spk is ASN.1 validated before, not need to check again
-
-	// subjectPublicKeyInfo
-	tag = asn1Tag(&cursor);
-
-	if (tag != ASN1_SEQUENCE) {
-		return -1;
-	}
-
-	buflen = asn1Length(&cursor);
-
-	// algorithm
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
-
-	if (tag != ASN1_SEQUENCE) {
-		return -1;
-	}
-
-	// subjectPublicKey
-	if (!asn1Next(&cursor, &buflen, &tag, &length, &value)) {
-		return -1;
-	}
+	unsigned char *cursor;
+	int length;
 
-	if (tag != ASN1_BIT_STRING) {
-		return -1;
-	}
+	length = (int)index->publicKey.length;
 
 	// Length is bitlen + '04' + public point
 	// encappuklen is tag + 3 byte tag + '04' + public point
@@ -525,7 +427,7 @@ int decodeECPointFromSPKI(unsigned char *spki, CK_ATTRIBUTE_PTR point, unsigned
 	cursor = encappuk;
 	asn1StoreTag(&cursor, ASN1_OCTET_STRING);
 	asn1StoreLength(&cursor, length - 1);
-	memcpy(cursor, value + 1, length - 1);
+	memcpy(cursor, index->cert + index->publicKey.offset + 1, length - 1);
 
 	point->type = CKA_EC_POINT;
 	point->pValue = encappuk;
@@ -625,9 +527,7 @@ int createCertificateObjectFromP15(struct p15CertificateDescription *p15, unsign
 	}
 
 	if (rc < 0) {
-#ifdef DEBUG
 		debug("Populating additional attributes failed\n");
-#endif
 	}
 
 	*pObject = p11o;
@@ -41,13 +41,38 @@
 #include <pkcs11/object.h>
 #include <common/pkcs15.h>
 
+/**
+ * Location of a field in the encoded certificate. A length of 0 indicates an absent field
+ */
+struct p11CertificateField {
+	unsigned int offset;			/**< Offset relative to the start of the certificate */
+	unsigned int length;			/**< Length of the field                       */
+};
+
+/**
+ * Fields of a X.509 certificate, determined once when the certificate is parsed
+ *
+ * The table is retained with the certificate object and dropped when CKA_VALUE changes.
+ */
+struct p11CertificateIndex {
+	unsigned char *cert;			/**< The encoded certificate in CKA_VALUE      */
+	struct p11CertificateField tbs;			/**< TBSCertificate                  */
+	struct p11CertificateField serial;		/**< serialNumber INTEGER            */
+	struct p11CertificateField issuer;		/**< issuer Name                     */
+	struct p11CertificateField subject;		/**< subject Name                    */
+	struct p11CertificateField spki;		/**< subjectPublicKeyInfo            */
+	struct p11CertificateField parameters;	/**< Algorithm parameters in SPKI    */
+	struct p11CertificateField publicKey;	/**< Value of subjectPublicKey BIT STRING */
+	struct p11CertificateField extensions;	/**< Extensions SEQUENCE             */
+};
+
 int createCertificateObject(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, struct p11Object_t *object);
+int getCertificateIndex(struct p11Object_t *pObject, struct p11CertificateIndex **index);
 int populateIssuerSubjectSerial(struct p11Object_t *pObject);
 int populateCVCAttributes(struct p11Object_t *pObject);
-int getSubjectPublicKeyInfo(struct p11Object_t *pObject, unsigned char **spki);
-int decodeModulusExponentFromSPKI(unsigned char *spki, CK_ATTRIBUTE_PTR modulus, CK_ATTRIBUTE_PTR exponent);
-int decodeECParamsFromSPKI(unsigned char *spki, CK_ATTRIBUTE_PTR ecparams);
-int decodeECPointFromSPKI(unsigned char *spki, CK_ATTRIBUTE_PTR point, unsigned char *encappuk, size_t encappuklen);
+int decodeModulusExponentFromSPKI(struct p11CertificateIndex *index, CK_ATTRIBUTE_PTR modulus, CK_ATTRIBUTE_PTR exponent);
+int decodeECParamsFromSPKI(struct p11CertificateIndex *index, CK_ATTRIBUTE_PTR ecparams);
+int decodeECPointFromSPKI(struct p11CertificateIndex *index, CK_ATTRIBUTE_PTR point, unsigned char *encappuk, size_t encappuklen);
 int createCertificateObjectFromP15(struct p15CertificateDescription *p15, unsigned char *cert, size_t certlen, struct p11Object_t **pObject);
 
 #endif /* ___SECRETKEYOBJECT_H_INC___ */
@@ -44,23 +44,17 @@
 #include <pkcs11/crypto.h>
 
 
-#ifdef DEBUG
 #include <common/debug.h>
-#endif
 
 
 
-#ifdef DEBUG
 #define FUNC_CRYPTOFAILVIAOUT(msg) do { \
 		rv = translateError(); \
-		debug("Function %s fails with rc=%d \"%s\"\n", __FUNCTION__, (rv), (msg)); \
+		if (LOG_ENABLED(LOG_LEVEL_ERROR)) \
+			logMessage(LOG_LEVEL_ERROR, "Function %s fails with rc=%d \"%s\"\n", __FUNCTION__, (rv), (msg)); \
 		goto out; \
 } while (0)
 
-#else
-#define FUNC_CRYPTOFAILVIAOUT(msg) do { rv = translateError(); goto out; } while (0)
-#endif
-
 
 
 void cryptoInitialize()
@@ -88,17 +82,15 @@ void cryptoFinalize()
 static CK_RV translateError()
 {
 	unsigned long err;
-#ifdef DEBUG
 	char scr[120];
-#endif
 	CK_RV rv;
 
 	err = ERR_get_error();
 
-#ifdef DEBUG
-	ERR_error_string_n(err, scr, sizeof(scr));
-	debug("libcrypto: %s\n", scr);
-#endif
+	if (LOG_ENABLED(LOG_LEVEL_DEBUG)) {
+		ERR_error_string_n(err, scr, sizeof(scr));
+		debug("libcrypto: %s\n", scr);
+	}
 	switch(err) {
 	case RSA_R_DATA_GREATER_THAN_MOD_LEN:
 	case RSA_R_DATA_TOO_LARGE:
@@ -710,7 +702,7 @@ CK_RV cryptoEncryptInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech)
 
 
 
-CK_RV cryptoEncrypt(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
+CK_RV cryptoEncrypt(struct p11Object_t *pObject, struct p11Session_t *session, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
 {
 	struct p11Attribute_t *keytype;
 	CK_RV rv;
@@ -871,3 +863,271 @@ CK_RV cryptoDigestFinal(struct p11Session_t * session, CK_BYTE_PTR pDigest, CK_U
 
 	FUNC_RETURNS(CKR_OK);
 }
+
+
+
+static unsigned char *putBigEndian(unsigned char *p, unsigned long long val, int len)
+{
+	int i;
+
+	for (i = len - 1; i >= 0; i--) {
+		p[i] = (unsigned char)(val & 0xFF);
+		val >>= 8;
+	}
+	return p + len;
+}
+
+
+
+#define ROTL32(x, n)	(((x) << (n)) | ((x) >> (32 - (n))))
+#define ROTR32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define ROTR64(x, n)	(((x) >> (n)) | ((x) << (64 - (n))))
+
+
+
+static unsigned long long getBigEndian(const unsigned char *p, int len)
+{
+	unsigned long long val = 0;
+	int i;
+
+	for (i = 0; i < len; i++)
+		val = (val << 8) | p[i];
+	return val;
+}
+
+
+
+static const unsigned int sha256K[64] = {
+	0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+	0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+	0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+	0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+	0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+	0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+	0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+	0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2
+};
+
+static const unsigned long long sha512K[80] = {
+	0x428A2F98D728AE22ULL, 0x7137449123EF65CDULL, 0xB5C0FBCFEC4D3B2FULL, 0xE9B5DBA58189DBBCULL,
+	0x3956C25BF348B538ULL, 0x59F111F1B605D019ULL, 0x923F82A4AF194F9BULL, 0xAB1C5ED5DA6D8118ULL,
+	0xD807AA98A3030242ULL, 0x12835B0145706FBEULL, 0x243185BE4EE4B28CULL, 0x550C7DC3D5FFB4E2ULL,
+	0x72BE5D74F27B896FULL, 0x80DEB1FE3B1696B1ULL, 0x9BDC06A725C71235ULL, 0xC19BF174CF692694ULL,
+	0xE49B69C19EF14AD2ULL, 0xEFBE4786384F25E3ULL, 0x0FC19DC68B8CD5B5ULL, 0x240CA1CC77AC9C65ULL,
+	0x2DE92C6F592B0275ULL, 0x4A7484AA6EA6E483ULL, 0x5CB0A9DCBD41FBD4ULL, 0x76F988DA831153B5ULL,
+	0x983E5152EE66DFABULL, 0xA831C66D2DB43210ULL, 0xB00327C898FB213FULL, 0xBF597FC7BEEF0EE4ULL,
+	0xC6E00BF33DA88FC2ULL, 0xD5A79147930AA725ULL, 0x06CA6351E003826FULL, 0x142929670A0E6E70ULL,
+	0x27B70A8546D22FFCULL, 0x2E1B21385C26C926ULL, 0x4D2C6DFC5AC42AEDULL, 0x53380D139D95B3DFULL,
+	0x650A73548BAF63DEULL, 0x766A0ABB3C77B2A8ULL, 0x81C2C92E47EDAEE6ULL, 0x92722C851482353BULL,
+	0xA2BFE8A14CF10364ULL, 0xA81A664BBC423001ULL, 0xC24B8B70D0F89791ULL, 0xC76C51A30654BE30ULL,
+	0xD192E819D6EF5218ULL, 0xD69906245565A910ULL, 0xF40E35855771202AULL, 0x106AA07032BBD1B8ULL,
+	0x19A4C116B8D2D0C8ULL, 0x1E376C085141AB53ULL, 0x2748774CDF8EEB99ULL, 0x34B0BCB5E19B48A8ULL,
+	0x391C0CB3C5C95A63ULL, 0x4ED8AA4AE3418ACBULL, 0x5B9CCA4F7763E373ULL, 0x682E6FF3D6B2B8A3ULL,
+	0x748F82EE5DEFB2FCULL, 0x78A5636F43172F60ULL, 0x84C87814A1F0AB72ULL, 0x8CC702081A6439ECULL,
+	0x90BEFFFA23631E28ULL, 0xA4506CEBDE82BDE9ULL, 0xBEF9A3F7B2C67915ULL, 0xC67178F2E372532BULL,
+	0xCA273ECEEA26619CULL, 0xD186B8C721C0C207ULL, 0xEADA7DD6CDE0EB1EULL, 0xF57D4F7FEE6ED178ULL,
+	0x06F067AA72176FBAULL, 0x0A637DC5A2C898A6ULL, 0x113F9804BEF90DAEULL, 0x1B710B35131C471BULL,
+	0x28DB77F523047D84ULL, 0x32CAAB7B40C72493ULL, 0x3C9EBE0A15C9BEBCULL, 0x431D67C49C100D4CULL,
+	0x4CC5D4BECB3E42B6ULL, 0x597F299CFC657E2AULL, 0x5FCB6FAB3AD6FAECULL, 0x6C44198C4A475817ULL
+};
+
+
+
+/**
+ * Process a single 64 byte block with the SHA-1 compression function
+ */
+static void sha1Block(unsigned int h[5], const unsigned char *blk)
+{
+	unsigned int w[80], a, b, c, d, e, f, k, t;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (unsigned int)getBigEndian(blk + (i << 2), 4);
+	for (; i < 80; i++)
+		w[i] = ROTL32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+
+	for (i = 0; i < 80; i++) {
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5A827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ED9EBA1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8F1BBCDC;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xCA62C1D6;
+		}
+		t = ROTL32(a, 5) + f + e + k + w[i];
+		e = d; d = c; c = ROTL32(b, 30); b = a; a = t;
+	}
+
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+	OPENSSL_cleanse(w, sizeof(w));
+}
+
+
+
+/**
+ * Process a single 64 byte block with the SHA-224/256 compression function
+ */
+static void sha256Block(unsigned int h[8], const unsigned char *blk)
+{
+	unsigned int w[64], s[8], t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (unsigned int)getBigEndian(blk + (i << 2), 4);
+	for (; i < 64; i++)
+		w[i] = (ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10)) + w[i - 7] +
+			(ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) + w[i - 16];
+
+	memcpy(s, h, sizeof(s));
+
+	for (i = 0; i < 64; i++) {
+		t1 = s[7] + (ROTR32(s[4], 6) ^ ROTR32(s[4], 11) ^ ROTR32(s[4], 25)) +
+			((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256K[i] + w[i];
+		t2 = (ROTR32(s[0], 2) ^ ROTR32(s[0], 13) ^ ROTR32(s[0], 22)) +
+			((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		memmove(s + 1, s, 7 * sizeof(s[0]));
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+
+	for (i = 0; i < 8; i++)
+		h[i] += s[i];
+	OPENSSL_cleanse(w, sizeof(w));
+	OPENSSL_cleanse(s, sizeof(s));
+}
+
+
+
+/**
+ * Process a single 128 byte block with the SHA-384/512 compression function
+ */
+static void sha512Block(unsigned long long h[8], const unsigned char *blk)
+{
+	unsigned long long w[80], s[8], t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = getBigEndian(blk + (i << 3), 8);
+	for (; i < 80; i++)
+		w[i] = (ROTR64(w[i - 2], 19) ^ ROTR64(w[i - 2], 61) ^ (w[i - 2] >> 6)) + w[i - 7] +
+			(ROTR64(w[i - 15], 1) ^ ROTR64(w[i - 15], 8) ^ (w[i - 15] >> 7)) + w[i - 16];
+
+	memcpy(s, h, sizeof(s));
+
+	for (i = 0; i < 80; i++) {
+		t1 = s[7] + (ROTR64(s[4], 14) ^ ROTR64(s[4], 18) ^ ROTR64(s[4], 41)) +
+			((s[4] & s[5]) ^ (~s[4] & s[6])) + sha512K[i] + w[i];
+		t2 = (ROTR64(s[0], 28) ^ ROTR64(s[0], 34) ^ ROTR64(s[0], 39)) +
+			((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		memmove(s + 1, s, 7 * sizeof(s[0]));
+		s[4] += t1;
+		s[0] = t1 + t2;
+	}
+
+	for (i = 0; i < 8; i++)
+		h[i] += s[i];
+	OPENSSL_cleanse(w, sizeof(w));
+	OPENSSL_cleanse(s, sizeof(s));
+}
+
+
+
+/**
+ * Hash all but the last block of a message and export the intermediate hash value
+ *
+ * The intermediate hash value is the chaining state in big endian byte order, followed by
+ * the number of bits hashed so far, encoded in the size of the length field used in the
+ * final padding of the hash algorithm. Between 1 and block size bytes remain unhashed,
+ * so that the final block can be processed by the token.
+ *
+ * OpenSSL does not provide access to the chaining state other than through the deprecated
+ * low level digest API, so the compression functions are implemented here.
+ *
+ * @param mech      One of CKM_SHA_1, CKM_SHA224, CKM_SHA256, CKM_SHA384 or CKM_SHA512
+ * @param data      The message
+ * @param len       The length of the message
+ * @param hashed    Number of message bytes covered by the intermediate hash value
+ * @param state     Buffer receiving the intermediate hash value, at least 80 bytes
+ * @param statelen  Length of the intermediate hash value
+ * @return          CKR_OK or CKR_MECHANISM_INVALID
+ */
+CK_RV cryptoIntermediateHash(CK_MECHANISM_TYPE mech, CK_BYTE_PTR data, CK_ULONG len, CK_ULONG_PTR hashed, CK_BYTE_PTR state, CK_ULONG_PTR statelen)
+{
+	static const unsigned int sha1IV[5] = {
+		0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0
+	};
+	static const unsigned int sha224IV[8] = {
+		0xC1059ED8, 0x367CD507, 0x3070DD17, 0xF70E5939, 0xFFC00B31, 0x68581511, 0x64F98FA7, 0xBEFA4FA4
+	};
+	static const unsigned int sha256IV[8] = {
+		0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+	};
+	static const unsigned long long sha384IV[8] = {
+		0xCBBB9D5DC1059ED8ULL, 0x629A292A367CD507ULL, 0x9159015A3070DD17ULL, 0x152FECD8F70E5939ULL,
+		0x67332667FFC00B31ULL, 0x8EB44A8768581511ULL, 0xDB0C2E0D64F98FA7ULL, 0x47B5481DBEFA4FA4ULL
+	};
+	static const unsigned long long sha512IV[8] = {
+		0x6A09E667F3BCC908ULL, 0xBB67AE8584CAA73BULL, 0x3C6EF372FE94F82BULL, 0xA54FF53A5F1D36F1ULL,
+		0x510E527FADE682D1ULL, 0x9B05688C2B3E6C1FULL, 0x1F83D9ABFB41BD6BULL, 0x5BE0CD19137E2179ULL
+	};
+	unsigned int h32[8];
+	unsigned long long h64[8];
+	unsigned char *p;
+	CK_ULONG bs, n, ofs;
+	int i;
+
+	FUNC_CALLED();
+
+	bs = ((mech == CKM_SHA384) || (mech == CKM_SHA512)) ? 128 : 64;
+	n = len > 0 ? ((len - 1) / bs) * bs : 0;
+	p = state;
+
+	switch(mech) {
+	case CKM_SHA_1:
+		memcpy(h32, sha1IV, sizeof(sha1IV));
+		for (ofs = 0; ofs < n; ofs += bs)
+			sha1Block(h32, data + ofs);
+		for (i = 0; i < 5; i++)
+			p = putBigEndian(p, h32[i], 4);
+		break;
+	case CKM_SHA224:
+	case CKM_SHA256:
+		memcpy(h32, mech == CKM_SHA224 ? sha224IV : sha256IV, sizeof(h32));
+		for (ofs = 0; ofs < n; ofs += bs)
+			sha256Block(h32, data + ofs);
+		for (i = 0; i < 8; i++)
+			p = putBigEndian(p, h32[i], 4);
+		break;
+	case CKM_SHA384:
+	case CKM_SHA512:
+		memcpy(h64, mech == CKM_SHA384 ? sha384IV : sha512IV, sizeof(h64));
+		for (ofs = 0; ofs < n; ofs += bs)
+			sha512Block(h64, data + ofs);
+		for (i = 0; i < 8; i++)
+			p = putBigEndian(p, h64[i], 8);
+		break;
+	default:
+		FUNC_FAILS(CKR_MECHANISM_INVALID, "Hash not supported");
+	}
+
+	OPENSSL_cleanse(h32, sizeof(h32));
+	OPENSSL_cleanse(h64, sizeof(h64));
+
+	// Bit counter, with the upper half of the 128 bit counter of SHA-384/512 always zero
+	if (bs == 128)
+		p = putBigEndian(p, 0, 8);
+	p = putBigEndian(p, (unsigned long long)n << 3, 8);
+
+	*hashed = n;
+	*statelen = (CK_ULONG)(p - state);
+
+	FUNC_RETURNS(CKR_OK);
+}
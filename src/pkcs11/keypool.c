@@ -0,0 +1,773 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    keypool.c
+ * @author  Andreas Schwier
+ * @brief   Pool of key pairs generated in advance on the token
+ *
+ * Generating a RSA key pair on the token takes several seconds. With PKCS11_KEY_POOL_SIZE
+ * set to a non-zero value, a background thread generates that number of key pairs for each
+ * of the key types listed in PKCS11_KEY_POOL_TYPES (default "rsa2048,secp256r1") while the
+ * user is logged in. Supported types are rsa1024 to rsa4096 and the curves known to the
+ * CVC encoder, e.g. secp256r1 or brainpoolP256r1.
+ *
+ * Pooled key pairs are generated with default parameters and a CHR that marks them as
+ * pool keys. They have no key description, so they are not visible as objects. A key generation request for a pooled type with
+ * default parameters is served by binding a pooled key pair to the attributes in the
+ * request, which only requires writing the key description. Other requests are passed to
+ * the token as before.
+ *
+ * Key pairs that are still unbound when the token is removed or the module is finalized
+ * remain on the token and are added to the pool again when the token is loaded. Key pairs
+ * without key description that do not carry the pool CHR are never adopted.
+ *
+ * Key generation is scheduled as bulk operation, so it does not delay interactive operations.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <common/mutex.h>
+
+#include <pkcs11/p11generic.h>
+#include <pkcs11/keypool.h>
+#include <pkcs11/object.h>
+#include <pkcs11/scheduler.h>
+#include <pkcs11/slot.h>
+
+#include <common/debug.h>
+
+
+
+struct p11KeyPoolEntry_t {
+	int type;                           /**< Index into configured key types             */
+	int id;                             /**< Key identifier on the token                 */
+	int keysize;                        /**< Key size in bits                            */
+};
+
+
+
+struct p11KeyPool_t {
+	struct p11KeyPoolEntry_t entries[KEY_POOL_MAX_ENTRIES]; /**< Unbound key pairs        */
+	int count;                          /**< Number of unbound key pairs                 */
+	CK_ULONG generated;                 /**< Key pairs generated in the background       */
+	CK_ULONG served;                    /**< Requests served from the pool               */
+	CK_ULONG missed;                    /**< Requests not matching a pooled key pair     */
+	int refillPending;                  /**< The pool is queued for refill               */
+	int closed;                         /**< The token has been removed                  */
+	int refs;                           /**< References from token and refill queue      */
+	struct p11Slot_t *slot;             /**< The slot used to refill the pool            */
+	struct p11Token_t *token;           /**< The token owning the pool                   */
+	struct p11KeyPool_t *next;          /**< Next pool in refill queue                   */
+};
+
+
+
+struct keyPoolType {
+	const char *name;
+	CK_MECHANISM_TYPE mech;
+	CK_ULONG bits;                      /**< Modulus size for RSA                        */
+	unsigned char *oid;                 /**< Curve object identifier for EC              */
+	size_t oidlen;
+};
+
+
+
+static struct keyPoolType knownTypes[] = {
+	{ "rsa1024", CKM_RSA_PKCS_KEY_PAIR_GEN, 1024, NULL, 0 },
+	{ "rsa1536", CKM_RSA_PKCS_KEY_PAIR_GEN, 1536, NULL, 0 },
+	{ "rsa2048", CKM_RSA_PKCS_KEY_PAIR_GEN, 2048, NULL, 0 },
+	{ "rsa3072", CKM_RSA_PKCS_KEY_PAIR_GEN, 3072, NULL, 0 },
+	{ "rsa4096", CKM_RSA_PKCS_KEY_PAIR_GEN, 4096, NULL, 0 },
+	{ "secp192r1", CKM_EC_KEY_PAIR_GEN, 0, (unsigned char *)"\x2A\x86\x48\xCE\x3D\x03\x01\x01", 8 },
+	{ "secp256r1", CKM_EC_KEY_PAIR_GEN, 0, (unsigned char *)"\x2A\x86\x48\xCE\x3D\x03\x01\x07", 8 },
+	{ "secp384r1", CKM_EC_KEY_PAIR_GEN, 0, (unsigned char *)"\x2B\x81\x04\x00\x22", 5 },
+	{ "secp521r1", CKM_EC_KEY_PAIR_GEN, 0, (unsigned char *)"\x2B\x81\x04\x00\x23", 5 },
+	{ "brainpoolP192r1", CKM_EC_KEY_PAIR_GEN, 0, (unsigned char *)"\x2B\x24\x03\x03\x02\x08\x01\x01\x03", 9 },
+	{ "brainpoolP224r1", CKM_EC_KEY_PAIR_GEN, 0, (unsigned char *)"\x2B\x24\x03\x03\x02\x08\x01\x01\x05", 9 },
+	{ "brainpoolP256r1", CKM_EC_KEY_PAIR_GEN, 0, (unsigned char *)"\x2B\x24\x03\x03\x02\x08\x01\x01\x07", 9 },
+	{ "brainpoolP320r1", CKM_EC_KEY_PAIR_GEN, 0, (unsigned char *)"\x2B\x24\x03\x03\x02\x08\x01\x01\x09", 9 },
+	{ "brainpoolP384r1", CKM_EC_KEY_PAIR_GEN, 0, (unsigned char *)"\x2B\x24\x03\x03\x02\x08\x01\x01\x0B", 9 },
+	{ "brainpoolP512r1", CKM_EC_KEY_PAIR_GEN, 0, (unsigned char *)"\x2B\x24\x03\x03\x02\x08\x01\x01\x0D", 9 },
+	{ "secp192k1", CKM_EC_KEY_PAIR_GEN, 0, (unsigned char *)"\x2B\x81\x04\x00\x1F", 5 },
+	{ "secp256k1", CKM_EC_KEY_PAIR_GEN, 0, (unsigned char *)"\x2B\x81\x04\x00\x0A", 5 },
+	{ NULL, 0, 0, NULL, 0 }
+};
+
+
+
+static int initialized = 0;
+static int poolSize = 0;
+static struct keyPoolType *poolTypes[KEY_POOL_MAX_TYPES];
+static int numberOfTypes = 0;
+
+static MUTEX poolMutex;
+static EVENT refillEvent;
+static THREAD refillThread;
+static int refillThreadStarted;
+static int terminating;
+static struct p11KeyPool_t *refillQueue;
+
+
+
+/**
+ * Release a reference to the pool, freeing memory with the last reference
+ *
+ * Must be called with the poolMutex locked, if initialized
+ */
+static void releasePool(struct p11KeyPool_t *pool)
+{
+	if (--pool->refs > 0)
+		return;
+
+	free(pool);
+}
+
+
+
+/**
+ * Return the pool of the token, allocating it on first use
+ *
+ * Must be called with the poolMutex locked
+ */
+static struct p11KeyPool_t *getPool(struct p11Token_t *token)
+{
+	struct p11KeyPool_t *pool;
+
+	pool = token->keyPool;
+
+	if (pool == NULL) {
+		pool = (struct p11KeyPool_t *)calloc(1, sizeof(struct p11KeyPool_t));
+		if (pool == NULL)
+			return NULL;
+
+		pool->refs = 1;
+		pool->slot = token->slot;
+		pool->token = token;
+		token->keyPool = pool;
+	}
+
+	return pool;
+}
+
+
+
+/**
+ * Find the configured key type matching mechanism and key parameter
+ *
+ * @return          Index into poolTypes or -1 if no type matches
+ */
+static int findPoolType(CK_MECHANISM_TYPE mech, CK_ULONG bits, unsigned char *oid, size_t oidlen)
+{
+	struct keyPoolType *t;
+	int i;
+
+	for (i = 0; i < numberOfTypes; i++) {
+		t = poolTypes[i];
+
+		if (t->mech != mech)
+			continue;
+
+		if (mech == CKM_RSA_PKCS_KEY_PAIR_GEN) {
+			if (t->bits == bits)
+				return i;
+		} else {
+			if ((t->oidlen == oidlen) && !memcmp(t->oid, oid, oidlen))
+				return i;
+		}
+	}
+
+	return -1;
+}
+
+
+
+/**
+ * Determine the configured key type requested with a key generation template
+ *
+ * Only named curves and the default public exponent 65537 are matched.
+ *
+ * @return          Index into poolTypes or -1 if no type matches
+ */
+static int determineRequestedType(CK_MECHANISM_PTR pMechanism, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount)
+{
+	unsigned char *ecparams;
+	int pos;
+
+	if (pMechanism->mechanism == CKM_RSA_PKCS_KEY_PAIR_GEN) {
+		pos = findAttributeInTemplate(CKA_PUBLIC_EXPONENT, pTemplate, ulCount);
+		if ((pos >= 0) && ((pTemplate[pos].ulValueLen != 3) || memcmp(pTemplate[pos].pValue, "\x01\x00\x01", 3)))
+			return -1;
+
+		pos = findAttributeInTemplate(CKA_MODULUS_BITS, pTemplate, ulCount);
+		if ((pos < 0) || (pTemplate[pos].ulValueLen != sizeof(CK_ULONG)))
+			return -1;
+
+		return findPoolType(CKM_RSA_PKCS_KEY_PAIR_GEN, *(CK_ULONG *)pTemplate[pos].pValue, NULL, 0);
+	}
+
+	if (pMechanism->mechanism == CKM_EC_KEY_PAIR_GEN) {
+		pos = findAttributeInTemplate(CKA_EC_PARAMS, pTemplate, ulCount);
+		if ((pos < 0) || (pTemplate[pos].ulValueLen < 2))
+			return -1;
+
+		ecparams = (unsigned char *)pTemplate[pos].pValue;
+		if ((ecparams[0] != 0x06) || (ecparams[1] != pTemplate[pos].ulValueLen - 2))
+			return -1;
+
+		return findPoolType(CKM_EC_KEY_PAIR_GEN, 0, ecparams + 2, ecparams[1]);
+	}
+
+	return -1;
+}
+
+
+
+/**
+ * Determine a configured key type with less than poolSize key pairs in the pool
+ *
+ * Must be called with the poolMutex locked
+ *
+ * @return          Index into poolTypes or -1 if the pool is complete
+ */
+static int findMissingType(struct p11KeyPool_t *pool)
+{
+	int i, type, cnt;
+
+	if (pool->count >= KEY_POOL_MAX_ENTRIES)
+		return -1;
+
+	for (type = 0; type < numberOfTypes; type++) {
+		cnt = 0;
+		for (i = 0; i < pool->count; i++) {
+			if (pool->entries[i].type == type)
+				cnt++;
+		}
+		if (cnt < poolSize)
+			return type;
+	}
+
+	return -1;
+}
+
+
+
+/**
+ * Generate missing key pairs on the token in the slot
+ *
+ * Each key pair is generated in a separate bulk operation. Generation stops if the token
+ * is removed or the user is no longer logged in.
+ */
+static void fillPool(struct p11KeyPool_t *pool)
+{
+	struct p11Token_t *token;
+	struct keyPoolType *t;
+	CK_MECHANISM mech = { 0, NULL_PTR, 0 };
+	CK_ATTRIBUTE attr;
+	unsigned char ecparams[32];
+	int type, id, keysize, rc;
+
+	while (1) {
+		mutex_lock(&poolMutex);
+		type = (terminating || pool->closed) ? -1 : findMissingType(pool);
+		mutex_unlock(&poolMutex);
+
+		if (type < 0)
+			return;
+
+		t = poolTypes[type];
+		mech.mechanism = t->mech;
+
+		if (t->mech == CKM_RSA_PKCS_KEY_PAIR_GEN) {
+			attr.type = CKA_MODULUS_BITS;
+			attr.pValue = &t->bits;
+			attr.ulValueLen = sizeof(t->bits);
+		} else {
+			ecparams[0] = 0x06;
+			ecparams[1] = (unsigned char)t->oidlen;
+			memcpy(ecparams + 2, t->oid, t->oidlen);
+			attr.type = CKA_EC_PARAMS;
+			attr.pValue = ecparams;
+			attr.ulValueLen = (CK_ULONG)t->oidlen + 2;
+		}
+
+		rc = scheduleSlot(pool->slot, NULL, SCHED_BULK);
+
+		if (rc != CKR_OK)
+			return;
+
+		rc = getToken(pool->slot, &token);
+
+		if ((rc == CKR_OK) && (token == pool->token) && (token->user == CKU_USER) && (token->drv->generatePoolKeyPair != NULL)) {
+			rc = token->drv->generatePoolKeyPair(pool->slot, &mech, &attr, 1, &id, &keysize);
+		} else {
+			rc = CKR_USER_NOT_LOGGED_IN;
+		}
+
+		releaseSlot(pool->slot);
+
+		if (rc != CKR_OK) {
+			debug("Generating %s key pair for pool failed with rc=%lx\n", t->name, (unsigned long)rc);
+			return;
+		}
+
+		mutex_lock(&poolMutex);
+		if (!pool->closed && (pool->count < KEY_POOL_MAX_ENTRIES)) {
+			pool->entries[pool->count].type = type;
+			pool->entries[pool->count].id = id;
+			pool->entries[pool->count].keysize = keysize;
+			pool->count++;
+			pool->generated++;
+		}
+		mutex_unlock(&poolMutex);
+	}
+}
+
+
+
+/**
+ * Background thread refilling queued pools
+ */
+static void refillPools(void *arg)
+{
+	struct p11KeyPool_t *pool;
+
+	while (1) {
+		event_wait(&refillEvent);
+
+		while (1) {
+			mutex_lock(&poolMutex);
+
+			if (terminating) {
+				mutex_unlock(&poolMutex);
+				return;
+			}
+
+			pool = refillQueue;
+			if (pool == NULL) {
+				mutex_unlock(&poolMutex);
+				break;
+			}
+
+			refillQueue = pool->next;
+			mutex_unlock(&poolMutex);
+
+			fillPool(pool);
+
+			mutex_lock(&poolMutex);
+			pool->refillPending = FALSE;
+			releasePool(pool);
+			mutex_unlock(&poolMutex);
+		}
+	}
+}
+
+
+
+/**
+ * Queue pool for refill, starting the background thread on first use
+ *
+ * Must be called with the poolMutex locked
+ */
+static void queueRefill(struct p11KeyPool_t *pool)
+{
+	struct p11KeyPool_t **ppool;
+
+	if (pool->refillPending || pool->closed || (findMissingType(pool) < 0))
+		return;
+
+	if (!refillThreadStarted) {
+		if (thread_create(&refillThread, refillPools, NULL) != 0) {
+			debug("Could not start key pool refill thread\n");
+			return;
+		}
+		refillThreadStarted = TRUE;
+	}
+
+	pool->refillPending = TRUE;
+	pool->refs++;
+	pool->next = NULL;
+
+	ppool = &refillQueue;
+	while (*ppool)
+		ppool = &(*ppool)->next;
+	*ppool = pool;
+
+	event_set(&refillEvent);
+}
+
+
+
+/**
+ * Parse the comma separated list of key types
+ */
+static void parseKeyTypes(const char *list)
+{
+	struct keyPoolType *t;
+	size_t len;
+	int i;
+
+	numberOfTypes = 0;
+
+	while (*list) {
+		while ((*list == ',') || (*list == ' '))
+			list++;
+
+		len = strcspn(list, ", ");
+		if (len == 0)
+			break;
+
+		for (t = knownTypes; t->name != NULL; t++) {
+			if ((strlen(t->name) == len) && !strncmp(t->name, list, len))
+				break;
+		}
+
+		if (t->name == NULL) {
+			debug("Ignoring unknown key type %.*s in PKCS11_KEY_POOL_TYPES\n", (int)len, list);
+		} else {
+			for (i = 0; (i < numberOfTypes) && (poolTypes[i] != t); i++);
+
+			if ((i == numberOfTypes) && (numberOfTypes < KEY_POOL_MAX_TYPES))
+				poolTypes[numberOfTypes++] = t;
+		}
+
+		list += len;
+	}
+}
+
+
+
+/**
+ * Read the pool configuration from the environment
+ *
+ * @return          CKR_OK or CKR_GENERAL_ERROR
+ */
+int initKeyPool()
+{
+	char *val;
+
+	poolSize = 0;
+	val = getenv("PKCS11_KEY_POOL_SIZE");
+	if (val != NULL)
+		poolSize = (int)strtol(val, NULL, 10);
+
+	if (poolSize < 0)
+		poolSize = 0;
+
+	if (poolSize > KEY_POOL_MAX_SIZE)
+		poolSize = KEY_POOL_MAX_SIZE;
+
+	val = getenv("PKCS11_KEY_POOL_TYPES");
+	parseKeyTypes(val != NULL ? val : "rsa2048,secp256r1");
+
+	if ((poolSize == 0) || (numberOfTypes == 0))
+		return CKR_OK;
+
+	if (mutex_init(&poolMutex) != 0)
+		return CKR_GENERAL_ERROR;
+
+	if (event_init(&refillEvent) != 0) {
+		mutex_destroy(&poolMutex);
+		return CKR_GENERAL_ERROR;
+	}
+
+	refillThreadStarted = FALSE;
+	terminating = FALSE;
+	refillQueue = NULL;
+	initialized = TRUE;
+
+	debug("Key pool size %d for %d key types\n", poolSize, numberOfTypes);
+	return CKR_OK;
+}
+
+
+
+/**
+ * Stop the background thread
+ *
+ * Pools still owned by tokens are released when the token is freed.
+ *
+ * Must be called without the context mutex held, as the refill thread takes it when
+ * it creates the scheduler of the slot.
+ */
+void terminateKeyPool()
+{
+	struct p11KeyPool_t *pool;
+
+	if (!initialized)
+		return;
+
+	if (refillThreadStarted) {
+		mutex_lock(&poolMutex);
+		terminating = TRUE;
+		mutex_unlock(&poolMutex);
+
+		event_set(&refillEvent);
+		thread_join(&refillThread);
+		refillThreadStarted = FALSE;
+	}
+
+	while (refillQueue) {
+		pool = refillQueue;
+		refillQueue = pool->next;
+		pool->refillPending = FALSE;
+		releasePool(pool);
+	}
+
+	initialized = FALSE;
+	event_destroy(&refillEvent);
+	mutex_destroy(&poolMutex);
+}
+
+
+
+/**
+ * Take a key pair matching the key generation request from the token's pool
+ *
+ * The caller must bind the key pair by writing a key description. The pool is
+ * queued for refill.
+ *
+ * @param token     The token
+ * @param pMechanism The key generation mechanism
+ * @param pPublicKeyTemplate The public key template of the request
+ * @param ulPublicKeyAttributeCount The number of attributes in the template
+ * @param id        The key identifier on the token
+ * @param keysize   The key size in bits
+ *
+ * @return          CKR_OK if a key pair was taken or CKR_FUNCTION_FAILED if the token must generate one
+ */
+int takeKeyPairFromPool(struct p11Token_t *token, CK_MECHANISM_PTR pMechanism, CK_ATTRIBUTE_PTR pPublicKeyTemplate, CK_ULONG ulPublicKeyAttributeCount, int *id, int *keysize)
+{
+	struct p11KeyPool_t *pool;
+	int rc, type, i;
+
+	if (!initialized)
+		return CKR_FUNCTION_FAILED;
+
+	type = determineRequestedType(pMechanism, pPublicKeyTemplate, ulPublicKeyAttributeCount);
+
+	mutex_lock(&poolMutex);
+
+	pool = getPool(token);
+
+	if ((pool == NULL) || pool->closed) {
+		mutex_unlock(&poolMutex);
+		return CKR_FUNCTION_FAILED;
+	}
+
+	rc = CKR_FUNCTION_FAILED;
+
+	for (i = 0; (type >= 0) && (i < pool->count); i++) {
+		if (pool->entries[i].type == type) {
+			*id = pool->entries[i].id;
+			*keysize = pool->entries[i].keysize;
+			pool->count--;
+			memmove(pool->entries + i, pool->entries + i + 1, (pool->count - i) * sizeof(struct p11KeyPoolEntry_t));
+			rc = CKR_OK;
+			break;
+		}
+	}
+
+	if (rc == CKR_OK) {
+		pool->served++;
+	} else {
+		pool->missed++;
+	}
+
+	queueRefill(pool);
+
+	mutex_unlock(&poolMutex);
+	return rc;
+}
+
+
+
+/**
+ * Add an unbound key pair found on the token to the token's pool
+ *
+ * @param token     The token
+ * @param mech      CKM_RSA_PKCS_KEY_PAIR_GEN or CKM_EC_KEY_PAIR_GEN
+ * @param keysize   The key size in bits
+ * @param oid       The curve object identifier for EC keys
+ * @param oidlen    The length of the curve object identifier
+ * @param id        The key identifier on the token
+ *
+ * @return          CKR_OK if the key pair was added or CKR_FUNCTION_FAILED if the key type is not pooled
+ */
+int addKeyPairToPool(struct p11Token_t *token, CK_MECHANISM_TYPE mech, int keysize, unsigned char *oid, size_t oidlen, int id)
+{
+	struct p11KeyPool_t *pool;
+	int type, i;
+
+	if (!initialized)
+		return CKR_FUNCTION_FAILED;
+
+	type = findPoolType(mech, (CK_ULONG)keysize, oid, oidlen);
+
+	if (type < 0)
+		return CKR_FUNCTION_FAILED;
+
+	mutex_lock(&poolMutex);
+
+	pool = getPool(token);
+
+	if ((pool == NULL) || pool->closed || (pool->count >= KEY_POOL_MAX_ENTRIES)) {
+		mutex_unlock(&poolMutex);
+		return CKR_FUNCTION_FAILED;
+	}
+
+	for (i = 0; (i < pool->count) && (pool->entries[i].id != id); i++);
+
+	if (i == pool->count) {
+		pool->entries[i].type = type;
+		pool->entries[i].id = id;
+		pool->entries[i].keysize = keysize;
+		pool->count++;
+	}
+
+	mutex_unlock(&poolMutex);
+	return CKR_OK;
+}
+
+
+
+/**
+ * Queue the token's pool for refill, e.g. after the user logged in
+ *
+ * @param token     The token
+ */
+void refillKeyPool(struct p11Token_t *token)
+{
+	struct p11KeyPool_t *pool;
+
+	if (!initialized)
+		return;
+
+	mutex_lock(&poolMutex);
+
+	pool = getPool(token);
+
+	if (pool != NULL)
+		queueRefill(pool);
+
+	mutex_unlock(&poolMutex);
+}
+
+
+
+/**
+ * Report configuration and state of the token's pool
+ *
+ * @param token     The token
+ * @param pInfo     The structure receiving the pool state
+ *
+ * @return          CKR_OK
+ */
+int getKeyPoolInfo(struct p11Token_t *token, CK_SC_HSM_KEY_POOL_INFO_PTR pInfo)
+{
+	struct p11KeyPool_t *pool;
+
+	memset(pInfo, 0, sizeof(CK_SC_HSM_KEY_POOL_INFO));
+
+	if (!initialized)
+		return CKR_OK;
+
+	pInfo->ulPoolSize = (CK_ULONG)poolSize;
+	pInfo->ulKeyTypes = (CK_ULONG)numberOfTypes;
+
+	mutex_lock(&poolMutex);
+
+	pool = token->keyPool;
+
+	if (pool != NULL) {
+		pInfo->ulAvailable = (CK_ULONG)pool->count;
+		pInfo->ulGenerated = pool->generated;
+		pInfo->ulServed = pool->served;
+		pInfo->ulMissed = pool->missed;
+	}
+
+	mutex_unlock(&poolMutex);
+	return CKR_OK;
+}
+
+
+
+/**
+ * Close the pool after the token has been removed
+ *
+ * Unbound key pairs remain on the token and are added to the pool when the token is loaded again.
+ *
+ * @param token     The removed token
+ */
+void clearKeyPool(struct p11Token_t *token)
+{
+	struct p11KeyPool_t *pool;
+
+	if (!initialized)
+		return;
+
+	mutex_lock(&poolMutex);
+
+	pool = token->keyPool;
+
+	if (pool != NULL) {
+		pool->closed = TRUE;
+		pool->count = 0;
+	}
+
+	mutex_unlock(&poolMutex);
+}
+
+
+
+/**
+ * Release the pool of a token that is freed
+ *
+ * @param token     The token
+ */
+void freeKeyPool(struct p11Token_t *token)
+{
+	struct p11KeyPool_t *pool;
+
+	pool = token->keyPool;
+
+	if (pool == NULL)
+		return;
+
+	token->keyPool = NULL;
+
+	if (!initialized) {
+		releasePool(pool);
+		return;
+	}
+
+	mutex_lock(&poolMutex);
+	pool->closed = TRUE;
+	releasePool(pool);
+	mutex_unlock(&poolMutex);
+}
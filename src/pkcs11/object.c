@@ -35,6 +35,7 @@
 #include <ctype.h>
 #include <string.h>
 #include <pkcs11/object.h>
+#include <pkcs11/reclaim.h>
 
 CK_BBOOL ckTrue = CK_TRUE, ckFalse = CK_FALSE;
 CK_MECHANISM_TYPE ckMechType = CK_UNAVAILABLE_INFORMATION;
@@ -703,6 +704,11 @@ int removeAttribute(struct p11Object_t *object, CK_ATTRIBUTE_PTR attributeTempla
 	pAttr = *ppAttr;
 	*ppAttr = (*ppAttr)->next;
 
+	if ((pAttr->attrData.type == CKA_VALUE) && object->certIndex) {
+		free(object->certIndex);
+		object->certIndex = NULL;
+	}
+
 	free(pAttr->attrData.pValue);
 	free(pAttr);
 
@@ -736,6 +742,9 @@ void addObjectToList(struct p11Object_t **list, struct p11Object_t *object)
 		list = &((*list)->next);
 	
 	object->next = NULL;
+
+	// Concurrent lookups must see a fully initialized object
+	MEMORY_BARRIER();
 	*list = object;
 
 //	object->next = *list;
@@ -759,9 +768,16 @@ void freeObject(struct p11Object_t *object)
 
 
 
+static void freeRetiredObject(void *ptr)
+{
+	freeObject((struct p11Object_t *)ptr);
+}
+
+
+
 /**
  * Remove a PKCS11 object from a linked list of objects
- * The object is removed and allocated memory freed
+ * The object is removed and allocated memory freed once it is no longer referenced
  *
  * @param list address of the pointer to the first entry in the list
  * @param handle the handle of the object to be removed
@@ -781,7 +797,7 @@ int removeObjectFromList(struct p11Object_t **list, CK_OBJECT_HANDLE handle)
 	object = *list;
 	*list = (*list)->next;
 
-	freeObject(object);
+	retirePointer(object, freeRetiredObject);
 
 	return CKR_OK;
 }
@@ -838,9 +854,7 @@ int createObject(CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, struct p11Object_
 	index = findAttributeInTemplate(CKA_CLASS, pTemplate, ulCount);
 
 	if (index == -1) { /* Attribute is not present */
-#ifdef DEBUG
 		debug("[createObject] Error creating object - the attribute CKA_CLASS is not present!");
-#endif
 		return CKR_TEMPLATE_INCOMPLETE;
 	} else {
 		addAttribute(pObject, &pTemplate[index]);
@@ -54,6 +54,8 @@ struct p11Attribute_t {
 
 
 struct p11Token_t;				// Forward declaration
+struct p11CertificateIndex;		// Forward declaration
+struct p11Session_t;			// Forward declaration
 
 /**
  * Internal structure to store common attributes of an object.
@@ -76,19 +78,19 @@ struct p11Object_t {
     struct p11Token_t *token;
 
     CK_RV (*C_EncryptInit)  (struct p11Object_t *, CK_MECHANISM_PTR);
-    CK_RV (*C_Encrypt)      (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
-    CK_RV (*C_EncryptUpdate)(struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
-    CK_RV (*C_EncryptFinal) (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
+    CK_RV (*C_Encrypt)      (struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+    CK_RV (*C_EncryptUpdate)(struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+    CK_RV (*C_EncryptFinal) (struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
 
     int (*C_DecryptInit)  (struct p11Object_t *, CK_MECHANISM_PTR);
-    int (*C_Decrypt)      (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
-    int (*C_DecryptUpdate)(struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
-    int (*C_DecryptFinal) (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
+    int (*C_Decrypt)      (struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+    int (*C_DecryptUpdate)(struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+    int (*C_DecryptFinal) (struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
 
     int (*C_SignInit)     (struct p11Object_t *, CK_MECHANISM_PTR);
     int (*C_Sign)         (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
-    int (*C_SignUpdate)   (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG);
-    int (*C_SignFinal)    (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
+    int (*C_SignUpdate)   (struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG);
+    int (*C_SignFinal)    (struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
 
     CK_RV (*C_VerifyInit)   (struct p11Object_t *, CK_MECHANISM_PTR);
     CK_RV (*C_Verify)       (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG);
@@ -98,6 +100,7 @@ struct p11Object_t {
     int (*C_DeriveKey)  (struct p11Object_t *, CK_MECHANISM_PTR, CK_ATTRIBUTE_PTR, CK_ULONG, struct p11Object_t **);
 
     struct p11Attribute_t *attrList;    /**< The list of attributes              */
+    struct p11CertificateIndex *certIndex; /**< Field offsets in CKA_VALUE of a X.509 certificate */
     struct p11Object_t *next;       /**< Pointer to next object              */
 
 };
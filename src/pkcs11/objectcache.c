@@ -0,0 +1,565 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    objectcache.c
+ * @author  Andreas Schwier
+ * @brief   Shared cache of public token objects
+ *
+ * Loading the objects of a token with many keys and certificates requires a large number
+ * of READ BINARY commands. Processes that are started frequently (e.g. a signing tool
+ * invoked for each document) spend most of their startup time reading the same public data
+ * again and again.
+ *
+ * If PKCS11_OBJECT_CACHE=<directory> is set, the content of the elementary files read while
+ * loading the public objects of a token is stored in a cache file in the given directory.
+ * Using a memory backed file system like /dev/shm makes the cache live until the next reboot.
+ *
+ * The cache file is keyed by the token identity (e.g. the serial number) and contains a
+ * fingerprint of the token content (e.g. the list of files on the token). The token driver
+ * reads identity and fingerprint from the token and then attaches the cache file read-only.
+ * If identity and fingerprint match, then the objects are decoded from the cached file
+ * content rather than read from the token. Failed reads are cached as well, so that a key
+ * without certificate does not cause a command either.
+ *
+ * A cache file is written to a temporary file and then renamed, so that a process attached
+ * to the current file is never affected by an update. The token driver removes the cache file
+ * whenever it changes the token.
+ *
+ * The fingerprint covers the list of files only, not their content. Reading lengths or content
+ * would cost the commands the cache is meant to save. The cache is therefore only safe if this
+ * module is the only writer to the token. Changes made with other tools or with this module
+ * on another host that do not alter the list of files, like replacing a certificate or the
+ * label of a key, are not detected and the cached objects are used until the cache file is
+ * removed. Do not enable the cache for tokens that are also updated by other means, or remove
+ * the cache file after each such change.
+ *
+ * Cache files are only used if owned by the effective user and not writable by others.
+ * The cache only contains public data that can be read from the token without
+ * authentication. The cache is not supported on Windows.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <pkcs11/objectcache.h>
+
+#include <common/debug.h>
+
+#ifndef _WIN32
+
+#define CACHE_MAGIC			"SCHSMOC1"
+
+#ifndef O_NOFOLLOW
+#define O_NOFOLLOW			0
+#endif
+
+/**
+ * Header at the start of each cache file
+ *
+ * The header is followed by the fingerprint and a sequence of entries, each
+ * starting at a 4 byte boundary.
+ */
+struct p11ObjectCacheHeader_t {
+	char magic[8];					/**< Magic value and format version */
+	unsigned int headerSize;			/**< sizeof(struct p11ObjectCacheHeader_t) */
+	unsigned int totalLength;			/**< Length of the cache file */
+	unsigned int fingerprintLength;			/**< Length of the fingerprint following the header */
+	unsigned int entries;				/**< Number of cached files */
+	char identity[MAX_CACHE_IDENTITY];		/**< Zero terminated token identity */
+};
+
+/**
+ * Header of each cached file, followed by the file content
+ */
+struct p11ObjectCacheEntry_t {
+	unsigned short fid;				/**< File identifier */
+	unsigned short reserved;
+	int length;					/**< Length of content or -1 if the file could not be read */
+};
+
+/**
+ * Handle for an attached or recorded cache
+ */
+struct p11ObjectCache_t {
+	char path[FILENAME_MAX];			/**< Path of the cache file */
+	unsigned char *map;				/**< Read-only mapping of a valid cache file or NULL */
+	size_t mapLength;				/**< Length of the mapping */
+	unsigned char *data;				/**< Content recorded while loading objects */
+	size_t length;					/**< Used length of data */
+	size_t size;					/**< Allocated length of data */
+	int failed;					/**< Recording failed, e.g. due to memory constraints */
+};
+
+#define ALIGN4(x)		(((x) + 3) & ~3)
+
+
+
+/**
+ * Determine the path of the cache file for the given identity
+ *
+ * Characters in the identity that are not alphanumeric are replaced by an underscore.
+ *
+ * @param identity  The token identity
+ * @param path      The buffer receiving the path
+ * @param pathlen   The size of the buffer
+ * @return          0 or -1 if the cache is disabled or the path does not fit the buffer
+ */
+static int getCachePath(char *identity, char *path, size_t pathlen)
+{
+	char *dir, *p;
+	size_t i;
+	int rc;
+
+	dir = getenv("PKCS11_OBJECT_CACHE");
+	if ((dir == NULL) || (*dir == 0))
+		return -1;
+
+	if ((identity == NULL) || (*identity == 0) || (strlen(identity) >= MAX_CACHE_IDENTITY))
+		return -1;
+
+	rc = snprintf(path, pathlen, "%s/sc-hsm-%s.cache", dir, identity);
+	if ((rc < 0) || (rc >= (int)pathlen))
+		return -1;
+
+	p = path + strlen(dir) + 8;
+	for (i = strlen(identity); i > 0; i--, p++) {
+		if (!isalnum((unsigned char)*p))
+			*p = '_';
+	}
+	return 0;
+}
+
+
+
+/**
+ * Locate an entry in the mapped cache file
+ *
+ * The entries were validated when the file was attached.
+ */
+static struct p11ObjectCacheEntry_t *findEntry(struct p11ObjectCache_t *cache, unsigned short fid)
+{
+	struct p11ObjectCacheHeader_t *hdr = (struct p11ObjectCacheHeader_t *)cache->map;
+	struct p11ObjectCacheEntry_t *entry;
+	size_t ofs;
+	unsigned int i;
+
+	ofs = ALIGN4(sizeof(*hdr) + hdr->fingerprintLength);
+
+	for (i = 0; i < hdr->entries; i++) {
+		entry = (struct p11ObjectCacheEntry_t *)(cache->map + ofs);
+		if (entry->fid == fid)
+			return entry;
+		ofs += ALIGN4(sizeof(*entry) + (entry->length > 0 ? entry->length : 0));
+	}
+	return NULL;
+}
+
+
+
+/**
+ * Validate the mapped cache file against identity and fingerprint
+ *
+ * @return          0 if valid, -1 otherwise
+ */
+static int validateCache(struct p11ObjectCache_t *cache, char *identity, unsigned char *fingerprint, size_t fingerprintlen)
+{
+	struct p11ObjectCacheHeader_t *hdr = (struct p11ObjectCacheHeader_t *)cache->map;
+	struct p11ObjectCacheEntry_t *entry;
+	size_t ofs;
+	unsigned int i;
+
+	if (cache->mapLength < sizeof(*hdr))
+		return -1;
+
+	if (memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) ||
+		(hdr->headerSize != sizeof(*hdr)) ||
+		(hdr->totalLength != cache->mapLength))
+		return -1;
+
+	if (strncmp(hdr->identity, identity, sizeof(hdr->identity)))
+		return -1;
+
+	if ((hdr->fingerprintLength != fingerprintlen) ||
+		(sizeof(*hdr) + fingerprintlen > cache->mapLength) ||
+		memcmp(cache->map + sizeof(*hdr), fingerprint, fingerprintlen))
+		return -1;
+
+	ofs = ALIGN4(sizeof(*hdr) + fingerprintlen);
+
+	for (i = 0; i < hdr->entries; i++) {
+		if (ofs + sizeof(*entry) > cache->mapLength)
+			return -1;
+		entry = (struct p11ObjectCacheEntry_t *)(cache->map + ofs);
+		if ((entry->length < -1) || (entry->length > (int)(cache->mapLength - ofs - sizeof(*entry))))
+			return -1;
+		ofs += ALIGN4(sizeof(*entry) + (entry->length > 0 ? entry->length : 0));
+	}
+	return 0;
+}
+
+
+
+/**
+ * Attach the cache file read-only
+ *
+ * @return          0 if the file was attached and is valid, -1 otherwise
+ */
+static int attachCache(struct p11ObjectCache_t *cache, char *identity, unsigned char *fingerprint, size_t fingerprintlen)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(cache->path, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0)
+		return -1;
+
+	if ((fstat(fd, &st) < 0) || !S_ISREG(st.st_mode) ||
+		(st.st_uid != geteuid()) || (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+		(st.st_size < (off_t)sizeof(struct p11ObjectCacheHeader_t)) || (st.st_size > MAX_CACHE_SIZE)) {
+		debug("Ignoring object cache %s\n", cache->path);
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return -1;
+
+	cache->map = map;
+	cache->mapLength = (size_t)st.st_size;
+
+	if (validateCache(cache, identity, fingerprint, fingerprintlen) < 0) {
+		debug("Object cache %s is outdated\n", cache->path);
+		munmap(cache->map, cache->mapLength);
+		cache->map = NULL;
+		cache->mapLength = 0;
+		return -1;
+	}
+	return 0;
+}
+
+
+
+/**
+ * Append data to the recorded cache content, growing the buffer as required
+ */
+static void appendData(struct p11ObjectCache_t *cache, void *data, size_t len)
+{
+	unsigned char *p;
+	size_t alen, nsize;
+
+	if (cache->failed)
+		return;
+
+	alen = ALIGN4(len);
+
+	if (cache->length + alen > MAX_CACHE_SIZE) {
+		cache->failed = 1;
+		return;
+	}
+
+	if (cache->length + alen > cache->size) {
+		nsize = cache->size ? cache->size : 4096;
+		while (nsize < cache->length + alen)
+			nsize <<= 1;
+		p = realloc(cache->data, nsize);
+		if (p == NULL) {
+			cache->failed = 1;
+			return;
+		}
+		cache->data = p;
+		cache->size = nsize;
+	}
+
+	memcpy(cache->data + cache->length, data, len);
+	memset(cache->data + cache->length + len, 0, alen - len);
+	cache->length += alen;
+}
+
+
+
+/**
+ * Write the recorded content to a temporary file and replace the cache file
+ */
+static int writeCache(struct p11ObjectCache_t *cache)
+{
+	char tmp[FILENAME_MAX];
+	ssize_t rc;
+	size_t ofs;
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.%d", cache->path, (int)getpid()) >= (int)sizeof(tmp))
+		return -1;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		debug("Can not create object cache %s\n", tmp);
+		return -1;
+	}
+
+	for (ofs = 0; ofs < cache->length; ofs += rc) {
+		rc = write(fd, cache->data + ofs, cache->length - ofs);
+		if (rc <= 0) {
+			close(fd);
+			unlink(tmp);
+			return -1;
+		}
+	}
+
+	if ((close(fd) < 0) || (rename(tmp, cache->path) < 0)) {
+		unlink(tmp);
+		return -1;
+	}
+
+	debug("Object cache %s written with %u bytes\n", cache->path, (unsigned int)cache->length);
+	return 0;
+}
+
+
+
+/**
+ * Open the cache for a token
+ *
+ * If a valid cache file exists for the given identity and fingerprint, then it is attached
+ * read-only and getCachedFile() returns the cached content. Otherwise the returned handle
+ * records the content passed to addCachedFile(), which is written when the cache is closed.
+ *
+ * @param identity  The zero terminated token identity
+ * @param fingerprint The fingerprint of the token content
+ * @param fingerprintlen The length of the fingerprint
+ * @return          The cache handle or NULL if the cache is disabled
+ */
+struct p11ObjectCache_t *openObjectCache(char *identity, unsigned char *fingerprint, size_t fingerprintlen)
+{
+	struct p11ObjectCache_t *cache;
+	struct p11ObjectCacheHeader_t hdr;
+
+	if (fingerprintlen > MAX_CACHE_FINGERPRINT)
+		return NULL;
+
+	cache = calloc(1, sizeof(*cache));
+	if (cache == NULL)
+		return NULL;
+
+	if (getCachePath(identity, cache->path, sizeof(cache->path)) < 0) {
+		free(cache);
+		return NULL;
+	}
+
+	if (attachCache(cache, identity, fingerprint, fingerprintlen) == 0) {
+		debug("Using object cache %s\n", cache->path);
+		return cache;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.headerSize = sizeof(hdr);
+	hdr.fingerprintLength = (unsigned int)fingerprintlen;
+	strncpy(hdr.identity, identity, sizeof(hdr.identity) - 1);
+
+	appendData(cache, &hdr, sizeof(hdr));
+	appendData(cache, fingerprint, fingerprintlen);
+
+	return cache;
+}
+
+
+
+/**
+ * Return true if the cache was attached to a valid cache file
+ */
+int isObjectCacheHit(struct p11ObjectCache_t *cache)
+{
+	return cache->map != NULL;
+}
+
+
+
+/**
+ * Obtain the content of a file from an attached cache
+ *
+ * Like a READ BINARY the content is truncated to the size of the buffer.
+ *
+ * @param cache     The cache handle
+ * @param fid       The file identifier
+ * @param content   The buffer receiving the file content
+ * @param len       The size of the buffer
+ * @param rc        The length of the content or -1 if the file could not be read from the token
+ * @return          1 if the file was found in the cache, 0 if it must be read from the token
+ */
+int getCachedFile(struct p11ObjectCache_t *cache, unsigned short fid, unsigned char *content, size_t len, int *rc)
+{
+	struct p11ObjectCacheEntry_t *entry;
+
+	if (cache->map == NULL)
+		return 0;
+
+	entry = findEntry(cache, fid);
+	if (entry == NULL)
+		return 0;
+
+	if (entry->length < 0) {
+		*rc = -1;
+		return 1;
+	}
+
+	*rc = entry->length > (int)len ? (int)len : entry->length;
+	memcpy(content, (unsigned char *)(entry + 1), *rc);
+	return 1;
+}
+
+
+
+/**
+ * Record the content of a file read from the token
+ *
+ * @param cache     The cache handle
+ * @param fid       The file identifier
+ * @param content   The file content
+ * @param len       The length of the content or -1 if the file does not exist
+ */
+void addCachedFile(struct p11ObjectCache_t *cache, unsigned short fid, unsigned char *content, int len)
+{
+	struct p11ObjectCacheHeader_t *hdr;
+	struct p11ObjectCacheEntry_t entry;
+
+	if ((cache->map != NULL) || cache->failed)
+		return;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.fid = fid;
+	entry.length = len < 0 ? -1 : len;
+
+	appendData(cache, &entry, sizeof(entry));
+	if (len > 0)
+		appendData(cache, content, len);
+
+	if (!cache->failed) {
+		hdr = (struct p11ObjectCacheHeader_t *)cache->data;
+		hdr->entries++;
+	}
+}
+
+
+
+/**
+ * Close the cache and release all resources
+ *
+ * @param cache     The cache handle, may be NULL
+ * @param commit    Write the recorded content to the cache file
+ */
+void closeObjectCache(struct p11ObjectCache_t *cache, int commit)
+{
+	struct p11ObjectCacheHeader_t *hdr;
+
+	if (cache == NULL)
+		return;
+
+	if (cache->map != NULL) {
+		munmap(cache->map, cache->mapLength);
+	} else if (commit && !cache->failed && (cache->data != NULL)) {
+		hdr = (struct p11ObjectCacheHeader_t *)cache->data;
+		hdr->totalLength = (unsigned int)cache->length;
+		writeCache(cache);
+	}
+
+	if (cache->data != NULL)
+		free(cache->data);
+	free(cache);
+}
+
+
+
+/**
+ * Remove the cache file for a token after the token content was changed
+ *
+ * @param identity  The zero terminated token identity
+ */
+void invalidateObjectCache(char *identity)
+{
+	char path[FILENAME_MAX];
+
+	if (getCachePath(identity, path, sizeof(path)) < 0)
+		return;
+
+	if (unlink(path) == 0)
+		debug("Object cache %s removed\n", path);
+}
+
+#else
+
+struct p11ObjectCache_t *openObjectCache(char *identity, unsigned char *fingerprint, size_t fingerprintlen)
+{
+	return NULL;
+}
+
+
+
+int isObjectCacheHit(struct p11ObjectCache_t *cache)
+{
+	return 0;
+}
+
+
+
+int getCachedFile(struct p11ObjectCache_t *cache, unsigned short fid, unsigned char *content, size_t len, int *rc)
+{
+	return 0;
+}
+
+
+
+void addCachedFile(struct p11ObjectCache_t *cache, unsigned short fid, unsigned char *content, int len)
+{
+}
+
+
+
+void closeObjectCache(struct p11ObjectCache_t *cache, int commit)
+{
+}
+
+
+
+void invalidateObjectCache(char *identity)
+{
+}
+
+#endif
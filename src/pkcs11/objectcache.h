@@ -0,0 +1,52 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    objectcache.h
+ * @author  Andreas Schwier
+ * @brief   Shared cache of public token objects
+ */
+
+#ifndef ___OBJECTCACHE_H_INC___
+#define ___OBJECTCACHE_H_INC___
+
+#include <stddef.h>
+
+#define MAX_CACHE_IDENTITY		64
+#define MAX_CACHE_FINGERPRINT		512
+#define MAX_CACHE_SIZE			(4 * 1024 * 1024)
+
+struct p11ObjectCache_t;
+
+struct p11ObjectCache_t *openObjectCache(char *identity, unsigned char *fingerprint, size_t fingerprintlen);
+int isObjectCacheHit(struct p11ObjectCache_t *cache);
+int getCachedFile(struct p11ObjectCache_t *cache, unsigned short fid, unsigned char *content, size_t len, int *rc);
+void addCachedFile(struct p11ObjectCache_t *cache, unsigned short fid, unsigned char *content, int len);
+void closeObjectCache(struct p11ObjectCache_t *cache, int commit);
+void invalidateObjectCache(char *identity);
+
+#endif /* ___OBJECTCACHE_H_INC___ */
@@ -38,13 +38,16 @@
 #include <pkcs11/p11generic.h>
 #include <pkcs11/session.h>
 #include <pkcs11/slotpool.h>
+#include <pkcs11/reclaim.h>
+#include <pkcs11/randompool.h>
+#include <pkcs11/keypool.h>
+#include <pkcs11/perfstats.h>
+#include <pkcs11/slot-replay.h>
 #include <pkcs11/strbpcpy.h>
 
 #include <pkcs11/crypto.h>
 
-#ifdef DEBUG
 #include <common/debug.h>
-#endif
 
 #ifdef __APPLE__
 #include <mach-o/dyld.h>
@@ -82,11 +85,14 @@ CK_RV p11DestroyMutex(CK_VOID_PTR pMutex)
 
 CK_RV p11LockMutex(CK_VOID_PTR pMutex)
 {
+	CK_RV rv;
+
 	if (initArgs.LockMutex) {
-#ifdef DEBUG
 		debug("LockMutex (%p)\n", pMutex);
-#endif
-		return (*initArgs.LockMutex)(pMutex);
+		TRACE_BEGIN("LockMutex");
+		rv = (*initArgs.LockMutex)(pMutex);
+		TRACE_END("LockMutex");
+		return rv;
 	}
 	return CKR_OK;
 }
@@ -96,9 +102,7 @@ CK_RV p11LockMutex(CK_VOID_PTR pMutex)
 CK_RV p11UnlockMutex(CK_VOID_PTR pMutex)
 {
 	if (initArgs.UnlockMutex) {
-#ifdef DEBUG
 		debug("UnlockMutex (%p)\n", pMutex);
-#endif
 		return (*initArgs.UnlockMutex)(pMutex);
 	}
 	return CKR_OK;
@@ -171,18 +175,14 @@ int determineCaller()
 
 	r = readlink("/proc/self/exe", path, sizeof(path) - 1);
 	if (r < 0) {
-#ifdef DEBUG
 		debug("[determineCaller] Error calling readlink(\"/proc/self/exe\")\n");
-#endif
 		return CALLER_UNKNOWN;
 	}
 	path[r] = '\0';
 #endif
 #endif
 
-#ifdef DEBUG
 	debug("[determineCaller] Caller=%s\n", path);
-#endif
 
 	if ((p = strrchr(path, '/')) || (p = strrchr(path, '\\'))) {
 		p++;
@@ -320,21 +320,78 @@ CK_DECLARE_FUNCTION(CK_RV, C_Initialize)
 	if (rv != CKR_OK)
 		return CKR_OK;
 
-#ifdef DEBUG
 	initDebug("pkcs11");
+	initTrace("pkcs11");
 	FUNC_CALLED();
-#endif
 
 	context->caller = determineCaller();
 
+	rv = initReclaim();
+
+	if (rv != CKR_OK) {
+		p11DestroyMutex(context->mutex);
+		free(context);
+		context = NULL;
+		FUNC_FAILS(rv, "Error initializing deferred reclamation");
+	}
+
+	rv = initRandomPool();
+
+	if (rv != CKR_OK) {
+		terminateReclaim();
+		p11DestroyMutex(context->mutex);
+		free(context);
+		context = NULL;
+		FUNC_FAILS(rv, "Error initializing random pool");
+	}
+
+	rv = initKeyPool();
+
+	if (rv != CKR_OK) {
+		terminateRandomPool();
+		terminateReclaim();
+		p11DestroyMutex(context->mutex);
+		free(context);
+		context = NULL;
+		FUNC_FAILS(rv, "Error initializing key pool");
+	}
+
+	rv = initPerfStats();
+
+	if (rv != CKR_OK) {
+		terminateKeyPool();
+		terminateRandomPool();
+		terminateReclaim();
+		p11DestroyMutex(context->mutex);
+		free(context);
+		context = NULL;
+		FUNC_FAILS(rv, "Error initializing performance counters");
+	}
+
+	rv = initReplay();
+
+	if (rv != CKR_OK) {
+		terminatePerfStats();
+		terminateKeyPool();
+		terminateRandomPool();
+		terminateReclaim();
+		p11DestroyMutex(context->mutex);
+		free(context);
+		context = NULL;
+		FUNC_FAILS(rv, "Error loading APDU transcript");
+	}
+
 	initSessionPool(&context->sessionPool);
 
 	rv = initSlotPool(&context->slotPool);
 
 	if (rv != CKR_OK) {
-#ifdef DEBUG
 		debug("[C_Initialize] Error initializing slot pool ...\n");
-#endif
+		terminateReplay();
+		terminatePerfStats();
+		terminateKeyPool();
+		terminateRandomPool();
+		terminateReclaim();
 		free(context);
 		context = NULL;
 		FUNC_RETURNS(rv);
@@ -361,16 +418,22 @@ CK_DECLARE_FUNCTION(CK_RV, C_Finalize)
 	FUNC_CALLED();
 
 	if (context != NULL) {
+		// The refill threads may need the context mutex to complete the current refill
+		terminateKeyPool();
+		terminateRandomPool();
+
 		p11LockMutex(context->mutex);
 
+		terminatePerfStats();
 		terminateSessionPool(&context->sessionPool);
 		terminateSlotPool(&context->slotPool);
+		terminateReplay();
+		terminateReclaim();
 
 		p11UnlockMutex(context->mutex);
 
-#ifdef DEBUG
-		termDebug(context);
-#endif
+		termTrace();
+		termDebug();
 
 		p11DestroyMutex(context->mutex);
 
@@ -66,36 +66,23 @@
 #endif /* _WIN32 */
 #endif /* CTAPI */
 
-#ifdef DEBUG
-#define FUNC_CALLED() do { \
-		debug("Function %s called.\n", __FUNCTION__); \
-} while (0)
-
-#define FUNC_RETURNS(rc) do { \
-		debug("Function %s completes with rc=%d.\n", __FUNCTION__, (rc)); \
-		return rc; \
-} while (0)
+#include <common/debug.h>
 
-#define FUNC_FAILS(rc, msg) do { \
-		debug("Function %s fails with rc=%d \"%s\"\n", __FUNCTION__, (rc), (msg)); \
-		return rc; \
-} while (0)
 #define FUNC_FAILVIAOUT(rc, msg) do { \
-		debug("Function %s fails with rc=%d \"%s\"\n", __FUNCTION__, (rc), (msg)); \
+		if (LOG_ENABLED(LOG_LEVEL_ERROR)) \
+			logMessage(LOG_LEVEL_ERROR, "Function %s fails with rc=%d \"%s\"\n", __FUNCTION__, (rc), (msg)); \
 		rv = rc; \
 		goto out; \
 } while (0)
 
-#else
-#define FUNC_CALLED()
-#define FUNC_RETURNS(rc) return (rc)
-#define FUNC_FAILS(rc, msg) return (rc)
-#define FUNC_FAILVIAOUT(rc, msg) do { rv = rc; goto out; } while (0)
-#endif
-
 
 
 struct p11TokenDriver;
+struct p11Session_t;
+struct p11Scheduler_t;
+struct p11RandomPool_t;
+struct p11KeyPool_t;
+struct p11PerfStats_t;
 
 #define INT_CKU_NO_USER 0xFF
 
@@ -122,6 +109,8 @@ struct p11Token_t {
 
 	void *mutex;                        /**< Mutex used to synchronize internal updates     */
 	struct p11TokenDriver *drv;         /**< Driver for this token                          */
+	struct p11RandomPool_t *randomPool; /**< Random data prefetched from the token          */
+	struct p11KeyPool_t *keyPool;       /**< Key pairs generated in advance on the token    */
 };
 
 
@@ -147,10 +136,24 @@ struct p11Slot_t {
 	int maxRAPDU;                     /**< Maximum length of response APDU     */
 	int noExtLengthReadAll;           /**< Prevent using Le='000000'           */
 	int supportsVirtualSlots;         /**< Allow a token to generate v-slotts  */
+	int isCluster;                    /**< Slot aggregates member slots        */
+	int isReplay;                     /**< Slot replays an APDU transcript     */
+	int pendingOperations;            /**< Operations dispatched by cluster    */
+	struct p11Scheduler_t *scheduler; /**< Queue of operations for this slot   */
+	struct p11PerfStats_t *perfStats; /**< Performance counters for this slot  */
+	int lockCount;                    /**< Nesting level of the slot lock      */
+	int lockHeldByLogin;              /**< Lock is held until logout           */
 	struct p11Slot_t *primarySlot;    /**< Base slot if slot is virtual        */
 	struct p11Slot_t *virtualSlots[2];/**< Virtual slots using this as base    */
 	struct p11Token_t *token;         /**< Pointer to token in the slot        */
 	struct p11Token_t *removedToken;  /**< Removed but not freed token         */
+	int statusMonitored;              /**< Reader state tracked by monitor     */
+	unsigned int statusEvents;        /**< Reader state changes seen by monitor*/
+	unsigned int validatedEvents;     /**< statusEvents at last presence check */
+	int presenceValid;                /**< Last presence check still current   */
+	int resetPending;                 /**< Card reset, token state not restored*/
+	int recovering;                   /**< Token state is being restored       */
+	int inChain;                      /**< Last APDU was part of a chain       */
 	struct p11Slot_t *next;           /**< Pointer to next available slot      */
 };
 
@@ -200,13 +203,13 @@ struct p11TokenDriver {
 	int (*setpin)(struct p11Slot_t *slot, CK_UTF8CHAR_PTR, CK_ULONG, CK_UTF8CHAR_PTR, CK_ULONG);
 
 	int (*C_DecryptInit)  (struct p11Object_t *, CK_MECHANISM_PTR);
-	int (*C_Decrypt)      (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
-	int (*C_DecryptUpdate)(struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
-	int (*C_DecryptFinal) (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
+	int (*C_Decrypt)      (struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+	int (*C_DecryptUpdate)(struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+	int (*C_DecryptFinal) (struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
 	int (*C_SignInit)     (struct p11Object_t *, CK_MECHANISM_PTR);
 	int (*C_Sign)         (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
-	int (*C_SignUpdate)   (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG);
-	int (*C_SignFinal)    (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
+	int (*C_SignUpdate)   (struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG);
+	int (*C_SignFinal)    (struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
 
 	int (*C_GenerateKey)      (struct p11Slot_t *, CK_MECHANISM_PTR, CK_ATTRIBUTE_PTR, CK_ULONG, struct p11Object_t **);
 	int (*C_GenerateKeyPair)  (struct p11Slot_t *, CK_MECHANISM_PTR, CK_ATTRIBUTE_PTR, CK_ULONG, CK_ATTRIBUTE_PTR, CK_ULONG, struct p11Object_t **, struct p11Object_t **);
@@ -215,6 +218,12 @@ struct p11TokenDriver {
 	int (*C_SetAttributeValue)(struct p11Slot_t *, struct p11Object_t *, CK_ATTRIBUTE_PTR, CK_ULONG);
 
 	int (*C_GenerateRandom)   (struct p11Slot_t *, CK_BYTE_PTR , CK_ULONG );
+
+	/**< Restore applet selection and login after the card was reset                      */
+	int (*recover)            (struct p11Slot_t *);
+
+	/**< Generate a key pair not yet bound to a key description for the key pool           */
+	int (*generatePoolKeyPair)(struct p11Slot_t *, CK_MECHANISM_PTR, CK_ATTRIBUTE_PTR, CK_ULONG, int *, int *);
 };
 
 
@@ -41,6 +41,9 @@
 #include <pkcs11/slotpool.h>
 #include <pkcs11/token.h>
 #include <pkcs11/crypto.h>
+#include <pkcs11/scheduler.h>
+#include <pkcs11/randompool.h>
+#include <pkcs11/perfstats.h>
 #include <common/debug.h>
 
 
@@ -98,6 +101,10 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptInit)(
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported");
 	}
 
+	if (rv == CKR_OK) {
+		rv = initCryptoBuffer(pSession, pMechanism);
+	}
+
 	if (rv == CKR_OK) {
 		pSession->activeObjectHandle = pObject->handle;
 		pSession->activeMechanism = pMechanism->mechanism;
@@ -121,6 +128,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_Encrypt)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	unsigned long long start;
 
 	FUNC_CALLED();
 
@@ -163,10 +171,19 @@ CK_DECLARE_FUNCTION(CK_RV, C_Encrypt)(
 	}
 
 	if (pObject->C_Encrypt != NULL) {
-		rv = pObject->C_Encrypt(pObject, pSession->activeMechanism, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+		start = pEncryptedData ? perfTimestamp() : 0;
+		rv = scheduleSlot(pSlot, pSession, SCHED_INTERACTIVE);
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "Slot queue limit reached");
+		}
+
+		rv = pObject->C_Encrypt(pObject, pSession, pSession->activeMechanism, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+		releaseSlot(pSlot);
+		perfCountMechanism(pSlot, pSession->activeMechanism, rv, start);
 
 		if ((pEncryptedData != NULL) && (rv != CKR_BUFFER_TOO_SMALL)) {
 			pSession->activeObjectHandle = CK_INVALID_HANDLE;
+			clearCryptoBuffer(pSession);
 		}
 	} else {
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported");
@@ -191,6 +208,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptUpdate)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	unsigned long long start;
 
 	FUNC_CALLED();
 
@@ -233,7 +251,15 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptUpdate)(
 	}
 
 	if (pObject->C_EncryptUpdate != NULL) {
-		rv = pObject->C_EncryptUpdate(pObject, pSession->activeMechanism, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen);
+		start = perfTimestamp();
+		rv = scheduleSlot(pSlot, pSession, SCHED_INTERACTIVE);
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "Slot queue limit reached");
+		}
+
+		rv = pObject->C_EncryptUpdate(pObject, pSession, pSession->activeMechanism, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen);
+		releaseSlot(pSlot);
+		perfCountMechanism(pSlot, pSession->activeMechanism, rv, start);
 		if (rv == CKR_DEVICE_ERROR) {
 			rv = handleDeviceError(hSession);
 			FUNC_FAILS(rv, "Device error reported");
@@ -258,6 +284,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptFinal)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	unsigned long long start;
 
 	FUNC_CALLED();
 
@@ -296,7 +323,15 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptFinal)(
 	}
 
 	if (pObject->C_EncryptFinal != NULL) {
-		rv = pObject->C_EncryptFinal(pObject, pSession->activeMechanism, pLastEncryptedPart, pulLastEncryptedPartLen);
+		start = pLastEncryptedPart ? perfTimestamp() : 0;
+		rv = scheduleSlot(pSlot, pSession, SCHED_INTERACTIVE);
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "Slot queue limit reached");
+		}
+
+		rv = pObject->C_EncryptFinal(pObject, pSession, pSession->activeMechanism, pLastEncryptedPart, pulLastEncryptedPartLen);
+		releaseSlot(pSlot);
+		perfCountMechanism(pSlot, pSession->activeMechanism, rv, start);
 		if (rv == CKR_DEVICE_ERROR) {
 			rv = handleDeviceError(hSession);
 			FUNC_FAILS(rv, "Device error reported");
@@ -305,9 +340,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_EncryptFinal)(
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
 	}
 
-	if (!rv) {
+	if ((pLastEncryptedPart != NULL) && (rv != CKR_BUFFER_TOO_SMALL)) {
 		pSession->activeObjectHandle = CK_INVALID_HANDLE;
-		rv = CKR_OK;
+		clearCryptoBuffer(pSession);
 	}
 
 	FUNC_RETURNS(rv);
@@ -365,6 +400,10 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptInit)(
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
 	}
 
+	if (!rv) {
+		rv = initCryptoBuffer(pSession, pMechanism);
+	}
+
 	if (!rv) {
 		pSession->activeObjectHandle = pObject->handle;
 		pSession->activeMechanism = pMechanism->mechanism;
@@ -389,6 +428,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_Decrypt)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	unsigned long long start;
 
 	FUNC_CALLED();
 
@@ -435,7 +475,18 @@ CK_DECLARE_FUNCTION(CK_RV, C_Decrypt)(
 	}
 
 	if (pObject->C_Decrypt != NULL) {
-		rv = pObject->C_Decrypt(pObject, pSession->activeMechanism, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
+		start = pData ? perfTimestamp() : 0;
+		rv = scheduleSlot(pSlot, pSession, SCHED_INTERACTIVE);
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "Slot queue limit reached");
+		}
+
+		rv = pObject->C_Decrypt(pObject, pSession, pSession->activeMechanism, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
+		releaseSlot(pSlot);
+		if (pData != NULL) {
+			clearCryptoBuffer(pSession);
+		}
+		perfCountMechanism(pSlot, pSession->activeMechanism, rv, start);
 		if (rv == CKR_DEVICE_ERROR) {
 			rv = handleDeviceError(hSession);
 			FUNC_FAILS(rv, "Device error reported");
@@ -463,6 +514,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptUpdate)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	unsigned long long start;
 
 	FUNC_CALLED();
 
@@ -505,7 +557,15 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptUpdate)(
 	}
 
 	if (pObject->C_DecryptUpdate != NULL) {
-		rv = pObject->C_DecryptUpdate(pObject, pSession->activeMechanism, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen);
+		start = perfTimestamp();
+		rv = scheduleSlot(pSlot, pSession, SCHED_INTERACTIVE);
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "Slot queue limit reached");
+		}
+
+		rv = pObject->C_DecryptUpdate(pObject, pSession, pSession->activeMechanism, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen);
+		releaseSlot(pSlot);
+		perfCountMechanism(pSlot, pSession->activeMechanism, rv, start);
 		if (rv == CKR_DEVICE_ERROR) {
 			rv = handleDeviceError(hSession);
 			FUNC_FAILS(rv, "Device error reported");
@@ -530,6 +590,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptFinal)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	unsigned long long start;
 
 	FUNC_CALLED();
 
@@ -567,7 +628,15 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptFinal)(
 	}
 
 	if (pObject->C_DecryptFinal != NULL) {
-		rv = pObject->C_DecryptFinal(pObject, pSession->activeMechanism, pLastPart, pulLastPartLen);
+		start = pLastPart ? perfTimestamp() : 0;
+		rv = scheduleSlot(pSlot, pSession, SCHED_INTERACTIVE);
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "Slot queue limit reached");
+		}
+
+		rv = pObject->C_DecryptFinal(pObject, pSession, pSession->activeMechanism, pLastPart, pulLastPartLen);
+		releaseSlot(pSlot);
+		perfCountMechanism(pSlot, pSession->activeMechanism, rv, start);
 		if (rv == CKR_DEVICE_ERROR) {
 			rv = handleDeviceError(hSession);
 			FUNC_FAILS(rv, "Device error reported");
@@ -576,9 +645,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_DecryptFinal)(
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
 	}
 
-	if (!rv) {
+	if ((pLastPart != NULL) && (rv != CKR_BUFFER_TOO_SMALL)) {
 		pSession->activeObjectHandle = CK_INVALID_HANDLE;
-		rv = CKR_OK;
+		clearCryptoBuffer(pSession);
 	}
 
 	FUNC_RETURNS(rv);
@@ -808,6 +877,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignInit)(
 	}
 
 	if (!rv) {
+		clearCryptoBuffer(pSession);
 		pSession->activeObjectHandle = pObject->handle;
 		pSession->activeMechanism = pMechanism->mechanism;
 		rv = CKR_OK;
@@ -831,6 +901,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_Sign)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	unsigned long long start;
 
 	FUNC_CALLED();
 
@@ -873,7 +944,15 @@ CK_DECLARE_FUNCTION(CK_RV, C_Sign)(
 	}
 
 	if (pObject->C_Sign != NULL) {
+		start = pSignature ? perfTimestamp() : 0;
+		rv = scheduleSlot(pSlot, pSession, SCHED_INTERACTIVE);
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "Slot queue limit reached");
+		}
+
 		rv = pObject->C_Sign(pObject, pSession->activeMechanism, pData, ulDataLen, pSignature, pulSignatureLen);
+		releaseSlot(pSlot);
+		perfCountMechanism(pSlot, pSession->activeMechanism, rv, start);
 
 		if ((pSignature != NULL) && (rv != CKR_BUFFER_TOO_SMALL)) {
 			pSession->activeObjectHandle = CK_INVALID_HANDLE;
@@ -904,6 +983,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignUpdate)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	unsigned long long start;
 
 	FUNC_CALLED();
 
@@ -938,7 +1018,15 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignUpdate)(
 	}
 
 	if (pObject->C_SignUpdate != NULL) {
-		rv = pObject->C_SignUpdate(pObject, pSession->activeMechanism, pPart, ulPartLen);
+		start = perfTimestamp();
+		rv = scheduleSlot(pSlot, pSession, SCHED_INTERACTIVE);
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "Slot queue limit reached");
+		}
+
+		rv = pObject->C_SignUpdate(pObject, pSession, pSession->activeMechanism, pPart, ulPartLen);
+		releaseSlot(pSlot);
+		perfCountMechanism(pSlot, pSession->activeMechanism, rv, start);
 		if (rv == CKR_DEVICE_ERROR) {
 			rv = handleDeviceError(hSession);
 			FUNC_FAILS(rv, "Device error reported");
@@ -963,6 +1051,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignFinal)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	unsigned long long start;
 
 	FUNC_CALLED();
 
@@ -1001,7 +1090,15 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignFinal)(
 	}
 
 	if (pObject->C_SignFinal != NULL) {
-		rv = pObject->C_SignFinal(pObject, pSession->activeMechanism, pSignature, pulSignatureLen);
+		start = pSignature ? perfTimestamp() : 0;
+		rv = scheduleSlot(pSlot, pSession, SCHED_INTERACTIVE);
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "Slot queue limit reached");
+		}
+
+		rv = pObject->C_SignFinal(pObject, pSession, pSession->activeMechanism, pSignature, pulSignatureLen);
+		releaseSlot(pSlot);
+		perfCountMechanism(pSlot, pSession->activeMechanism, rv, start);
 
 		if ((pSignature != NULL) && (rv != CKR_BUFFER_TOO_SMALL)) {
 			pSession->activeObjectHandle = CK_INVALID_HANDLE;
@@ -1014,7 +1111,15 @@ CK_DECLARE_FUNCTION(CK_RV, C_SignFinal)(
 		}
 	} else {
 		if (pObject->C_Sign != NULL) {
+			start = pSignature ? perfTimestamp() : 0;
+			rv = scheduleSlot(pSlot, pSession, SCHED_INTERACTIVE);
+			if (rv != CKR_OK) {
+				FUNC_FAILS(rv, "Slot queue limit reached");
+			}
+
 			rv = pObject->C_Sign(pObject, pSession->activeMechanism, pSession->cryptoBuffer, pSession->cryptoBufferSize, pSignature, pulSignatureLen);
+			releaseSlot(pSlot);
+			perfCountMechanism(pSlot, pSession->activeMechanism, rv, start);
 
 			if ((pSignature != NULL) && (rv != CKR_BUFFER_TOO_SMALL)) {
 				pSession->activeObjectHandle = CK_INVALID_HANDLE;
@@ -1148,6 +1253,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_Verify)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	unsigned long long start;
 
 	FUNC_CALLED();
 
@@ -1184,7 +1290,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_Verify)(
 	}
 
 	if (pObject->C_Verify != NULL) {
+		start = perfTimestamp();
 		rv = pObject->C_Verify(pObject, pSession->activeMechanism, pData, ulDataLen, pSignature, ulSignatureLen);
+		perfCountMechanism(pSlot, pSession->activeMechanism, rv, start);
 		pSession->activeObjectHandle = CK_INVALID_HANDLE;
 	} else {
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported");
@@ -1207,6 +1315,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyUpdate)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	unsigned long long start;
 
 	FUNC_CALLED();
 
@@ -1239,7 +1348,9 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyUpdate)(
 	}
 
 	if (pObject->C_VerifyUpdate != NULL) {
+		start = perfTimestamp();
 		rv = pObject->C_VerifyUpdate(pObject, pSession->activeMechanism, pPart, ulPartLen);
+		perfCountMechanism(pSlot, pSession->activeMechanism, rv, start);
 	} else {
 		rv = appendToCryptoBuffer(pSession, pPart, ulPartLen);
 	}
@@ -1261,6 +1372,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyFinal)(
 	struct p11Object_t *pObject;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	unsigned long long start;
 
 	FUNC_CALLED();
 
@@ -1293,13 +1405,17 @@ CK_DECLARE_FUNCTION(CK_RV, C_VerifyFinal)(
 	}
 
 	if (pObject->C_VerifyFinal != NULL) {
+		start = perfTimestamp();
 		rv = pObject->C_VerifyFinal(pObject, pSession->activeMechanism, pSignature, ulSignatureLen);
+		perfCountMechanism(pSlot, pSession->activeMechanism, rv, start);
 
 		pSession->activeObjectHandle = CK_INVALID_HANDLE;
 		clearCryptoBuffer(pSession);
 	} else {
 		if (pObject->C_Verify != NULL) {
+			start = perfTimestamp();
 			rv = pObject->C_Verify(pObject, pSession->activeMechanism, pSession->cryptoBuffer, pSession->cryptoBufferSize, pSignature, ulSignatureLen);
+			perfCountMechanism(pSlot, pSession->activeMechanism, rv, start);
 
 			pSession->activeObjectHandle = CK_INVALID_HANDLE;
 			clearCryptoBuffer(pSession);
@@ -1463,6 +1579,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GenerateKey)(
 	int pos;
 	struct p11Slot_t *slot;
 	struct p11Session_t *pSession;
+	unsigned long long start;
 	struct p11Token_t *token;
 	struct p11Object_t *p11SecretKey;
 
@@ -1517,14 +1634,22 @@ CK_DECLARE_FUNCTION(CK_RV, C_GenerateKey)(
 	rv = getValidatedToken(slot, &token);
 
 	if (rv != CKR_OK) {
-		return rv;
+		FUNC_RETURNS(rv);
 	}
 
 	if (getSessionState(pSession, token) != CKS_RW_USER_FUNCTIONS) {
 		FUNC_FAILS(CKR_SESSION_READ_ONLY, "Session is read/only");
 	}
 
+	start = perfTimestamp();
+	rv = scheduleSlot(slot, pSession, SCHED_BULK);
+	if (rv != CKR_OK) {
+		FUNC_FAILS(rv, "Slot queue limit reached");
+	}
+
 	rv = generateTokenKey(slot, pMechanism, pTemplate, ulCount, &p11SecretKey);
+	releaseSlot(slot);
+	perfCountMechanism(slot, pMechanism->mechanism, rv, start);
 
 	if (rv == CKR_DEVICE_ERROR) {
 		rv = handleDeviceError(hSession);
@@ -1558,6 +1683,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GenerateKeyPair)(
 	int pos;
 	struct p11Slot_t *slot;
 	struct p11Session_t *pSession;
+	unsigned long long start;
 	struct p11Token_t *token;
 	struct p11Object_t *p11PriKey, *p11PubKey;
 
@@ -1622,14 +1748,22 @@ CK_DECLARE_FUNCTION(CK_RV, C_GenerateKeyPair)(
 	rv = getValidatedToken(slot, &token);
 
 	if (rv != CKR_OK) {
-		return rv;
+		FUNC_RETURNS(rv);
 	}
 
 	if (getSessionState(pSession, token) != CKS_RW_USER_FUNCTIONS) {
 		FUNC_FAILS(CKR_SESSION_READ_ONLY, "Session is read/only");
 	}
 
+	start = perfTimestamp();
+	rv = scheduleSlot(slot, pSession, SCHED_BULK);
+	if (rv != CKR_OK) {
+		FUNC_FAILS(rv, "Slot queue limit reached");
+	}
+
 	rv = generateTokenKeypair(slot, pMechanism, pPublicKeyTemplate, ulPublicKeyAttributeCount, pPrivateKeyTemplate, ulPrivateKeyAttributeCount, &p11PubKey, &p11PriKey);
+	releaseSlot(slot);
+	perfCountMechanism(slot, pMechanism->mechanism, rv, start);
 
 	if (rv == CKR_DEVICE_ERROR) {
 		rv = handleDeviceError(hSession);
@@ -1711,6 +1845,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_DeriveKey)(
 	struct p11Object_t *pObject, *derivedKey;
 	struct p11Slot_t *pSlot;
 	struct p11Session_t *pSession;
+	unsigned long long start;
 
 	FUNC_CALLED();
 
@@ -1749,7 +1884,15 @@ CK_DECLARE_FUNCTION(CK_RV, C_DeriveKey)(
 	}
 
 	if (pObject->C_DeriveKey != NULL) {
+		start = perfTimestamp();
+		rv = scheduleSlot(pSlot, pSession, SCHED_INTERACTIVE);
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "Slot queue limit reached");
+		}
+
 		rv = pObject->C_DeriveKey(pObject, pMechanism, pTemplate, ulAttributeCount, &derivedKey);
+		releaseSlot(pSlot);
+		perfCountMechanism(pSlot, pMechanism->mechanism, rv, start);
 	} else {
 		FUNC_FAILS(CKR_FUNCTION_NOT_SUPPORTED, "Operation not supported by token");
 	}
@@ -1822,10 +1965,20 @@ CK_DECLARE_FUNCTION(CK_RV, C_GenerateRandom)(
 	rv = getValidatedToken(slot, &token);
 
 	if (rv != CKR_OK) {
-		return rv;
+		FUNC_RETURNS(rv);
+	}
+
+	if (getRandomFromPool(token, pRandomData, ulRandomLen) == CKR_OK) {
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	rv = scheduleSlot(slot, pSession, SCHED_INTERACTIVE);
+	if (rv != CKR_OK) {
+		FUNC_FAILS(rv, "Slot queue limit reached");
 	}
 
 	rv = generateTokenRandom(slot, pRandomData, ulRandomLen);
+	releaseSlot(slot);
 
 	if (rv == CKR_DEVICE_ERROR) {
 		rv = handleDeviceError(hSession);
@@ -38,12 +38,11 @@
 #include <pkcs11/slot.h>
 #include <pkcs11/slotpool.h>
 #include <pkcs11/token.h>
+#include <pkcs11/scheduler.h>
 #include <pkcs11/dataobject.h>
 #include <pkcs11/certificateobject.h>
 
-#ifdef DEBUG
 #include <common/debug.h>
-#endif
 
 extern struct p11Context_t *context;
 
@@ -119,14 +118,20 @@ CK_DECLARE_FUNCTION(CK_RV, C_CreateObject)(
 		rv = getValidatedToken(slot, &token);
 
 		if (rv != CKR_OK) {
-			return rv;
+			FUNC_RETURNS(rv);
 		}
 
 		if (getSessionState(session, token) != CKS_RW_USER_FUNCTIONS) {
 			FUNC_FAILS(CKR_SESSION_READ_ONLY, "Session is read/only");
 		}
 
+		rv = scheduleSlot(slot, session, SCHED_BULK);
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "Slot queue limit reached");
+		}
+
 		rv = createTokenObject(slot, pTemplate, ulCount, &pObject);
+		releaseSlot(slot);
 
 		if (rv == CKR_DEVICE_ERROR) {
 			rv = handleDeviceError(hSession);
@@ -171,9 +176,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_CreateObject)(
 			}
 
 			if (rv != CKR_OK) {
-		#ifdef DEBUG
 				debug("Populating additional attributes failed\n");
-		#endif
 			}
 
 			addSessionObject(session, pObject);
@@ -259,7 +262,13 @@ CK_DECLARE_FUNCTION(CK_RV, C_DestroyObject)(
 		}
 
 		/* remove the object from the token */
+		rv = scheduleSlot(slot, session, SCHED_BULK);
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "Slot queue limit reached");
+		}
+
 		rv = destroyObject(slot, pObject);
+		releaseSlot(slot);
 
 		if (rv != CKR_OK) {
 			FUNC_FAILS(rv, "Can't destroy object on token");
@@ -330,10 +339,10 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetObjectSize)(
 				rv = findObject(slot->token, hObject, &pObject, FALSE);
 
 				if (rv < 0) {
-					return CKR_OBJECT_HANDLE_INVALID;
+					FUNC_FAILS(CKR_OBJECT_HANDLE_INVALID, "No object found for that handle");
 				}
 			} else {
-				return CKR_OBJECT_HANDLE_INVALID;
+				FUNC_FAILS(CKR_OBJECT_HANDLE_INVALID, "No object found for that handle");
 			}
 		}
 	}
@@ -405,9 +414,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetAttributeValue)(
 		}
 	}
 
-#ifdef DEBUG
 	debug("[C_GetAttributeValue] Trying to get %u attributes ...\n", ulCount);
-#endif
 
 	rv = CKR_OK;
 
@@ -519,7 +526,13 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
 			FUNC_FAILS(rv, "Could not get validated token");
 		}
 
+		rv = scheduleSlot(slot, session, SCHED_BULK);
+		if (rv != CKR_OK) {
+			FUNC_FAILS(rv, "Slot queue limit reached");
+		}
+
 		rv = setTokenObjectAttributes(slot, pObject, pTemplate, ulCount);
+		releaseSlot(slot);
 
 		if ((rv != CKR_OK) && (rv != CKR_FUNCTION_NOT_SUPPORTED)) {
 			FUNC_FAILS(rv, "Could not update attribute on token");
@@ -541,7 +554,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
 		if (pTemplate[i].type == CKA_PRIVATE) {
 			/* changed from TRUE to FALSE */
 			if ((*(CK_BBOOL *)pTemplate[i].pValue == CK_FALSE) && (*(CK_BBOOL *)attribute->attrData.pValue == CK_TRUE)) {
-				return CKR_TEMPLATE_INCONSISTENT;
+				FUNC_FAILS(CKR_TEMPLATE_INCONSISTENT, "CKA_PRIVATE can not be changed from TRUE to FALSE");
 			}
 
 			/* changed from FALSE to TRUE */
@@ -567,6 +580,11 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
 				addObject(slot->token, tmp, FALSE);
 			}
 		} else {
+			if ((pTemplate[i].type == CKA_VALUE) && pObject->certIndex) {
+				free(pObject->certIndex);		// Offsets no longer match the new value
+				pObject->certIndex = NULL;
+			}
+
 			if (pTemplate[i].ulValueLen > attribute->attrData.ulValueLen) {
 				free(attribute->attrData.pValue);
 				attribute->attrData.pValue = malloc(pTemplate[i].ulValueLen);
@@ -718,18 +736,14 @@ CK_DECLARE_FUNCTION(CK_RV, C_FindObjects)(
 
 	if (session->searchObj.objectsCollected == session->searchObj.searchNumOfObjects) {
 		*pulObjectCount = 0;
-#ifdef DEBUG
 		debug("No objects in left in search list\n");
-#endif
 		FUNC_RETURNS(CKR_OK);
 	}
 
 	pObject = session->searchObj.searchList;
 
 	i = session->searchObj.objectsCollected;
-#ifdef DEBUG
 	debug("objectsCollected=%d\n", i);
-#endif
 
 	while (i > 0) {
 		pObject = pObject->next;
@@ -747,9 +761,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_FindObjects)(
 		pObject = pObject->next;
 	}
 
-#ifdef DEBUG
 	debug("*pulObjectCount=%d\n", cnt);
-#endif
 
 	*pulObjectCount = cnt;
 	session->searchObj.objectsCollected += cnt;
@@ -38,6 +38,8 @@
 #include <pkcs11/slotpool.h>
 #include <pkcs11/slot.h>
 #include <pkcs11/token.h>
+#include <pkcs11/scheduler.h>
+#include <pkcs11/keypool.h>
 #include <common/debug.h>
 
 extern struct p11Context_t *context;
@@ -307,25 +309,35 @@ CK_DECLARE_FUNCTION(CK_RV, C_Login)(
 		return rv;
 	}
 
+	rv = scheduleSlot(slot, session, SCHED_INTERACTIVE);
+
+	if (rv != CKR_OK) {
+		FUNC_FAILS(rv, "Slot queue limit reached");
+	}
+
 	p11LockMutex(context->mutex);
 
 	if ((userType != CKU_CONTEXT_SPECIFIC) && (token->user == CKU_USER || token->user == CKU_SO)) {
 		p11UnlockMutex(context->mutex);
+		releaseSlot(slot);
 		FUNC_RETURNS(CKR_USER_ALREADY_LOGGED_IN);
 	}
 
 	if (userType == CKU_USER || userType == CKU_CONTEXT_SPECIFIC) {
 		if (!(token->info.flags & CKF_USER_PIN_INITIALIZED)) {
 			p11UnlockMutex(context->mutex);
+			releaseSlot(slot);
 			FUNC_RETURNS(CKR_USER_PIN_NOT_INITIALIZED);
 		}
 	} else {
 		if (!(session->flags & CKF_RW_SESSION)) {
 			p11UnlockMutex(context->mutex);
+			releaseSlot(slot);
 			FUNC_RETURNS(CKR_SESSION_READ_ONLY);
 		}
 		if (token->rosessions) {
 			p11UnlockMutex(context->mutex);
+			releaseSlot(slot);
 			FUNC_RETURNS(CKR_SESSION_READ_ONLY_EXISTS);
 		}
 	}
@@ -334,13 +346,21 @@ CK_DECLARE_FUNCTION(CK_RV, C_Login)(
 
 	if (rv != CKR_OK) {
 		p11UnlockMutex(context->mutex);
+		releaseSlot(slot);
 		FUNC_RETURNS(rv);
 	}
 
-	if (userType != CKU_CONTEXT_SPECIFIC)
+	if (userType != CKU_CONTEXT_SPECIFIC) {
 		token->user = userType;
+		holdSlotLock(slot);
+	}
 
 	p11UnlockMutex(context->mutex);
+	releaseSlot(slot);
+
+	// Key pairs are generated for the pool while the user is logged in
+	if (userType == CKU_USER)
+		refillKeyPool(token);
 
 	FUNC_RETURNS(CKR_OK);
 }
@@ -379,13 +399,21 @@ CK_DECLARE_FUNCTION(CK_RV, C_Logout)(
 		FUNC_RETURNS(rv);
 	}
 
+	rv = scheduleSlot(slot, session, SCHED_INTERACTIVE);
+
+	if (rv != CKR_OK) {
+		FUNC_FAILS(rv, "Slot queue limit reached");
+	}
+
 	token->user = INT_CKU_NO_USER;
 
 	p11LockMutex(context->mutex);
 
 	rv = logOut(slot);
+	releaseHeldSlotLock(slot);
 
 	p11UnlockMutex(context->mutex);
+	releaseSlot(slot);
 
 	if (rv != CKR_OK) {
 		FUNC_RETURNS(rv);
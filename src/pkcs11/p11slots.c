@@ -38,6 +38,9 @@
 #include <pkcs11/slotpool.h>
 #include <pkcs11/slot.h>
 #include <pkcs11/token.h>
+#include <pkcs11/scheduler.h>
+#include <pkcs11/perfstats.h>
+#include <pkcs11/keypool.h>
 #include <common/debug.h>
 
 extern struct p11Context_t *context;
@@ -101,9 +104,7 @@ CK_DECLARE_FUNCTION(CK_RV, C_GetSlotList)(
 			rv = CKR_BUFFER_TOO_SMALL;
 		}
 	} else {
-#ifdef DEBUG
 		debug("Size inquiry returns %d slots\n", i);
-#endif
 	}
 	*pulCount = i;
 
@@ -486,3 +487,167 @@ CK_DECLARE_FUNCTION(CK_RV, C_SetPIN)(
 
 	FUNC_RETURNS(rv);
 }
+
+
+
+/*  SC_HSM_GetSlotQueueInfo obtains statistics about the operation queue of a slot.
+    This is a vendor extension not listed in the function list. */
+CK_DECLARE_FUNCTION(CK_RV, SC_HSM_GetSlotQueueInfo)(
+		CK_SLOT_ID slotID,
+		CK_SC_HSM_SLOT_QUEUE_INFO_PTR pInfo
+)
+{
+	int rv;
+	struct p11Slot_t *slot;
+
+	FUNC_CALLED();
+
+	if (context == NULL) {
+		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
+	}
+
+	if (!isValidPtr(pInfo)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	rv = findSlot(&context->slotPool, slotID, &slot);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = getSlotQueueInfo(slot, pInfo);
+
+	FUNC_RETURNS(rv);
+}
+
+
+
+/*  SC_HSM_GetSlotStatistics obtains performance counters for a slot.
+    This is a vendor extension not listed in the function list. */
+CK_DECLARE_FUNCTION(CK_RV, SC_HSM_GetSlotStatistics)(
+		CK_SLOT_ID slotID,
+		CK_SC_HSM_SLOT_STATISTICS_PTR pInfo
+)
+{
+	int rv;
+	struct p11Slot_t *slot;
+
+	FUNC_CALLED();
+
+	if (context == NULL) {
+		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
+	}
+
+	if (!isValidPtr(pInfo)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	rv = findSlot(&context->slotPool, slotID, &slot);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = getSlotStatistics(slot, pInfo);
+
+	FUNC_RETURNS(rv);
+}
+
+
+
+/*  SC_HSM_GetMechanismStatistics obtains performance counters for a mechanism used on a slot.
+    This is a vendor extension not listed in the function list. */
+CK_DECLARE_FUNCTION(CK_RV, SC_HSM_GetMechanismStatistics)(
+		CK_SLOT_ID slotID,
+		CK_MECHANISM_TYPE type,
+		CK_SC_HSM_MECHANISM_STATISTICS_PTR pInfo
+)
+{
+	int rv;
+	struct p11Slot_t *slot;
+
+	FUNC_CALLED();
+
+	if (context == NULL) {
+		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
+	}
+
+	if (!isValidPtr(pInfo)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	rv = findSlot(&context->slotPool, slotID, &slot);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = getMechanismStatistics(slot, type, pInfo);
+
+	FUNC_RETURNS(rv);
+}
+
+
+
+/*  SC_HSM_SetResetRecovery enables transparent recovery after the card was reset by
+    another process. The callback supplies the PIN to restore the login.
+    This is a vendor extension not listed in the function list. */
+CK_DECLARE_FUNCTION(CK_RV, SC_HSM_SetResetRecovery)(
+		CK_SC_HSM_RECOVERY_CALLBACK pCallback,
+		CK_VOID_PTR pApplication
+)
+{
+	int rv;
+
+	FUNC_CALLED();
+
+	if (context == NULL) {
+		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
+	}
+
+	rv = setResetRecovery(pCallback, pApplication);
+
+	FUNC_RETURNS(rv);
+}
+
+
+
+/*  SC_HSM_GetKeyPoolInfo obtains the state of the pool of key pairs generated in advance
+    for the token in a slot.
+    This is a vendor extension not listed in the function list. */
+CK_DECLARE_FUNCTION(CK_RV, SC_HSM_GetKeyPoolInfo)(
+		CK_SLOT_ID slotID,
+		CK_SC_HSM_KEY_POOL_INFO_PTR pInfo
+)
+{
+	int rv;
+	struct p11Slot_t *slot;
+	struct p11Token_t *token;
+
+	FUNC_CALLED();
+
+	if (context == NULL) {
+		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
+	}
+
+	if (!isValidPtr(pInfo)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	rv = findSlot(&context->slotPool, slotID, &slot);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = getValidatedToken(slot, &token);
+
+	if (rv != CKR_OK) {
+		FUNC_RETURNS(rv);
+	}
+
+	rv = getKeyPoolInfo(token, pInfo);
+
+	FUNC_RETURNS(rv);
+}
@@ -0,0 +1,670 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    perfstats.c
+ * @author  Andreas Schwier
+ * @brief   Per-slot and per-mechanism performance counters
+ *
+ * For each slot the module counts APDUs, transferred bytes and the class of returned status
+ * words. It also records latency histograms for the APDU round trip, the wait for exclusive
+ * access to the card (lockSlot), the wait for other operations of the same process
+ * (scheduleSlot) and the token presence check (getValidatedToken). For each mechanism used
+ * on a slot the number of operations, errors and the latency of the operation are recorded.
+ * Calls that only determine the length of the output are not counted.
+ *
+ * Comparing the mechanism latency with the card time, lock wait and queue wait shows if a
+ * slow operation is caused by the card, by other processes or by contention in this process.
+ *
+ * Histograms use log-linear buckets: 16 sub-buckets for each power of two, so that
+ * percentiles have a relative error of about 6% over the full range from 1 us to 71 min.
+ *
+ * Counters are collected unless PKCS11_STATS is set to 0 or off. They can be obtained with
+ * SC_HSM_GetSlotStatistics() and SC_HSM_GetMechanismStatistics(). If PKCS11_STATS_FILE is set,
+ * a report for all slots is appended to the file every PKCS11_STATS_INTERVAL seconds
+ * (default 60) and at C_Finalize.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <common/mutex.h>
+
+#include <pkcs11/p11generic.h>
+#include <pkcs11/perfstats.h>
+
+#include <common/debug.h>
+
+extern struct p11Context_t *context;
+
+
+
+#define PERF_SUB_BUCKET_BITS	4
+#define PERF_SUB_BUCKETS		(1 << PERF_SUB_BUCKET_BITS)
+#define PERF_BUCKETS			((32 - PERF_SUB_BUCKET_BITS + 1) * PERF_SUB_BUCKETS)
+
+#define PERF_SW_SUCCESS			0
+#define PERF_SW_WARNING			1
+#define PERF_SW_EXECUTION		2
+#define PERF_SW_CHECKING		3
+#define PERF_SW_OTHER			4
+#define PERF_SW_CLASSES			5
+
+
+
+struct perfHistogram {
+	unsigned long long count;
+	unsigned long long total;
+	unsigned long long max;
+	unsigned long buckets[PERF_BUCKETS];
+};
+
+
+
+struct perfMechanism {
+	CK_MECHANISM_TYPE type;
+	unsigned long long errors;
+	struct perfHistogram latency;
+	struct perfMechanism *next;
+};
+
+
+
+struct p11PerfStats_t {
+	MUTEX mutex;                        /**< Protects the counters                       */
+	unsigned long long apdus;
+	unsigned long long bytesSent;
+	unsigned long long bytesReceived;
+	unsigned long long transmitErrors;
+	unsigned long long sw[PERF_SW_CLASSES];
+	struct perfHistogram hist[PERF_HISTOGRAMS];
+	int numberOfMechanisms;
+	struct perfMechanism *mechanisms;
+};
+
+
+
+static const char *histNames[PERF_HISTOGRAMS] = { "card time", "lock wait", "queue wait", "validation" };
+
+static int enabled = 0;
+static int initialized = 0;
+static MUTEX statsMutex;
+
+static char *dumpFile = NULL;
+static int dumpInterval;
+static EVENT dumpEvent;
+static THREAD dumpThread;
+static int dumpThreadStarted;
+static int terminating;
+
+
+
+/**
+ * Return the bucket for a value
+ *
+ * Values below 16 have a bucket each, larger values are mapped to one of 16 buckets
+ * for each power of two.
+ */
+static int bucketForValue(unsigned long long value)
+{
+	int e;
+
+	if (value > 0xFFFFFFFFUL)
+		value = 0xFFFFFFFFUL;
+
+	if (value < PERF_SUB_BUCKETS)
+		return (int)value;
+
+	for (e = PERF_SUB_BUCKET_BITS; (value >> (e + 1)) != 0; e++);
+
+	return (e - PERF_SUB_BUCKET_BITS + 1) * PERF_SUB_BUCKETS +
+		(int)((value >> (e - PERF_SUB_BUCKET_BITS)) & (PERF_SUB_BUCKETS - 1));
+}
+
+
+
+/**
+ * Return the largest value mapped to a bucket
+ */
+static unsigned long long highestValueInBucket(int bucket)
+{
+	int shift;
+
+	if (bucket < PERF_SUB_BUCKETS)
+		return bucket;
+
+	shift = bucket / PERF_SUB_BUCKETS - 1;
+	return (((unsigned long long)(bucket % PERF_SUB_BUCKETS + PERF_SUB_BUCKETS + 1)) << shift) - 1;
+}
+
+
+
+static void recordValue(struct perfHistogram *hist, unsigned long long value)
+{
+	hist->count++;
+	hist->total += value;
+	if (value > hist->max)
+		hist->max = value;
+	hist->buckets[bucketForValue(value)]++;
+}
+
+
+
+/**
+ * Return the value below which the given percentage of samples fall
+ */
+static unsigned long long valueAtPercentile(struct perfHistogram *hist, int percent)
+{
+	unsigned long long limit, sum;
+	int i;
+
+	limit = (hist->count * percent + 99) / 100;
+	sum = 0;
+
+	for (i = 0; i < PERF_BUCKETS; i++) {
+		sum += hist->buckets[i];
+		if (sum >= limit)
+			break;
+	}
+
+	if (i >= PERF_BUCKETS)
+		return hist->max;
+
+	return highestValueInBucket(i) < hist->max ? highestValueInBucket(i) : hist->max;
+}
+
+
+
+static void getLatency(struct perfHistogram *hist, CK_SC_HSM_LATENCY *lat)
+{
+	memset(lat, 0, sizeof(*lat));
+
+	if (hist->count == 0)
+		return;
+
+	lat->ulCount = (CK_ULONG)hist->count;
+	lat->ulAverage = (CK_ULONG)(hist->total / hist->count);
+	lat->ulMedian = (CK_ULONG)valueAtPercentile(hist, 50);
+	lat->ulP90 = (CK_ULONG)valueAtPercentile(hist, 90);
+	lat->ulP99 = (CK_ULONG)valueAtPercentile(hist, 99);
+	lat->ulMax = (CK_ULONG)hist->max;
+}
+
+
+
+/**
+ * Return the counters for the slot, creating them on first use
+ */
+static struct p11PerfStats_t *getPerfStats(struct p11Slot_t *slot)
+{
+	struct p11PerfStats_t *stats;
+
+	if (slot->primarySlot)
+		slot = slot->primarySlot;
+
+	if (slot->perfStats)
+		return slot->perfStats;
+
+	// The global mutex can not be used, as APDUs are exchanged while it is held
+	mutex_lock(&statsMutex);
+
+	if (slot->perfStats == NULL) {
+		stats = (struct p11PerfStats_t *)calloc(1, sizeof(struct p11PerfStats_t));
+
+		if ((stats != NULL) && (mutex_init(&stats->mutex) != 0)) {
+			free(stats);
+			stats = NULL;
+		}
+
+		if (stats != NULL) {
+			MEMORY_BARRIER();
+			slot->perfStats = stats;
+		}
+	}
+
+	mutex_unlock(&statsMutex);
+
+	return slot->perfStats;
+}
+
+
+
+static struct perfMechanism *findMechanism(struct p11PerfStats_t *stats, CK_MECHANISM_TYPE type)
+{
+	struct perfMechanism *mech;
+
+	for (mech = stats->mechanisms; mech != NULL; mech = mech->next) {
+		if (mech->type == type)
+			return mech;
+	}
+	return NULL;
+}
+
+
+
+/**
+ * Return the start time for a measurement or 0 if counters are disabled
+ */
+unsigned long long perfTimestamp()
+{
+	return enabled ? getMicroseconds() : 0;
+}
+
+
+
+/**
+ * Count an APDU exchanged with the card
+ *
+ * @param slot      The slot
+ * @param start     The value returned by perfTimestamp() before the APDU was sent
+ * @param sent      The length of the command APDU
+ * @param received  The length of the response APDU or -1 if no valid response was received
+ * @param SW1SW2    The status word returned by the card
+ */
+void perfCountAPDU(struct p11Slot_t *slot, unsigned long long start, int sent, int received, unsigned short SW1SW2)
+{
+	struct p11PerfStats_t *stats;
+	unsigned long long elapsed;
+	int swclass;
+	int sw1;
+
+	if (!enabled || !start)
+		return;
+
+	elapsed = getMicroseconds() - start;
+
+	stats = getPerfStats(slot);
+	if (stats == NULL)
+		return;
+
+	sw1 = SW1SW2 >> 8;
+	if (SW1SW2 == 0x9000) {
+		swclass = PERF_SW_SUCCESS;
+	} else if ((sw1 >= 0x61) && (sw1 <= 0x63)) {
+		swclass = PERF_SW_WARNING;
+	} else if ((sw1 >= 0x64) && (sw1 <= 0x66)) {
+		swclass = PERF_SW_EXECUTION;
+	} else if ((sw1 >= 0x67) && (sw1 <= 0x6F)) {
+		swclass = PERF_SW_CHECKING;
+	} else {
+		swclass = PERF_SW_OTHER;
+	}
+
+	mutex_lock(&stats->mutex);
+
+	stats->apdus++;
+	stats->bytesSent += sent;
+	if (received < 0) {
+		stats->transmitErrors++;
+	} else {
+		stats->bytesReceived += received + 2;
+		stats->sw[swclass]++;
+	}
+	recordValue(&stats->hist[PERF_HIST_CARD], elapsed);
+
+	mutex_unlock(&stats->mutex);
+}
+
+
+
+/**
+ * Record the time elapsed since start in one of the slot histograms
+ *
+ * @param slot      The slot
+ * @param hist      One of the PERF_HIST_ constants
+ * @param start     The value returned by perfTimestamp()
+ */
+void perfCountLatency(struct p11Slot_t *slot, int hist, unsigned long long start)
+{
+	struct p11PerfStats_t *stats;
+	unsigned long long elapsed;
+
+	if (!enabled || !start)
+		return;
+
+	elapsed = getMicroseconds() - start;
+
+	stats = getPerfStats(slot);
+	if (stats == NULL)
+		return;
+
+	mutex_lock(&stats->mutex);
+	recordValue(&stats->hist[hist], elapsed);
+	mutex_unlock(&stats->mutex);
+}
+
+
+
+/**
+ * Count an operation performed with a mechanism
+ *
+ * @param slot      The slot
+ * @param type      The mechanism
+ * @param rv        The result of the operation
+ * @param start     The value returned by perfTimestamp() when the operation was started
+ */
+void perfCountMechanism(struct p11Slot_t *slot, CK_MECHANISM_TYPE type, CK_RV rv, unsigned long long start)
+{
+	struct p11PerfStats_t *stats;
+	struct perfMechanism *mech;
+	unsigned long long elapsed;
+
+	if (!enabled || !start)
+		return;
+
+	elapsed = getMicroseconds() - start;
+
+	stats = getPerfStats(slot);
+	if (stats == NULL)
+		return;
+
+	mutex_lock(&stats->mutex);
+
+	mech = findMechanism(stats, type);
+
+	if ((mech == NULL) && (stats->numberOfMechanisms < PERF_MAX_MECHANISMS)) {
+		mech = (struct perfMechanism *)calloc(1, sizeof(struct perfMechanism));
+		if (mech != NULL) {
+			mech->type = type;
+			mech->next = stats->mechanisms;
+			stats->mechanisms = mech;
+			stats->numberOfMechanisms++;
+		}
+	}
+
+	if (mech != NULL) {
+		if ((rv != CKR_OK) && (rv != CKR_BUFFER_TOO_SMALL))
+			mech->errors++;
+		recordValue(&mech->latency, elapsed);
+	}
+
+	mutex_unlock(&stats->mutex);
+}
+
+
+
+/**
+ * Return the counters for a slot
+ *
+ * @param slot      The slot
+ * @param pInfo     The structure receiving the counters
+ */
+int getSlotStatistics(struct p11Slot_t *slot, CK_SC_HSM_SLOT_STATISTICS_PTR pInfo)
+{
+	struct p11PerfStats_t *stats;
+
+	memset(pInfo, 0, sizeof(*pInfo));
+
+	if (!enabled)
+		return CKR_OK;
+
+	stats = getPerfStats(slot);
+	if (stats == NULL)
+		return CKR_HOST_MEMORY;
+
+	mutex_lock(&stats->mutex);
+
+	pInfo->ulAPDUs = (CK_ULONG)stats->apdus;
+	pInfo->ulBytesSent = (CK_ULONG)stats->bytesSent;
+	pInfo->ulBytesReceived = (CK_ULONG)stats->bytesReceived;
+	pInfo->ulTransmitErrors = (CK_ULONG)stats->transmitErrors;
+	pInfo->ulSWSuccess = (CK_ULONG)stats->sw[PERF_SW_SUCCESS];
+	pInfo->ulSWWarning = (CK_ULONG)stats->sw[PERF_SW_WARNING];
+	pInfo->ulSWExecutionError = (CK_ULONG)stats->sw[PERF_SW_EXECUTION];
+	pInfo->ulSWCheckingError = (CK_ULONG)stats->sw[PERF_SW_CHECKING];
+	pInfo->ulSWOther = (CK_ULONG)stats->sw[PERF_SW_OTHER];
+	getLatency(&stats->hist[PERF_HIST_CARD], &pInfo->cardTime);
+	getLatency(&stats->hist[PERF_HIST_LOCK], &pInfo->lockWait);
+	getLatency(&stats->hist[PERF_HIST_QUEUE], &pInfo->queueWait);
+	getLatency(&stats->hist[PERF_HIST_VALIDATE], &pInfo->tokenValidation);
+
+	mutex_unlock(&stats->mutex);
+
+	return CKR_OK;
+}
+
+
+
+/**
+ * Return the counters for a mechanism used on the slot
+ *
+ * @param slot      The slot
+ * @param type      The mechanism
+ * @param pInfo     The structure receiving the counters
+ */
+int getMechanismStatistics(struct p11Slot_t *slot, CK_MECHANISM_TYPE type, CK_SC_HSM_MECHANISM_STATISTICS_PTR pInfo)
+{
+	struct p11PerfStats_t *stats;
+	struct perfMechanism *mech;
+
+	memset(pInfo, 0, sizeof(*pInfo));
+
+	if (!enabled)
+		return CKR_OK;
+
+	stats = getPerfStats(slot);
+	if (stats == NULL)
+		return CKR_HOST_MEMORY;
+
+	mutex_lock(&stats->mutex);
+
+	mech = findMechanism(stats, type);
+	if (mech != NULL) {
+		pInfo->ulOperations = (CK_ULONG)mech->latency.count;
+		pInfo->ulErrors = (CK_ULONG)mech->errors;
+		getLatency(&mech->latency, &pInfo->latency);
+	}
+
+	mutex_unlock(&stats->mutex);
+
+	return CKR_OK;
+}
+
+
+
+static void dumpLatency(FILE *fp, const char *name, struct perfHistogram *hist)
+{
+	CK_SC_HSM_LATENCY lat;
+
+	getLatency(hist, &lat);
+	fprintf(fp, "  %-22s count=%lu avg=%lu p50=%lu p90=%lu p99=%lu max=%lu us\n", name,
+		lat.ulCount, lat.ulAverage, lat.ulMedian, lat.ulP90, lat.ulP99, lat.ulMax);
+}
+
+
+
+static void dumpSlot(FILE *fp, struct p11Slot_t *slot)
+{
+	struct p11PerfStats_t *stats = slot->perfStats;
+	struct perfMechanism *mech;
+	char name[32];
+	int i;
+
+	mutex_lock(&stats->mutex);
+
+	fprintf(fp, "Slot %lu %.64s\n", slot->id, (char *)slot->info.slotDescription);
+	fprintf(fp, "  APDUs=%llu sent=%llu received=%llu transmit errors=%llu\n",
+		stats->apdus, stats->bytesSent, stats->bytesReceived, stats->transmitErrors);
+	fprintf(fp, "  SW1/SW2 success=%llu warning=%llu execution error=%llu checking error=%llu other=%llu\n",
+		stats->sw[PERF_SW_SUCCESS], stats->sw[PERF_SW_WARNING], stats->sw[PERF_SW_EXECUTION],
+		stats->sw[PERF_SW_CHECKING], stats->sw[PERF_SW_OTHER]);
+
+	for (i = 0; i < PERF_HISTOGRAMS; i++)
+		dumpLatency(fp, histNames[i], &stats->hist[i]);
+
+	for (mech = stats->mechanisms; mech != NULL; mech = mech->next) {
+		sprintf(name, "mechanism %08lX", mech->type);
+		dumpLatency(fp, name, &mech->latency);
+		if (mech->errors)
+			fprintf(fp, "  %-22s errors=%llu\n", "", mech->errors);
+	}
+
+	mutex_unlock(&stats->mutex);
+}
+
+
+
+/**
+ * Append a report for all slots to the statistics file
+ */
+static void dumpStatistics()
+{
+	struct p11Slot_t *slot;
+	struct tm *tm;
+	time_t now;
+	FILE *fp;
+
+	fp = fopen(dumpFile, "a+");
+	if (fp == NULL)
+		return;
+
+	now = time(NULL);
+	tm = localtime(&now);
+	fprintf(fp, "Statistics at %04d-%02d-%02d %02d:%02d:%02d\n",
+		tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday, tm->tm_hour, tm->tm_min, tm->tm_sec);
+
+	// Slots are only released at C_Finalize, after the dump thread has been stopped
+	for (slot = context->slotPool.list; slot != NULL; slot = slot->next) {
+		if (!slot->primarySlot && slot->perfStats)
+			dumpSlot(fp, slot);
+	}
+
+	fprintf(fp, "\n");
+	fclose(fp);
+}
+
+
+
+static void dumpStatisticsPeriodically(void *arg)
+{
+	while (1) {
+		event_wait_timeout(&dumpEvent, dumpInterval * 1000);
+
+		if (terminating)
+			return;
+
+		dumpStatistics();
+	}
+}
+
+
+
+/**
+ * Read the configuration from the environment and start the dump thread, if configured
+ *
+ * @return          CKR_OK or CKR_GENERAL_ERROR
+ */
+int initPerfStats()
+{
+	char *val;
+
+	val = getenv("PKCS11_STATS");
+	enabled = !val || (strcmp(val, "0") && strcmp(val, "off"));
+
+	if (!enabled)
+		return CKR_OK;
+
+	if (mutex_init(&statsMutex) != 0)
+		return CKR_GENERAL_ERROR;
+
+	initialized = TRUE;
+
+	dumpThreadStarted = FALSE;
+	terminating = FALSE;
+	dumpFile = getenv("PKCS11_STATS_FILE");
+
+	if (dumpFile == NULL)
+		return CKR_OK;
+
+	dumpInterval = PERF_DEFAULT_INTERVAL;
+	val = getenv("PKCS11_STATS_INTERVAL");
+	if (val && (atoi(val) > 0))
+		dumpInterval = atoi(val);
+
+	if (event_init(&dumpEvent) != 0)
+		return CKR_OK;
+
+	if (thread_create(&dumpThread, dumpStatisticsPeriodically, NULL) != 0) {
+		debug("Could not start statistics thread\n");
+		event_destroy(&dumpEvent);
+		return CKR_OK;
+	}
+
+	dumpThreadStarted = TRUE;
+	return CKR_OK;
+}
+
+
+
+/**
+ * Stop the dump thread and write the final report
+ */
+void terminatePerfStats()
+{
+	if (!initialized)
+		return;
+
+	if (dumpThreadStarted) {
+		terminating = TRUE;
+		event_set(&dumpEvent);
+		thread_join(&dumpThread);
+		event_destroy(&dumpEvent);
+		dumpThreadStarted = FALSE;
+	}
+
+	if (dumpFile != NULL)
+		dumpStatistics();
+
+	enabled = FALSE;
+	initialized = FALSE;
+	mutex_destroy(&statsMutex);
+}
+
+
+
+/**
+ * Release the counters when the slot is deallocated
+ */
+void freePerfStats(struct p11Slot_t *slot)
+{
+	struct perfMechanism *mech;
+
+	if (slot->primarySlot || (slot->perfStats == NULL))
+		return;
+
+	while (slot->perfStats->mechanisms) {
+		mech = slot->perfStats->mechanisms;
+		slot->perfStats->mechanisms = mech->next;
+		free(mech);
+	}
+
+	mutex_destroy(&slot->perfStats->mutex);
+	free(slot->perfStats);
+	slot->perfStats = NULL;
+}
@@ -0,0 +1,59 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    perfstats.h
+ * @author  Andreas Schwier
+ * @brief   Per-slot and per-mechanism performance counters
+ */
+
+#ifndef ___PERFSTATS_H_INC___
+#define ___PERFSTATS_H_INC___
+
+#include <pkcs11/cryptoki.h>
+#include <pkcs11/p11generic.h>
+
+#define PERF_HIST_CARD			0	/**< Round trip time of APDUs                       */
+#define PERF_HIST_LOCK			1	/**< Wait for lockSlot()                            */
+#define PERF_HIST_QUEUE			2	/**< Wait in scheduleSlot()                         */
+#define PERF_HIST_VALIDATE		3	/**< Duration of getValidatedToken()                */
+#define PERF_HISTOGRAMS			4
+
+#define PERF_MAX_MECHANISMS		64	/**< Mechanisms tracked per slot                    */
+#define PERF_DEFAULT_INTERVAL	60	/**< Seconds between dumps to PKCS11_STATS_FILE     */
+
+int initPerfStats();
+void terminatePerfStats();
+unsigned long long perfTimestamp();
+void perfCountAPDU(struct p11Slot_t *slot, unsigned long long start, int sent, int received, unsigned short SW1SW2);
+void perfCountLatency(struct p11Slot_t *slot, int hist, unsigned long long start);
+void perfCountMechanism(struct p11Slot_t *slot, CK_MECHANISM_TYPE type, CK_RV rv, unsigned long long start);
+int getSlotStatistics(struct p11Slot_t *slot, CK_SC_HSM_SLOT_STATISTICS_PTR pInfo);
+int getMechanismStatistics(struct p11Slot_t *slot, CK_MECHANISM_TYPE type, CK_SC_HSM_MECHANISM_STATISTICS_PTR pInfo);
+void freePerfStats(struct p11Slot_t *slot);
+
+#endif /* ___PERFSTATS_H_INC___ */
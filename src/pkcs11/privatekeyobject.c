@@ -120,13 +120,13 @@ int createPrivateKeyObjectFromP15(struct p15PrivateKeyDescription *p15, struct p
 			{ 0, NULL, 0 }
 	};
 	struct p11Object_t *p11o;
-	unsigned char *spki = NULL;
+	struct p11CertificateIndex *index = NULL;
 	int rc, attributes;
 
 	FUNC_CALLED();
 
 	if (cert) {
-		rc = getSubjectPublicKeyInfo(cert, &spki);
+		rc = getCertificateIndex(cert, &index);
 
 		if (rc != CKR_OK){
 			FUNC_FAILS(rc, "Could not create public key in certificate");
@@ -159,15 +159,15 @@ int createPrivateKeyObjectFromP15(struct p15PrivateKeyDescription *p15, struct p
 	switch(p15->keytype) {
 	case P15_KEYTYPE_RSA:
 		keyType = CKK_RSA;
-		if (spki) {
-			decodeModulusExponentFromSPKI(spki, &template[attributes], &template[attributes + 1]);
+		if (index) {
+			decodeModulusExponentFromSPKI(index, &template[attributes], &template[attributes + 1]);
 			attributes += 2;
 		}
 		break;
 	case P15_KEYTYPE_ECC:
 		keyType = CKK_ECDSA;
-		if (spki) {
-			decodeECParamsFromSPKI(spki, &template[attributes]);
+		if (index) {
+			decodeECParamsFromSPKI(index, &template[attributes]);
 			attributes += 1;
 		}
 		break;
@@ -275,9 +275,7 @@ int createPrivateKeyObjectFromP15AndPublicKey(struct p15PrivateKeyDescription *p
 		keyType = CKK_ECDSA;
 
 		if (findAttribute(puk, CKA_EC_PARAMS, &pattr) < 0) {
-#ifdef DEBUG
 			debug("Can't find CKA_EC_PARAMS in public key object\n");
-#endif
 
 		} else {
 			template[attributes++] = pattr->attrData;
@@ -127,7 +127,8 @@ int createPublicKeyObjectFromCertificate(struct p15PrivateKeyDescription *p15, s
 			{ 0, NULL, 0 }
 	};
 	struct p11Object_t *p11o;
-	unsigned char *spki,*po;
+	struct p11CertificateIndex *index;
+	unsigned char *po;
 	unsigned char eccpoint[136];		// Tag + 2Len + '04' + 2 * 66
 	int len, rc, attributes;
 
@@ -143,7 +144,7 @@ int createPublicKeyObjectFromCertificate(struct p15PrivateKeyDescription *p15, s
 		template[5].ulValueLen = (CK_ULONG)p15->id.len;
 	}
 
-	rc = getSubjectPublicKeyInfo(cert, &spki);
+	rc = getCertificateIndex(cert, &index);
 
 	if (rc != CKR_OK){
 		FUNC_FAILS(rc, "Could not create public key in certificate");
@@ -160,7 +161,7 @@ int createPublicKeyObjectFromCertificate(struct p15PrivateKeyDescription *p15, s
 	switch(p15->keytype) {
 	case P15_KEYTYPE_RSA:
 		keyType = CKK_RSA;
-		if (decodeModulusExponentFromSPKI(spki, &template[attributes], &template[attributes + 1])) {
+		if (decodeModulusExponentFromSPKI(index, &template[attributes], &template[attributes + 1])) {
 			free(p11o);
 			FUNC_FAILS(CKR_KEY_TYPE_INCONSISTENT, "Can't decode modulus - Private key type does not match public key type in certificate");
 		}
@@ -175,12 +176,12 @@ int createPublicKeyObjectFromCertificate(struct p15PrivateKeyDescription *p15, s
 		break;
 	case P15_KEYTYPE_ECC:
 		keyType = CKK_ECDSA;
-		if (decodeECParamsFromSPKI(spki, &template[attributes])) {
+		if (decodeECParamsFromSPKI(index, &template[attributes])) {
 			free(p11o);
 			FUNC_FAILS(CKR_KEY_TYPE_INCONSISTENT, "Can't decode EC parameter - Private key type does not match public key type in certificate");
 		}
 		attributes++;
-		if (decodeECPointFromSPKI(spki, &template[attributes], eccpoint, sizeof(eccpoint))) {
+		if (decodeECPointFromSPKI(index, &template[attributes], eccpoint, sizeof(eccpoint))) {
 			free(p11o);
 			FUNC_FAILS(CKR_KEY_TYPE_INCONSISTENT, "Private key type does not match public key type in certificate");
 		}
@@ -294,9 +295,7 @@ int createPublicKeyObjectFromCVC(struct p15PrivateKeyDescription *p15, unsigned
 	case P15_KEYTYPE_ECC:
 		keyType = CKK_ECDSA;
 		if (cvcDetermineCurveOID(&cvc, &oid)) {
-#ifdef DEBUG
 			debug("Can't determine EC curve oid from domain parameter\n");
-#endif
 		} else {
 			asn1Append(&ecparam, ASN1_OBJECT_IDENTIFIER, oid);
 			template[attributes].type = CKA_EC_PARAMS;
@@ -0,0 +1,431 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    randompool.c
+ * @author  Andreas Schwier
+ * @brief   Pool of random data prefetched from the token
+ *
+ * Requesting a few bytes of random data from the token costs a full APDU round trip. With
+ * PKCS11_RANDOM_POOL_SIZE set to a non-zero value, each token keeps a buffer of random data
+ * of that size. A background thread refills the buffer from the token with GET CHALLENGE
+ * whenever the level drops below PKCS11_RANDOM_POOL_LOW_WATER (default half the pool size).
+ *
+ * Requests are served from the buffer if enough random data is available, otherwise they
+ * are passed to the token as before. Served data is removed from the buffer and wiped, so
+ * each byte is returned once. The buffer is wiped when the token is removed.
+ *
+ * Refills are scheduled as bulk operations, so they do not delay interactive operations.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <common/mutex.h>
+#include <common/memset_s.h>
+
+#include <pkcs11/p11generic.h>
+#include <pkcs11/randompool.h>
+#include <pkcs11/scheduler.h>
+#include <pkcs11/slot.h>
+
+#include <common/debug.h>
+
+
+
+struct p11RandomPool_t {
+	unsigned char *buffer;              /**< Random data                                 */
+	size_t level;                       /**< Number of bytes available in buffer         */
+	int refillPending;                  /**< The pool is queued for refill               */
+	int closed;                         /**< The token has been removed                  */
+	int refs;                           /**< References from token and refill queue      */
+	struct p11Slot_t *slot;             /**< The slot used to refill the pool            */
+	struct p11Token_t *token;           /**< The token owning the pool                   */
+	struct p11RandomPool_t *next;       /**< Next pool in refill queue                   */
+};
+
+
+
+static int initialized = 0;
+static size_t poolSize = 0;
+static size_t lowWater = 0;
+
+static MUTEX poolMutex;
+static EVENT refillEvent;
+static THREAD refillThread;
+static int refillThreadStarted;
+static int terminating;
+static struct p11RandomPool_t *refillQueue;
+
+
+
+/**
+ * Release a reference to the pool, wiping and freeing memory with the last reference
+ *
+ * Must be called with the poolMutex locked, if initialized
+ */
+static void releasePool(struct p11RandomPool_t *pool)
+{
+	if (--pool->refs > 0)
+		return;
+
+	memset_s(pool->buffer, poolSize, 0, poolSize);
+	free(pool->buffer);
+	free(pool);
+}
+
+
+
+/**
+ * Fill the pool from the token in the slot
+ *
+ * The token is only accessed if it is still the token that owns the pool.
+ */
+static void fillPool(struct p11RandomPool_t *pool, unsigned char *scr, size_t need)
+{
+	struct p11Token_t *token;
+	size_t len;
+	int rc;
+
+	rc = scheduleSlot(pool->slot, NULL, SCHED_BULK);
+
+	if (rc != CKR_OK)
+		return;
+
+	rc = getToken(pool->slot, &token);
+
+	if ((rc == CKR_OK) && (token == pool->token) && (token->drv->C_GenerateRandom != NULL)) {
+		rc = token->drv->C_GenerateRandom(pool->slot, scr, need);
+	} else {
+		rc = CKR_TOKEN_NOT_PRESENT;
+	}
+
+	releaseSlot(pool->slot);
+
+	if (rc == CKR_OK) {
+		mutex_lock(&poolMutex);
+		if (!pool->closed) {
+			len = poolSize - pool->level;
+			if (len > need)
+				len = need;
+			memcpy(pool->buffer + pool->level, scr, len);
+			pool->level += len;
+		}
+		mutex_unlock(&poolMutex);
+	}
+	else {
+		debug("Refilling random pool failed with rc=%lx\n", (unsigned long)rc);
+	}
+
+	memset_s(scr, need, 0, need);
+}
+
+
+
+/**
+ * Background thread refilling queued pools
+ */
+static void refillPools(void *arg)
+{
+	struct p11RandomPool_t *pool;
+	unsigned char *scr;
+	size_t need;
+	int closed;
+
+	scr = (unsigned char *)malloc(poolSize);
+
+	while (1) {
+		event_wait(&refillEvent);
+
+		while (1) {
+			mutex_lock(&poolMutex);
+
+			if (terminating || !scr) {
+				mutex_unlock(&poolMutex);
+				free(scr);
+				return;
+			}
+
+			pool = refillQueue;
+			if (pool == NULL) {
+				mutex_unlock(&poolMutex);
+				break;
+			}
+
+			refillQueue = pool->next;
+			need = poolSize - pool->level;
+			closed = pool->closed;
+			mutex_unlock(&poolMutex);
+
+			if (!closed && (need > 0))
+				fillPool(pool, scr, need);
+
+			mutex_lock(&poolMutex);
+			pool->refillPending = FALSE;
+			releasePool(pool);
+			mutex_unlock(&poolMutex);
+		}
+	}
+}
+
+
+
+/**
+ * Queue pool for refill, starting the background thread on first use
+ *
+ * Must be called with the poolMutex locked
+ */
+static void queueRefill(struct p11RandomPool_t *pool)
+{
+	struct p11RandomPool_t **ppool;
+
+	if (!refillThreadStarted) {
+		if (thread_create(&refillThread, refillPools, NULL) != 0) {
+			debug("Could not start random pool refill thread\n");
+			return;
+		}
+		refillThreadStarted = TRUE;
+	}
+
+	pool->refillPending = TRUE;
+	pool->refs++;
+	pool->next = NULL;
+
+	ppool = &refillQueue;
+	while (*ppool)
+		ppool = &(*ppool)->next;
+	*ppool = pool;
+
+	event_set(&refillEvent);
+}
+
+
+
+/**
+ * Read the pool configuration from the environment
+ *
+ * @return          CKR_OK or CKR_GENERAL_ERROR
+ */
+int initRandomPool()
+{
+	char *val;
+
+	poolSize = 0;
+	val = getenv("PKCS11_RANDOM_POOL_SIZE");
+	if (val != NULL)
+		poolSize = (size_t)strtoul(val, NULL, 10);
+
+	if (poolSize > RANDOM_POOL_MAX_SIZE)
+		poolSize = RANDOM_POOL_MAX_SIZE;
+
+	lowWater = poolSize / 2;
+	val = getenv("PKCS11_RANDOM_POOL_LOW_WATER");
+	if (val != NULL)
+		lowWater = (size_t)strtoul(val, NULL, 10);
+
+	if (lowWater > poolSize)
+		lowWater = poolSize;
+
+	if (poolSize == 0)
+		return CKR_OK;
+
+	if (mutex_init(&poolMutex) != 0)
+		return CKR_GENERAL_ERROR;
+
+	if (event_init(&refillEvent) != 0) {
+		mutex_destroy(&poolMutex);
+		return CKR_GENERAL_ERROR;
+	}
+
+	refillThreadStarted = FALSE;
+	terminating = FALSE;
+	refillQueue = NULL;
+	initialized = TRUE;
+
+	debug("Random pool size %lu, low water mark %lu\n", (unsigned long)poolSize, (unsigned long)lowWater);
+	return CKR_OK;
+}
+
+
+
+/**
+ * Stop the background thread
+ *
+ * Pools still owned by tokens are released when the token is freed.
+ *
+ * Must be called without the context mutex held, as the refill thread takes it when
+ * it creates the scheduler of the slot.
+ */
+void terminateRandomPool()
+{
+	struct p11RandomPool_t *pool;
+
+	if (!initialized)
+		return;
+
+	if (refillThreadStarted) {
+		mutex_lock(&poolMutex);
+		terminating = TRUE;
+		mutex_unlock(&poolMutex);
+
+		event_set(&refillEvent);
+		thread_join(&refillThread);
+		refillThreadStarted = FALSE;
+	}
+
+	while (refillQueue) {
+		pool = refillQueue;
+		refillQueue = pool->next;
+		pool->refillPending = FALSE;
+		releasePool(pool);
+	}
+
+	initialized = FALSE;
+	event_destroy(&refillEvent);
+	mutex_destroy(&poolMutex);
+}
+
+
+
+/**
+ * Serve a request for random data from the token's pool
+ *
+ * @param token     The token
+ * @param rnd       The buffer receiving random data
+ * @param rndlen    The number of random bytes requested
+ *
+ * @return          CKR_OK if the request was served or CKR_FUNCTION_FAILED if the token must be used
+ */
+int getRandomFromPool(struct p11Token_t *token, CK_BYTE_PTR rnd, CK_ULONG rndlen)
+{
+	struct p11RandomPool_t *pool;
+	int rc;
+
+	if (!initialized || (rndlen > poolSize))
+		return CKR_FUNCTION_FAILED;
+
+	mutex_lock(&poolMutex);
+
+	pool = token->randomPool;
+
+	if (pool == NULL) {
+		pool = (struct p11RandomPool_t *)calloc(1, sizeof(struct p11RandomPool_t));
+		if (pool != NULL) {
+			pool->buffer = (unsigned char *)calloc(1, poolSize);
+			if (pool->buffer == NULL) {
+				free(pool);
+				pool = NULL;
+			}
+		}
+
+		if (pool == NULL) {
+			mutex_unlock(&poolMutex);
+			return CKR_FUNCTION_FAILED;
+		}
+
+		pool->refs = 1;
+		pool->slot = token->slot;
+		pool->token = token;
+		token->randomPool = pool;
+	}
+
+	if (pool->closed) {
+		mutex_unlock(&poolMutex);
+		return CKR_FUNCTION_FAILED;
+	}
+
+	rc = CKR_FUNCTION_FAILED;
+
+	if (pool->level >= rndlen) {
+		pool->level -= rndlen;
+		memcpy(rnd, pool->buffer + pool->level, rndlen);
+		memset_s(pool->buffer + pool->level, rndlen, 0, rndlen);
+		rc = CKR_OK;
+	}
+
+	if ((pool->level < lowWater || pool->level < rndlen) && !pool->refillPending)
+		queueRefill(pool);
+
+	mutex_unlock(&poolMutex);
+	return rc;
+}
+
+
+
+/**
+ * Wipe the pool after the token has been removed
+ *
+ * @param token     The removed token
+ */
+void clearRandomPool(struct p11Token_t *token)
+{
+	struct p11RandomPool_t *pool;
+
+	if (!initialized)
+		return;
+
+	mutex_lock(&poolMutex);
+
+	pool = token->randomPool;
+
+	if (pool != NULL) {
+		pool->closed = TRUE;
+		memset_s(pool->buffer, poolSize, 0, poolSize);
+		pool->level = 0;
+	}
+
+	mutex_unlock(&poolMutex);
+}
+
+
+
+/**
+ * Release the pool of a token that is freed
+ *
+ * @param token     The token
+ */
+void freeRandomPool(struct p11Token_t *token)
+{
+	struct p11RandomPool_t *pool;
+
+	pool = token->randomPool;
+
+	if (pool == NULL)
+		return;
+
+	token->randomPool = NULL;
+
+	if (!initialized) {
+		releasePool(pool);
+		return;
+	}
+
+	mutex_lock(&poolMutex);
+	pool->closed = TRUE;
+	releasePool(pool);
+	mutex_unlock(&poolMutex);
+}
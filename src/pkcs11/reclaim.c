@@ -0,0 +1,495 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    reclaim.c
+ * @author  Andreas Schwier
+ * @brief   Deferred reclamation of sessions, tokens and objects
+ *
+ * Sessions, tokens and objects are looked up without taking a lock. Writers still serialize
+ * changes to the lists, but instead of freeing an unlinked element immediately they pass it
+ * to retirePointer(). The element is released once no thread can still reference it.
+ *
+ * Two mechanisms are combined:
+ *
+ * Lookups traverse lists inside a read section. Each thread announces the global epoch when
+ * entering a read section. The epoch is advanced once all threads inside a read section have
+ * seen the current epoch, so an element retired in epoch e can no longer be reached by any
+ * list traversal when the epoch reaches e + 2.
+ *
+ * The element returned by a lookup is used beyond the read section, typically for the rest
+ * of the PKCS#11 call. The lookup therefore publishes the pointer in a per-thread hazard slot
+ * before leaving the read section. A hazard slot is overwritten by the next lookup of the same
+ * kind in the same thread.
+ *
+ * Code that performs a lookup while still using an element of the same kind, e.g. the cluster
+ * slot dispatching to a member token, encloses the inner lookup in enterHazardScope() and
+ * leaveHazardScope(). Lookups within the scope use a separate set of hazard slots, which is
+ * cleared when the scope is left. Scopes can be nested up to HAZARD_LEVELS.
+ *
+ * Readers only write to their own per-thread record, so the cost of a lookup does not grow
+ * with the number of threads. If the module is not initialized, e.g. when used in the
+ * minidriver, retired elements are released immediately.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <common/mutex.h>
+
+#include <pkcs11/cryptoki.h>
+#include <pkcs11/reclaim.h>
+
+#include <common/debug.h>
+
+
+
+struct reclaimThread_t {
+	volatile unsigned long epoch;           /**< Global epoch seen when entering the read section */
+	volatile int active;                    /**< The thread is inside a read section              */
+	int depth;                              /**< Nesting level of read sections                   */
+	int level;                              /**< Current hazard scope                             */
+	int inUse;                              /**< The record is assigned to a running thread       */
+	void * volatile hazard[HAZARD_LEVELS][HAZARD_KINDS];   /**< Pointers still in use by the thread */
+	struct reclaimThread_t *next;           /**< Next thread record                               */
+	char padding[64];                       /**< Keep records of threads on separate cache lines  */
+};
+
+
+
+struct reclaimEntry_t {
+	void *ptr;                              /**< The retired element                              */
+	reclaimFunc_t func;                     /**< Function releasing the element                   */
+	unsigned long epoch;                    /**< Global epoch when the element was retired        */
+	struct reclaimEntry_t *next;            /**< Next retired element                             */
+};
+
+
+
+static int initialized = 0;
+static MUTEX reclaimMutex;
+static volatile unsigned long globalEpoch;
+static struct reclaimThread_t *threadList;
+static struct reclaimEntry_t *retiredList;
+
+#ifdef _WIN32
+static DWORD threadKey;
+#else
+static pthread_key_t threadKey;
+#endif
+
+
+
+/**
+ * Release the thread record when a thread terminates
+ */
+static void releaseThreadRecord(void *ptr)
+{
+	struct reclaimThread_t *rec = (struct reclaimThread_t *)ptr;
+
+	mutex_lock(&reclaimMutex);
+	memset((void *)rec->hazard, 0, sizeof(rec->hazard));
+	rec->active = 0;
+	rec->depth = 0;
+	rec->level = 0;
+	rec->inUse = 0;
+	mutex_unlock(&reclaimMutex);
+}
+
+
+
+#ifdef _WIN32
+static VOID WINAPI threadTerminated(PVOID ptr)
+{
+	if (ptr != NULL)
+		releaseThreadRecord(ptr);
+}
+#endif
+
+
+
+/**
+ * Return the record for the calling thread, creating or reusing one on first use
+ */
+static struct reclaimThread_t *getThreadRecord()
+{
+	struct reclaimThread_t *rec;
+
+#ifdef _WIN32
+	rec = (struct reclaimThread_t *)FlsGetValue(threadKey);
+#else
+	rec = (struct reclaimThread_t *)pthread_getspecific(threadKey);
+#endif
+
+	if (rec != NULL)
+		return rec;
+
+	mutex_lock(&reclaimMutex);
+
+	for (rec = threadList; rec && rec->inUse; rec = rec->next);
+
+	if (rec == NULL) {
+		rec = (struct reclaimThread_t *)calloc(1, sizeof(struct reclaimThread_t));
+
+		if (rec == NULL) {
+			mutex_unlock(&reclaimMutex);
+			debug("Out of memory allocating thread record\n");
+			return NULL;
+		}
+
+		rec->next = threadList;
+		threadList = rec;
+	}
+
+	rec->inUse = 1;
+	mutex_unlock(&reclaimMutex);
+
+#ifdef _WIN32
+	FlsSetValue(threadKey, rec);
+#else
+	pthread_setspecific(threadKey, rec);
+#endif
+	return rec;
+}
+
+
+
+/**
+ * Initialize deferred reclamation
+ *
+ * @return          CKR_OK or CKR_GENERAL_ERROR
+ */
+int initReclaim()
+{
+	if (mutex_init(&reclaimMutex) != 0)
+		return CKR_GENERAL_ERROR;
+
+#ifdef _WIN32
+	threadKey = FlsAlloc(threadTerminated);
+	if (threadKey == FLS_OUT_OF_INDEXES) {
+#else
+	if (pthread_key_create(&threadKey, releaseThreadRecord) != 0) {
+#endif
+		mutex_destroy(&reclaimMutex);
+		return CKR_GENERAL_ERROR;
+	}
+
+	globalEpoch = 0;
+	threadList = NULL;
+	retiredList = NULL;
+	initialized = 1;
+
+	return CKR_OK;
+}
+
+
+
+/**
+ * Release all retired elements and thread records
+ *
+ * Must only be called when no other thread is using the module, i.e. from C_Finalize
+ */
+void terminateReclaim()
+{
+	struct reclaimThread_t *rec;
+	struct reclaimEntry_t *entry;
+
+	if (!initialized)
+		return;
+
+	// Elements retired while releasing other elements are released immediately
+	initialized = 0;
+
+	while (retiredList) {
+		entry = retiredList;
+		retiredList = entry->next;
+		entry->func(entry->ptr);
+		free(entry);
+	}
+
+#ifdef _WIN32
+	FlsFree(threadKey);
+#else
+	pthread_key_delete(threadKey);
+#endif
+
+	while (threadList) {
+		rec = threadList;
+		threadList = rec->next;
+		free(rec);
+	}
+
+	mutex_destroy(&reclaimMutex);
+}
+
+
+
+/**
+ * Enter a read section before traversing a list of sessions or objects
+ *
+ * Read sections can be nested. Elements reachable within the read section are not released
+ * before the outermost read section is left.
+ */
+void enterReadSection()
+{
+	struct reclaimThread_t *rec;
+
+	if (!initialized)
+		return;
+
+	rec = getThreadRecord();
+
+	if ((rec == NULL) || (rec->depth++ > 0))
+		return;
+
+	rec->epoch = globalEpoch;
+	rec->active = 1;
+
+	// Announce the read section before reading any list element
+	MEMORY_BARRIER();
+}
+
+
+
+/**
+ * Leave a read section
+ */
+void leaveReadSection()
+{
+	struct reclaimThread_t *rec;
+
+	if (!initialized)
+		return;
+
+	rec = getThreadRecord();
+
+	if ((rec == NULL) || (rec->depth == 0) || (--rec->depth > 0))
+		return;
+
+	// Complete all reads and publish hazard pointers before leaving
+	MEMORY_BARRIER();
+
+	rec->active = 0;
+}
+
+
+
+/**
+ * Start a scope for lookups, while elements found before are still in use
+ *
+ * Pointers protected within the scope do not replace pointers protected outside of it.
+ * Exceeding HAZARD_LEVELS is a programming error and rejected without entering the scope.
+ *
+ * @return          CKR_OK or CKR_GENERAL_ERROR if scopes are nested too deeply
+ */
+int enterHazardScope()
+{
+	struct reclaimThread_t *rec;
+
+	if (!initialized)
+		return CKR_OK;
+
+	rec = getThreadRecord();
+
+	if (rec == NULL)
+		return CKR_HOST_MEMORY;
+
+	assert(rec->level < HAZARD_LEVELS - 1);
+
+	if (rec->level >= HAZARD_LEVELS - 1) {
+		debug("Hazard scopes nested too deeply\n");
+		return CKR_GENERAL_ERROR;
+	}
+
+	rec->level++;
+	return CKR_OK;
+}
+
+
+
+/**
+ * Leave a scope entered with enterHazardScope(), releasing all pointers protected in it
+ */
+void leaveHazardScope()
+{
+	struct reclaimThread_t *rec;
+	int i;
+
+	if (!initialized)
+		return;
+
+	rec = getThreadRecord();
+
+	if ((rec == NULL) || (rec->level == 0))
+		return;
+
+	for (i = 0; i < HAZARD_KINDS; i++)
+		rec->hazard[rec->level][i] = NULL;
+
+	rec->level--;
+}
+
+
+
+/**
+ * Keep an element found in a read section alive after leaving the read section
+ *
+ * The element remains protected until the next call with the same hazard slot in the same thread
+ * and hazard scope or until the hazard scope is left.
+ *
+ * @param hazard    One of HAZARD_SESSION, HAZARD_TOKEN or HAZARD_OBJECT
+ * @param ptr       The element or NULL to clear the hazard slot
+ */
+void protectPointer(int hazard, void *ptr)
+{
+	struct reclaimThread_t *rec;
+
+	if (!initialized)
+		return;
+
+	rec = getThreadRecord();
+
+	if (rec != NULL)
+		rec->hazard[rec->level][hazard] = ptr;
+}
+
+
+
+/**
+ * Advance the global epoch if all threads in a read section have seen the current epoch
+ *
+ * Must be called with the reclaimMutex locked
+ */
+static int advanceEpoch()
+{
+	struct reclaimThread_t *rec;
+
+	MEMORY_BARRIER();
+
+	for (rec = threadList; rec; rec = rec->next) {
+		if (rec->inUse && rec->active && (rec->epoch != globalEpoch))
+			return 0;
+	}
+
+	globalEpoch++;
+	return 1;
+}
+
+
+
+/**
+ * Check if an element is protected by any thread
+ *
+ * Must be called with the reclaimMutex locked
+ */
+static int isProtected(void *ptr)
+{
+	struct reclaimThread_t *rec;
+	int i, j;
+
+	for (rec = threadList; rec; rec = rec->next) {
+		if (!rec->inUse)
+			continue;
+
+		for (i = 0; i < HAZARD_LEVELS; i++) {
+			for (j = 0; j < HAZARD_KINDS; j++) {
+				if (rec->hazard[i][j] == ptr)
+					return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+
+
+/**
+ * Release an element once no thread can reference it anymore
+ *
+ * The element must already be unlinked from all lists. The release function is called
+ * without any lock held and may retire further elements.
+ *
+ * @param ptr       The element to release
+ * @param func      The function releasing the element
+ */
+void retirePointer(void *ptr, reclaimFunc_t func)
+{
+	struct reclaimEntry_t *entry, **pentry, *reclaimable;
+
+	if (ptr == NULL)
+		return;
+
+	if (!initialized) {
+		func(ptr);
+		return;
+	}
+
+	entry = (struct reclaimEntry_t *)calloc(1, sizeof(struct reclaimEntry_t));
+
+	if (entry == NULL) {
+		// Leaking the element is safer than releasing it while still in use
+		debug("Out of memory retiring element\n");
+		return;
+	}
+
+	entry->ptr = ptr;
+	entry->func = func;
+
+	mutex_lock(&reclaimMutex);
+
+	entry->epoch = globalEpoch;
+	entry->next = retiredList;
+	retiredList = entry;
+
+	// Without concurrent readers two steps make the element eligible right away
+	if (advanceEpoch())
+		advanceEpoch();
+
+	reclaimable = NULL;
+	pentry = &retiredList;
+
+	while (*pentry) {
+		entry = *pentry;
+		if ((globalEpoch - entry->epoch >= 2) && !isProtected(entry->ptr)) {
+			*pentry = entry->next;
+			entry->next = reclaimable;
+			reclaimable = entry;
+		} else {
+			pentry = &entry->next;
+		}
+	}
+
+	mutex_unlock(&reclaimMutex);
+
+	while (reclaimable) {
+		entry = reclaimable;
+		reclaimable = entry->next;
+		entry->func(entry->ptr);
+		free(entry);
+	}
+}
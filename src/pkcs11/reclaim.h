@@ -0,0 +1,56 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    reclaim.h
+ * @author  Andreas Schwier
+ * @brief   Deferred reclamation of sessions, tokens and objects
+ */
+
+#ifndef ___RECLAIM_H_INC___
+#define ___RECLAIM_H_INC___
+
+#include <common/mutex.h>
+
+#define HAZARD_SESSION		0	/**< Session returned by findSessionByHandle()           */
+#define HAZARD_TOKEN		1	/**< Token returned by getToken()                        */
+#define HAZARD_OBJECT		2	/**< Object returned by findObject() or findSessionObject() */
+#define HAZARD_KINDS		3
+#define HAZARD_LEVELS		4	/**< Maximum nesting of hazard scopes                     */
+
+typedef void (*reclaimFunc_t)(void *ptr);
+
+int initReclaim();
+void terminateReclaim();
+void enterReadSection();
+void leaveReadSection();
+int enterHazardScope();
+void leaveHazardScope();
+void protectPointer(int hazard, void *ptr);
+void retirePointer(void *ptr, reclaimFunc_t func);
+
+#endif /* ___RECLAIM_H_INC___ */
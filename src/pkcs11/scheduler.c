@@ -0,0 +1,420 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    scheduler.c
+ * @author  Andreas Schwier
+ * @brief   Per-slot scheduling of token operations
+ *
+ * Only one operation is performed on a token at a time. Waiting operations are queued
+ * in two priority classes: interactive operations (sign, decrypt, random) are served
+ * before bulk operations (key generation, object import). To prevent starvation, a bulk
+ * operation is served after SCHED_MAX_INTERACTIVE_BURST interactive operations.
+ *
+ * Within a class, operations are ordered by a start-time fair queuing tag maintained per
+ * session, so that a session submitting a burst of operations does not block other sessions.
+ *
+ * The number of waiting operations is limited by PKCS11_SLOT_QUEUE_DEPTH (default 32). Bulk
+ * operations are rejected at half the limit, leaving room for interactive operations. A rejected
+ * operation fails with the vendor defined CKR_SC_HSM_QUEUE_FULL.
+ *
+ * If PKCS11_SLOT_LOCKING is set, the card is locked against access from other processes
+ * using lockSlot() while an operation is active. This costs an additional round trip to the
+ * PC/SC resource manager per operation and is therefore not done by default.
+ *
+ * The scheduler also provides the mutex that serializes changes to the lock state of the slot.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <common/mutex.h>
+
+#include <pkcs11/p11generic.h>
+#include <pkcs11/perfstats.h>
+#include <pkcs11/scheduler.h>
+#include <pkcs11/slot.h>
+
+#include <common/debug.h>
+
+#ifndef MINIDRIVER
+extern struct p11Context_t *context;
+#endif
+
+
+
+struct p11SchedulerWaiter_t {
+	int priority;                       /**< SCHED_INTERACTIVE or SCHED_BULK             */
+	unsigned long tag;                  /**< Fair queuing tag                            */
+	unsigned long long enqueued;        /**< Time when the operation was queued          */
+	EVENT event;                        /**< Signaled when operation may proceed         */
+	struct p11SchedulerWaiter_t *next;
+};
+
+
+
+struct p11Scheduler_t {
+	MUTEX mutex;                        /**< Protects the scheduler state                */
+	MUTEX lockMutex;                    /**< Protects lockCount and lockHeldByLogin      */
+	int busy;                           /**< An operation is active on the slot          */
+	unsigned long virtualTime;          /**< Tag of the last started operation           */
+	int interactiveBurst;               /**< Interactive operations while bulk is queued */
+	int maxQueueDepth;
+	struct p11SchedulerWaiter_t *queue; /**< Waiting operations in order of arrival      */
+
+	CK_ULONG queueDepth;
+	CK_ULONG peakQueueDepth;
+	CK_ULONG rejected;
+	CK_ULONG completed[2];
+	unsigned long long waitTotal[2];
+	unsigned long long waitMax[2];
+};
+
+
+
+/**
+ * Return the scheduler for the slot, creating it on first use
+ */
+static struct p11Scheduler_t *getScheduler(struct p11Slot_t *slot)
+{
+	struct p11Scheduler_t *sched;
+	char *depth;
+
+	// Pairs with the barrier before publishing, so a scheduler seen is fully initialized
+	sched = slot->scheduler;
+	MEMORY_BARRIER();
+
+	if (sched)
+		return sched;
+
+#ifndef MINIDRIVER
+	p11LockMutex(context->mutex);
+#endif
+
+	if (slot->scheduler == NULL) {
+		sched = (struct p11Scheduler_t *)calloc(1, sizeof(struct p11Scheduler_t));
+
+		if ((sched != NULL) && (mutex_init(&sched->mutex) != 0)) {
+			free(sched);
+			sched = NULL;
+		}
+
+		if ((sched != NULL) && (mutex_init(&sched->lockMutex) != 0)) {
+			mutex_destroy(&sched->mutex);
+			free(sched);
+			sched = NULL;
+		}
+
+		if (sched != NULL) {
+			sched->maxQueueDepth = SCHED_DEFAULT_QUEUE_DEPTH;
+			depth = getenv("PKCS11_SLOT_QUEUE_DEPTH");
+			if (depth && (atoi(depth) > 1)) {
+				sched->maxQueueDepth = atoi(depth);
+			}
+			MEMORY_BARRIER();
+			slot->scheduler = sched;
+		}
+	}
+
+#ifndef MINIDRIVER
+	p11UnlockMutex(context->mutex);
+#endif
+
+	return slot->scheduler;
+}
+
+
+
+/**
+ * Account for an operation that starts after waiting
+ */
+static void startOperation(struct p11Scheduler_t *sched, int priority, unsigned long tag, unsigned long long waited)
+{
+	sched->busy = 1;
+	sched->virtualTime = tag;
+	sched->completed[priority]++;
+	sched->waitTotal[priority] += waited;
+	if (waited > sched->waitMax[priority])
+		sched->waitMax[priority] = waited;
+}
+
+
+
+/**
+ * Remove the next operation from the queue
+ *
+ * The interactive operation with the lowest tag is selected, unless bulk operations
+ * were passed over too often.
+ */
+static struct p11SchedulerWaiter_t *dequeueNext(struct p11Scheduler_t *sched)
+{
+	struct p11SchedulerWaiter_t **pp, **best[2], *w;
+	int priority;
+
+	best[SCHED_INTERACTIVE] = NULL;
+	best[SCHED_BULK] = NULL;
+
+	for (pp = &sched->queue; *pp != NULL; pp = &(*pp)->next) {
+		priority = (*pp)->priority;
+		if ((best[priority] == NULL) || ((*pp)->tag < (*best[priority])->tag))
+			best[priority] = pp;
+	}
+
+	if (best[SCHED_BULK] && (!best[SCHED_INTERACTIVE] || (sched->interactiveBurst >= SCHED_MAX_INTERACTIVE_BURST))) {
+		pp = best[SCHED_BULK];
+		sched->interactiveBurst = 0;
+	} else if (best[SCHED_INTERACTIVE]) {
+		pp = best[SCHED_INTERACTIVE];
+		if (best[SCHED_BULK])
+			sched->interactiveBurst++;
+	} else {
+		return NULL;
+	}
+
+	w = *pp;
+	*pp = w->next;
+	sched->queueDepth--;
+	return w;
+}
+
+
+
+/**
+ * Wait until the slot is available for the calling operation
+ *
+ * Every successful call must be matched by a call to releaseSlot().
+ *
+ * @param slot      The slot on which the operation is performed
+ * @param session   The session issuing the operation or NULL
+ * @param priority  One of SCHED_INTERACTIVE or SCHED_BULK
+ * @return          CKR_OK, CKR_SC_HSM_QUEUE_FULL if the queue limit is reached or CKR_HOST_MEMORY
+ */
+int scheduleSlot(struct p11Slot_t *slot, struct p11Session_t *session, int priority)
+{
+	struct p11Scheduler_t *sched;
+	struct p11SchedulerWaiter_t w, **pp;
+	unsigned long long start;
+	unsigned long tag;
+	CK_ULONG limit;
+
+	if (slot->primarySlot)
+		slot = slot->primarySlot;
+
+	// Cluster operations are scheduled on the member slot
+	if (slot->isCluster)
+		return CKR_OK;
+
+	sched = getScheduler(slot);
+	if (sched == NULL)
+		return CKR_HOST_MEMORY;
+
+	start = perfTimestamp();
+
+	mutex_lock(&sched->mutex);
+
+	tag = sched->virtualTime;
+	if (session != NULL) {
+		if (session->schedulerTag > tag)
+			tag = session->schedulerTag;
+		session->schedulerTag = tag + 1;
+	}
+	tag++;
+
+	if (!sched->busy && (sched->queue == NULL)) {
+		startOperation(sched, priority, tag, 0);
+		mutex_unlock(&sched->mutex);
+		perfCountLatency(slot, PERF_HIST_QUEUE, start);
+		if (isOperationLockingEnabled())
+			lockSlot(slot);
+		return CKR_OK;
+	}
+
+	limit = priority == SCHED_BULK ? sched->maxQueueDepth / 2 : sched->maxQueueDepth;
+	if (sched->queueDepth >= limit) {
+		sched->rejected++;
+		mutex_unlock(&sched->mutex);
+		debug("Operation with priority %d rejected for slot %lu, %lu operations queued\n", priority, slot->id, sched->queueDepth);
+		return CKR_SC_HSM_QUEUE_FULL;
+	}
+
+	if (event_init(&w.event) != 0) {
+		mutex_unlock(&sched->mutex);
+		return CKR_HOST_MEMORY;
+	}
+
+	w.priority = priority;
+	w.tag = tag;
+	w.enqueued = getMicroseconds();
+	w.next = NULL;
+
+	for (pp = &sched->queue; *pp != NULL; pp = &(*pp)->next);
+	*pp = &w;
+
+	sched->queueDepth++;
+	if (sched->queueDepth > sched->peakQueueDepth)
+		sched->peakQueueDepth = sched->queueDepth;
+
+	mutex_unlock(&sched->mutex);
+
+	TRACE_BEGIN_SLOT("scheduleSlot", slot->id);
+	event_wait(&w.event);
+	event_destroy(&w.event);
+	TRACE_END("scheduleSlot");
+
+	perfCountLatency(slot, PERF_HIST_QUEUE, start);
+
+	// A failed lock is not fatal, the operation will report the token error
+	if (isOperationLockingEnabled())
+		lockSlot(slot);
+
+	debug("Operation with priority %d waited %llu us for slot %lu\n", priority, getMicroseconds() - w.enqueued, slot->id);
+	return CKR_OK;
+}
+
+
+
+/**
+ * Complete the current operation and pass the slot to the next waiting operation
+ *
+ * @param slot      The slot on which the operation was performed
+ */
+void releaseSlot(struct p11Slot_t *slot)
+{
+	struct p11Scheduler_t *sched;
+	struct p11SchedulerWaiter_t *w;
+
+	if (slot->primarySlot)
+		slot = slot->primarySlot;
+
+	sched = slot->scheduler;
+	if (slot->isCluster || (sched == NULL))
+		return;
+
+	if (isOperationLockingEnabled())
+		unlockSlot(slot);
+
+	mutex_lock(&sched->mutex);
+
+	w = dequeueNext(sched);
+	if (w != NULL) {
+		startOperation(sched, w->priority, w->tag, getMicroseconds() - w->enqueued);
+		event_set(&w->event);
+	} else {
+		sched->busy = 0;
+	}
+
+	mutex_unlock(&sched->mutex);
+}
+
+
+
+/**
+ * Return queue statistics for the slot
+ *
+ * @param slot      The slot
+ * @param pInfo     The structure receiving the statistics
+ */
+int getSlotQueueInfo(struct p11Slot_t *slot, CK_SC_HSM_SLOT_QUEUE_INFO_PTR pInfo)
+{
+	struct p11Scheduler_t *sched;
+
+	if (slot->primarySlot)
+		slot = slot->primarySlot;
+
+	memset(pInfo, 0, sizeof(*pInfo));
+
+	sched = getScheduler(slot);
+	if (sched == NULL)
+		return CKR_HOST_MEMORY;
+
+	mutex_lock(&sched->mutex);
+
+	pInfo->ulQueueDepth = sched->queueDepth;
+	pInfo->ulPeakQueueDepth = sched->peakQueueDepth;
+	pInfo->ulMaxQueueDepth = sched->maxQueueDepth;
+	pInfo->ulInteractiveOperations = sched->completed[SCHED_INTERACTIVE];
+	pInfo->ulBulkOperations = sched->completed[SCHED_BULK];
+	pInfo->ulRejectedOperations = sched->rejected;
+	if (sched->completed[SCHED_INTERACTIVE])
+		pInfo->ulInteractiveWaitAvg = (CK_ULONG)(sched->waitTotal[SCHED_INTERACTIVE] / sched->completed[SCHED_INTERACTIVE]);
+	pInfo->ulInteractiveWaitMax = (CK_ULONG)sched->waitMax[SCHED_INTERACTIVE];
+	if (sched->completed[SCHED_BULK])
+		pInfo->ulBulkWaitAvg = (CK_ULONG)(sched->waitTotal[SCHED_BULK] / sched->completed[SCHED_BULK]);
+	pInfo->ulBulkWaitMax = (CK_ULONG)sched->waitMax[SCHED_BULK];
+
+	mutex_unlock(&sched->mutex);
+
+	return CKR_OK;
+}
+
+
+
+/**
+ * Acquire the mutex protecting the lock state of the slot
+ *
+ * @param slot      The primary slot
+ * @return          CKR_OK or CKR_HOST_MEMORY
+ */
+int lockSlotState(struct p11Slot_t *slot)
+{
+	struct p11Scheduler_t *sched;
+
+	sched = getScheduler(slot);
+	if (sched == NULL)
+		return CKR_HOST_MEMORY;
+
+	mutex_lock(&sched->lockMutex);
+	return CKR_OK;
+}
+
+
+
+/**
+ * Release the mutex acquired with lockSlotState()
+ *
+ * @param slot      The primary slot
+ */
+void unlockSlotState(struct p11Slot_t *slot)
+{
+	mutex_unlock(&slot->scheduler->lockMutex);
+}
+
+
+
+/**
+ * Release the scheduler when the slot is deallocated
+ */
+void freeScheduler(struct p11Slot_t *slot)
+{
+	if (slot->primarySlot || (slot->scheduler == NULL))
+		return;
+
+	mutex_destroy(&slot->scheduler->mutex);
+	mutex_destroy(&slot->scheduler->lockMutex);
+	free(slot->scheduler);
+	slot->scheduler = NULL;
+}
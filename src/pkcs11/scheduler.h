@@ -0,0 +1,54 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    scheduler.h
+ * @author  Andreas Schwier
+ * @brief   Per-slot scheduling of token operations
+ */
+
+#ifndef ___SCHEDULER_H_INC___
+#define ___SCHEDULER_H_INC___
+
+#include <pkcs11/cryptoki.h>
+#include <pkcs11/p11generic.h>
+#include <pkcs11/session.h>
+
+#define SCHED_INTERACTIVE		0	/**< Latency sensitive operations like sign or decrypt   */
+#define SCHED_BULK				1	/**< Long running operations like key generation         */
+
+#define SCHED_DEFAULT_QUEUE_DEPTH	32
+#define SCHED_MAX_INTERACTIVE_BURST	8
+
+int scheduleSlot(struct p11Slot_t *slot, struct p11Session_t *session, int priority);
+void releaseSlot(struct p11Slot_t *slot);
+int getSlotQueueInfo(struct p11Slot_t *slot, CK_SC_HSM_SLOT_QUEUE_INFO_PTR pInfo);
+int lockSlotState(struct p11Slot_t *slot);
+void unlockSlotState(struct p11Slot_t *slot);
+void freeScheduler(struct p11Slot_t *slot);
+
+#endif /* ___SCHEDULER_H_INC___ */
@@ -37,6 +37,7 @@
 
 #include <pkcs11/session.h>
 #include <pkcs11/slotpool.h>
+#include <pkcs11/reclaim.h>
 
 extern struct p11Context_t *context;
 
@@ -86,15 +87,17 @@ void addSession(struct p11SessionPool_t *pool, struct p11Session_t *session)
 	session->next = NULL;
 
 	p11LockMutex(context->mutex);
+	session->handle = pool->nextSessionHandle++;
+
 	pSession = &pool->list;
 	while(*pSession)
 		pSession = &(*pSession)->next;
 
+	// Concurrent lookups must see a fully initialized session
+	MEMORY_BARRIER();
 	*pSession = session;
-	p11UnlockMutex(context->mutex);
-
-	session->handle = pool->nextSessionHandle++;
 	pool->numberOfSessions++;
+	p11UnlockMutex(context->mutex);
 }
 
 
@@ -102,6 +105,9 @@ void addSession(struct p11SessionPool_t *pool, struct p11Session_t *session)
 /**
  * Find a session in the session pool by it's slot handle
  *
+ * The lookup does not lock the session pool. A session closed concurrently remains valid
+ * until the calling thread looks up another session.
+ *
  * @param pool       Pointer to session pool structure.
  * @param handle     The handle of the session.
  * @param session    Pointer to session structure.
@@ -112,27 +118,26 @@ void addSession(struct p11SessionPool_t *pool, struct p11Session_t *session)
 int findSessionByHandle(struct p11SessionPool_t *pool, CK_SESSION_HANDLE handle, struct p11Session_t **session)
 {
 	struct p11Session_t *psession;
+	int rc;
 
-	p11LockMutex(context->mutex);
+	enterReadSection();
 	psession = pool->list;
 	*session = NULL;
+	rc = CKR_SESSION_HANDLE_INVALID;
 
 	while (psession != NULL) {
 		if (psession->handle == handle) {
 			*session = psession;
-			if (psession->isRemoved) {
-				p11UnlockMutex(context->mutex);
-				return CKR_DEVICE_REMOVED;
-			}
-			p11UnlockMutex(context->mutex);
-			return CKR_OK;
+			protectPointer(HAZARD_SESSION, psession);
+			rc = psession->isRemoved ? CKR_DEVICE_REMOVED : CKR_OK;
+			break;
 		}
 
 		psession = psession->next;
 	}
-	p11UnlockMutex(context->mutex);
+	leaveReadSection();
 
-	return CKR_SESSION_HANDLE_INVALID;
+	return rc;
 }
 
 
@@ -184,13 +189,41 @@ int findSessionBySlotID(struct p11SessionPool_t *pool, CK_SLOT_ID slotID, struct
 
 
 
+/**
+ * Release memory allocated for a session that is no longer referenced
+ *
+ * @param ptr        Pointer to session structure
+ */
+static void freeSession(void *ptr)
+{
+	struct p11Session_t *session = (struct p11Session_t *)ptr;
+
+	clearSearchList(session);
+
+	while(session->sessionObjList) {
+		if (removeSessionObject(session, session->sessionObjList->handle) != CKR_OK)
+			break;
+	}
+
+	if (session->cryptoBuffer) {
+		free(session->cryptoBuffer);
+		session->cryptoBuffer = NULL;
+		session->cryptoBufferMax = 0;
+		session->cryptoBufferSize = 0;
+	}
+
+	free(session);
+}
+
+
+
 /**
  * Remove a session from the session-pool
  *
  * @param pool       Pointer to session-pool structure
  * @param handle     The handle of the session
  *
- * @return CKR_OK, CKR_SESSION_HANDLE_INVALID, CKR_GENERAL_ERROR
+ * @return CKR_OK, CKR_SESSION_HANDLE_INVALID
  */
 int removeSession(struct p11SessionPool_t *pool, CK_SESSION_HANDLE handle)
 {
@@ -213,6 +246,7 @@ int removeSession(struct p11SessionPool_t *pool, CK_SESSION_HANDLE handle)
 	}
 
 	*pSession = session->next;
+	pool->numberOfSessions--;
 	p11UnlockMutex(context->mutex);
 
 	rc = findSlot(&context->slotPool, session->slotID, &slot);
@@ -223,23 +257,7 @@ int removeSession(struct p11SessionPool_t *pool, CK_SESSION_HANDLE handle)
 		}
 	}
 
-	clearSearchList(session);
-
-	while(session->sessionObjList) {
-		if (removeSessionObject(session, session->sessionObjList->handle) != CKR_OK)
-			return CKR_GENERAL_ERROR;
-	}
-
-	if (session->cryptoBuffer) {
-		free(session->cryptoBuffer);
-		session->cryptoBuffer = NULL;
-		session->cryptoBufferMax = 0;
-		session->cryptoBufferSize = 0;
-	}
-
-	free(session);
-
-	pool->numberOfSessions--;
+	retirePointer(session, freeSession);
 
 	return CKR_OK;
 }
@@ -354,12 +372,15 @@ int findSessionObject(struct p11Session_t *session, CK_OBJECT_HANDLE handle, str
 	struct p11Object_t *obj;
 	int pos = 0;            /* remember the current position in the list */
 
+	enterReadSection();
 	obj = session->sessionObjList;
 	*object = NULL;
 
 	while (obj != NULL) {
 		if (obj->handle == handle) {
 			*object = obj;
+			protectPointer(HAZARD_OBJECT, obj);
+			leaveReadSection();
 			return pos;
 		}
 
@@ -367,6 +388,7 @@ int findSessionObject(struct p11Session_t *session, CK_OBJECT_HANDLE handle, str
 		pos++;
 	}
 
+	leaveReadSection();
 	return -1;
 }
 
@@ -498,3 +520,25 @@ void clearCryptoBuffer(struct p11Session_t *session)
 		session->cryptoBufferSize = 0;
 	}
 }
+
+
+
+/**
+ * Initialize the crypto buffer with the mechanism parameter at the start of an operation
+ *
+ * Tokens that implement an update() function keep the state of the operation in the
+ * crypto buffer, e.g. the chaining value starting with the IV of a block cipher mode.
+ *
+ * @param session   the session
+ * @param mech      the mechanism of the operation
+ * @return CKR_OK or CKR_HOST_MEMORY
+ */
+int initCryptoBuffer(struct p11Session_t *session, CK_MECHANISM_PTR mech)
+{
+	clearCryptoBuffer(session);
+
+	if ((mech->pParameter == NULL) || (mech->ulParameterLen == 0))
+		return CKR_OK;
+
+	return appendToCryptoBuffer(session, mech->pParameter, mech->ulParameterLen);
+}
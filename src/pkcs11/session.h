@@ -62,6 +62,7 @@ struct p11Session_t {
 	CK_BYTE_PTR cryptoBuffer;           /**< Buffer storing intermediate results                */
 	CK_ULONG cryptoBufferSize;          /**< Current content of crypto buffer                   */
 	CK_ULONG cryptoBufferMax;           /**< Current size of crypto buffer                      */
+	unsigned long schedulerTag;         /**< Fair queuing tag of the last scheduled operation   */
 
 	struct p11ObjectSearch_t searchObj; /**< Store the result of a search operation             */
 
@@ -92,5 +93,6 @@ int addObjectToSearchList(struct p11Session_t *session, struct p11Object_t *obje
 void clearSearchList(struct p11Session_t *session);
 int appendToCryptoBuffer(struct p11Session_t *session, CK_BYTE_PTR data, CK_ULONG length);
 void clearCryptoBuffer(struct p11Session_t *session);
+int initCryptoBuffer(struct p11Session_t *session, CK_MECHANISM_PTR mech);
 
 #endif /* ___SESSION_H_INC___ */
@@ -0,0 +1,926 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    slot-cluster.c
+ * @author  Andreas Schwier
+ * @brief   Virtual slot aggregating tokens with replicated keys
+ *
+ * The cluster slot is enabled with the environment variable PKCS11_CLUSTER_SLOT=<filter>.
+ * All readers whose name matches the filter expression become member of the cluster.
+ * The token in the cluster slot contains a single copy of each object found on any of
+ * the member tokens. Objects are considered identical, if they share the same class, CKA_ID
+ * and public key (or value in case of certificates and data objects).
+ *
+ * Private key operations are dispatched to the member slot with the lowest number of
+ * pending operations that holds a matching key. If a member fails with a device error or
+ * its operation queue is full, then the operation is retried on the remaining members.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pkcs11/p11generic.h>
+#include <pkcs11/slot-cluster.h>
+#include <pkcs11/slot.h>
+#include <pkcs11/slotpool.h>
+#include <pkcs11/token.h>
+#include <pkcs11/object.h>
+#include <pkcs11/strbpcpy.h>
+#include <pkcs11/scheduler.h>
+#include <pkcs11/reclaim.h>
+
+#include <common/debug.h>
+
+#ifdef CTAPI
+#include "slot-ctapi.h"
+#else
+#include "slot-pcsc.h"
+#endif
+
+extern struct p11Context_t *context;
+
+enum clusterOperation { CLUSTER_SIGN, CLUSTER_DECRYPT, CLUSTER_ENCRYPT };
+
+static struct p11Slot_t *clusterSlot = NULL;
+static char *clusterFilter = NULL;
+static void *clusterMutex = NULL;
+
+static struct p11Slot_t *members[MAX_CLUSTER_MEMBERS];
+static int memberCount = 0;
+
+
+
+/**
+ * Determine the value that identifies the key material of an object
+ *
+ * For key objects this is the modulus or the public point. Private EC keys do not
+ * contain the public point, so the related public key object with the same CKA_ID is used.
+ * Certificates and data objects are identified by CKA_VALUE.
+ *
+ * @param token     The token containing the object
+ * @param object    The object
+ * @return          The attribute or NULL if none found
+ */
+static struct p11Attribute_t *getObjectFingerprint(struct p11Token_t *token, struct p11Object_t *object)
+{
+	struct p11Attribute_t *attr, *id;
+	struct p11Object_t *pubkey;
+
+	if (findAttribute(object, CKA_MODULUS, &attr) >= 0)
+		return attr;
+
+	if (findAttribute(object, CKA_EC_POINT, &attr) >= 0)
+		return attr;
+
+	if (findAttribute(object, CKA_VALUE, &attr) >= 0)
+		return attr;
+
+	if (findAttribute(object, CKA_ID, &id) < 0)
+		return NULL;
+
+	if (findMatchingTokenObjectById(token, CKO_PUBLIC_KEY, id->attrData.pValue, id->attrData.ulValueLen, &pubkey) != CKR_OK)
+		return NULL;
+
+	if (findAttribute(pubkey, CKA_EC_POINT, &attr) >= 0)
+		return attr;
+
+	return NULL;
+}
+
+
+
+static int isSameAttribute(struct p11Attribute_t *a, struct p11Attribute_t *b)
+{
+	if ((a == NULL) || (b == NULL))
+		return (a == b);
+
+	return (a->attrData.ulValueLen == b->attrData.ulValueLen) &&
+		!memcmp(a->attrData.pValue, b->attrData.pValue, a->attrData.ulValueLen);
+}
+
+
+
+/**
+ * Check if two objects on different tokens represent the same object
+ *
+ * @param ta        The token containing the first object
+ * @param a         The first object
+ * @param tb        The token containing the second object
+ * @param b         The second object
+ * @return          1 if matching, 0 otherwise
+ */
+static int isSameObject(struct p11Token_t *ta, struct p11Object_t *a, struct p11Token_t *tb, struct p11Object_t *b)
+{
+	struct p11Attribute_t *attra, *attrb;
+
+	if (findAttribute(a, CKA_CLASS, &attra) < 0)
+		return 0;
+
+	if (findAttribute(b, CKA_CLASS, &attrb) < 0)
+		return 0;
+
+	if (!isSameAttribute(attra, attrb))
+		return 0;
+
+	findAttribute(a, CKA_ID, &attra);
+	findAttribute(b, CKA_ID, &attrb);
+
+	if (!isSameAttribute(attra, attrb))
+		return 0;
+
+	attra = getObjectFingerprint(ta, a);
+	attrb = getObjectFingerprint(tb, b);
+
+	return isSameAttribute(attra, attrb);
+}
+
+
+
+/**
+ * Find an object on a token that is identical to the given object
+ *
+ * @param token     The token to search
+ * @param tobj      The token containing the reference object
+ * @param obj       The reference object
+ * @return          The matching object or NULL
+ */
+static struct p11Object_t *findSameObject(struct p11Token_t *token, struct p11Token_t *tobj, struct p11Object_t *obj)
+{
+	struct p11Object_t *p;
+
+	for (p = token->tokenObjList; p != NULL; p = p->next) {
+		if (isSameObject(token, p, tobj, obj))
+			return p;
+	}
+
+	for (p = token->tokenPrivObjList; p != NULL; p = p->next) {
+		if (isSameObject(token, p, tobj, obj))
+			return p;
+	}
+
+	return NULL;
+}
+
+
+
+/**
+ * Select the least loaded member slot with a token containing a matching object
+ *
+ * The pending operation counter of the selected slot is incremented. The member token and
+ * object are protected in a hazard scope, so that they remain valid if the token is removed
+ * concurrently. The caller must call releaseMember() for the selected slot.
+ *
+ * @param pObject   The object in the cluster token or NULL for operations not related to an object
+ * @param excluded  Bitmap of members that already failed
+ * @param index     The index of the selected member
+ * @param memberToken The token in the selected member slot
+ * @param memberObj The matching object in the member token
+ * @return          The selected slot or NULL if no member is available
+ */
+static struct p11Slot_t *acquireMember(struct p11Object_t *pObject, int excluded, int *index, struct p11Token_t **memberToken, struct p11Object_t **memberObj)
+{
+	struct p11Slot_t *slot, *selected;
+	struct p11Token_t *token, *selectedToken;
+	struct p11Object_t *obj, *selectedObj;
+	int i;
+
+	selected = NULL;
+	selectedToken = NULL;
+	selectedObj = NULL;
+
+	if (enterHazardScope() != CKR_OK)
+		return NULL;
+
+	p11LockMutex(clusterMutex);
+	enterReadSection();
+
+	for (i = 0; i < memberCount; i++) {
+		if (excluded & (1 << i))
+			continue;
+
+		slot = members[i];
+		token = slot->token;
+		if (token == NULL)
+			continue;
+
+		obj = NULL;
+		if (pObject != NULL) {
+			if (!pObject->publicObj && (token->user != CKU_USER))
+				continue;
+
+			obj = findSameObject(token, pObject->token, pObject);
+			if (obj == NULL)
+				continue;
+		}
+
+		if ((selected == NULL) || (slot->pendingOperations < selected->pendingOperations)) {
+			selected = slot;
+			selectedToken = token;
+			selectedObj = obj;
+			*index = i;
+		}
+	}
+
+	if (selected != NULL) {
+		selected->pendingOperations++;
+		protectPointer(HAZARD_TOKEN, selectedToken);
+		protectPointer(HAZARD_OBJECT, selectedObj);
+	}
+
+	leaveReadSection();
+	p11UnlockMutex(clusterMutex);
+
+	if (selected == NULL)
+		leaveHazardScope();
+
+	if (memberToken != NULL)
+		*memberToken = selectedToken;
+
+	if (memberObj != NULL)
+		*memberObj = selectedObj;
+
+	return selected;
+}
+
+
+
+/**
+ * Release a member acquired with acquireMember(), including the protection of token and object
+ */
+static void releaseMember(struct p11Slot_t *slot)
+{
+	p11LockMutex(clusterMutex);
+	slot->pendingOperations--;
+	p11UnlockMutex(clusterMutex);
+
+	leaveHazardScope();
+}
+
+
+
+/**
+ * Decide if a failed operation shall be retried on a different member
+ */
+static int isFailover(int rc)
+{
+	return (rc == CKR_DEVICE_ERROR) || (rc == CKR_DEVICE_REMOVED) ||
+		(rc == CKR_TOKEN_NOT_PRESENT) || (rc == CKR_USER_NOT_LOGGED_IN);
+}
+
+
+
+/**
+ * Mark member as failed and let the slot detect a removed token
+ */
+static void failMember(struct p11Slot_t *slot, int rc)
+{
+	struct p11Token_t *token;
+
+	debug("Cluster member slot %lu failed with rc=%d\n", slot->id, rc);
+
+	if (((rc == CKR_DEVICE_ERROR) || (rc == CKR_DEVICE_REMOVED)) && (enterHazardScope() == CKR_OK)) {
+		getValidatedToken(slot, &token);
+		leaveHazardScope();
+	}
+}
+
+
+
+static int cluster_C_OperationInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech, enum clusterOperation op)
+{
+	struct p11Slot_t *slot;
+	struct p11Object_t *obj;
+	int rv, index, excluded;
+
+	FUNC_CALLED();
+
+	excluded = 0;
+	while ((slot = acquireMember(pObject, excluded, &index, NULL, &obj)) != NULL) {
+		switch(op) {
+		case CLUSTER_SIGN:
+			rv = obj->C_SignInit ? obj->C_SignInit(obj, mech) : CKR_KEY_FUNCTION_NOT_PERMITTED;
+			break;
+		case CLUSTER_DECRYPT:
+			rv = obj->C_DecryptInit ? obj->C_DecryptInit(obj, mech) : CKR_KEY_FUNCTION_NOT_PERMITTED;
+			break;
+		default:
+			rv = obj->C_EncryptInit ? obj->C_EncryptInit(obj, mech) : CKR_KEY_FUNCTION_NOT_PERMITTED;
+			break;
+		}
+
+		releaseMember(slot);
+
+		if (!isFailover(rv))
+			FUNC_RETURNS(rv);
+
+		failMember(slot, rv);
+		excluded |= 1 << index;
+	}
+
+	FUNC_FAILS(CKR_DEVICE_ERROR, "No cluster member available for key");
+}
+
+
+
+static int cluster_C_Operation(struct p11Object_t *pObject, struct p11Session_t *session, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pIn, CK_ULONG ulInLen, CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen, enum clusterOperation op)
+{
+	struct p11Slot_t *slot;
+	struct p11Object_t *obj;
+	int rv, index, excluded;
+
+	FUNC_CALLED();
+
+	excluded = 0;
+	while ((slot = acquireMember(pObject, excluded, &index, NULL, &obj)) != NULL) {
+		debug("Dispatching operation %d to cluster member slot %lu with %d pending operations\n", op, slot->id, slot->pendingOperations);
+		if (scheduleSlot(slot, NULL, SCHED_INTERACTIVE) != CKR_OK) {
+			releaseMember(slot);
+			excluded |= 1 << index;
+			continue;
+		}
+
+		switch(op) {
+		case CLUSTER_SIGN:
+			rv = obj->C_Sign ? obj->C_Sign(obj, mech, pIn, ulInLen, pOut, pulOutLen) : CKR_KEY_FUNCTION_NOT_PERMITTED;
+			break;
+		case CLUSTER_DECRYPT:
+			rv = obj->C_Decrypt ? obj->C_Decrypt(obj, session, mech, pIn, ulInLen, pOut, pulOutLen) : CKR_KEY_FUNCTION_NOT_PERMITTED;
+			break;
+		default:
+			rv = obj->C_Encrypt ? obj->C_Encrypt(obj, session, mech, pIn, ulInLen, pOut, pulOutLen) : CKR_KEY_FUNCTION_NOT_PERMITTED;
+			break;
+		}
+
+		releaseSlot(slot);
+		releaseMember(slot);
+
+		if (!isFailover(rv))
+			FUNC_RETURNS(rv);
+
+		failMember(slot, rv);
+		excluded |= 1 << index;
+	}
+
+	FUNC_FAILS(CKR_DEVICE_ERROR, "No cluster member available for key");
+}
+
+
+
+static int cluster_C_SignInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech)
+{
+	return cluster_C_OperationInit(pObject, mech, CLUSTER_SIGN);
+}
+
+
+
+static int cluster_C_Sign(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	return cluster_C_Operation(pObject, NULL, mech, pData, ulDataLen, pSignature, pulSignatureLen, CLUSTER_SIGN);
+}
+
+
+
+static int cluster_C_DecryptInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech)
+{
+	return cluster_C_OperationInit(pObject, mech, CLUSTER_DECRYPT);
+}
+
+
+
+static int cluster_C_Decrypt(struct p11Object_t *pObject, struct p11Session_t *session, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+{
+	return cluster_C_Operation(pObject, session, mech, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen, CLUSTER_DECRYPT);
+}
+
+
+
+static CK_RV cluster_C_EncryptInit(struct p11Object_t *pObject, CK_MECHANISM_PTR mech)
+{
+	return cluster_C_OperationInit(pObject, mech, CLUSTER_ENCRYPT);
+}
+
+
+
+static CK_RV cluster_C_Encrypt(struct p11Object_t *pObject, struct p11Session_t *session, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR pulEncryptedDataLen)
+{
+	return cluster_C_Operation(pObject, session, mech, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen, CLUSTER_ENCRYPT);
+}
+
+
+
+/**
+ * Create a copy of a member object for the cluster token
+ *
+ * Operations that require the key on the token are dispatched to a member, while
+ * public key operations performed on the host are taken over from the member object.
+ *
+ * @param src       The member object
+ * @param pObject   The variable receiving the new object
+ */
+static int cloneObject(struct p11Object_t *src, struct p11Object_t **pObject)
+{
+	struct p11Object_t *obj;
+	struct p11Attribute_t *attr;
+	int isPublicKey;
+
+	FUNC_CALLED();
+
+	obj = (struct p11Object_t *)calloc(1, sizeof(struct p11Object_t));
+
+	if (obj == NULL) {
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	obj->publicObj = src->publicObj;
+	obj->tokenObj = src->tokenObj;
+	obj->sensitiveObj = src->sensitiveObj;
+	obj->tokenid = src->tokenid;
+	obj->keysize = src->keysize;
+
+	for (attr = src->attrList; attr != NULL; attr = attr->next) {
+		if (addAttribute(obj, &attr->attrData) != CKR_OK) {
+			freeObject(obj);
+			FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+		}
+	}
+
+	isPublicKey = (findAttribute(src, CKA_CLASS, &attr) >= 0) &&
+			(*(CK_OBJECT_CLASS *)attr->attrData.pValue == CKO_PUBLIC_KEY);
+
+	if (isPublicKey) {
+		obj->C_EncryptInit = src->C_EncryptInit;
+		obj->C_Encrypt = src->C_Encrypt;
+	} else if (src->C_Encrypt) {
+		obj->C_EncryptInit = cluster_C_EncryptInit;
+		obj->C_Encrypt = cluster_C_Encrypt;
+	}
+
+	if (src->C_Sign) {
+		obj->C_SignInit = cluster_C_SignInit;
+		obj->C_Sign = cluster_C_Sign;
+	}
+
+	if (src->C_Decrypt) {
+		obj->C_DecryptInit = cluster_C_DecryptInit;
+		obj->C_Decrypt = cluster_C_Decrypt;
+	}
+
+	obj->C_VerifyInit = src->C_VerifyInit;
+	obj->C_Verify = src->C_Verify;
+	obj->C_VerifyUpdate = src->C_VerifyUpdate;
+	obj->C_VerifyFinal = src->C_VerifyFinal;
+
+	*pObject = obj;
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Add objects from a member token not yet contained in the cluster token
+ *
+ * Objects are never removed from the cluster token to keep object handles stable
+ * while members come and go.
+ *
+ * @param token     The cluster token
+ * @param member    The member token
+ */
+static int mergeObjects(struct p11Token_t *token, struct p11Token_t *member)
+{
+	struct p11Object_t *p, *obj;
+	int publicObject, rc;
+
+	FUNC_CALLED();
+
+	// Public objects first, so that private EC keys can be matched via the public key
+	for (publicObject = 1; publicObject >= 0; publicObject--) {
+		p = publicObject ? member->tokenObjList : member->tokenPrivObjList;
+
+		for (; p != NULL; p = p->next) {
+			if (findSameObject(token, member, p) != NULL)
+				continue;
+
+			rc = cloneObject(p, &obj);
+			if (rc != CKR_OK) {
+				FUNC_FAILS(rc, "Could not copy object into cluster token");
+			}
+
+			addObject(token, obj, publicObject);
+		}
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static int cluster_C_GetMechanismList(CK_MECHANISM_TYPE_PTR pMechanismList, CK_ULONG_PTR pulCount)
+{
+	struct p11Slot_t *slot;
+	struct p11Token_t *token;
+	int rv, index;
+
+	slot = acquireMember(NULL, 0, &index, &token, NULL);
+	if (slot == NULL)
+		return CKR_TOKEN_NOT_PRESENT;
+
+	rv = getMechanismList(token, pMechanismList, pulCount);
+	releaseMember(slot);
+	return rv;
+}
+
+
+
+static int cluster_C_GetMechanismInfo(CK_MECHANISM_TYPE type, CK_MECHANISM_INFO_PTR pInfo)
+{
+	struct p11Slot_t *slot;
+	struct p11Token_t *token;
+	int rv, index;
+
+	slot = acquireMember(NULL, 0, &index, &token, NULL);
+	if (slot == NULL)
+		return CKR_TOKEN_NOT_PRESENT;
+
+	rv = getMechanismInfo(token, type, pInfo);
+	releaseMember(slot);
+	return rv;
+}
+
+
+
+/**
+ * Login to all member tokens using the same PIN
+ *
+ * The login stops at the first member reporting a wrong or blocked PIN, to prevent
+ * exhausting the retry counter of all members.
+ *
+ * Members added after the login remain unauthenticated and are not used for
+ * private key operations until the next login.
+ */
+static int cluster_login(struct p11Slot_t *slot, int userType, CK_UTF8CHAR_PTR pin, CK_ULONG pinlen)
+{
+	struct p11Slot_t *snapshot[MAX_CLUSTER_MEMBERS];
+	int rv, rc, i, cnt;
+
+	FUNC_CALLED();
+
+	p11LockMutex(clusterMutex);
+	cnt = memberCount;
+	memcpy(snapshot, members, sizeof(snapshot));
+	p11UnlockMutex(clusterMutex);
+
+	rv = CKR_TOKEN_NOT_PRESENT;
+	for (i = 0; i < cnt; i++) {
+		if (snapshot[i]->token == NULL)
+			continue;
+
+		rc = logIn(snapshot[i], userType, pin, pinlen);
+
+		if ((rc == CKR_PIN_INCORRECT) || (rc == CKR_PIN_LOCKED)) {
+			while (--i >= 0) {
+				if ((snapshot[i]->token != NULL) && (snapshot[i]->token->user == userType))
+					logOut(snapshot[i]);
+			}
+			FUNC_FAILS(rc, "PIN verification failed on cluster member");
+		}
+
+		if ((rv != CKR_OK) && (rc != CKR_DEVICE_ERROR))
+			rv = rc;
+	}
+
+	FUNC_RETURNS(rv);
+}
+
+
+
+static int cluster_logout(struct p11Slot_t *slot)
+{
+	int i;
+
+	FUNC_CALLED();
+
+	p11LockMutex(clusterMutex);
+	for (i = 0; i < memberCount; i++) {
+		if (members[i]->token != NULL)
+			logOut(members[i]);
+	}
+	p11UnlockMutex(clusterMutex);
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static int cluster_C_GenerateRandom(struct p11Slot_t *slot, CK_BYTE_PTR rnd, CK_ULONG rndlen)
+{
+	struct p11Slot_t *member;
+	int rv, index, excluded;
+
+	FUNC_CALLED();
+
+	excluded = 0;
+	while ((member = acquireMember(NULL, excluded, &index, NULL, NULL)) != NULL) {
+		if (scheduleSlot(member, NULL, SCHED_INTERACTIVE) != CKR_OK) {
+			releaseMember(member);
+			excluded |= 1 << index;
+			continue;
+		}
+
+		rv = generateTokenRandom(member, rnd, rndlen);
+
+		releaseSlot(member);
+		releaseMember(member);
+
+		if (!isFailover(rv))
+			FUNC_RETURNS(rv);
+
+		failMember(member, rv);
+		excluded |= 1 << index;
+	}
+
+	FUNC_FAILS(CKR_DEVICE_ERROR, "No cluster member available");
+}
+
+
+
+static struct p11TokenDriver *getClusterTokenDriver()
+{
+	static struct p11TokenDriver cluster_token = {
+		"Cluster",
+		1,
+		0,
+		0,
+		0,
+		NULL,
+		NULL,
+		NULL,
+		cluster_C_GetMechanismList,
+		cluster_C_GetMechanismInfo,
+		cluster_login,
+		cluster_logout,
+		NULL,
+		NULL,
+
+		cluster_C_DecryptInit,		// int (*C_DecryptInit)  (struct p11Object_t *, CK_MECHANISM_PTR);
+		cluster_C_Decrypt,		// int (*C_Decrypt)      (struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+		NULL,				// int (*C_DecryptUpdate)(struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+		NULL,				// int (*C_DecryptFinal) (struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
+
+		cluster_C_SignInit,		// int (*C_SignInit)     (struct p11Object_t *, CK_MECHANISM_PTR);
+		cluster_C_Sign,			// int (*C_Sign)         (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+		NULL,				// int (*C_SignUpdate)   (struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG);
+		NULL,				// int (*C_SignFinal)    (struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
+
+		NULL,				// Keys are generated on the member tokens and replicated using key backup and restore
+		NULL,
+		NULL,
+		NULL,
+		NULL,
+		cluster_C_GenerateRandom	// int (*C_GenerateRandom)   (struct p11Slot_t *, CK_BYTE_PTR , CK_ULONG );
+	};
+
+	return &cluster_token;
+}
+
+
+
+/**
+ * Check if slot is a candidate for cluster membership
+ */
+static int isClusterMember(struct p11Slot_t *slot)
+{
+	char name[sizeof(slot->info.slotDescription) + 1];
+	int i;
+
+	if (slot->isCluster || slot->primarySlot || slot->closed)
+		return 0;
+
+	i = sizeof(slot->info.slotDescription);
+	memcpy(name, slot->info.slotDescription, i);
+	while ((i > 0) && (name[i - 1] == ' '))
+		i--;
+	name[i] = 0;
+
+	return matchFilter(name, clusterFilter);
+}
+
+
+
+/**
+ * Create the cluster token, taking token information from the first member
+ */
+static int newClusterToken(struct p11Slot_t *slot, struct p11Token_t *member, struct p11Token_t **token)
+{
+	struct p11Token_t *ptoken;
+	int rc;
+
+	FUNC_CALLED();
+
+	rc = allocateToken(&ptoken, 0);
+	if (rc != CKR_OK) {
+		FUNC_FAILS(rc, "Could not allocate cluster token");
+	}
+
+	ptoken->slot = slot;
+	ptoken->freeObjectNumber = 1;
+	ptoken->user = INT_CKU_NO_USER;
+	ptoken->drv = getClusterTokenDriver();
+
+	ptoken->info = member->info;
+	ptoken->info.flags &= CKF_RNG | CKF_LOGIN_REQUIRED | CKF_USER_PIN_INITIALIZED | CKF_TOKEN_INITIALIZED | CKF_PROTECTED_AUTHENTICATION_PATH;
+	ptoken->info.flags |= CKF_WRITE_PROTECTED;
+
+	strbpcpy(ptoken->info.label, "Cluster", sizeof(ptoken->info.label));
+	strbpcpy(ptoken->info.serialNumber, "Cluster", sizeof(ptoken->info.serialNumber));
+
+	rc = addToken(slot, ptoken);
+	if (rc != CKR_OK) {
+		freeToken(ptoken);
+		FUNC_FAILS(rc, "addToken() failed");
+	}
+
+	*token = ptoken;
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Update the list of members and the content of the cluster token
+ *
+ * Must be called with the global lock held.
+ *
+ * @param slot      The cluster slot
+ * @param token     The variable receiving the cluster token
+ */
+int getClusterToken(struct p11Slot_t *slot, struct p11Token_t **token)
+{
+	struct p11Slot_t *pslot, *found[MAX_CLUSTER_MEMBERS];
+	struct p11Token_t *ptoken;
+	int rc, cnt, i;
+
+	FUNC_CALLED();
+
+	// Checking the presence of tokens involves the card reader, so it is done without
+	// holding the cluster mutex, which would otherwise block operations on all members
+	cnt = 0;
+	for (pslot = context->slotPool.list; pslot != NULL; pslot = pslot->next) {
+		if (!isClusterMember(pslot))
+			continue;
+
+#ifdef CTAPI
+		getCTAPIToken(pslot, &ptoken);
+#else
+		getPCSCToken(pslot, &ptoken);
+#endif
+
+		if ((ptoken != NULL) && (cnt < MAX_CLUSTER_MEMBERS)) {
+			found[cnt++] = pslot;
+		}
+	}
+
+	// Pending operations still reference the slot, which is never released
+	p11LockMutex(clusterMutex);
+	memcpy(members, found, cnt * sizeof(*found));
+	memberCount = cnt;
+	p11UnlockMutex(clusterMutex);
+
+	if (cnt == 0) {
+		if (slot->token != NULL) {
+			debug("Last cluster member removed\n");
+			removeToken(slot);
+			slot->eventOccured = TRUE;
+		}
+		*token = NULL;
+		FUNC_RETURNS(CKR_TOKEN_NOT_PRESENT);
+	}
+
+	if (slot->token == NULL) {
+		rc = newClusterToken(slot, found[0]->token, &ptoken);
+		if (rc != CKR_OK) {
+			FUNC_FAILS(rc, "Could not create cluster token");
+		}
+		slot->eventOccured = TRUE;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		rc = mergeObjects(slot->token, found[i]->token);
+		if (rc != CKR_OK) {
+			FUNC_FAILS(rc, "Could not merge objects from cluster member");
+		}
+	}
+
+	rc = getToken(slot, token);
+	FUNC_RETURNS(rc);
+}
+
+
+
+/**
+ * Create the cluster slot if enabled with PKCS11_CLUSTER_SLOT
+ *
+ * Must be called with the global lock held.
+ *
+ * @param pool the pool of already allocated slots
+ */
+int updateClusterSlot(struct p11SlotPool_t *pool)
+{
+	struct p11Slot_t *slot;
+	struct p11Token_t *token;
+	int rc;
+
+	FUNC_CALLED();
+
+	if (clusterSlot != NULL) {
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	clusterFilter = getenv("PKCS11_CLUSTER_SLOT");
+	if (clusterFilter == NULL) {
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	debug("Cluster filter '%s'\n", clusterFilter);
+
+	slot = (struct p11Slot_t *) calloc(1, sizeof(struct p11Slot_t));
+
+	if (slot == NULL) {
+		FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+	}
+
+	rc = p11CreateMutex(&clusterMutex);
+	if (rc != CKR_OK) {
+		free(slot);
+		FUNC_FAILS(rc, "Could not create mutex");
+	}
+
+	slot->isCluster = 1;
+
+	strbpcpy(slot->info.slotDescription,
+			"Cluster",
+			sizeof(slot->info.slotDescription));
+
+	strbpcpy(slot->info.manufacturerID,
+			"CardContact",
+			sizeof(slot->info.manufacturerID));
+
+	slot->info.firmwareVersion.major = VERSION_MAJOR;
+	slot->info.firmwareVersion.minor = VERSION_MINOR;
+
+	slot->info.flags = CKF_REMOVABLE_DEVICE;
+
+	slot->eventOccured = TRUE;
+
+	addSlot(pool, slot);
+
+	clusterSlot = slot;
+
+	debug("Added cluster slot (%lu)\n", slot->id);
+
+	getClusterToken(slot, &token);
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+int closeClusterSlot(struct p11Slot_t *slot)
+{
+	FUNC_CALLED();
+
+	p11LockMutex(clusterMutex);
+	memberCount = 0;
+	p11UnlockMutex(clusterMutex);
+
+	p11DestroyMutex(clusterMutex);
+	clusterMutex = NULL;
+	clusterSlot = NULL;
+
+	FUNC_RETURNS(CKR_OK);
+}
@@ -49,9 +49,7 @@
 
 #include <pkcs11/strbpcpy.h>
 
-#ifdef DEBUG
 #include <common/debug.h>
-#endif
 
 #include <ctccid/ctapi.h>
 
@@ -307,7 +305,7 @@ int getCTAPIToken(struct p11Slot_t *slot, struct p11Token_t **token)
 		rc = checkForNewCTAPIToken(slot);
 	}
 
-	*token = slot->token;
+	getToken(slot, token);
 	return rc;
 }
 
@@ -329,9 +327,7 @@ int updateCTAPISlots(struct p11SlotPool_t *pool)
 			rc = CT_init(ctn, ctn);
 
 			if (rc != OK) {
-#ifdef DEBUG
 				debug("CT_init returns %d\n", rc);
-#endif
 			} else {
 				slot->closed = FALSE;
 			}
@@ -345,9 +341,7 @@ int updateCTAPISlots(struct p11SlotPool_t *pool)
 		rc = CT_init(ctn, ctn);
 
 		if (rc != OK) {
-#ifdef DEBUG
 			debug("CT_init returns %d\n", rc);
-#endif
 			break;
 		}
 
@@ -394,9 +388,7 @@ int closeCTAPISlot(struct p11Slot_t *slot)
 	rc = CT_close(slot->ctn);
 
 	if (rc != OK) {
-#ifdef DEBUG
 		debug("CT_close returns %d\n", rc);
-#endif
 	}
 
 	slot->closed = TRUE;
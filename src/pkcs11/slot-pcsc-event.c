@@ -36,9 +36,8 @@
 #include <pkcs11/slot-pcsc.h>
 #include <pkcs11/crc32.h>
 
-#ifdef DEBUG
 #include <common/debug.h>
-#endif
+#include <common/mutex.h>
 
 #ifdef _WIN32
 #include <winscard.h>
@@ -60,54 +59,13 @@ static SCARDCONTEXT globalContext = -1;
 static SCARDCONTEXT globalBlockingContext = -1;
 static int slotCounter = 0;
 
+static SCARDCONTEXT monitorContext = -1;
+static THREAD monitorThread;
+static EVENT monitorWakeup;
+static int monitorStarted = FALSE;
+static int monitorTerminating;
 
-
-/**
- * Match an references against a filter expression
- *
- * The following assertions are valid:
- *
- * assert(matchFilter("ABC", "ABC") == 1);
- * assert(matchFilter("ABC", "ABCD") == 0);
- * assert(matchFilter("ABC", "*") == 1);
- * assert(matchFilter("ABC", "A*") == 1);
- * assert(matchFilter("ABC", "B*") == 0);
- * assert(matchFilter("ABC", "???") == 1);
- * assert(matchFilter("ABC", "????") == 0);
- * assert(matchFilter("ABC", "??") == 0);
- * assert(matchFilter("ABC", "?BC") == 1);
- * assert(matchFilter("ABC", "*C") == 1);
- * assert(matchFilter("ABC", "*B*") == 1);
- * assert(matchFilter("ABC", "*C*") == 0);
- */
-static int matchFilter(char *value, char *filter)
-{
-	if (!filter)
-		return 1;
-
-	while(*value) {
-		if ((*value != *filter) && (*filter != '*') && (*filter != '?'))
-			return 0;
-
-		if (*filter == '*') {
-			filter++;
-			value++;
-
-			if (!*filter)		// * is last element
-				return 1;
-
-			while(*value && (*value != *filter))
-				value++;
-
-			continue;
-		}
-
-		value++;
-		filter++;
-	}
-
-	return *filter ? 0 : 1;
-}
+static void startPCSCStatusMonitor(struct p11SlotPool_t *pool);
 
 
 
@@ -126,7 +84,7 @@ int updatePCSCSlots(struct p11SlotPool_t *pool)
 	DWORD cch = 0;
 	LPTSTR p;
 	LONG rc;
-	int match,vslotcnt,i;
+	int match,vslotcnt,i,added;
 
 	FUNC_CALLED();
 
@@ -137,9 +95,7 @@ int updatePCSCSlots(struct p11SlotPool_t *pool)
 
 		rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &globalContext);
 
-#ifdef DEBUG
 		debug("SCardEstablishContext: %s\n", pcsc_error_to_string(rc));
-#endif
 
 		if (rc != SCARD_S_SUCCESS) {
 			FUNC_FAILS(CKR_DEVICE_ERROR, "Could not establish context to PC/SC manager");
@@ -148,9 +104,7 @@ int updatePCSCSlots(struct p11SlotPool_t *pool)
 
 	rc = SCardListReaders(globalContext, NULL, NULL, &cch);
 
-#ifdef DEBUG
 	debug("SCardListReaders: %s\n", pcsc_error_to_string(rc));
-#endif
 
 	if (rc == SCARD_E_NO_READERS_AVAILABLE) {
 		FUNC_RETURNS(CKR_OK);
@@ -164,9 +118,7 @@ int updatePCSCSlots(struct p11SlotPool_t *pool)
 
 	rc = SCardListReaders(globalContext, NULL, readers, &cch);
 
-#ifdef DEBUG
 	debug("SCardListReaders: %s\n", pcsc_error_to_string(rc));
-#endif
 
 	if (rc == SCARD_E_NO_READERS_AVAILABLE) {
 		FUNC_RETURNS(CKR_OK);
@@ -177,18 +129,15 @@ int updatePCSCSlots(struct p11SlotPool_t *pool)
 	}
 	
 	filter = getenv("PKCS11_READER_FILTER");
-#ifdef DEBUG
 	if (filter) {
 		debug("Reader filter '%s'\n", filter);
 	}
-#endif
 
 	/* Determine the total number of readers */
+	added = FALSE;
 	p = readers;
 	while (*p != '\0') {
-#ifdef DEBUG
 		debug("Found reader '%s'\n", p);
-#endif
 
 		/* Check if we already have a slot for the reader */
 		slot = pool->list;
@@ -204,8 +153,10 @@ int updatePCSCSlots(struct p11SlotPool_t *pool)
 		/* Skip the reader as we already have a slot for it */
 		if (match) {
 			p += strlen(p) + 1;
-			if (slot->closed)
+			if (slot->closed) {
 				slot->eventOccured = TRUE;
+				added = TRUE;
+			}
 			slot->closed = FALSE;
 			continue;
 		}
@@ -234,9 +185,7 @@ int updatePCSCSlots(struct p11SlotPool_t *pool)
 
 		rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &(slot->context));
 
-#ifdef DEBUG
 		debug("SCardEstablishContext: %s\n", pcsc_error_to_string(rc));
-#endif
 
 		if (rc != SCARD_S_SUCCESS) {
 			free(slot);
@@ -271,13 +220,9 @@ int updatePCSCSlots(struct p11SlotPool_t *pool)
 
 		// The REINER SCT readers have an APDU buffer limitation of 1014 bytes
 		if (!strncmp((char *)p, "REINER SCT", 10)) {
-#ifdef DEBUG
 			debug("Detected a REINER SCT reader\n");
-#endif
 			if (!strncmp((char *)p, "REINER SCT cyberJack ecom_a", 27)) {
-#ifdef DEBUG
 				debug("Detected a 'REINER SCT cyberJack ecom_a' reader. Limiting use of Le='000000'\n");
-#endif
 				// Some REINER SCT readers fail if Le='000000' returns more than
 				// 1014 bytes.
 				slot->noExtLengthReadAll = 1;
@@ -292,9 +237,7 @@ int updatePCSCSlots(struct p11SlotPool_t *pool)
 
 		addSlot(&context->slotPool, slot);
 
-#ifdef DEBUG
 		debug("Added slot (%lu, %s) - slot counter is %i\n", slot->id, slot->readername, slotCounter);
-#endif
 
 		// The PREALLOCATE option creates two additional virtual slots per card reader.
 		// This is required for Firefox/NSS which sets the friendly flag only for slots that are
@@ -307,9 +250,7 @@ int updatePCSCSlots(struct p11SlotPool_t *pool)
 			} else {
 				vslotcnt = 2;
 			}
-#ifdef DEBUG
 			debug("Pre-allocate virtual slots '' %d\n", prealloc, vslotcnt);
-#endif
 
 			slot->supportsVirtualSlots = 1;
 			for (i = 0; i < vslotcnt; i++) {
@@ -320,10 +261,14 @@ int updatePCSCSlots(struct p11SlotPool_t *pool)
 		checkForNewPCSCToken(slot);
 
 		p += strlen(p) + 1;
+		added = TRUE;
 	}
 
 	free(readers);
 
+	if (added || !monitorStarted)
+		startPCSCStatusMonitor(pool);
+
 	FUNC_RETURNS(CKR_OK);
 }
 
@@ -348,9 +293,7 @@ int waitForPCSCEvent(struct p11SlotPool_t *pool, int timeout)
 
 		rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &globalBlockingContext);
 
-#ifdef DEBUG
 		debug("SCardEstablishContext: %s\n", pcsc_error_to_string(rc));
-#endif
 
 		if (rc != SCARD_S_SUCCESS) {
 			FUNC_FAILS(CKR_DEVICE_ERROR, "Could not establish context to PC/SC manager");
@@ -360,7 +303,7 @@ int waitForPCSCEvent(struct p11SlotPool_t *pool, int timeout)
 	slot = pool->list;
 	readers = 0;
 	while (slot) {
-		if ((slot->primarySlot == NULL) && !slot->closed)
+		if ((slot->primarySlot == NULL) && !slot->isCluster && !slot->closed)
 			readers++;
 		slot = slot->next;
 	}
@@ -374,7 +317,7 @@ int waitForPCSCEvent(struct p11SlotPool_t *pool, int timeout)
 	slot = pool->list;
 	i = 0;
 	while (slot) {
-		if ((slot->primarySlot == NULL) && !slot->closed) {
+		if ((slot->primarySlot == NULL) && !slot->isCluster && !slot->closed) {
 			rs[i].szReader = slot->readername;
 			rs[i].pvUserData = slot;
 			i++;
@@ -410,9 +353,7 @@ int waitForPCSCEvent(struct p11SlotPool_t *pool, int timeout)
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not query status change");
 
 	for (i = 0; i < readers; i++) {
-#ifdef DEBUG
 		debug("Event for %08lx %08lx %s\n", rs[i].dwCurrentState, rs[i].dwEventState, rs[i].szReader);
-#endif
 		if (rs[i].dwEventState & SCARD_STATE_CHANGED) {
 			if (rs[i].pvUserData) {
 				slot = (struct p11Slot_t *)rs[i].pvUserData;
@@ -428,43 +369,220 @@ int waitForPCSCEvent(struct p11SlotPool_t *pool, int timeout)
 
 
 
+/**
+ * Stop tracking the readers in the reader state array
+ */
+static void unmonitorSlots(SCARD_READERSTATE *rs, DWORD readers)
+{
+	struct p11Slot_t *slot;
+	DWORD i;
+
+	for (i = 0; i < readers; i++) {
+		if (rs[i].pvUserData) {
+			slot = (struct p11Slot_t *)rs[i].pvUserData;
+			slot->statusMonitored = FALSE;
+		}
+	}
+}
+
+
+
+/**
+ * Background thread tracking the state of all readers
+ *
+ * Every change reported by the PC/SC manager for a reader increments the event counter
+ * of the slot, which invalidates the result of the last presence check. The reader list
+ * is rebuilt when slots are added or a reader is attached.
+ */
+static void monitorSlotStatus(void *arg)
+{
+	struct p11SlotPool_t *pool = (struct p11SlotPool_t *)arg;
+	SCARD_READERSTATE *rs = NULL;
+	struct p11Slot_t *slot;
+	DWORD readers = 0, i;
+	LONG rc;
+	int rebuild = TRUE;
+
+	while (!monitorTerminating) {
+		if (rebuild) {
+			if (rs) {
+				unmonitorSlots(rs, readers);
+				free(rs);
+			}
+
+			readers = 0;
+			for (slot = pool->list; slot; slot = slot->next) {
+				if ((slot->primarySlot == NULL) && !slot->isCluster && !slot->isReplay && !slot->closed)
+					readers++;
+			}
+
+#ifndef __APPLE__
+			readers++;
+#endif
+
+			rs = (SCARD_READERSTATE *)calloc(sizeof(SCARD_READERSTATE), readers + 1);
+			if (rs == NULL) {
+				readers = 0;
+				break;
+			}
+
+			i = 0;
+			for (slot = pool->list; slot && (i < readers); slot = slot->next) {
+				if ((slot->primarySlot == NULL) && !slot->isCluster && !slot->isReplay && !slot->closed) {
+					rs[i].szReader = slot->readername;
+					rs[i].pvUserData = slot;
+					i++;
+				}
+			}
+
+#ifndef __APPLE__
+			rs[i].szReader = "\\\\?PnP?\\Notification";
+			i++;
+#endif
+			readers = i;
+			rebuild = FALSE;
+		}
+
+		if (readers == 0) {
+			event_wait(&monitorWakeup);
+			rebuild = TRUE;
+			continue;
+		}
+
+		rc = SCardGetStatusChange(monitorContext, INFINITE, rs, readers);
+
+		if ((rc == SCARD_E_CANCELLED) || (rc == SCARD_E_TIMEOUT)) {
+			rebuild = TRUE;
+			continue;
+		}
+
+		if (rc != SCARD_S_SUCCESS) {
+			debug("SCardGetStatusChange: %s - stopping status monitor\n", pcsc_error_to_string(rc));
+			break;
+		}
+
+		for (i = 0; i < readers; i++) {
+			if (rs[i].dwEventState & SCARD_STATE_CHANGED) {
+				if (rs[i].pvUserData) {
+					slot = (struct p11Slot_t *)rs[i].pvUserData;
+					slot->statusEvents++;
+					MEMORY_BARRIER();
+					slot->statusMonitored = TRUE;
+				} else if (rs[i].dwCurrentState != SCARD_STATE_UNAWARE) {
+					rebuild = TRUE;
+				}
+			}
+			rs[i].dwCurrentState = rs[i].dwEventState & ~SCARD_STATE_CHANGED;
+		}
+	}
+
+	if (rs) {
+		unmonitorSlots(rs, readers);
+		free(rs);
+	}
+}
+
+
+
+/**
+ * Start the status monitor or make it pick up new slots
+ *
+ * The monitor allows presence checks to be served from memory. It is disabled
+ * with PKCS11_STATUS_MONITOR=0.
+ *
+ * @param pool the pool of already allocated slots
+ */
+static void startPCSCStatusMonitor(struct p11SlotPool_t *pool)
+{
+	char *val;
+	LONG rc;
+
+	if (monitorStarted) {
+		event_set(&monitorWakeup);
+		SCardCancel(monitorContext);
+		return;
+	}
+
+	val = getenv("PKCS11_STATUS_MONITOR");
+	if ((val != NULL) && !strcmp(val, "0"))
+		return;
+
+	rc = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &monitorContext);
+
+	debug("SCardEstablishContext: %s\n", pcsc_error_to_string(rc));
+
+	if (rc != SCARD_S_SUCCESS)
+		return;
+
+	if (event_init(&monitorWakeup) != 0) {
+		SCardReleaseContext(monitorContext);
+		monitorContext = -1;
+		return;
+	}
+
+	monitorTerminating = FALSE;
+	if (thread_create(&monitorThread, monitorSlotStatus, pool) != 0) {
+		debug("Could not start status monitor thread\n");
+		event_destroy(&monitorWakeup);
+		SCardReleaseContext(monitorContext);
+		monitorContext = -1;
+		return;
+	}
+
+	monitorStarted = TRUE;
+}
+
+
+
+/**
+ * Stop the status monitor before slots are released
+ */
+void stopPCSCStatusMonitor()
+{
+	if (!monitorStarted)
+		return;
+
+	monitorTerminating = TRUE;
+	MEMORY_BARRIER();
+	event_set(&monitorWakeup);
+	SCardCancel(monitorContext);
+	thread_join(&monitorThread);
+
+	event_destroy(&monitorWakeup);
+	SCardReleaseContext(monitorContext);
+	monitorContext = -1;
+	monitorStarted = FALSE;
+}
+
+
+
 int closePCSCSlot(struct p11Slot_t *slot)
 {
 	LONG rc;
 
 	FUNC_CALLED();
 
-#ifdef DEBUG
 	debug("Trying to close slot (%i, %s)\n", slot->id, slot->readername);
-#endif
 
 	slotCounter--;
 
 	if (slotCounter == 0) {
 		if (globalBlockingContext != -1) {
 			SCardCancel(globalBlockingContext);
-#ifdef DEBUG
 			debug("Releasing global blocking PC/SC context\n");
-#endif
 			rc = SCardReleaseContext(globalBlockingContext);
 
-#ifdef DEBUG
 			debug("SCardReleaseContext (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rc));
-#endif
 
 			globalBlockingContext = -1;
 
 		}
 
 		if (globalContext != -1) {
-#ifdef DEBUG
 			debug("Releasing global PC/SC context\n");
-#endif
 			rc = SCardReleaseContext(globalContext);
 
-#ifdef DEBUG
 			debug("SCardReleaseContext (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rc));
-#endif
 
 			globalContext = -1;
 		}
@@ -478,16 +596,12 @@ int closePCSCSlot(struct p11Slot_t *slot)
 
 	rc = SCardDisconnect(slot->card, SCARD_UNPOWER_CARD);
 
-#ifdef DEBUG
 	debug("SCardDisconnect (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rc));
 	debug("Releasing slot specific PC/SC context - slot counter is %i\n", slotCounter);
-#endif
 
 	rc = SCardReleaseContext(slot->context);
 
-#ifdef DEBUG
 	debug("SCardReleaseContext (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rc));
-#endif
 
 	slot->context = 0;
 	slot->card = 0;
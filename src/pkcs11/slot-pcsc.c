@@ -47,9 +47,8 @@
 #include <pkcs11/slot-pcsc.h>
 #include <pkcs11/strbpcpy.h>
 
-#ifdef DEBUG
 #include <common/debug.h>
-#endif
+#include <common/mutex.h>
 
 #ifdef _WIN32
 #include <winscard.h>
@@ -69,8 +68,6 @@ extern struct p11Context_t *context;
 
 
 
-#ifdef DEBUG
-
 char* pcsc_error_to_string(const LONG error) {
 	static char strError[75];
 
@@ -267,7 +264,6 @@ char* pcsc_feature_to_string(const WORD feature) {
 
 	return strFeature;
 }
-#endif /* DEBUG */
 
 
 
@@ -298,9 +294,11 @@ int transmitAPDUviaPCSC(struct p11Slot_t *slot,
 
 	rc = SCardTransmit(slot->card, SCARD_PCI_T1, capdu, (DWORD)capdu_len, NULL, rapdu, &lenr);
 
-#ifdef DEBUG
 	debug("SCardTransmit: %s\n", pcsc_error_to_string(rc));
-#endif
+
+	if (rc == SCARD_W_RESET_CARD) {
+		FUNC_FAILS(ERR_CARD_RESET, "Card was reset");
+	}
 
 	if (rc != SCARD_S_SUCCESS) {
 		FUNC_FAILS(-1, "SCardTransmit failed");
@@ -358,9 +356,7 @@ int transmitVerifyPinAPDUviaPCSC(struct p11Slot_t *slot,
 
 	rc = SCardControl(slot->card, slot->hasFeatureVerifyPINDirect, &verify,  (DWORD)(18 + capdu_len + 1), rapdu, (DWORD)rapdu_len, &lenr);
 
-#ifdef DEBUG
 	debug("SCardControl (VERIFY_PIN_DIRECT): %s\n", pcsc_error_to_string(rc));
-#endif
 
 	if (rc != SCARD_S_SUCCESS) {
 		FUNC_FAILS(-1, "SCardControl failed");
@@ -382,31 +378,23 @@ void checkPCSCPinPad(struct p11Slot_t *slot)
 
 	rv = SCardControl(slot->card, SCARD_CTL_CODE(3400), NULL,0, buf, sizeof(buf), &lenr);
 
-#ifdef DEBUG
 	debug("SCardControl (CM_IOCTL_GET_FEATURE_REQUEST): %s\n", pcsc_error_to_string(rv));
-#endif
 
 	/* Ignore the feature codes if an error occured */
 	if (rv == SCARD_S_SUCCESS) {
 		for (i = 0; i < (int)lenr; i += 6) {
 			feature = buf[i];
 			featurecode = (buf[i + 2] << 24) + (buf[i + 3] << 16) + (buf[i + 4] << 8) + buf[i + 5];
-	#ifdef DEBUG
 			debug("%s - 0x%08X\n", pcsc_feature_to_string(feature), featurecode);
-	#endif
 			if (feature == FEATURE_VERIFY_PIN_DIRECT) {
 				po = getenv("PKCS11_IGNORE_PINPAD");
-	#ifdef DEBUG
 				if (po) {
 					debug("PKCS11_IGNORE_PINPAD=%s\n", po);
 				} else {
 					debug("PKCS11_IGNORE_PINPAD not found\n");
 				}
-	#endif
 				if (!po || (*po == '0')) {
-	#ifdef DEBUG
 					debug("Slot supports feature VERIFY_PIN_DIRECT - setting CKF_PROTECTED_AUTHENTICATION_PATH for token\n");
-	#endif
 					slot->hasFeatureVerifyPINDirect = featurecode;
 				}
 			}
@@ -455,9 +443,7 @@ int checkForNewPCSCToken(struct p11Slot_t *slot)
 
 	rv = SCardConnect(slot->context, slot->readername, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, &(slot->card), &dwActiveProtocol);
 
-#ifdef DEBUG
 	debug("SCardConnect (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rv));
-#endif
 
 	if (rv == SCARD_E_NO_SMARTCARD || rv == SCARD_W_REMOVED_CARD || rv == SCARD_E_SHARING_VIOLATION) {
 		FUNC_RETURNS(CKR_TOKEN_NOT_PRESENT);
@@ -532,9 +518,7 @@ static int checkForRemovedPCSCToken(struct p11Slot_t *slot)
 
 	rv = SCardStatus(slot->card, NULL, 0, 0, 0, 0, 0);
 
-#ifdef DEBUG
 	debug("SCardStatus: %s\n", pcsc_error_to_string(rv));
-#endif
 
 	if (rv == SCARD_S_SUCCESS) {
 		FUNC_RETURNS(CKR_OK);
@@ -544,11 +528,12 @@ static int checkForRemovedPCSCToken(struct p11Slot_t *slot)
 			FUNC_RETURNS(rc);
 		}
 
+		// Disconnecting ends any open transaction
+		resetSlotLock(slot);
+
 		rc = SCardDisconnect(slot->card, SCARD_UNPOWER_CARD);
 
-#ifdef DEBUG
 		debug("SCardDisconnect (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rc));
-#endif
 
 		// Check if a new token was inserted in the meantime
 		rc = checkForNewPCSCToken(slot);
@@ -565,24 +550,113 @@ static int checkForRemovedPCSCToken(struct p11Slot_t *slot)
 
 
 
+/**
+ * Determine if a token is present in the slot
+ *
+ * While the status monitor tracks the reader and reported no change since the last
+ * check, the result of that check is returned without querying the PC/SC manager.
+ *
+ * @param slot       Pointer to slot structure.
+ * @param token      Pointer to token pointer updated with the token in the slot
+ * @return           CKR_OK, CKR_TOKEN_NOT_PRESENT or any other Cryptoki error code
+ */
 int getPCSCToken(struct p11Slot_t *slot, struct p11Token_t **token)
 {
+	unsigned int events;
 	int rc;
 
 	FUNC_CALLED();
 
+	if (slot->statusMonitored && slot->presenceValid && (slot->validatedEvents == slot->statusEvents)) {
+		rc = getToken(slot, token);
+		FUNC_RETURNS(rc);
+	}
+
+	// Events reported while checking invalidate the result
+	events = slot->statusEvents;
+	MEMORY_BARRIER();
+
 	if (slot->token) {
 		rc = checkForRemovedPCSCToken(slot);
 	} else {
 		rc = checkForNewPCSCToken(slot);
 	}
 
-	*token = slot->token;
+	slot->validatedEvents = events;
+	slot->presenceValid = (rc == CKR_OK) || ((rc == CKR_TOKEN_NOT_PRESENT) && !slot->token);
+
+	getToken(slot, token);
 	FUNC_RETURNS(rc);
 }
 
 
 
+static int lockMode = -1;
+static int operationLocking = FALSE;
+
+
+
+/**
+ * Determine the locking mode from PKCS11_SLOT_LOCKING
+ *
+ * "transaction" uses SCardBeginTransaction/SCardEndTransaction,
+ * "login" additionally holds the transaction from C_Login until C_Logout,
+ * "reconnect" reconnects the card in exclusive mode and "none" disables locking.
+ *
+ * If any of "transaction", "login" or "reconnect" is set, every scheduled operation locks
+ * the card, which costs an additional SCardBeginTransaction/SCardEndTransaction round trip
+ * to the resource manager per operation. If the variable is not set, only the few multi-APDU
+ * sequences that must not be interleaved with other processes lock the card using transactions.
+ */
+static void readLockMode()
+{
+	char *mode;
+
+	if (lockMode != -1)
+		return;
+
+	mode = getenv("PKCS11_SLOT_LOCKING");
+	if (mode == NULL) {
+		lockMode = LOCK_TRANSACTION;
+	} else if (!strcmp(mode, "none")) {
+		lockMode = LOCK_NONE;
+	} else if (!strcmp(mode, "reconnect")) {
+		lockMode = LOCK_RECONNECT;
+		operationLocking = TRUE;
+	} else if (!strcmp(mode, "login")) {
+		lockMode = LOCK_TRANSACTION_LOGIN;
+		operationLocking = TRUE;
+	} else {
+		lockMode = LOCK_TRANSACTION;
+		operationLocking = TRUE;
+	}
+	debug("Slot locking mode %d, operation locking %d\n", lockMode, operationLocking);
+}
+
+
+
+/**
+ * Return the locking mode configured with PKCS11_SLOT_LOCKING
+ */
+int getPCSCLockMode()
+{
+	readLockMode();
+	return lockMode;
+}
+
+
+
+/**
+ * Return TRUE if every scheduled operation shall lock the card
+ */
+int isPCSCOperationLocking()
+{
+	readLockMode();
+	return operationLocking;
+}
+
+
+
 int lockPCSCSlot(struct p11Slot_t *slot)
 {
 	DWORD dwActiveProtocol;
@@ -590,15 +664,82 @@ int lockPCSCSlot(struct p11Slot_t *slot)
 
 	FUNC_CALLED();
 
-	rv = SCardReconnect(slot->card, SCARD_SHARE_EXCLUSIVE, SCARD_PROTOCOL_T1, SCARD_LEAVE_CARD, &dwActiveProtocol);
+	switch(getPCSCLockMode()) {
+	case LOCK_NONE:
+		FUNC_RETURNS(CKR_OK);
+
+	case LOCK_RECONNECT:
+		rv = SCardReconnect(slot->card, SCARD_SHARE_EXCLUSIVE, SCARD_PROTOCOL_T1, SCARD_LEAVE_CARD, &dwActiveProtocol);
+
+		debug("SCardReconnect (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rv));
+
+		if (rv != SCARD_S_SUCCESS)
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Could not reconnect to card");
+		break;
+
+	default:
+		rv = SCardBeginTransaction(slot->card);
+
+		debug("SCardBeginTransaction (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rv));
+
+		// The card was reset by another process since the last operation
+		if ((rv == SCARD_W_RESET_CARD) && isResetRecoveryEnabled()) {
+			if (reconnectPCSCSlot(slot) != CKR_OK)
+				FUNC_FAILS(CKR_DEVICE_ERROR, "Could not reconnect to card");
+
+			rv = SCardBeginTransaction(slot->card);
+
+			debug("SCardBeginTransaction (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rv));
+		}
+
+		if (rv != SCARD_S_SUCCESS)
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Could not begin transaction");
+		break;
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Reconnect to the card after it was reset by another process
+ *
+ * A transaction held for the slot is lost with the reset and started again. The
+ * token state is restored before the next APDU is sent to the card.
+ *
+ * @param slot       Pointer to slot structure.
+ * @return           CKR_OK or CKR_DEVICE_ERROR
+ */
+int reconnectPCSCSlot(struct p11Slot_t *slot)
+{
+	DWORD dwActiveProtocol, share;
+	LONG rv;
+	int mode;
+
+	FUNC_CALLED();
+
+	mode = getPCSCLockMode();
+	share = ((mode == LOCK_RECONNECT) && (slot->lockCount > 0)) ? SCARD_SHARE_EXCLUSIVE : SCARD_SHARE_SHARED;
+
+	rv = SCardReconnect(slot->card, share, SCARD_PROTOCOL_T1, SCARD_LEAVE_CARD, &dwActiveProtocol);
 
-#ifdef DEBUG
 	debug("SCardReconnect (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rv));
-#endif
 
 	if (rv != SCARD_S_SUCCESS)
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not reconnect to card");
 
+	if ((slot->lockCount > 0) && ((mode == LOCK_TRANSACTION) || (mode == LOCK_TRANSACTION_LOGIN))) {
+		rv = SCardBeginTransaction(slot->card);
+
+		debug("SCardBeginTransaction (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rv));
+
+		if (rv != SCARD_S_SUCCESS)
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Could not begin transaction");
+	}
+
+	slot->resetPending = TRUE;
+
 	FUNC_RETURNS(CKR_OK);
 }
 
@@ -611,14 +752,28 @@ int unlockPCSCSlot(struct p11Slot_t *slot)
 
 	FUNC_CALLED();
 
-	rv = SCardReconnect(slot->card, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, SCARD_LEAVE_CARD, &dwActiveProtocol);
+	switch(getPCSCLockMode()) {
+	case LOCK_NONE:
+		FUNC_RETURNS(CKR_OK);
 
-#ifdef DEBUG
-	debug("SCardReconnect (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rv));
-#endif
+	case LOCK_RECONNECT:
+		rv = SCardReconnect(slot->card, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T1, SCARD_LEAVE_CARD, &dwActiveProtocol);
 
-	if (rv != SCARD_S_SUCCESS)
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not reconnect to card");
+		debug("SCardReconnect (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rv));
+
+		if (rv != SCARD_S_SUCCESS)
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Could not reconnect to card");
+		break;
+
+	default:
+		rv = SCardEndTransaction(slot->card, SCARD_LEAVE_CARD);
+
+		debug("SCardEndTransaction (%i, %s): %s\n", slot->id, slot->readername, pcsc_error_to_string(rv));
+
+		if (rv != SCARD_S_SUCCESS)
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Could not end transaction");
+		break;
+	}
 
 	FUNC_RETURNS(CKR_OK);
 }
@@ -103,10 +103,8 @@ typedef struct {
 } PIN_VERIFY_DIRECT_STRUCTURE_t;
 #pragma pack()
 
-#ifdef DEBUG
 char* pcsc_error_to_string(const LONG error);
 char* pcsc_feature_to_string(const WORD feature);
-#endif
 
 int transmitVerifyPinAPDUviaPCSC(struct p11Slot_t *slot,
 	unsigned char pinformat, unsigned char minpinsize, unsigned char maxpinsize,
@@ -119,10 +117,14 @@ int transmitAPDUviaPCSC(struct p11Slot_t *slot,
 int getPCSCToken(struct p11Slot_t *slot, struct p11Token_t **token);
 void checkPCSCPinPad(struct p11Slot_t *slot);
 int checkForNewPCSCToken(struct p11Slot_t *slot);
+int getPCSCLockMode();
+int isPCSCOperationLocking();
 int lockPCSCSlot(struct p11Slot_t *slot);
 int unlockPCSCSlot(struct p11Slot_t *slot);
+int reconnectPCSCSlot(struct p11Slot_t *slot);
 int updatePCSCSlots(struct p11SlotPool_t *pool);
 int waitForPCSCEvent(struct p11SlotPool_t *pool, int timeout);
+void stopPCSCStatusMonitor();
 int closePCSCSlot(struct p11Slot_t *slot);
 
 #endif
@@ -0,0 +1,840 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    slot-replay.c
+ * @author  Andreas Schwier
+ * @brief   Recording and replay of APDU transcripts
+ *
+ * If PKCS11_APDU_RECORD=<file> is set, all APDUs exchanged with tokens are written to a
+ * transcript file. If PKCS11_APDU_REPLAY=<file> is set, the module does not access any
+ * reader, but provides one slot for each slot in the transcript and answers commands from
+ * the recorded responses. This allows to reproduce a problem or to benchmark the host side
+ * code without a card attached. Replay takes precedence over recording.
+ *
+ * The transcript is a text file with one record per line:
+ *
+ * SLOT <id> <maxCAPDU> <maxRAPDU> <noExtLengthReadAll> <slot description>
+ * ATR <id> <hex>
+ * APDU <id> <microseconds> <command hex> <response hex incl. SW1/SW2 or - if failed>
+ *
+ * Lines starting with # are comments. Commands that carry a PIN or other secret
+ * (VERIFY, CHANGE REFERENCE DATA, RESET RETRY COUNTER and the SmartCard-HSM INITIALIZE
+ * DEVICE and IMPORT DKEK SHARE) are recorded with the header only, followed by a *.
+ * All other data, including signatures and decrypted plain text, is recorded as is, so
+ * transcripts should only be recorded with test keys.
+ *
+ * During replay a command is answered with the next recorded response for the same
+ * command, starting from the position of the last match and wrapping around at the end
+ * of the transcript. If no identical command is found, then the next command with the same
+ * header is used, which covers commands containing a host generated random value.
+ * Redacted commands only match on the header.
+ *
+ * By default responses are returned immediately. PKCS11_APDU_REPLAY_TIMING=original delays
+ * each response by the recorded time, a numeric value scales the recorded time with the
+ * given factor.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include <common/mutex.h>
+#include <common/memset_s.h>
+
+#include <pkcs11/p11generic.h>
+#include <pkcs11/slot-replay.h>
+#include <pkcs11/slot.h>
+#include <pkcs11/slotpool.h>
+#include <pkcs11/token.h>
+#include <pkcs11/strbpcpy.h>
+
+#include <common/debug.h>
+
+#ifdef CTAPI
+#include "slot-ctapi.h"
+#else
+#include "slot-pcsc.h"
+#endif
+
+#define REPLAY_LINE_SIZE		(2 * (MAX_CAPDU + MAX_RAPDU) + 256)
+
+struct replayRecord {
+	unsigned long micros;             /**< Recorded time for the exchange      */
+	int redacted;                     /**< Only the command header is known    */
+	int clen;                         /**< Length of the command APDU          */
+	int rlen;                         /**< Length of the response or -1        */
+	unsigned char *capdu;             /**< Command APDU                        */
+	unsigned char *rapdu;             /**< Response APDU including SW1/SW2     */
+};
+
+struct replaySlot {
+	unsigned long id;                 /**< Slot id at the time of recording    */
+	char description[65];             /**< Slot description                    */
+	int maxCAPDU;
+	int maxRAPDU;
+	int noExtLengthReadAll;
+	unsigned char atr[36];
+	int atrlen;                       /**< Length of ATR, 0 if slot was empty  */
+	int noToken;                      /**< Token detection failed during replay*/
+	struct replayRecord *records;
+	int count;
+	int size;
+	int cursor;                       /**< Record following the last match     */
+	struct p11Slot_t *slot;           /**< Slot created for this entry         */
+};
+
+extern struct p11Context_t *context;
+
+static int initialized = FALSE;
+static MUTEX replayMutex;
+
+static FILE *recordFile = NULL;
+static unsigned long recordedSlots[MAX_REPLAY_SLOTS];
+static int recordedSlotCount = 0;
+
+static struct replaySlot replaySlots[MAX_REPLAY_SLOTS];
+static int replaySlotCount = 0;
+static int replayMode = FALSE;
+static double timingFactor = 0.0;
+
+
+
+/**
+ * Decide if the command data must not be written to the transcript
+ */
+static int isSecretCommand(unsigned char *capdu, size_t len)
+{
+	if (len < 4)
+		return FALSE;
+
+	switch(capdu[1]) {
+	case 0x20:		// VERIFY
+	case 0x24:		// CHANGE REFERENCE DATA
+	case 0x2C:		// RESET RETRY COUNTER
+		return TRUE;
+	case 0x50:		// SmartCard-HSM INITIALIZE DEVICE
+	case 0x52:		// SmartCard-HSM IMPORT DKEK SHARE
+		return capdu[0] == 0x80;
+	}
+	return FALSE;
+}
+
+
+
+static void writeHex(FILE *fp, unsigned char *data, size_t len)
+{
+	while (len--)
+		fprintf(fp, "%02X", *data++);
+}
+
+
+
+static void writeSlotDescription(FILE *fp, struct p11Slot_t *slot)
+{
+	int i;
+
+	i = sizeof(slot->info.slotDescription);
+	while ((i > 0) && (slot->info.slotDescription[i - 1] == ' '))
+		i--;
+
+	fprintf(fp, "%.*s", i, slot->info.slotDescription);
+}
+
+
+
+/**
+ * Write the SLOT line for a slot, if not yet done
+ *
+ * Must be called with the replay mutex held.
+ */
+static void recordSlot(struct p11Slot_t *slot)
+{
+	int i;
+
+	for (i = 0; i < recordedSlotCount; i++) {
+		if (recordedSlots[i] == slot->id)
+			return;
+	}
+
+	if (recordedSlotCount < MAX_REPLAY_SLOTS)
+		recordedSlots[recordedSlotCount++] = slot->id;
+
+	fprintf(recordFile, "SLOT %lu %d %d %d ", slot->id, slot->maxCAPDU, slot->maxRAPDU, slot->noExtLengthReadAll);
+	writeSlotDescription(recordFile, slot);
+	fprintf(recordFile, "\n");
+}
+
+
+
+/**
+ * Record the ATR of a newly detected token
+ *
+ * @param slot      The slot in which the token was detected
+ * @param atr       The ATR returned by the reader
+ * @param atrlen    The length of the ATR
+ */
+void recordATR(struct p11Slot_t *slot, unsigned char *atr, size_t atrlen)
+{
+	if (recordFile == NULL)
+		return;
+
+	if (slot->primarySlot)
+		slot = slot->primarySlot;
+
+	mutex_lock(&replayMutex);
+
+	recordSlot(slot);
+
+	fprintf(recordFile, "ATR %lu ", slot->id);
+	writeHex(recordFile, atr, atrlen);
+	fprintf(recordFile, "\n");
+	fflush(recordFile);
+
+	mutex_unlock(&replayMutex);
+}
+
+
+
+/**
+ * Transmit an APDU using the reader and write the exchange to the transcript
+ *
+ * The command is transmitted in place, so a copy is kept for the transcript.
+ *
+ * @param slot      The primary slot
+ * @param capdu     The command APDU
+ * @param capdu_len The length of the command APDU
+ * @param rapdu     The buffer receiving the response APDU
+ * @param rapdu_len The size of the response buffer
+ * @return          The length of the response APDU or -1 on error
+ */
+int transmitAPDUwithRecording(struct p11Slot_t *slot,
+		unsigned char *capdu, size_t capdu_len,
+		unsigned char *rapdu, size_t rapdu_len)
+{
+	unsigned char cmd[MAX_CAPDU];
+	unsigned long long start;
+	unsigned long micros;
+	int rc;
+
+	if (capdu_len > sizeof(cmd))
+		return -1;
+
+	memcpy(cmd, capdu, capdu_len);
+
+	start = getMicroseconds();
+
+#ifdef CTAPI
+	rc = transmitAPDUviaCTAPI(slot, 0,
+			capdu, capdu_len,
+			rapdu, rapdu_len);
+#else
+	rc = transmitAPDUviaPCSC(slot,
+			capdu, capdu_len,
+			rapdu, rapdu_len);
+#endif
+
+	micros = (unsigned long)(getMicroseconds() - start);
+
+	mutex_lock(&replayMutex);
+
+	recordSlot(slot);
+
+	fprintf(recordFile, "APDU %lu %lu ", slot->id, micros);
+	if (isSecretCommand(cmd, capdu_len)) {
+		writeHex(recordFile, cmd, 4);
+		fprintf(recordFile, "* ");
+	} else {
+		writeHex(recordFile, cmd, capdu_len);
+		fprintf(recordFile, " ");
+	}
+
+	if (rc >= 0) {
+		writeHex(recordFile, rapdu, rc);
+	} else {
+		fprintf(recordFile, "-");
+	}
+	fprintf(recordFile, "\n");
+	fflush(recordFile);
+
+	mutex_unlock(&replayMutex);
+
+	memset_s(cmd, sizeof(cmd), 0, sizeof(cmd));
+	return rc;
+}
+
+
+
+/**
+ * Decode hexadecimal characters up to the next space, * or end of line
+ *
+ * @param p         Pointer to the input, updated to point behind the decoded characters
+ * @param buf       The output buffer
+ * @param size      The size of the output buffer
+ * @return          The number of decoded bytes or -1 on error
+ */
+static int decodeHex(char **p, unsigned char *buf, int size)
+{
+	char *s = *p;
+	int len, i, c, v;
+
+	len = 0;
+	while (*s && (*s != ' ') && (*s != '*')) {
+		v = 0;
+		for (i = 0; i < 2; i++) {
+			c = *s++;
+			if ((c >= '0') && (c <= '9')) {
+				c -= '0';
+			} else if ((c >= 'A') && (c <= 'F')) {
+				c -= 'A' - 10;
+			} else if ((c >= 'a') && (c <= 'f')) {
+				c -= 'a' - 10;
+			} else {
+				return -1;
+			}
+			v = (v << 4) | c;
+		}
+		if (len >= size)
+			return -1;
+		buf[len++] = (unsigned char)v;
+	}
+
+	*p = s;
+	return len;
+}
+
+
+
+static struct replaySlot *findReplaySlotById(unsigned long id)
+{
+	int i;
+
+	for (i = 0; i < replaySlotCount; i++) {
+		if (replaySlots[i].id == id)
+			return &replaySlots[i];
+	}
+	return NULL;
+}
+
+
+
+static struct replaySlot *findReplaySlot(struct p11Slot_t *slot)
+{
+	int i;
+
+	for (i = 0; i < replaySlotCount; i++) {
+		if (replaySlots[i].slot == slot)
+			return &replaySlots[i];
+	}
+	return NULL;
+}
+
+
+
+static int parseSlot(char *line)
+{
+	struct replaySlot *rs;
+	unsigned long id;
+	int maxc, maxr, noext, ofs;
+
+	ofs = 0;
+	if (sscanf(line, "%lu %d %d %d %n", &id, &maxc, &maxr, &noext, &ofs) < 4)
+		return -1;
+
+	if (findReplaySlotById(id) != NULL)
+		return 0;
+
+	if (replaySlotCount >= MAX_REPLAY_SLOTS)
+		return -1;
+
+	rs = &replaySlots[replaySlotCount++];
+	memset(rs, 0, sizeof(*rs));
+	rs->id = id;
+	rs->maxCAPDU = (maxc > 0) && (maxc <= MAX_CAPDU) ? maxc : MAX_CAPDU;
+	rs->maxRAPDU = (maxr > 0) && (maxr <= MAX_RAPDU) ? maxr : MAX_RAPDU;
+	rs->noExtLengthReadAll = noext;
+	strncpy(rs->description, line + ofs, sizeof(rs->description) - 1);
+	return 0;
+}
+
+
+
+static int parseATR(char *line)
+{
+	struct replaySlot *rs;
+	unsigned long id;
+	int ofs, len;
+	char *p;
+
+	ofs = 0;
+	if (sscanf(line, "%lu %n", &id, &ofs) < 1)
+		return -1;
+
+	rs = findReplaySlotById(id);
+	if (rs == NULL)
+		return -1;
+
+	// Only the first token in the slot is replayed
+	if (rs->atrlen > 0)
+		return 0;
+
+	p = line + ofs;
+	len = decodeHex(&p, rs->atr, sizeof(rs->atr));
+	if (len < 0)
+		return -1;
+
+	rs->atrlen = len;
+	return 0;
+}
+
+
+
+static int parseAPDU(char *line, unsigned char *scr)
+{
+	struct replaySlot *rs;
+	struct replayRecord *rec;
+	unsigned long id, micros;
+	int ofs, clen, rlen, redacted;
+	char *p;
+
+	ofs = 0;
+	if (sscanf(line, "%lu %lu %n", &id, &micros, &ofs) < 2)
+		return -1;
+
+	rs = findReplaySlotById(id);
+	if (rs == NULL)
+		return -1;
+
+	p = line + ofs;
+	clen = decodeHex(&p, scr, MAX_CAPDU);
+	if (clen < 4)
+		return -1;
+
+	redacted = (*p == '*');
+	if (redacted)
+		p++;
+
+	if (*p++ != ' ')
+		return -1;
+
+	if (*p == '-') {
+		rlen = -1;
+	} else {
+		rlen = decodeHex(&p, scr + clen, MAX_RAPDU);
+		if (rlen < 2)
+			return -1;
+	}
+
+	if (rs->count == rs->size) {
+		rec = (struct replayRecord *)realloc(rs->records, (rs->size + 256) * sizeof(struct replayRecord));
+		if (rec == NULL)
+			return -1;
+		rs->records = rec;
+		rs->size += 256;
+	}
+
+	rec = &rs->records[rs->count];
+	rec->capdu = (unsigned char *)malloc(clen + (rlen > 0 ? rlen : 0));
+	if (rec->capdu == NULL)
+		return -1;
+
+	memcpy(rec->capdu, scr, clen + (rlen > 0 ? rlen : 0));
+	rec->rapdu = rec->capdu + clen;
+	rec->clen = clen;
+	rec->rlen = rlen;
+	rec->redacted = redacted;
+	rec->micros = micros;
+	rs->count++;
+	return 0;
+}
+
+
+
+/**
+ * Load the transcript into memory
+ */
+static int loadTranscript(char *filename)
+{
+	FILE *fp;
+	char *line, *p;
+	unsigned char *scr;
+	int lineno, rc;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		debug("Could not open APDU transcript %s\n", filename);
+		return -1;
+	}
+
+	line = (char *)malloc(REPLAY_LINE_SIZE);
+	scr = (unsigned char *)malloc(MAX_CAPDU + MAX_RAPDU);
+
+	if ((line == NULL) || (scr == NULL)) {
+		free(line);
+		free(scr);
+		fclose(fp);
+		return -1;
+	}
+
+	lineno = 0;
+	while (fgets(line, REPLAY_LINE_SIZE, fp)) {
+		lineno++;
+
+		p = line + strlen(line);
+		while ((p > line) && ((p[-1] == '\n') || (p[-1] == '\r')))
+			*--p = 0;
+
+		if ((*line == 0) || (*line == '#'))
+			continue;
+
+		if (!strncmp(line, "SLOT ", 5)) {
+			rc = parseSlot(line + 5);
+		} else if (!strncmp(line, "ATR ", 4)) {
+			rc = parseATR(line + 4);
+		} else if (!strncmp(line, "APDU ", 5)) {
+			rc = parseAPDU(line + 5, scr);
+		} else {
+			rc = -1;
+		}
+
+		if (rc < 0)
+			debug("Ignoring invalid line %d in APDU transcript\n", lineno);
+	}
+
+	free(line);
+	free(scr);
+	fclose(fp);
+	return 0;
+}
+
+
+
+static int matchRecord(struct replayRecord *rec, unsigned char *capdu, size_t capdu_len, int headerOnly)
+{
+	if (memcmp(rec->capdu, capdu, 4))
+		return FALSE;
+
+	if (headerOnly || rec->redacted)
+		return TRUE;
+
+	return (rec->clen == capdu_len) && !memcmp(rec->capdu, capdu, capdu_len);
+}
+
+
+
+static void delayResponse(unsigned long micros)
+{
+	unsigned long delay;
+
+	if (timingFactor <= 0.0)
+		return;
+
+	delay = (unsigned long)(micros * timingFactor);
+
+#ifdef _WIN32
+	Sleep(delay / 1000);
+#else
+	usleep(delay);
+#endif
+}
+
+
+
+/**
+ * Answer a command APDU from the transcript
+ *
+ * @param slot      The primary slot
+ * @param capdu     The command APDU
+ * @param capdu_len The length of the command APDU
+ * @param rapdu     The buffer receiving the response APDU
+ * @param rapdu_len The size of the response buffer
+ * @return          The length of the response APDU or -1 if no response was recorded
+ */
+int transmitAPDUviaReplay(struct p11Slot_t *slot,
+		unsigned char *capdu, size_t capdu_len,
+		unsigned char *rapdu, size_t rapdu_len)
+{
+	struct replaySlot *rs;
+	struct replayRecord *rec;
+	int i, n, headerOnly;
+
+	if (capdu_len < 4)
+		return -1;
+
+	mutex_lock(&replayMutex);
+
+	rs = findReplaySlot(slot);
+	rec = NULL;
+
+	for (headerOnly = 0; (rs != NULL) && (rec == NULL) && (headerOnly < 2); headerOnly++) {
+		for (i = 0; i < rs->count; i++) {
+			n = (rs->cursor + i) % rs->count;
+			if (matchRecord(&rs->records[n], capdu, capdu_len, headerOnly)) {
+				rec = &rs->records[n];
+				rs->cursor = n + 1;
+				break;
+			}
+		}
+	}
+
+	mutex_unlock(&replayMutex);
+
+	if (rec == NULL) {
+		debug("No recorded response for %02X %02X %02X %02X\n", capdu[0], capdu[1], capdu[2], capdu[3]);
+		return -1;
+	}
+
+	delayResponse(rec->micros);
+
+	if ((rec->rlen < 0) || (rec->rlen > (int)rapdu_len))
+		return -1;
+
+	memcpy(rapdu, rec->rapdu, rec->rlen);
+	return rec->rlen;
+}
+
+
+
+/**
+ * Detect the token in a replay slot using the recorded ATR
+ *
+ * @param slot      The replay slot
+ * @param token     The variable receiving the token or NULL
+ * @return          CKR_OK or CKR_TOKEN_NOT_PRESENT
+ */
+int getReplayToken(struct p11Slot_t *slot, struct p11Token_t **token)
+{
+	struct replaySlot *rs;
+	struct p11Token_t *ptoken;
+	int rc;
+
+	FUNC_CALLED();
+
+	rs = findReplaySlot(slot);
+
+	if ((slot->token == NULL) && (rs != NULL) && (rs->atrlen > 0) && !rs->noToken) {
+		rc = newToken(slot, rs->atr, rs->atrlen, &ptoken);
+
+		// Don't consume the transcript with repeated detection attempts
+		if (rc != CKR_OK) {
+			rs->noToken = TRUE;
+			*token = NULL;
+			FUNC_FAILS(rc, "newToken() failed");
+		}
+	}
+
+	rc = getToken(slot, token);
+	FUNC_RETURNS(rc);
+}
+
+
+
+/**
+ * Create a slot for each slot in the transcript
+ *
+ * Must be called with the global lock held.
+ *
+ * @param pool the pool of already allocated slots
+ */
+int updateReplaySlots(struct p11SlotPool_t *pool)
+{
+	struct replaySlot *rs;
+	struct p11Slot_t *slot;
+	struct p11Token_t *token;
+	int i;
+
+	FUNC_CALLED();
+
+	for (i = 0; i < replaySlotCount; i++) {
+		rs = &replaySlots[i];
+		if (rs->slot != NULL)
+			continue;
+
+		slot = (struct p11Slot_t *) calloc(1, sizeof(struct p11Slot_t));
+
+		if (slot == NULL) {
+			FUNC_FAILS(CKR_HOST_MEMORY, "Out of memory");
+		}
+
+		slot->isReplay = 1;
+		slot->id = rs->id;
+
+		strbpcpy(slot->info.slotDescription,
+				rs->description,
+				sizeof(slot->info.slotDescription));
+
+		strbpcpy(slot->info.manufacturerID,
+				"CardContact",
+				sizeof(slot->info.manufacturerID));
+
+		slot->info.firmwareVersion.major = VERSION_MAJOR;
+		slot->info.firmwareVersion.minor = VERSION_MINOR;
+
+		slot->info.flags = CKF_REMOVABLE_DEVICE;
+
+		slot->eventOccured = TRUE;
+
+		slot->maxCAPDU = rs->maxCAPDU;
+		slot->maxRAPDU = rs->maxRAPDU;
+		slot->noExtLengthReadAll = rs->noExtLengthReadAll;
+
+		if (context->caller != CALLER_FIREFOX) {
+			slot->supportsVirtualSlots = 1;
+		}
+
+		rs->slot = slot;
+
+		addSlot(pool, slot);
+
+		// Keep automatically assigned ids clear of the recorded ids
+		if (pool->nextSlotID <= slot->id)
+			pool->nextSlotID = slot->id + 4;
+
+		debug("Added replay slot (%lu) with %d APDUs\n", slot->id, rs->count);
+
+		getReplayToken(slot, &token);
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+int closeReplaySlot(struct p11Slot_t *slot)
+{
+	struct replaySlot *rs;
+
+	FUNC_CALLED();
+
+	rs = findReplaySlot(slot);
+	if (rs != NULL)
+		rs->slot = NULL;
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+int isReplayEnabled()
+{
+	return replayMode;
+}
+
+
+
+int isRecordingEnabled()
+{
+	return recordFile != NULL;
+}
+
+
+
+/**
+ * Open the transcript for recording or load the transcript for replay
+ *
+ * @return          CKR_OK or CKR_GENERAL_ERROR if the transcript for replay can not be read
+ */
+int initReplay()
+{
+	char *record, *replay, *timing;
+
+	record = getenv("PKCS11_APDU_RECORD");
+	replay = getenv("PKCS11_APDU_REPLAY");
+
+	if ((record == NULL) && (replay == NULL))
+		return CKR_OK;
+
+	if (mutex_init(&replayMutex) != 0)
+		return CKR_GENERAL_ERROR;
+
+	initialized = TRUE;
+
+	if (replay != NULL) {
+		if (loadTranscript(replay) < 0) {
+			terminateReplay();
+			return CKR_GENERAL_ERROR;
+		}
+
+		timing = getenv("PKCS11_APDU_REPLAY_TIMING");
+		if (timing == NULL) {
+			timingFactor = 0.0;
+		} else if (!strcmp(timing, "original")) {
+			timingFactor = 1.0;
+		} else {
+			timingFactor = atof(timing);
+		}
+
+		replayMode = TRUE;
+		debug("Replaying %d slots from %s\n", replaySlotCount, replay);
+		return CKR_OK;
+	}
+
+	recordFile = fopen(record, "w");
+	if (recordFile == NULL) {
+		debug("Could not create APDU transcript %s\n", record);
+		return CKR_OK;
+	}
+
+	fprintf(recordFile, "# APDU transcript recorded by the SmartCard-HSM PKCS#11 module\n");
+	recordedSlotCount = 0;
+	return CKR_OK;
+}
+
+
+
+/**
+ * Close the transcript and release all recorded APDUs
+ */
+void terminateReplay()
+{
+	int i, j;
+
+	if (!initialized)
+		return;
+
+	if (recordFile != NULL) {
+		fclose(recordFile);
+		recordFile = NULL;
+	}
+
+	for (i = 0; i < replaySlotCount; i++) {
+		for (j = 0; j < replaySlots[i].count; j++)
+			free(replaySlots[i].records[j].capdu);
+		free(replaySlots[i].records);
+	}
+
+	replaySlotCount = 0;
+	recordedSlotCount = 0;
+	replayMode = FALSE;
+
+	mutex_destroy(&replayMutex);
+	initialized = FALSE;
+}
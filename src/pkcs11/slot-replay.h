@@ -0,0 +1,57 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    slot-replay.h
+ * @author  Andreas Schwier
+ * @brief   Recording and replay of APDU transcripts
+ */
+
+#ifndef ___SLOT_REPLAY_H_INC___
+#define ___SLOT_REPLAY_H_INC___
+
+#include <pkcs11/cryptoki.h>
+#include <pkcs11/p11generic.h>
+
+#define MAX_REPLAY_SLOTS		8
+
+int initReplay();
+void terminateReplay();
+int isReplayEnabled();
+int isRecordingEnabled();
+void recordATR(struct p11Slot_t *slot, unsigned char *atr, size_t atrlen);
+int transmitAPDUwithRecording(struct p11Slot_t *slot,
+		unsigned char *capdu, size_t capdu_len,
+		unsigned char *rapdu, size_t rapdu_len);
+int transmitAPDUviaReplay(struct p11Slot_t *slot,
+		unsigned char *capdu, size_t capdu_len,
+		unsigned char *rapdu, size_t rapdu_len);
+int updateReplaySlots(struct p11SlotPool_t *pool);
+int getReplayToken(struct p11Slot_t *slot, struct p11Token_t **token);
+int closeReplaySlot(struct p11Slot_t *slot);
+
+#endif /* ___SLOT_REPLAY_H_INC___ */
@@ -40,10 +40,15 @@
 #include <pkcs11/token.h>
 #include <pkcs11/slotpool.h>
 #include <pkcs11/session.h>
+#include <pkcs11/reclaim.h>
+#include <pkcs11/scheduler.h>
+#ifndef MINIDRIVER
+#include <pkcs11/randompool.h>
+#include <pkcs11/keypool.h>
+#include <pkcs11/perfstats.h>
+#endif
 
-#ifdef DEBUG
 #include <common/debug.h>
-#endif
 
 #ifdef CTAPI
 #include "slot-ctapi.h"
@@ -51,6 +56,11 @@
 #include "slot-pcsc.h"
 #endif
 
+#ifndef MINIDRIVER
+#include "slot-cluster.h"
+#include "slot-replay.h"
+#endif
+
 #ifndef _WIN32
 #include <unistd.h>
 #endif
@@ -59,6 +69,17 @@
 extern struct p11Context_t *context;
 #endif
 
+static int recoveryEnabled = -1;
+static CK_SC_HSM_RECOVERY_CALLBACK recoveryCallback = NULL;
+static CK_VOID_PTR recoveryApplication = NULL;
+
+
+
+static void freeRetiredToken(void *ptr)
+{
+	freeToken((struct p11Token_t *)ptr);
+}
+
 
 
 /**
@@ -87,12 +108,16 @@ int addToken(struct p11Slot_t *slot, struct p11Token_t *token)
 	}
 
 	if (slot->removedToken) {
-		freeToken(slot->removedToken);
+		retirePointer(slot->removedToken, freeRetiredToken);
 		slot->removedToken = NULL;
 	}
 
+	// Concurrent lookups must see a fully initialized token
+	MEMORY_BARRIER();
+
 	slot->token = token;                     /* Add token to slot                */
 	slot->info.flags |= CKF_TOKEN_PRESENT;   /* indicate the presence of a token */
+	slot->presenceValid = FALSE;
 	if (slot->primarySlot != NULL)
 		slot->eventOccured = TRUE;
 
@@ -140,15 +165,22 @@ int removeToken(struct p11Slot_t *slot)
 #ifndef MINIDRIVER
 		closeSessionsForSlot(&context->sessionPool, slot->id);
 #endif
-		freeToken(slot->removedToken);
+		retirePointer(slot->removedToken, freeRetiredToken);
 		slot->removedToken = NULL;
 	}
 
+#ifndef MINIDRIVER
+	clearRandomPool(slot->token);
+	clearKeyPool(slot->token);
+#endif
+
 	// A removed token and associated sessions are not immediately released from memory
-	// to give running threads a change to complete token operations.
+	// to give running threads a change to complete token operations. Memory is finally
+	// released once no thread references the token anymore.
 	slot->removedToken = slot->token;
 	slot->token = NULL;
 	slot->info.flags &= ~CKF_TOKEN_PRESENT;
+	slot->presenceValid = FALSE;
 	if (slot->primarySlot != NULL)
 		slot->eventOccured = TRUE;
 
@@ -236,38 +268,15 @@ int encodeCommandAPDU(
 
 
 
-/*
- *  Process an ISO 7816 APDU with the underlying terminal hardware.
- *
- *  CLA     : Class byte of instruction
- *  INS     : Instruction byte
- *  P1      : Parameter P1
- *  P2      : Parameter P2
- *  OutLen  : Length of outgoing data (Lc)
- *  OutData : Outgoing data or NULL if none
- *  InLen   : Length of incoming data (Le)
- *  InData  : Input buffer for incoming data
- *  InSize  : buffer size
- *  SW1SW2  : Address of short integer to receive SW1SW2
- *
- *  Returns : < 0 Error > 0 Bytes read
+/**
+ * Write command APDU to the log, hiding PIN values
  */
-int transmitAPDU(struct p11Slot_t *slot,
-		unsigned char CLA, unsigned char INS, unsigned char P1, unsigned char P2,
-		int OutLen, unsigned char *OutData,
-		int InLen, unsigned char *InData, int InSize, unsigned short *SW1SW2)
+static void traceCommandAPDU(unsigned char CLA, unsigned char INS, unsigned char P1, unsigned char P2,
+		int OutLen, unsigned char *OutData, int InLen, int hasInData)
 {
-	int rc;
-	unsigned char apdu[MAX_CAPDU];
-#ifdef DEBUG
 	char scr[MAX_CAPDU + 128];
 	char *po;
-#endif
-
-	if (slot->primarySlot)
-		slot = slot->primarySlot;
 
-#ifdef DEBUG
 	sprintf(scr, "C-APDU: %02X %02X %02X %02X ", CLA, INS, P1, P2);
 	po = strchr(scr, '\0');
 
@@ -290,35 +299,241 @@ int transmitAPDU(struct p11Slot_t *slot,
 		po++;
 	}
 
-	if (InData && InSize)
+	if (hasInData)
 		sprintf(po, "Le=%02X(%d)", InLen, InLen);
 
 	debug("%s\n", scr);
 	memset_s(scr, sizeof(scr), 0, sizeof(scr));
+}
+
+
+
+/**
+ * Write response APDU to the log
+ */
+static void traceResponseAPDU(int rc, unsigned char *InData, unsigned short SW1SW2)
+{
+	char scr[MAX_CAPDU + 128];
+	char *po;
+
+	if (rc > 0 && InData) {
+		sprintf(scr, "R-APDU: Lr=%02X(%d) ", rc, rc);
+		po = strchr(scr, '\0');
+		if (rc > 2048) {
+			decodeBCDString(InData, 2048, po);
+			strcat(scr, "..");
+		} else {
+			decodeBCDString(InData, rc, po);
+		}
+
+		po = strchr(scr, '\0');
+		sprintf(po, " SW1/SW2=%04X", SW1SW2);
+	} else
+		sprintf(scr, "R-APDU: rc=%d SW1/SW2=%04X", rc, SW1SW2);
+
+	debug("%s\n", scr);
+	memset_s(scr, sizeof(scr), 0, sizeof(scr));
+}
+
+
+
+/**
+ * Enable transparent recovery after the card was reset by another process
+ *
+ * Recovery can also be enabled with PKCS11_RESET_RECOVERY=1. Without a callback
+ * a login is only restored for tokens with a PIN pad.
+ *
+ * @param callback      Function supplying the PIN or NULL
+ * @param application   Argument passed to the callback
+ * @return              CKR_OK
+ */
+int setResetRecovery(CK_SC_HSM_RECOVERY_CALLBACK callback, CK_VOID_PTR application)
+{
+	recoveryCallback = callback;
+	recoveryApplication = application;
+	recoveryEnabled = TRUE;
+	return CKR_OK;
+}
+
+
+
+int isResetRecoveryEnabled()
+{
+	char *val;
+
+	if (recoveryEnabled < 0) {
+		val = getenv("PKCS11_RESET_RECOVERY");
+		recoveryEnabled = (val != NULL) && !strcmp(val, "1");
+	}
+	return recoveryEnabled;
+}
+
+
+
+/**
+ * Obtain the PIN to restore a login after the card was reset
+ *
+ * @param slot      The slot in which the token is inserted
+ * @param userType  The user that was logged in
+ * @param pin       Buffer receiving the PIN
+ * @param pinlen    Size of the buffer on entry, length of the PIN or 0 for the PIN pad on return
+ * @return          CKR_OK or CKR_USER_NOT_LOGGED_IN if the login can not be restored
+ */
+int getRecoveryPIN(struct p11Slot_t *slot, CK_USER_TYPE userType, CK_UTF8CHAR_PTR pin, CK_ULONG_PTR pinlen)
+{
+	if (recoveryCallback != NULL)
+		return recoveryCallback(slot->id, userType, pin, pinlen, recoveryApplication);
+
+	if (slot->token && (slot->token->info.flags & CKF_PROTECTED_AUTHENTICATION_PATH)) {
+		*pinlen = 0;
+		return CKR_OK;
+	}
+
+	return CKR_USER_NOT_LOGGED_IN;
+}
+
+
+
+#ifndef CTAPI
+/**
+ * Let the token driver restore the applet selection and login after a card reset
+ *
+ * The pending reset is cleared even if the driver fails, so that subsequent operations
+ * fail on the card rather than triggering recovery over and over again.
+ */
+static int restoreTokenState(struct p11Slot_t *slot)
+{
+	int rc;
+
+	FUNC_CALLED();
+
+	slot->resetPending = FALSE;
+
+	if (!slot->token || !slot->token->drv->recover) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Token does not support recovery");
+	}
+
+	slot->recovering = TRUE;
+	rc = slot->token->drv->recover(slot);
+	slot->recovering = FALSE;
+
+	if (rc != CKR_OK) {
+		FUNC_FAILS(rc, "Restoring token state failed");
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+#endif
+
+
+
+/*
+ *  Process an ISO 7816 APDU with the underlying terminal hardware.
+ *
+ *  CLA     : Class byte of instruction
+ *  INS     : Instruction byte
+ *  P1      : Parameter P1
+ *  P2      : Parameter P2
+ *  OutLen  : Length of outgoing data (Lc)
+ *  OutData : Outgoing data or NULL if none
+ *  InLen   : Length of incoming data (Le)
+ *  InData  : Input buffer for incoming data
+ *  InSize  : buffer size
+ *  SW1SW2  : Address of short integer to receive SW1SW2
+ *
+ *  Returns : < 0 Error > 0 Bytes read
+ */
+int transmitAPDU(struct p11Slot_t *slot,
+		unsigned char CLA, unsigned char INS, unsigned char P1, unsigned char P2,
+		int OutLen, unsigned char *OutData,
+		int InLen, unsigned char *InData, int InSize, unsigned short *SW1SW2)
+{
+	int rc, len;
+	unsigned char apdu[MAX_CAPDU];
+#ifndef MINIDRIVER
+	unsigned long long start;
+#endif
+#ifndef CTAPI
+	int replayed = FALSE;
+#endif
+
+	if (slot->primarySlot)
+		slot = slot->primarySlot;
+
+#ifndef CTAPI
+	// Restore the token state lost with a reset detected while locking the card
+	if (slot->resetPending && !slot->recovering && (restoreTokenState(slot) != CKR_OK)) {
+		FUNC_FAILS(-1, "Token state could not be restored after reset");
+	}
 #endif
 
+	if (LOG_ENABLED(LOG_LEVEL_DEBUG))
+		traceCommandAPDU(CLA, INS, P1, P2, OutLen, OutData, InLen, InData && InSize);
+
+	if (traceEnabled)
+		traceRecord('B', "APDU", TRACE_ARGS_COMMAND, CLA, INS, P1, P2, OutLen, InData ? InLen : -1);
+
+#ifndef CTAPI
+replay:
+#endif
 	rc = encodeCommandAPDU(CLA, INS, P1, P2,
 			OutLen, OutData, InData ? InLen : -1,
 			apdu, sizeof(apdu));
 
 	if (rc < 0) {
 		memset_s(apdu, sizeof(apdu), 0, sizeof(apdu));
+		TRACE_END("APDU");
 		FUNC_FAILS(rc, "Encoding APDU failed");
 	}
 
+	len = rc;
+#ifndef MINIDRIVER
+	start = perfTimestamp();
+#endif
+
+#ifndef MINIDRIVER
+	if (slot->isReplay) {
+		rc = transmitAPDUviaReplay(slot,
+				apdu, len,
+				apdu, sizeof(apdu));
+	} else if (isRecordingEnabled()) {
+		rc = transmitAPDUwithRecording(slot,
+				apdu, len,
+				apdu, sizeof(apdu));
+	} else
+#endif
+	{
 #ifdef CTAPI
-	rc = transmitAPDUviaCTAPI(slot, 0,
-			apdu, rc,
-			apdu, sizeof(apdu));
+		rc = transmitAPDUviaCTAPI(slot, 0,
+				apdu, len,
+				apdu, sizeof(apdu));
 #else
-	rc = transmitAPDUviaPCSC(slot,
-			apdu, rc,
-			apdu, sizeof(apdu));
+		rc = transmitAPDUviaPCSC(slot,
+				apdu, len,
+				apdu, sizeof(apdu));
 #endif
+	}
+
+#ifndef CTAPI
+	// The card was reset by another process before the APDU was processed. Reconnect,
+	// restore the token state and send the APDU again, unless it continues a chain
+	if ((rc == ERR_CARD_RESET) && !replayed && !slot->recovering && !slot->inChain && !(CLA & 0x10) && isResetRecoveryEnabled()) {
+		replayed = TRUE;
+		if ((reconnectPCSCSlot(slot) == CKR_OK) && (restoreTokenState(slot) == CKR_OK)) {
+			debug("Replaying APDU after card reset\n");
+			goto replay;
+		}
+	}
+#endif
+
+	slot->inChain = (CLA & 0x10) && (rc >= 0);
 
 	if (rc >= 2) {
 		*SW1SW2 = (apdu[rc - 2] << 8) | apdu[rc - 1];
 		rc -= 2;
+#ifndef MINIDRIVER
+		perfCountAPDU(slot, start, len, rc, *SW1SW2);
+#endif
 
 		if (InData && InSize) {
 			if (rc > InSize) {		// Never return more than caller allocated a buffer for
@@ -327,27 +542,25 @@ int transmitAPDU(struct p11Slot_t *slot,
 			memcpy(InData, apdu, rc);
 		}
 	} else {
+#ifndef MINIDRIVER
+		perfCountAPDU(slot, start, len, -1, 0);
+#endif
 		rc = -1;
 	}
 
-#ifdef DEBUG
-	if (rc > 0 && InData) {
-		sprintf(scr, "R-APDU: Lr=%02X(%d) ", rc, rc);
-		po = strchr(scr, '\0');
-		if (rc > 2048) {
-			decodeBCDString(InData, 2048, po);
-			strcat(scr, "..");
-		} else {
-			decodeBCDString(InData, rc, po);
-		}
+	// A failed transmission or a change in the security state of the card invalidates
+	// the cached result of the last presence check. PIN status queries are excluded.
+	if ((rc < 0) ||
+		(*SW1SW2 == 0x6982) ||
+		(((*SW1SW2 == 0x6983) || ((*SW1SW2 & 0xFFF0) == 0x63C0)) && ((INS != 0x20) || OutLen)))
+		slot->presenceValid = FALSE;
 
-		po = strchr(scr, '\0');
-		sprintf(po, " SW1/SW2=%04X", *SW1SW2);
-	} else
-		sprintf(scr, "R-APDU: rc=%d SW1/SW2=%04X", rc, *SW1SW2);
+	if (LOG_ENABLED(LOG_LEVEL_DEBUG))
+		traceResponseAPDU(rc, InData, *SW1SW2);
+
+	if (traceEnabled)
+		traceRecord('E', "APDU", TRACE_ARGS_RESPONSE, rc, *SW1SW2, 0, 0, 0, 0);
 
-	debug("%s\n", scr);
-#endif
 	memset_s(apdu, sizeof(apdu), 0, sizeof(apdu));
 	return rc;
 }
@@ -362,18 +575,11 @@ int transmitVerifyPinAPDU(struct p11Slot_t *slot,
 {
 	int rc;
 	unsigned char apdu[MAX_CAPDU];
-#ifdef DEBUG
-	char scr[MAX_CAPDU + 128];
-#endif
 
 	if (slot->primarySlot)
 		slot = slot->primarySlot;
 
-#ifdef DEBUG
-	sprintf(scr, "C-APDU: %02X %02X %02X %02X ", CLA, INS, P1, P2);
-
-	debug("%s\n", scr);
-#endif
+	debug("C-APDU: %02X %02X %02X %02X\n", CLA, INS, P1, P2);
 
 	rc = encodeCommandAPDU(CLA, INS, P1, P2,
 			OutLen, OutData, -1,
@@ -382,6 +588,9 @@ int transmitVerifyPinAPDU(struct p11Slot_t *slot,
 	if (rc < 0)
 		FUNC_FAILS(rc, "Encoding APDU failed");
 
+	if (traceEnabled)
+		traceRecord('B', "VerifyPIN", TRACE_ARGS_COMMAND, CLA, INS, P1, P2, OutLen, -1);
+
 #ifdef CTAPI
 	/*
 	 * Not implemented yet
@@ -401,15 +610,65 @@ int transmitVerifyPinAPDU(struct p11Slot_t *slot,
 		rc -= 2;
 	}
 
-#ifdef DEBUG
-	sprintf(scr, "R-APDU: rc=%d SW1/SW2=%04X", rc, *SW1SW2);
-	debug("%s\n", scr);
-#endif
+	debug("R-APDU: rc=%d SW1/SW2=%04X\n", rc, *SW1SW2);
+
+	if (traceEnabled)
+		traceRecord('E', "VerifyPIN", TRACE_ARGS_RESPONSE, rc, *SW1SW2, 0, 0, 0, 0);
+
 	return rc;
 }
 
 
 
+/**
+ * Match an references against a filter expression
+ *
+ * The following assertions are valid:
+ *
+ * assert(matchFilter("ABC", "ABC") == 1);
+ * assert(matchFilter("ABC", "ABCD") == 0);
+ * assert(matchFilter("ABC", "*") == 1);
+ * assert(matchFilter("ABC", "A*") == 1);
+ * assert(matchFilter("ABC", "B*") == 0);
+ * assert(matchFilter("ABC", "???") == 1);
+ * assert(matchFilter("ABC", "????") == 0);
+ * assert(matchFilter("ABC", "??") == 0);
+ * assert(matchFilter("ABC", "?BC") == 1);
+ * assert(matchFilter("ABC", "*C") == 1);
+ * assert(matchFilter("ABC", "*B*") == 1);
+ * assert(matchFilter("ABC", "*C*") == 0);
+ */
+int matchFilter(char *value, char *filter)
+{
+	if (!filter)
+		return 1;
+
+	while(*value) {
+		if ((*value != *filter) && (*filter != '*') && (*filter != '?'))
+			return 0;
+
+		if (*filter == '*') {
+			filter++;
+			value++;
+
+			if (!*filter)		// * is last element
+				return 1;
+
+			while(*value && (*value != *filter))
+				value++;
+
+			continue;
+		}
+
+		value++;
+		filter++;
+	}
+
+	return *filter ? 0 : 1;
+}
+
+
+
 void appendStr(CK_UTF8CHAR_PTR dest, int destlen, char *str)
 {
 	int i = destlen;
@@ -477,9 +736,12 @@ int getToken(struct p11Slot_t *slot, struct p11Token_t **token)
 {
 	FUNC_CALLED();
 
+	enterReadSection();
 	*token = slot->token;
+	protectPointer(HAZARD_TOKEN, *token);
+	leaveReadSection();
 
-	FUNC_RETURNS(slot->token ? CKR_OK : CKR_TOKEN_NOT_PRESENT);
+	FUNC_RETURNS(*token ? CKR_OK : CKR_TOKEN_NOT_PRESENT);
 }
 
 
@@ -488,6 +750,9 @@ int getValidatedToken(struct p11Slot_t *slot, struct p11Token_t **token)
 {
 	int rc;
 	struct p11Slot_t *pslot;
+#ifndef MINIDRIVER
+	unsigned long long start;
+#endif
 
 	FUNC_CALLED();
 
@@ -498,17 +763,29 @@ int getValidatedToken(struct p11Slot_t *slot, struct p11Token_t **token)
 		pslot = pslot->primarySlot;
 
 #ifndef MINIDRIVER
+	start = perfTimestamp();
+
 	p11LockMutex(context->mutex);
-#endif
 
+	if (pslot->isCluster) {
+		rc = getClusterToken(pslot, token);
+	} else if (pslot->isReplay) {
+		rc = getReplayToken(pslot, token);
+	} else
+#endif
+	{
 #ifdef CTAPI
-	rc = getCTAPIToken(pslot, token);
+		rc = getCTAPIToken(pslot, token);
 #else
-	rc = getPCSCToken(pslot, token);
+		rc = getPCSCToken(pslot, token);
 #endif
+	}
 
 #ifndef MINIDRIVER
 	p11UnlockMutex(context->mutex);
+
+	if (!pslot->isCluster)
+		perfCountLatency(pslot, PERF_HIST_VALIDATE, start);
 #endif
 
 	if (rc != CKR_OK)
@@ -519,6 +796,45 @@ int getValidatedToken(struct p11Slot_t *slot, struct p11Token_t **token)
 
 
 
+#ifndef MINIDRIVER
+/**
+ * Check if the token used by the session is still present
+ */
+static int validateSessionToken(CK_SESSION_HANDLE hSession)
+{
+	int rv;
+	struct p11Session_t *session;
+	struct p11Slot_t *slot;
+	struct p11Token_t *token;
+
+	rv = findSessionByHandle(&context->sessionPool, hSession, &session);
+
+	if (rv == CKR_SESSION_HANDLE_INVALID) {
+		return CKR_DEVICE_REMOVED;
+	}
+
+	if (rv != CKR_OK) {
+		return rv;
+	}
+
+	rv = findSlot(&context->slotPool, session->slotID, &slot);
+
+	if (rv != CKR_OK) {
+		return rv;
+	}
+
+	rv = getValidatedToken(slot, &token);
+
+	if (rv != CKR_OK) {
+		return rv;
+	}
+
+	return CKR_DEVICE_ERROR;
+}
+#endif
+
+
+
 /**
  * If a token operation returns CKR_DEVICE_ERROR, then check if the token
  * is still present.
@@ -528,9 +844,6 @@ int handleDeviceError(CK_SESSION_HANDLE hSession)
 {
 #ifndef MINIDRIVER
 	int rv;
-	struct p11Session_t *session;
-	struct p11Slot_t *slot;
-	struct p11Token_t *token;
 
 	FUNC_CALLED();
 
@@ -546,36 +859,110 @@ int handleDeviceError(CK_SESSION_HANDLE hSession)
 	usleep(100000);
 #endif
 
-	rv = findSessionByHandle(&context->sessionPool, hSession, &session);
-
-	if (rv == CKR_SESSION_HANDLE_INVALID) {
-		FUNC_RETURNS(CKR_DEVICE_REMOVED);
+	// The caller still uses the session, token and object it found before
+	if (enterHazardScope() != CKR_OK) {
+		FUNC_RETURNS(CKR_DEVICE_ERROR);
 	}
 
-	if (rv != CKR_OK) {
-		FUNC_RETURNS(rv);
-	}
+	rv = validateSessionToken(hSession);
 
-	rv = findSlot(&context->slotPool, session->slotID, &slot);
+	leaveHazardScope();
 
-	if (rv != CKR_OK) {
-		FUNC_RETURNS(rv);
-	}
+	FUNC_RETURNS(rv);
+#endif
 
-	rv = getValidatedToken(slot, &token);
+	FUNC_RETURNS(CKR_DEVICE_ERROR);
+}
 
-	if (rv != CKR_OK) {
-		FUNC_RETURNS(rv);
+
+
+/**
+ * Lock the card for the outermost lock request
+ *
+ * The caller must hold the lock state mutex of the primary slot.
+ */
+static int lockSlotLocked(struct p11Slot_t *pslot)
+{
+	int rc;
+#if !defined(CTAPI) && !defined(MINIDRIVER)
+	unsigned long long start;
+#endif
+
+	if (pslot->lockCount > 0) {
+		pslot->lockCount++;
+		return CKR_OK;
 	}
+
+#ifdef CTAPI
+	rc = 0;
+#else
+#ifndef MINIDRIVER
+	start = perfTimestamp();
 #endif
+	TRACE_BEGIN_SLOT("lockSlot", pslot->id);
 
-	FUNC_RETURNS(CKR_DEVICE_ERROR);
+	rc = lockPCSCSlot(pslot);
+
+	TRACE_END("lockSlot");
+#ifndef MINIDRIVER
+	perfCountLatency(pslot, PERF_HIST_LOCK, start);
+#endif
+#endif
+
+	if (rc == CKR_OK)
+		pslot->lockCount = 1;
+
+	return rc;
+}
+
+
+
+/**
+ * Unlock the card when the outermost lock is released
+ *
+ * The caller must hold the lock state mutex of the primary slot.
+ */
+static int unlockSlotLocked(struct p11Slot_t *pslot)
+{
+	int rc;
+
+	if (pslot->lockCount <= 0)
+		return CKR_OK;
+
+	if (--pslot->lockCount > 0)
+		return CKR_OK;
+
+#ifdef CTAPI
+	rc = 0;
+#else
+	rc = unlockPCSCSlot(pslot);
+#endif
+	return rc;
+}
+
+
+
+/**
+ * Return TRUE if every scheduled operation shall lock the card
+ *
+ * Locking each operation costs an additional round trip to the resource manager and
+ * is only done if enabled with PKCS11_SLOT_LOCKING.
+ */
+int isOperationLockingEnabled()
+{
+#ifdef CTAPI
+	return FALSE;
+#else
+	return isPCSCOperationLocking();
+#endif
 }
 
 
 
 /**
  * Gain exclusive access to the token in the slot, preventing other processes to access the token
+ *
+ * Calls can be nested, only the outermost call locks the card.
  */
 int lockSlot(struct p11Slot_t *slot)
 {
@@ -586,11 +973,16 @@ int lockSlot(struct p11Slot_t *slot)
 	if (pslot->primarySlot)
 		pslot = pslot->primarySlot;
 
-#ifdef CTAPI
-	rc = 0;
-#else
-	rc = lockPCSCSlot(pslot);
-#endif
+	if (pslot->isCluster || pslot->isReplay)
+		return CKR_OK;
+
+	rc = lockSlotState(pslot);
+	if (rc != CKR_OK)
+		return rc;
+
+	rc = lockSlotLocked(pslot);
+
+	unlockSlotState(pslot);
 	return rc;
 }
 
@@ -608,16 +1000,110 @@ int unlockSlot(struct p11Slot_t *slot)
 	if (pslot->primarySlot)
 		pslot = pslot->primarySlot;
 
-#ifdef CTAPI
-	rc = 0;
+	if (pslot->isCluster || pslot->isReplay)
+		return CKR_OK;
+
+	rc = lockSlotState(pslot);
+	if (rc != CKR_OK)
+		return rc;
+
+	rc = unlockSlotLocked(pslot);
+
+	unlockSlotState(pslot);
+	return rc;
+}
+
+
+
+/**
+ * Keep the slot locked after a successful login, if configured with PKCS11_SLOT_LOCKING=login
+ *
+ * This makes a sequence of login, crypto operations and logout atomic with regard to other
+ * processes. The caller must have exclusive use of the slot, e.g. via scheduleSlot().
+ */
+int holdSlotLock(struct p11Slot_t *slot)
+{
+#ifndef CTAPI
+	struct p11Slot_t *pslot;
+	int rc;
+
+	pslot = slot;
+	if (pslot->primarySlot)
+		pslot = pslot->primarySlot;
+
+	if ((getPCSCLockMode() != LOCK_TRANSACTION_LOGIN) || pslot->isCluster || pslot->isReplay)
+		return CKR_OK;
+
+	rc = lockSlotState(pslot);
+	if (rc != CKR_OK)
+		return rc;
+
+	if (!pslot->lockHeldByLogin) {
+		rc = lockSlotLocked(pslot);
+
+		if (rc == CKR_OK)
+			pslot->lockHeldByLogin = TRUE;
+	}
+
+	unlockSlotState(pslot);
+	return rc;
 #else
-	rc = unlockPCSCSlot(pslot);
+	return CKR_OK;
 #endif
+}
+
+
+
+/**
+ * Release a lock held since login
+ */
+int releaseHeldSlotLock(struct p11Slot_t *slot)
+{
+	struct p11Slot_t *pslot;
+	int rc;
+
+	pslot = slot;
+	if (pslot->primarySlot)
+		pslot = pslot->primarySlot;
+
+	if (pslot->isCluster || pslot->isReplay)
+		return CKR_OK;
+
+	rc = lockSlotState(pslot);
+	if (rc != CKR_OK)
+		return rc;
+
+	if (pslot->lockHeldByLogin) {
+		pslot->lockHeldByLogin = FALSE;
+		rc = unlockSlotLocked(pslot);
+	}
+
+	unlockSlotState(pslot);
 	return rc;
 }
 
 
 
+/**
+ * Forget all locks after the connection to the card was closed
+ *
+ * Closing the connection ends any transaction, so the lock state is reset without
+ * unlocking the card.
+ */
+void resetSlotLock(struct p11Slot_t *slot)
+{
+	// Without a scheduler the slot was never locked
+	if (slot->scheduler == NULL)
+		return;
+
+	lockSlotState(slot);
+	slot->lockCount = 0;
+	slot->lockHeldByLogin = FALSE;
+	unlockSlotState(slot);
+}
+
+
+
 int findSlotObject(struct p11Slot_t *slot, CK_OBJECT_HANDLE handle, struct p11Object_t **object, int publicObject)
 {
 	int rc;
@@ -661,6 +1147,16 @@ int closeSlot(struct p11Slot_t *slot)
 		FUNC_RETURNS(CKR_OK);
 
 #ifndef MINIDRIVER
+	if (slot->isCluster) {
+		rc = closeClusterSlot(slot);
+		FUNC_RETURNS(rc);
+	}
+
+	if (slot->isReplay) {
+		rc = closeReplaySlot(slot);
+		FUNC_RETURNS(rc);
+	}
+
 #ifdef CTAPI
 	rc = closeCTAPISlot(slot);
 #else
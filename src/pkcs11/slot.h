@@ -37,6 +37,13 @@
 #include <pkcs11/cryptoki.h>
 #include <pkcs11/p11generic.h>
 
+#define LOCK_NONE				0	/**< No locking of the card                         */
+#define LOCK_TRANSACTION		1	/**< Transaction per token operation                */
+#define LOCK_TRANSACTION_LOGIN	2	/**< Transaction held from login to logout          */
+#define LOCK_RECONNECT			3	/**< Reconnect card in exclusive mode               */
+
+#define ERR_CARD_RESET			-2	/**< Card was reset by another process              */
+
 int addToken(struct p11Slot_t *slot, struct p11Token_t *token);
 int removeToken(struct p11Slot_t *slot);
 int encodeCommandAPDU(
@@ -60,10 +67,18 @@ int findSlotObject(struct p11Slot_t *slot, CK_OBJECT_HANDLE handle, struct p11Ob
 int findSlotKey(struct p11Slot_t *slot, CK_OBJECT_HANDLE handle, struct p11Object_t **object);
 int lockSlot(struct p11Slot_t *slot);
 int unlockSlot(struct p11Slot_t *slot);
+int holdSlotLock(struct p11Slot_t *slot);
+int releaseHeldSlotLock(struct p11Slot_t *slot);
+void resetSlotLock(struct p11Slot_t *slot);
+int isOperationLockingEnabled();
 int updateSlots(struct p11SlotPool_t *pool);
 int closeSlot(struct p11Slot_t *slot);
 int addToken(struct p11Slot_t *slot, struct p11Token_t *token);
 int removeToken(struct p11Slot_t *slot);
 int getVirtualSlot(struct p11Slot_t *slot, int index, struct p11Slot_t **vslot);
+int matchFilter(char *value, char *filter);
+int setResetRecovery(CK_SC_HSM_RECOVERY_CALLBACK callback, CK_VOID_PTR application);
+int isResetRecoveryEnabled();
+int getRecoveryPIN(struct p11Slot_t *slot, CK_USER_TYPE userType, CK_UTF8CHAR_PTR pin, CK_ULONG_PTR pinlen);
 
 #endif /* ___SLOT_H_INC___ */
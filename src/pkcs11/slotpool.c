@@ -40,6 +40,7 @@
 #include <pkcs11/slot.h>
 #include <pkcs11/token.h>
 #include <pkcs11/session.h>
+#include <pkcs11/reclaim.h>
 #include <common/debug.h>
 
 #ifdef CTAPI
@@ -48,6 +49,11 @@
 #include "slot-pcsc.h"
 #endif
 
+#include "slot-cluster.h"
+#include "slot-replay.h"
+#include "scheduler.h"
+#include "perfstats.h"
+
 extern struct p11Context_t *context;
 
 
@@ -109,6 +115,10 @@ int terminateSlotPool(struct p11SlotPool_t *pool)
 
 	FUNC_CALLED();
 
+#ifndef CTAPI
+	stopPCSCStatusMonitor();
+#endif
+
 	pSlot = pool->list;
 
 	/* clear the slot pool */
@@ -125,6 +135,8 @@ int terminateSlotPool(struct p11SlotPool_t *pool)
 		}
 
 		closeSlot(pSlot);
+		freeScheduler(pSlot);
+		freePerfStats(pSlot);
 
 		pFreeSlot = pSlot;
 		pSlot = pSlot->next;
@@ -162,6 +174,9 @@ int addSlot(struct p11SlotPool_t *pool, struct p11Slot_t *slot)
 		ppSlot = &(*ppSlot)->next;
 
 	slot->next = *ppSlot;
+
+	// Slots are looked up without locking and only released in C_Finalize
+	MEMORY_BARRIER();
 	*ppSlot = slot;
 
 	pool->numberOfSlots++;
@@ -234,11 +249,18 @@ int updateSlots(struct p11SlotPool_t *pool)
 
 	FUNC_CALLED();
 
+	if (isReplayEnabled()) {
+		rc = updateReplaySlots(pool);
+	} else {
 #ifdef CTAPI
-	rc = updateCTAPISlots(pool);
+		rc = updateCTAPISlots(pool);
 #else
-	rc = updatePCSCSlots(pool);
+		rc = updatePCSCSlots(pool);
 #endif
+	}
+
+	if (rc == CKR_OK)
+		rc = updateClusterSlot(pool);
 
 	FUNC_RETURNS(rc);
 }
@@ -289,7 +311,11 @@ int waitForSlotEvent(struct p11SlotPool_t *pool)
 #ifdef CTAPI
 	rc = CKR_FUNCTION_NOT_SUPPORTED;
 #else
-	rc = waitForPCSCEvent(pool, -1);
+	// Replayed slots never change
+	if (isReplayEnabled())
+		rc = CKR_FUNCTION_NOT_SUPPORTED;
+	else
+		rc = waitForPCSCEvent(pool, -1);
 #endif
 	if (rc != CKR_OK) {
 		FUNC_FAILS(rc, "Failed to wait for slot event");
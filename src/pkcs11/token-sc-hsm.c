@@ -43,6 +43,7 @@
 
 #include <pkcs11/slot.h>
 #include <pkcs11/object.h>
+#include <pkcs11/session.h>
 #include <pkcs11/token.h>
 #include <pkcs11/certificateobject.h>
 #include <pkcs11/privatekeyobject.h>
@@ -50,6 +51,10 @@
 #include <pkcs11/secretkeyobject.h>
 #include <pkcs11/strbpcpy.h>
 #include <pkcs11/crypto.h>
+#ifndef MINIDRIVER
+#include <pkcs11/objectcache.h>
+#include <pkcs11/keypool.h>
+#endif
 
 
 
@@ -64,6 +69,7 @@ static unsigned char atrJCOP3[]  = { 0x3B,0xDE,0x18,0xFF,0x81,0x91,0xFE,0x1F,0xC
 static struct bytestring_s defaultAlgorithmRSA = { (unsigned char *)"\x04\x00\x7F\x00\x07\x02\x02\x02\x01\x02", 10 };
 static struct bytestring_s defaultAlgorithmEC = { (unsigned char *)"\x04\x00\x7F\x00\x07\x02\x02\x02\x02\x03", 10 };
 static struct bytestring_s defaultCHR = { (unsigned char *)"UTDUMMY00000", 12 };
+static struct bytestring_s poolCHR = { (unsigned char *)"UTKEYPOOL00000", 14 };
 static struct bytestring_s defaultPublicExponent = { (unsigned char *)"\x01\x00\x01", 3 };
 static struct bytestring_s defaultAESAlgorithms = { (unsigned char *)"\x10\x11\x18\x99", 4 };
 
@@ -147,7 +153,8 @@ static int selectApplet(struct p11Slot_t *slot, unsigned char *tag85, size_t *ta
 {
 	int rc;
 	unsigned short SW1SW2;
-	unsigned char scr[256], *po;
+	unsigned char scr[256];
+	struct asn1Cursor cur;
 	FUNC_CALLED();
 
 	rc = transmitAPDU(slot, 0x00, 0xA4, 0x04, 0x04,
@@ -163,10 +170,10 @@ static int selectApplet(struct p11Slot_t *slot, unsigned char *tag85, size_t *ta
 	}
 
 	if (tag85 != NULL) {
-		po = asn1Find(scr, (unsigned char*)"\x62\x85", 2);
-		if ((po != NULL) && (*(po + 1) <= *tag85len)) {
-			*tag85len = *(po + 1);
-			memcpy(tag85, po + 2, *tag85len);
+		asn1InitCursor(&cur, scr, rc);
+		if ((asn1CursorFindPath(&cur, (unsigned char*)"\x62\x85", 2) > 0) && (cur.length <= *tag85len)) {
+			*tag85len = cur.length;
+			memcpy(tag85, cur.value, *tag85len);
 		}
 	}
 
@@ -198,21 +205,21 @@ static int enumerateObjects(struct p11Slot_t *slot, unsigned char *filelist, siz
 
 
 
-static int readEF(struct p11Slot_t *slot, unsigned short fid, unsigned char *content, size_t len)
+static int readEFWithStatus(struct p11Slot_t *slot, unsigned short fid, unsigned char *content, size_t len, unsigned short *SW1SW2)
 {
 	int rc;
-	unsigned short SW1SW2;
 	FUNC_CALLED();
 
+	*SW1SW2 = 0;
 	rc = transmitAPDU(slot, 0x00, 0xB1, fid >> 8, fid & 0xFF,
 			4, (unsigned char*)"\x54\x02\x00\x00",
-			65536, content, (int)len, &SW1SW2);
+			65536, content, (int)len, SW1SW2);
 
 	if (rc < 0) {
 		FUNC_FAILS(rc, "transmitAPDU failed");
 	}
 
-	if (SW1SW2 != 0x9000) {
+	if (*SW1SW2 != 0x9000) {
 		FUNC_FAILS(-1, "Read EF failed");
 	}
 
@@ -221,6 +228,91 @@ static int readEF(struct p11Slot_t *slot, unsigned short fid, unsigned char *con
 
 
 
+static int readEF(struct p11Slot_t *slot, unsigned short fid, unsigned char *content, size_t len)
+{
+	unsigned short SW1SW2;
+
+	return readEFWithStatus(slot, fid, content, len, &SW1SW2);
+}
+
+
+
+#ifndef MINIDRIVER
+/**
+ * Determine the identity of the token used as key for the object cache
+ *
+ * The identity is the serial number obtained from the device authentication certificate.
+ */
+static void getTokenIdentity(struct p11Token_t *token, char *identity, size_t len)
+{
+	size_t i;
+
+	i = sizeof(token->info.serialNumber);
+	if (i >= len)
+		i = len - 1;
+
+	memcpy(identity, token->info.serialNumber, i);
+
+	while ((i > 0) && (identity[i - 1] == ' '))
+		i--;
+	identity[i] = 0;
+}
+
+
+
+/**
+ * Remove the cached objects of the token in the slot before the token content is changed
+ */
+static void invalidateTokenCache(struct p11Slot_t *slot)
+{
+	char identity[MAX_CACHE_IDENTITY];
+
+	if (slot->token == NULL)
+		return;
+
+	getTokenIdentity(slot->token, identity, sizeof(identity));
+	invalidateObjectCache(identity);
+}
+#endif
+
+
+
+/**
+ * Read an EF while loading objects
+ *
+ * The content is taken from the object cache if attached or recorded into the cache
+ * if a new cache is created. A file that does not exist is recorded as well.
+ */
+static int readCachedEF(struct p11Token_t *token, unsigned short fid, unsigned char *content, size_t len)
+{
+#ifndef MINIDRIVER
+	struct token_sc_hsm *sc = getPrivateData(token);
+	unsigned short SW1SW2;
+	int rc;
+
+	if (sc->cache == NULL)
+		return readEF(token->slot, fid, content, len);
+
+	if (getCachedFile(sc->cache, fid, content, len, &rc))
+		return rc;
+
+	rc = readEFWithStatus(token->slot, fid, content, len, &SW1SW2);
+
+	if ((rc >= 0) || (SW1SW2 == 0x6A82)) {
+		addCachedFile(sc->cache, fid, content, rc);
+	} else {
+		// Don't create a cache from an incomplete view of the token
+		closeObjectCache(sc->cache, FALSE);
+		sc->cache = NULL;
+	}
+	return rc;
+#else
+	return readEF(token->slot, fid, content, len);
+#endif
+}
+
+
+
 static int writeEF(struct p11Slot_t *slot, unsigned short fid, unsigned char *content, size_t len)
 {
 	int rc, blen, ofs;
@@ -230,6 +322,10 @@ static int writeEF(struct p11Slot_t *slot, unsigned short fid, unsigned char *co
 
 	FUNC_CALLED();
 
+#ifndef MINIDRIVER
+	invalidateTokenCache(slot);
+#endif
+
 	maxblk = slot->maxCAPDU - 15;			// Maximum block size
 	ofs = 0;
 	rc = CKR_OK;
@@ -276,6 +372,10 @@ static int deleteEF(struct p11Slot_t *slot, unsigned short fid)
 	unsigned short SW1SW2;
 	FUNC_CALLED();
 
+#ifndef MINIDRIVER
+	invalidateTokenCache(slot);
+#endif
+
 	scr[0] = fid >> 8;
 	scr[1] = fid & 0xFF;
 
@@ -419,9 +519,7 @@ static int decodeECDSASignature(unsigned char *data, int datalen,
 		fieldsizebytes = 66;
 	}
 
-#ifdef DEBUG
 	debug("Field size %d, signature buffer size %d\n", fieldsizebytes, outlen);
-#endif
 
 	if (outlen < (fieldsizebytes * 2)) {
 		FUNC_FAILS(-1, "output too small for EC signature");
@@ -603,6 +701,11 @@ static CK_RV sc_hsm_C_EncryptInit(struct p11Object_t *pObject, CK_MECHANISM_PTR
 		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported");
 	}
 
+	// The IV is kept by the session as initial chaining value for multi-part operations
+	if ((mech->mechanism == CKM_AES_CBC) && (mech->pParameter != NULL) && (mech->ulParameterLen != AES_BLOCK_SIZE)) {
+		FUNC_FAILS(CKR_MECHANISM_PARAM_INVALID, "IV must have the length of an AES block");
+	}
+
 	FUNC_RETURNS(CKR_OK);
 }
 
@@ -619,12 +722,21 @@ static int sc_hsm_C_DecryptInit(struct p11Object_t *pObject, CK_MECHANISM_PTR me
 		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported");
 	}
 
+	// The IV is kept by the session as initial chaining value for multi-part operations
+	if ((mech->mechanism == CKM_AES_CBC) && (mech->pParameter != NULL) && (mech->ulParameterLen != AES_BLOCK_SIZE)) {
+		FUNC_FAILS(CKR_MECHANISM_PARAM_INVALID, "IV must have the length of an AES block");
+	}
+
 	FUNC_RETURNS(CKR_OK);
 }
 
 
 
-static CK_RV sc_hsm_C_Encrypt(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pData, CK_ULONG pulDataLen, CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR ulEncryptedDataLen)
+static int sc_hsm_AESCBCUpdate(struct p11Object_t *pObject, struct p11Session_t *session, int algo, CK_BYTE_PTR pIn, CK_ULONG ulInLen, CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen);
+
+
+
+static CK_RV sc_hsm_C_Encrypt(struct p11Object_t *pObject, struct p11Session_t *session, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pData, CK_ULONG pulDataLen, CK_BYTE_PTR pEncryptedData, CK_ULONG_PTR ulEncryptedDataLen)
 {
 	int rc, algo;
 	unsigned short SW1SW2;
@@ -632,6 +744,15 @@ static CK_RV sc_hsm_C_Encrypt(struct p11Object_t *pObject, CK_MECHANISM_TYPE mec
 
 	FUNC_CALLED();
 
+	// Apply the IV kept in the session and process data longer than a single APDU
+	if ((mech == CKM_AES_CBC) && (session != NULL)) {
+		if (pulDataLen % AES_BLOCK_SIZE) {
+			FUNC_FAILS(CKR_DATA_LEN_RANGE, "Data length not a multiple of the AES block size");
+		}
+		rc = sc_hsm_AESCBCUpdate(pObject, session, ALGO_AES_CBC_ENCRYPT, pData, pulDataLen, pEncryptedData, ulEncryptedDataLen);
+		FUNC_RETURNS(rc);
+	}
+
 	if (pEncryptedData == NULL) {
 		*ulEncryptedDataLen = pObject->keysize >> 3;
 		FUNC_RETURNS(CKR_OK);
@@ -711,7 +832,7 @@ static int stripPKCS15Padding(unsigned char *scr, int len, CK_BYTE_PTR pData, CK
 
 
 
-static int sc_hsm_C_Decrypt(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+static int sc_hsm_C_Decrypt(struct p11Object_t *pObject, struct p11Session_t *session, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
 {
 	int rc, algo, ins;
 	unsigned short SW1SW2;
@@ -719,6 +840,15 @@ static int sc_hsm_C_Decrypt(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech,
 
 	FUNC_CALLED();
 
+	// Apply the IV kept in the session and process data longer than a single APDU
+	if ((mech == CKM_AES_CBC) && (session != NULL)) {
+		if (ulEncryptedDataLen % AES_BLOCK_SIZE) {
+			FUNC_FAILS(CKR_ENCRYPTED_DATA_LEN_RANGE, "Encrypted data length not a multiple of the AES block size");
+		}
+		rc = sc_hsm_AESCBCUpdate(pObject, session, ALGO_AES_CBC_DECRYPT, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
+		FUNC_RETURNS(rc);
+	}
+
 	if (pData == NULL) {
 		*pulDataLen = pObject->keysize >> 3;
 		FUNC_RETURNS(CKR_OK);
@@ -794,6 +924,405 @@ static int sc_hsm_C_Decrypt(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech,
 
 
 
+/**
+ * Determine the number of bytes processed with a single AES command APDU. This is the largest
+ * multiple of the AES block size that fits into command and response APDU of token and reader.
+ */
+static int getAESChunkSize(struct p11Object_t *pObject)
+{
+	struct p11Slot_t *slot = pObject->token->slot;
+	int maxblk;
+
+	maxblk = pObject->token->drv->maxCAPDU;
+	if (slot->maxCAPDU && (slot->maxCAPDU < maxblk))
+		maxblk = slot->maxCAPDU;
+	if (maxblk > MAX_CAPDU)
+		maxblk = MAX_CAPDU;
+	maxblk -= 9;					// Accommodate header, extended Lc and Le
+
+	if (slot->maxRAPDU && (slot->maxRAPDU - 2 < maxblk))
+		maxblk = slot->maxRAPDU - 2;		// Accommodate SW1/SW2
+
+	return maxblk & ~(AES_BLOCK_SIZE - 1);
+}
+
+
+
+/**
+ * Process the next part of a multi-part AES-CBC operation
+ *
+ * The session crypto buffer contains the chaining value, initially the IV, followed by
+ * the bytes of an incomplete block left over from the previous part. The input is sent
+ * to the device in chunks as large as the APDU allows and the result is received directly
+ * into the caller's buffer.
+ *
+ * The device always starts with a zero IV, so the chaining value is applied on the host
+ * by XORing it with the first plain text block of a chunk before encryption or with the
+ * first plain text block of a chunk after decryption.
+ */
+static int sc_hsm_AESCBCUpdate(struct p11Object_t *pObject, struct p11Session_t *session, int algo, CK_BYTE_PTR pIn, CK_ULONG ulInLen, CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen)
+{
+	unsigned char scr[MAX_CAPDU];
+	unsigned char icv[AES_BLOCK_SIZE], carry[AES_BLOCK_SIZE];
+	unsigned char next[AES_BLOCK_SIZE] = { 0 };
+	CK_ULONG pending, outlen, ofs, inofs, chunk, fill;
+	unsigned short SW1SW2;
+	int rc, maxblk, i;
+
+	FUNC_CALLED();
+
+	if (session->cryptoBufferSize >= AES_BLOCK_SIZE) {
+		memcpy(icv, session->cryptoBuffer, AES_BLOCK_SIZE);
+		pending = session->cryptoBufferSize - AES_BLOCK_SIZE;
+		memcpy(carry, session->cryptoBuffer + AES_BLOCK_SIZE, pending);
+	} else {
+		memset(icv, 0, sizeof(icv));		// No IV given with the mechanism
+		pending = 0;
+	}
+
+	outlen = pending + ulInLen;
+	outlen -= outlen % AES_BLOCK_SIZE;
+
+	if (pOut == NULL) {
+		*pulOutLen = outlen;
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	if (outlen > *pulOutLen) {
+		*pulOutLen = outlen;
+		FUNC_FAILS(CKR_BUFFER_TOO_SMALL, "supplied buffer too small");
+	}
+
+	maxblk = getAESChunkSize(pObject);
+	if (maxblk < AES_BLOCK_SIZE) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "APDU size too small for AES block");
+	}
+
+	ofs = 0;
+	inofs = 0;
+	while (ofs < outlen) {
+		chunk = outlen - ofs;
+		if (chunk > (CK_ULONG)maxblk)
+			chunk = maxblk;
+
+		memcpy(scr, carry, pending);
+		fill = chunk - pending;
+		memcpy(scr + pending, pIn + inofs, fill);
+		inofs += fill;
+
+		// Read ahead of the output position, as the caller may use the same buffer for in- and output
+		pending = ulInLen - inofs;
+		if (pending > AES_BLOCK_SIZE - 1)
+			pending = AES_BLOCK_SIZE - 1;
+		memcpy(carry, pIn + inofs, pending);
+		inofs += pending;
+
+		if (algo == ALGO_AES_CBC_ENCRYPT) {
+			for (i = 0; i < AES_BLOCK_SIZE; i++)
+				scr[i] ^= icv[i];
+		} else {
+			memcpy(next, scr + chunk - AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+		}
+
+		rc = transmitAPDU(pObject->token->slot, 0x80, 0x78, (unsigned char)pObject->tokenid, (unsigned char)algo,
+				(int)chunk, scr,
+				0, pOut + ofs, (int)chunk, &SW1SW2);
+
+		memset(scr, 0, chunk);
+
+		if (rc < 0) {
+			FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+		}
+
+		switch(SW1SW2) {
+		case 0x9000:
+			break;
+		case 0x6984:
+			FUNC_FAILS(CKR_KEY_FUNCTION_NOT_PERMITTED, "Key user counter expired");
+			break;
+		case 0x6A81:
+			FUNC_FAILS(CKR_KEY_FUNCTION_NOT_PERMITTED, "Cipher operation not allowed for key");
+			break;
+		case 0x6982:
+			FUNC_FAILS(CKR_USER_NOT_LOGGED_IN, "User not logged in");
+			break;
+		case 0x6A80:
+			FUNC_FAILS(CKR_ENCRYPTED_DATA_INVALID, "Cipher operation failed");
+			break;
+		default:
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Cipher operation failed");
+			break;
+		}
+
+		if (rc != (int)chunk) {
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Unexpected length of cipher response");
+		}
+
+		if (algo == ALGO_AES_CBC_ENCRYPT) {
+			memcpy(icv, pOut + ofs + chunk - AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+		} else {
+			for (i = 0; i < AES_BLOCK_SIZE; i++)
+				pOut[ofs + i] ^= icv[i];
+			memcpy(icv, next, AES_BLOCK_SIZE);
+		}
+
+		ofs += chunk;
+	}
+
+	// Keep chaining value and incomplete block for the next part
+	clearCryptoBuffer(session);
+	rc = appendToCryptoBuffer(session, icv, AES_BLOCK_SIZE);
+	if (rc == CKR_OK)
+		rc = appendToCryptoBuffer(session, carry, pending);
+	if (rc == CKR_OK)
+		rc = appendToCryptoBuffer(session, pIn + inofs, ulInLen - inofs);
+	memset(carry, 0, sizeof(carry));
+
+	if (rc != CKR_OK) {
+		FUNC_FAILS(rc, "Could not save operation state");
+	}
+
+	*pulOutLen = outlen;
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static CK_RV sc_hsm_C_EncryptUpdate(struct p11Object_t *pObject, struct p11Session_t *session, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pPart, CK_ULONG ulPartLen, CK_BYTE_PTR pEncryptedPart, CK_ULONG_PTR pulEncryptedPartLen)
+{
+	int rc;
+
+	FUNC_CALLED();
+
+	if (mech != CKM_AES_CBC) {
+		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported for multi-part operation");
+	}
+
+	rc = sc_hsm_AESCBCUpdate(pObject, session, ALGO_AES_CBC_ENCRYPT, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen);
+	FUNC_RETURNS(rc);
+}
+
+
+
+static CK_RV sc_hsm_C_EncryptFinal(struct p11Object_t *pObject, struct p11Session_t *session, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pLastEncryptedPart, CK_ULONG_PTR pulLastEncryptedPartLen)
+{
+	FUNC_CALLED();
+
+	if (session->cryptoBufferSize > AES_BLOCK_SIZE) {
+		FUNC_FAILS(CKR_DATA_LEN_RANGE, "Data length not a multiple of the AES block size");
+	}
+
+	*pulLastEncryptedPartLen = 0;
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+static int sc_hsm_C_DecryptUpdate(struct p11Object_t *pObject, struct p11Session_t *session, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart, CK_ULONG_PTR pulPartLen)
+{
+	int rc;
+
+	FUNC_CALLED();
+
+	if (mech != CKM_AES_CBC) {
+		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported for multi-part operation");
+	}
+
+	rc = sc_hsm_AESCBCUpdate(pObject, session, ALGO_AES_CBC_DECRYPT, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen);
+	FUNC_RETURNS(rc);
+}
+
+
+
+static int sc_hsm_C_DecryptFinal(struct p11Object_t *pObject, struct p11Session_t *session, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pLastPart, CK_ULONG_PTR pulLastPartLen)
+{
+	FUNC_CALLED();
+
+	if (session->cryptoBufferSize > AES_BLOCK_SIZE) {
+		FUNC_FAILS(CKR_ENCRYPTED_DATA_LEN_RANGE, "Encrypted data length not a multiple of the AES block size");
+	}
+
+	*pulLastPartLen = 0;
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * State of a multi-part AES-CMAC operation kept in the session crypto buffer,
+ * followed by the message bytes not yet sent to the device
+ */
+struct sc_hsm_cmac_state {
+	unsigned char chained;				/* Message blocks have been processed with CBC */
+	unsigned char icv[AES_BLOCK_SIZE];		/* Last cipher text block */
+	unsigned char input[AES_BLOCK_SIZE];		/* Block cipher input that produced icv */
+};
+
+
+
+/**
+ * Continue a multi-part AES-CMAC operation
+ *
+ * Message bytes are collected in the session until more than fit into a single command APDU.
+ * Full chunks are then encrypted with AES-CBC on the device, while the remaining bytes are
+ * kept for sc_hsm_C_SignFinal(). Only the last cipher text block and the block cipher input
+ * that produced it are retained, so memory is bounded by the APDU size.
+ */
+static int sc_hsm_C_SignUpdate(struct p11Object_t *pObject, struct p11Session_t *session, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pPart, CK_ULONG ulPartLen)
+{
+	struct sc_hsm_cmac_state state;
+	unsigned char scr[MAX_CAPDU], cipher[MAX_CAPDU];
+	CK_ULONG pending, remaining, ofs, chunk;
+	unsigned short SW1SW2;
+	int rc, maxblk, i;
+
+	FUNC_CALLED();
+
+	if (mech != CKM_AES_CMAC) {
+		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported for multi-part operation");
+	}
+
+	// Leave room for the block cipher input sent with the remaining bytes in sc_hsm_C_SignFinal()
+	maxblk = getAESChunkSize(pObject) - AES_BLOCK_SIZE;
+	if (maxblk < AES_BLOCK_SIZE) {
+		FUNC_FAILS(CKR_DEVICE_ERROR, "APDU size too small for AES block");
+	}
+
+	if (session->cryptoBufferSize < sizeof(state)) {
+		memset(&state, 0, sizeof(state));
+		rc = appendToCryptoBuffer(session, (CK_BYTE_PTR)&state, sizeof(state));
+		if (rc != CKR_OK) {
+			FUNC_FAILS(rc, "Could not save operation state");
+		}
+	}
+
+	memcpy(&state, session->cryptoBuffer, sizeof(state));
+	pending = session->cryptoBufferSize - sizeof(state);
+	remaining = pending + ulPartLen;
+
+	if (remaining <= (CK_ULONG)maxblk) {
+		rc = appendToCryptoBuffer(session, pPart, ulPartLen);
+		FUNC_RETURNS(rc);
+	}
+
+	memcpy(scr, session->cryptoBuffer + sizeof(state), pending);
+
+	ofs = 0;
+	while (remaining > (CK_ULONG)maxblk) {
+		chunk = maxblk;
+		memcpy(scr + pending, pPart + ofs, chunk - pending);
+		ofs += chunk - pending;
+		pending = 0;
+		remaining -= chunk;
+
+		for (i = 0; i < AES_BLOCK_SIZE; i++)
+			scr[i] ^= state.icv[i];
+
+		rc = transmitAPDU(pObject->token->slot, 0x80, 0x78, (unsigned char)pObject->tokenid, ALGO_AES_CBC_ENCRYPT,
+				(int)chunk, scr,
+				0, cipher, (int)chunk, &SW1SW2);
+
+		if (rc < 0) {
+			FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+		}
+
+		switch(SW1SW2) {
+		case 0x9000:
+			break;
+		case 0x6984:
+			FUNC_FAILS(CKR_KEY_FUNCTION_NOT_PERMITTED, "Key user counter expired");
+			break;
+		case 0x6A81:
+			FUNC_FAILS(CKR_KEY_FUNCTION_NOT_PERMITTED, "Key does not allow CBC encryption required for multi-part CMAC");
+			break;
+		case 0x6982:
+			FUNC_FAILS(CKR_USER_NOT_LOGGED_IN, "User not logged in");
+			break;
+		default:
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Signature operation failed");
+			break;
+		}
+
+		if (rc != (int)chunk) {
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Unexpected length of cipher response");
+		}
+
+		memcpy(state.input, scr + chunk - AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+		if (chunk > AES_BLOCK_SIZE) {
+			for (i = 0; i < AES_BLOCK_SIZE; i++)
+				state.input[i] ^= cipher[chunk - 2 * AES_BLOCK_SIZE + i];
+		}
+		memcpy(state.icv, cipher + chunk - AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+		state.chained = 1;
+	}
+
+	memset(scr, 0, sizeof(scr));
+	memset(cipher, 0, sizeof(cipher));
+
+	clearCryptoBuffer(session);
+	rc = appendToCryptoBuffer(session, (CK_BYTE_PTR)&state, sizeof(state));
+	if (rc == CKR_OK)
+		rc = appendToCryptoBuffer(session, pPart + ofs, ulPartLen - ofs);
+	memset(&state, 0, sizeof(state));
+
+	if (rc != CKR_OK) {
+		FUNC_FAILS(rc, "Could not save operation state");
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Finish a multi-part AES-CMAC operation
+ *
+ * The remaining message bytes are sent to the device with the CMAC algorithm. If blocks have
+ * been processed before, the block cipher input of the last block is prepended. The device then
+ * reproduces the chaining value and applies the subkey to the final block, which yields the
+ * CMAC of the complete message.
+ */
+static int sc_hsm_C_SignFinal(struct p11Object_t *pObject, struct p11Session_t *session, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen)
+{
+	struct sc_hsm_cmac_state state;
+	unsigned char scr[MAX_CAPDU];
+	CK_ULONG pending, len;
+	int rc;
+
+	FUNC_CALLED();
+
+	if (mech != CKM_AES_CMAC) {
+		FUNC_FAILS(CKR_MECHANISM_INVALID, "Mechanism not supported for multi-part operation");
+	}
+
+	if (session->cryptoBufferSize < sizeof(state)) {
+		memset(&state, 0, sizeof(state));	// Empty message
+		pending = 0;
+	} else {
+		memcpy(&state, session->cryptoBuffer, sizeof(state));
+		pending = session->cryptoBufferSize - sizeof(state);
+	}
+
+	len = 0;
+	if (state.chained) {
+		memcpy(scr, state.input, AES_BLOCK_SIZE);
+		len = AES_BLOCK_SIZE;
+	}
+	if (pending > 0) {
+		memcpy(scr + len, session->cryptoBuffer + sizeof(state), pending);
+		len += pending;
+	}
+
+	rc = sc_hsm_C_Sign(pObject, mech, scr, len, pSignature, pulSignatureLen);
+
+	memset(scr, 0, len);
+	memset(&state, 0, sizeof(state));
+
+	FUNC_RETURNS(rc);
+}
+
+
+
 static int sc_hsm_C_GenerateRandom(struct p11Slot_t *slot, CK_BYTE_PTR rnd, CK_ULONG rndlen)
 {
 	unsigned short SW1SW2;
@@ -1001,34 +1530,35 @@ static int encodeGAKP(bytebuffer bb, CK_MECHANISM_PTR pMechanism, CK_ATTRIBUTE_P
 
 static int decodeLabel(struct p11Token_t *token)
 {
-	int rc, len;
-	unsigned char ciainfo[256], *po;
+	int rc;
+	size_t len;
+	unsigned char ciainfo[256];
+	struct asn1Cursor cur;
 
 	FUNC_CALLED();
 
-	rc = readEF(token->slot, 0x2F03, ciainfo, sizeof(ciainfo));
+	rc = readCachedEF(token, 0x2F03, ciainfo, sizeof(ciainfo));
 
 	if (rc < 0)
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading CIAInfo");
 
-	rc = (int)asn1Validate(ciainfo, rc);
+	asn1InitCursor(&cur, ciainfo, rc);
 
-	if (rc < 0)
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not decode CVC request");
+	rc = asn1CursorFindPath(&cur, (unsigned char *)"\x30\x80", 2);
 
-	po = asn1Find(ciainfo, (unsigned char *)"\x30\x80", 2);
+	if (rc < 0)
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Could not decode CIAInfo");
 
-	if (po == NULL)
+	if (rc == 0)
 		FUNC_FAILS(CKR_DEVICE_ERROR, "label not found");
 
 	memset(token->info.label, ' ', sizeof(token->info.label));
-	asn1Tag(&po);
-	len = asn1Length(&po);
+	len = cur.length;
 
 	if (len > sizeof(token->info.label))
 		len = sizeof(token->info.label);
 
-	memcpy(token->info.label, po, len);
+	memcpy(token->info.label, cur.value, len);
 
 	FUNC_RETURNS(CKR_OK);
 }
@@ -1145,18 +1675,22 @@ static int addEECertificateAndKeyObjects(struct p11Token_t *token, unsigned char
 	struct p15SecretKeyDescription *p15skey = NULL;
 	struct p15CertificateDescription p15cert;
 	unsigned char prkd[MAX_P15_SIZE];
+	unsigned char arenabuf[P15_ARENA_SIZE(MAX_P15_SIZE)];
+	struct p15Arena arena;
 	int rc, certLen;
 
 	FUNC_CALLED();
 
-	rc = readEF(token->slot, (PRKD_PREFIX << 8) | id, prkd, sizeof(prkd));
+	p15InitArena(&arena, arenabuf, sizeof(arenabuf));
+
+	rc = readCachedEF(token, (PRKD_PREFIX << 8) | id, prkd, sizeof(prkd));
 
 	if (rc < 0) {
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading private key description");
 	}
 
 	if (prkd[0] == P15_KEYTYPE_AES) {
-		rc = decodeSecretKeyDescription(prkd, rc, &p15skey);
+		rc = decodeSecretKeyDescriptionInArena(prkd, rc, &arena, &p15skey);
 
 		if (rc != CKR_OK) {
 			FUNC_FAILS(CKR_DEVICE_ERROR, "Error decoding secret key description");
@@ -1168,19 +1702,25 @@ static int addEECertificateAndKeyObjects(struct p11Token_t *token, unsigned char
 			FUNC_FAILS(CKR_DEVICE_ERROR, "Could not create secret key object");
 		}
 
-		freeSecretKeyDescription(&p15skey);
+		p15ReleaseArena(&arena);
 
 		p11prikey->C_EncryptInit = sc_hsm_C_EncryptInit;
 		p11prikey->C_Encrypt = sc_hsm_C_Encrypt;
+		p11prikey->C_EncryptUpdate = sc_hsm_C_EncryptUpdate;
+		p11prikey->C_EncryptFinal = sc_hsm_C_EncryptFinal;
+		p11prikey->C_DecryptUpdate = sc_hsm_C_DecryptUpdate;
+		p11prikey->C_DecryptFinal = sc_hsm_C_DecryptFinal;
+		p11prikey->C_SignUpdate = sc_hsm_C_SignUpdate;
+		p11prikey->C_SignFinal = sc_hsm_C_SignFinal;
 		p11prikey->C_DeriveKey = sc_hsm_C_DeriveSymmetricKey;
 	} else {
-		rc = decodePrivateKeyDescription(prkd, rc, &p15key);
+		rc = decodePrivateKeyDescriptionInArena(prkd, rc, &arena, &p15key);
 
 		if (rc < 0) {
 			FUNC_FAILS(CKR_DEVICE_ERROR, "Error decoding private key description");
 		}
 
-		rc = readEF(token->slot, (EE_CERTIFICATE_PREFIX << 8) | id, certValue, sizeof(certValue));
+		rc = readCachedEF(token, (EE_CERTIFICATE_PREFIX << 8) | id, certValue, sizeof(certValue));
 
 		if (rc > 0) {
 			certLen = rc;
@@ -1269,7 +1809,7 @@ static int addEECertificateAndKeyObjects(struct p11Token_t *token, unsigned char
 			}
 		}
 
-		freePrivateKeyDescription(&p15key);
+		p15ReleaseArena(&arena);
 
 		p11prikey->C_DeriveKey = sc_hsm_C_DeriveKey;
 	}
@@ -1303,25 +1843,28 @@ static int addCACertificateObject(struct p11Token_t *token, unsigned char id)
 	struct p11Object_t *p11cert;
 	struct p15CertificateDescription *p15cert;
 	unsigned char cd[MAX_P15_SIZE];
+	unsigned char arenabuf[P15_ARENA_SIZE(MAX_P15_SIZE)];
+	struct p15Arena arena;
 	unsigned short fid;
 	int rc;
 
 	FUNC_CALLED();
 
-	rc = readEF(token->slot, (CD_PREFIX << 8) | id, cd, sizeof(cd));
+	rc = readCachedEF(token, (CD_PREFIX << 8) | id, cd, sizeof(cd));
 
 	if (rc < 0) {
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading certificate description");
 	}
 
-	rc = decodeCertificateDescription(cd, rc, &p15cert);
+	p15InitArena(&arena, arenabuf, sizeof(arenabuf));
+	rc = decodeCertificateDescriptionInArena(cd, rc, &arena, &p15cert);
 
 	if (rc < 0) {
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Error decoding certificate description");
 	}
 
 	fid = (CA_CERTIFICATE_PREFIX << 8) | id;
-	rc = readEF(token->slot, fid, certValue, sizeof(certValue));
+	rc = readCachedEF(token, fid, certValue, sizeof(certValue));
 
 	if (rc < 0) {
 		FUNC_FAILS(CKR_DEVICE_ERROR, "Error reading certificate");
@@ -1340,7 +1883,7 @@ static int addCACertificateObject(struct p11Token_t *token, unsigned char id)
 
 	addObject(token, p11cert, TRUE);
 
-	freeCertificateDescription(&p15cert);
+	p15ReleaseArena(&arena);
 	FUNC_RETURNS(CKR_OK);
 }
 
@@ -1772,11 +2315,9 @@ static int sc_hsm_C_CreateObject(
 		idlen = pTemplate[pos].ulValueLen;
 
 		rc = findMatchingTokenObjectById(slot->token, CKO_PRIVATE_KEY, id, idlen, &p11Key);
-#ifdef DEBUG
 		if (rc != CKR_OK) {
 			debug("No private key found with matching CKA_ID");
 		}
-#endif
 
 		// See if we already have a certificate object for that ID
 		findMatchingTokenObjectById(slot->token, CKO_CERTIFICATE, id, idlen, &p11o);
@@ -1850,9 +2391,7 @@ static int sc_hsm_C_CreateObject(
 	}
 
 	if (rc != CKR_OK) {
-#ifdef DEBUG
 		debug("Populating additional attributes failed\n");
-#endif
 	}
 
 	addObject(slot->token, p11o, TRUE);
@@ -1949,6 +2488,161 @@ static int sc_hsm_C_GenerateKey(
 
 
 
+/**
+ * Generate EC or RSA key pair on the token without key description
+ *
+ * @param slot      The slot in which the token is inserted
+ * @param pMechanism CKM_EC_KEY_PAIR_GEN or CKM_RSA_PKCS_KEY_PAIR_GEN
+ * @param pPublicKeyTemplate The template with the key parameter
+ * @param ulPublicKeyAttributeCount The number of attributes in the template
+ * @param id        The key identifier allocated on the token
+ * @param keysize   The key size in bits
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+static int generateUnboundKeyPair(
+		struct p11Slot_t *slot,
+		CK_MECHANISM_PTR pMechanism,
+		CK_ATTRIBUTE_PTR pPublicKeyTemplate,
+		CK_ULONG ulPublicKeyAttributeCount,
+		int *id,
+		int *keysize)
+{
+	unsigned char buff[512];
+	struct bytebuffer_s bb = { buff, 0, sizeof(buff) };
+	unsigned short SW1SW2;
+	int rc;
+
+	FUNC_CALLED();
+
+	rc = encodeGAKP(&bb, pMechanism, pPublicKeyTemplate, ulPublicKeyAttributeCount, keysize);
+
+	if (rc != CKR_OK)
+		FUNC_FAILS(rc, "Encoding GAKP failed");
+
+	*id = determineFreeKeyId(slot, KEY_PREFIX);
+
+	if (*id < 0)
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Determine free id failed");
+
+	rc = transmitAPDU(slot, 0x00, 0x46, *id, 0x00,
+			(int)bbGetLength(&bb), buff,
+			0, NULL, 0, &SW1SW2);
+
+	if (rc < 0)
+		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+
+	if (SW1SW2 != 0x9000)
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Signature operation failed");
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+/**
+ * Generate a key pair for the key pool
+ *
+ * The key pair carries a dedicated CHR, so that only key pairs generated for the pool
+ * are adopted from the token when it is loaded again. Key pairs generated by other
+ * applications without key description are left alone.
+ *
+ * @param slot      The slot in which the token is inserted
+ * @param pMechanism CKM_EC_KEY_PAIR_GEN or CKM_RSA_PKCS_KEY_PAIR_GEN
+ * @param pPublicKeyTemplate The template with the key parameter
+ * @param ulPublicKeyAttributeCount The number of attributes in the template
+ * @param id        The key identifier allocated on the token
+ * @param keysize   The key size in bits
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+static int generatePoolKeyPair(
+		struct p11Slot_t *slot,
+		CK_MECHANISM_PTR pMechanism,
+		CK_ATTRIBUTE_PTR pPublicKeyTemplate,
+		CK_ULONG ulPublicKeyAttributeCount,
+		int *id,
+		int *keysize)
+{
+	CK_ATTRIBUTE template[4];
+	int rc;
+
+	FUNC_CALLED();
+
+	if (ulPublicKeyAttributeCount >= sizeof(template) / sizeof(template[0]))
+		FUNC_FAILS(CKR_TEMPLATE_INCONSISTENT, "Too many attributes for pooled key pair");
+
+	memcpy(template, pPublicKeyTemplate, ulPublicKeyAttributeCount * sizeof(CK_ATTRIBUTE));
+	template[ulPublicKeyAttributeCount].type = CKA_CVC_CHR;
+	template[ulPublicKeyAttributeCount].pValue = poolCHR.val;
+	template[ulPublicKeyAttributeCount].ulValueLen = (CK_ULONG)poolCHR.len;
+
+	rc = generateUnboundKeyPair(slot, pMechanism, template, ulPublicKeyAttributeCount + 1, id, keysize);
+
+	FUNC_RETURNS(rc);
+}
+
+
+
+#ifndef MINIDRIVER
+/**
+ * Bind a key pair from the key pool to the key description requested in the private key template
+ *
+ * Pooled key pairs are generated with default parameters, so requests with attributes
+ * that change the encoded key generation command are not served from the pool.
+ *
+ * The key description is only written if the key pair is still unbound on the token, so
+ * a key pair can not be bound twice if more than one process adopted it from the token.
+ *
+ * @return          CKR_OK or CKR_FUNCTION_FAILED if the key pair must be generated
+ */
+static int bindPooledKeyPair(
+		struct p11Slot_t *slot,
+		CK_MECHANISM_PTR pMechanism,
+		CK_ATTRIBUTE_PTR pPublicKeyTemplate,
+		CK_ULONG ulPublicKeyAttributeCount,
+		CK_ATTRIBUTE_PTR pPrivateKeyTemplate,
+		CK_ULONG ulPrivateKeyAttributeCount,
+		int *id,
+		int *keysize)
+{
+	static const CK_ATTRIBUTE_TYPE requestParameter[] = {
+			CKA_CVC_INNER_CAR, CKA_CVC_OUTER_CAR, CKA_CVC_CHR,
+			CKA_SC_HSM_PUBLIC_KEY_ALGORITHM, CKA_SC_HSM_KEY_USE_COUNTER, CKA_SC_HSM_ALGORITHM_LIST };
+	unsigned char prkd[MAX_P15_SIZE];
+	unsigned short SW1SW2;
+	int rc, i;
+
+	FUNC_CALLED();
+
+	for (i = 0; i < sizeof(requestParameter) / sizeof(requestParameter[0]); i++) {
+		if (findAttributeInTemplate(requestParameter[i], pPublicKeyTemplate, ulPublicKeyAttributeCount) >= 0)
+			FUNC_RETURNS(CKR_FUNCTION_FAILED);
+	}
+
+	while (takeKeyPairFromPool(slot->token, pMechanism, pPublicKeyTemplate, ulPublicKeyAttributeCount, id, keysize) == CKR_OK) {
+		lockSlot(slot);
+
+		rc = readEFWithStatus(slot, (PRKD_PREFIX << 8) | *id, prkd, sizeof(prkd), &SW1SW2);
+
+		if ((rc < 0) && (SW1SW2 == 0x6A82)) {
+			rc = createPrivateKeyDescription(slot, pMechanism, pPrivateKeyTemplate, ulPrivateKeyAttributeCount, *id, *keysize);
+			unlockSlot(slot);
+
+			if (rc != CKR_OK)
+				FUNC_FAILS(rc, "Binding pooled key pair failed");
+
+			FUNC_RETURNS(CKR_OK);
+		}
+
+		unlockSlot(slot);
+		debug("Pooled key pair %d is no longer unbound\n", *id);
+	}
+
+	FUNC_RETURNS(CKR_FUNCTION_FAILED);
+}
+#endif
+
+
+
 /**
  * Generate EC or RSA key pair
  */
@@ -1962,10 +2656,7 @@ static int sc_hsm_C_GenerateKeyPair(
 		struct p11Object_t **phPublicKey,
 		struct p11Object_t **phPrivateKey)
 {
-	unsigned char buff[512];
-	struct bytebuffer_s bb = { buff, 0, sizeof(buff) };
 	struct p11Object_t *priKey, *pubKey;
-	unsigned short SW1SW2;
 	int rc,id,keysize,idpos;
 
 	FUNC_CALLED();
@@ -1985,27 +2676,20 @@ static int sc_hsm_C_GenerateKeyPair(
 			FUNC_FAILS(CKR_ATTRIBUTE_VALUE_INVALID, "A private key with that CKA_ID does already exist");
 	}
 
-	rc = encodeGAKP(&bb, pMechanism, pPublicKeyTemplate, ulPublicKeyAttributeCount, &keysize);
-
-	if (rc != CKR_OK)
-		FUNC_FAILS(rc, "Encoding GAKP failed");
-
-	id = determineFreeKeyId(slot, KEY_PREFIX);
-
-	if (id < 0)
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Determine free id failed");
-
-	rc = transmitAPDU(slot, 0x00, 0x46, id, 0x00,
-			(int)bbGetLength(&bb), buff,
-			0, NULL, 0, &SW1SW2);
+#ifndef MINIDRIVER
+	rc = bindPooledKeyPair(slot, pMechanism, pPublicKeyTemplate, ulPublicKeyAttributeCount, pPrivateKeyTemplate, ulPrivateKeyAttributeCount, &id, &keysize);
+#else
+	rc = CKR_FUNCTION_FAILED;
+#endif
 
-	if (rc < 0)
-		FUNC_FAILS(CKR_DEVICE_ERROR, "transmitAPDU failed");
+	if (rc != CKR_OK) {
+		rc = generateUnboundKeyPair(slot, pMechanism, pPublicKeyTemplate, ulPublicKeyAttributeCount, &id, &keysize);
 
-	if (SW1SW2 != 0x9000)
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Signature operation failed");
+		if (rc != CKR_OK)
+			FUNC_FAILS(rc, "Generating key pair failed");
 
-	createPrivateKeyDescription(slot,pMechanism, pPrivateKeyTemplate, ulPrivateKeyAttributeCount, id, keysize);
+		createPrivateKeyDescription(slot,pMechanism, pPrivateKeyTemplate, ulPrivateKeyAttributeCount, id, keysize);
+	}
 
 	rc = addEECertificateAndKeyObjects(slot->token, id, &priKey, &pubKey, NULL);
 
@@ -2219,10 +2903,67 @@ static int sc_hsm_destroyObject(struct p11Slot_t *slot, struct p11Object_t *pObj
 
 
 
+#ifndef MINIDRIVER
+/**
+ * Add a key pair without key description to the key pool
+ *
+ * Only key pairs generated for the key pool in a previous session are added. They are
+ * recognized by the CHR set in generatePoolKeyPair().
+ */
+static void adoptUnboundKeyPair(struct p11Token_t *token, unsigned char id)
+{
+	unsigned char buff[MAX_CERTIFICATE_SIZE];
+	struct cvc cvc;
+	bytestring oid;
+	int rc, keysize;
+
+	rc = readCachedEF(token, (PRKD_PREFIX << 8) | id, buff, sizeof(buff));
+	if (rc >= 0)
+		return;
+
+	rc = readCachedEF(token, (EE_CERTIFICATE_PREFIX << 8) | id, buff, sizeof(buff));
+	if ((rc <= 0) || (buff[0] != 0x7F) || (cvcDecode(buff, rc, &cvc) < 0))
+		return;
+
+	if (bsCompare(&cvc.chr, &poolCHR) || (cvc.car.val != NULL))
+		return;
+
+	keysize = (int)(cvc.primeOrModulus.len << 3);
+
+	if (!bsCompare(&cvc.pukoid, &defaultAlgorithmRSA)) {
+		if (bsCompare(&cvc.coefficientAorExponent, &defaultPublicExponent))
+			return;
+		rc = addKeyPairToPool(token, CKM_RSA_PKCS_KEY_PAIR_GEN, keysize, NULL, 0, id);
+	} else if (!bsCompare(&cvc.pukoid, &defaultAlgorithmEC)) {
+		if (cvcDetermineCurveOID(&cvc, &oid) < 0)
+			return;
+		rc = addKeyPairToPool(token, CKM_EC_KEY_PAIR_GEN, keysize, oid->val, oid->len, id);
+	} else {
+		return;
+	}
+
+	if (rc == CKR_OK)
+		debug("Added unbound key pair %d to key pool\n", id);
+}
+#endif
+
+
+
+/**
+ * Load label and objects from the token
+ *
+ * If the object cache is enabled, then the list of files on the token serves as fingerprint
+ * and the content of all files is taken from the cache if it matches. Changes to the content
+ * of existing files by other writers are not detected, see objectcache.c.
+ */
 static int sc_hsm_loadObjects(struct p11Token_t *token)
 {
 	unsigned char filelist[MAX_FILES * 2];
 	struct p11Slot_t *slot = token->slot;
+#ifndef MINIDRIVER
+	struct token_sc_hsm *sc = getPrivateData(token);
+	char identity[MAX_CACHE_IDENTITY];
+#endif
 	int rc,listlen,i,id,prefix;
 
 	FUNC_CALLED();
@@ -2233,6 +2974,14 @@ static int sc_hsm_loadObjects(struct p11Token_t *token)
 	}
 
 	listlen = rc;
+
+#ifndef MINIDRIVER
+	getTokenIdentity(token, identity, sizeof(identity));
+	sc->cache = openObjectCache(identity, filelist, listlen);
+#endif
+
+	decodeLabel(token);
+
 	for (i = 0; i < listlen; i += 2) {
 		prefix = filelist[i];
 		id = filelist[i + 1];
@@ -2242,8 +2991,9 @@ static int sc_hsm_loadObjects(struct p11Token_t *token)
 			if (id != 0) {				// Skip Device Authentication Key
 				rc = addEECertificateAndKeyObjects(token, id, NULL, NULL, NULL);
 				if (rc != CKR_OK) {
-#ifdef DEBUG
 					debug("addEECertificateAndKeyObjects failed with rc=%d\n", rc);
+#ifndef MINIDRIVER
+					adoptUnboundKeyPair(token, id);
 #endif
 				}
 			}
@@ -2251,14 +3001,17 @@ static int sc_hsm_loadObjects(struct p11Token_t *token)
 		case CA_CERTIFICATE_PREFIX:
 			rc = addCACertificateObject(token, id);
 			if (rc != CKR_OK) {
-#ifdef DEBUG
 				debug("addCACertificateAndKeyObjects failed with rc=%d\n", rc);
-#endif
 			}
 			break;
 		}
 	}
 
+#ifndef MINIDRIVER
+	closeObjectCache(sc->cache, TRUE);
+	sc->cache = NULL;
+#endif
+
 	FUNC_RETURNS(CKR_OK);
 }
 
@@ -2372,9 +3125,7 @@ static int sc_hsm_login(struct p11Slot_t *slot, int userType, CK_UTF8CHAR_PTR pi
 		retry = 2;			// Retry PIN verification if applet selection was lost
 		while (retry--) {
 			if ((slot->token->info.flags & CKF_PROTECTED_AUTHENTICATION_PATH) && !pinlen && !pin) {
-#ifdef DEBUG
 				debug("Verify PIN using CKF_PROTECTED_AUTHENTICATION_PATH\n");
-#endif
 				rc = transmitVerifyPinAPDU(slot, 0x00, 0x20, 0x00, 0x81,
 					0, NULL,
 					&SW1SW2,
@@ -2384,9 +3135,7 @@ static int sc_hsm_login(struct p11Slot_t *slot, int userType, CK_UTF8CHAR_PTR pi
 					0x00 /* bmPINLengthFormat: no PIN length insertion - set to all zeros */
 					);
 			} else {
-#ifdef DEBUG
 				debug("Verify PIN using provided PIN value\n");
-#endif
 				if (pinlen > 16) {
 					FUNC_FAILS(CKR_PIN_LEN_RANGE, "transmitAPDU failed");
 				}
@@ -2418,6 +3167,12 @@ static int sc_hsm_login(struct p11Slot_t *slot, int userType, CK_UTF8CHAR_PTR pi
 
 			FUNC_FAILS(rc, "sc_hsm_login failed");
 		}
+
+		// A login by the application allows recovery to try again
+		if (!slot->recovering) {
+			sc = getPrivateData(slot->token);
+			sc->recoveryPINRejected = FALSE;
+		}
 	}
 
 	FUNC_RETURNS(rc);
@@ -2425,6 +3180,74 @@ static int sc_hsm_login(struct p11Slot_t *slot, int userType, CK_UTF8CHAR_PTR pi
 
 
 
+/**
+ * Restore applet selection and user login after the card was reset by another process
+ *
+ * The PIN is verified at most once with a wrong value. Once the card rejected the PIN,
+ * recovery no longer restores the login until the application logs in again. VERIFY is
+ * also skipped if the retry counter is already low, so that resets can not block the PIN.
+ *
+ * @param slot      The slot in which the token is inserted
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+static int sc_hsm_recover(struct p11Slot_t *slot)
+{
+	CK_UTF8CHAR pin[64];
+	CK_ULONG pinlen;
+	struct token_sc_hsm *sc;
+	int rc;
+
+	FUNC_CALLED();
+
+	rc = selectApplet(slot, NULL, NULL);
+	if (rc < 0) {
+		FUNC_FAILS(CKR_TOKEN_NOT_RECOGNIZED, "applet selection failed");
+	}
+
+	// The SO-PIN is only kept in memory and needs no card state
+	if (slot->token->user != CKU_USER) {
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	sc = getPrivateData(slot->token);
+	if (sc->recoveryPINRejected) {
+		FUNC_FAILS(CKR_PIN_INCORRECT, "PIN for recovery was rejected before");
+	}
+
+	rc = checkPINStatus(slot, 0x81);
+	if (rc < 0) {
+		FUNC_FAILS(CKR_TOKEN_NOT_RECOGNIZED, "checkPINStatus failed");
+	}
+
+	if (updatePinStatus(slot->token, rc) == CKR_OK) {
+		FUNC_RETURNS(CKR_OK);
+	}
+
+	if (slot->token->info.flags & (CKF_USER_PIN_LOCKED | CKF_USER_PIN_COUNT_LOW)) {
+		FUNC_FAILS(CKR_PIN_INCORRECT, "PIN retry counter too low to restore login");
+	}
+
+	pinlen = sizeof(pin);
+	rc = getRecoveryPIN(slot, CKU_USER, pin, &pinlen);
+	if (rc != CKR_OK) {
+		FUNC_FAILS(rc, "No PIN to restore login");
+	}
+
+	rc = sc_hsm_login(slot, CKU_USER, pinlen ? pin : NULL, pinlen);
+	memset(pin, 0, sizeof(pin));
+
+	if ((rc == CKR_PIN_INCORRECT) || (rc == CKR_PIN_LOCKED))
+		sc->recoveryPINRejected = TRUE;
+
+	if (rc != CKR_OK) {
+		FUNC_FAILS(rc, "Restoring login failed");
+	}
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
 /**
  * Reselect applet in order to reset authentication state
  *
@@ -2484,9 +3307,7 @@ static int sc_hsm_initpin(struct p11Slot_t *slot, CK_UTF8CHAR_PTR pin, CK_ULONG
 	if (pin != NULL)
 		memcpy(data + sizeof(sc->sopin), pin, pinlen);
 
-#ifdef DEBUG
 	debug("Init PIN using provided PIN value\n");
-#endif
 	rc = transmitAPDU(slot, 0x00, 0x2C, pinlen ? 0x00 : 0x01, 0x81,
 		pinlen + sizeof(sc->sopin), data,
 		0, NULL, 0, &SW1SW2);
@@ -2564,9 +3385,7 @@ static int sc_hsm_setpin(struct p11Slot_t *slot, CK_UTF8CHAR_PTR oldpin, CK_ULON
 		p2 = 0x81;
 	}
 
-#ifdef DEBUG
 	debug("Set PIN using provided PIN value\n");
-#endif
 	rc = transmitAPDU(slot, 0x00, 0x24, 0x00, p2,
 		len, data,
 		0, NULL, 0, &SW1SW2);
@@ -2679,8 +3498,6 @@ int newSmartCardHSMToken(struct p11Slot_t *slot, struct p11Token_t **token)
 		ptoken->info.flags |= CKF_TOKEN_INITIALIZED;
 	}
 
-	decodeLabel(ptoken);
-
 	rc = decodeDevAutCert(ptoken);
 	if (rc != CKR_OK) {
 		freeToken(ptoken);
@@ -2875,21 +3692,24 @@ struct p11TokenDriver *getSmartCardHSMTokenDriver()
 		sc_hsm_setpin,
 
 		sc_hsm_C_DecryptInit,		// int (*C_DecryptInit)  (struct p11Object_t *, CK_MECHANISM_PTR);
-		sc_hsm_C_Decrypt,		// int (*C_Decrypt)      (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
-		NULL,				// int (*C_DecryptUpdate)(struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
-		NULL,				// int (*C_DecryptFinal) (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
+		sc_hsm_C_Decrypt,		// int (*C_Decrypt)      (struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+		NULL,				// int (*C_DecryptUpdate)(struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+		NULL,				// int (*C_DecryptFinal) (struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
 
 		sc_hsm_C_SignInit,		// int (*C_SignInit)     (struct p11Object_t *, CK_MECHANISM_PTR);
 		sc_hsm_C_Sign,			// int (*C_Sign)         (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
-		NULL,				// int (*C_SignUpdate)   (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG);
-		NULL,				// int (*C_SignFinal)    (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
+		NULL,				// int (*C_SignUpdate)   (struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG);
+		NULL,				// int (*C_SignFinal)    (struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
 
 		sc_hsm_C_GenerateKey,
 		sc_hsm_C_GenerateKeyPair,	// int (*C_GenerateKeyPair)  (struct p11Slot_t *, CK_MECHANISM_PTR, CK_ATTRIBUTE_PTR, CK_ULONG, CK_ATTRIBUTE_PTR, CK_ULONG, struct p11Object_t **, struct p11Object_t **);
 		sc_hsm_C_CreateObject,		// int (*C_CreateObject)     (struct p11Slot_t *, CK_ATTRIBUTE_PTR, CK_ULONG ulCount, struct p11Object_t **);
 		sc_hsm_destroyObject,		// int (*destroyObject)       (struct p11Slot_t *, struct p11Object_t *);
 		sc_hsm_C_SetAttributeValue,	// int (*C_SetAttributeValue)(struct p11Slot_t *, struct p11Object_t *, CK_ATTRIBUTE_PTR, CK_ULONG);
-		sc_hsm_C_GenerateRandom		// int (*C_GenerateRandom)   (struct p11Slot_t *, CK_BYTE_PTR , CK_ULONG );
+		sc_hsm_C_GenerateRandom,	// int (*C_GenerateRandom)   (struct p11Slot_t *, CK_BYTE_PTR , CK_ULONG );
+
+		sc_hsm_recover,			// int (*recover)            (struct p11Slot_t *);
+		generatePoolKeyPair		// int (*generatePoolKeyPair)(struct p11Slot_t *, CK_MECHANISM_PTR, CK_ATTRIBUTE_PTR, CK_ULONG, int *, int *);
 	};
 
 	return &sc_hsm_token;
@@ -73,11 +73,17 @@
 #define ALGO_AES_CBC_DECRYPT	0x11
 #define ALGO_AES_CMAC		0x18
 
+#define AES_BLOCK_SIZE		16		/* Block size and length of the IV for AES */
+
 #define ID_USER_PIN		0x81		/* User PIN identifier */
 #define ID_SO_PIN		0x88		/* Security officer PIN identifier */
 
+struct p11ObjectCache_t;
+
 struct token_sc_hsm {
 	unsigned char sopin[8];
+	struct p11ObjectCache_t *cache;		/* Object cache used while loading objects */
+	int recoveryPINRejected;			/* The PIN for restoring the login after a reset was wrong */
 };
 
 struct p11TokenDriver *sc_hsm_getDriver();
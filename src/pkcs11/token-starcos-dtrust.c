@@ -197,50 +197,6 @@ static int isCandidate(unsigned char *atr, size_t atrLen)
 
 
 
-static int loadObjects(struct p11Token_t *token)
-{
-	struct starcosPrivateData *sc;
-	int rc,i;
-
-	FUNC_CALLED();
-
-	sc = starcosGetPrivateData(token);
-
-	// The D-Trust card stores certificates in a separate DF
-	rc = starcosSwitchApplication(token, &starcosApplications[2]);
-	if (rc != CKR_OK) {
-		FUNC_FAILS(rc, "Could not switch to DF.Certs");
-	}
-
-	for (i = 0; i < (int)sc->application->certsLen; i++) {
-		struct p15CertificateDescription *p15 = &sc->application->certs[i];
-
-		rc = starcosAddCertificateObject(token, p15);
-		if (rc != CKR_OK) {
-#ifdef DEBUG
-			debug("addCertificateObject failed with rc=%d\n", rc);
-#endif
-		}
-	}
-
-	starcosSelectApplication(token);
-
-	for (i = 0; i < (int)sc->application->privateKeysLen; i++) {
-		struct p15PrivateKeyDescription *p15 = &sc->application->privateKeys[i];
-
-		rc = starcosAddPrivateKeyObject(token, p15);
-		if (rc != CKR_OK) {
-#ifdef DEBUG
-			debug("addPrivateKeyObject failed with rc=%d\n", rc);
-#endif
-		}
-	}
-
-	FUNC_RETURNS(CKR_OK);
-}
-
-
-
 /**
  * Create a new STARCOS token if token detection and initialization is successful
  *
@@ -320,22 +276,24 @@ static int createDTrustToken(struct p11Slot_t *slot, struct p11Token_t **token,
 		ptoken->info.flags |= CKF_LOGIN_REQUIRED;
 	}
 
-	rc = loadObjects(ptoken);
+	// Query the PIN status while the application is still selected
+	rc = starcosCheckPINStatus(slot, sc->application->pinref);
 
 	if (rc < 0) {
 		freeToken(ptoken);
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Error loading objects from token");
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Error querying PIN status");
 	}
 
-	rc = starcosCheckPINStatus(slot, sc->application->pinref);
+	starcosUpdatePinStatus(ptoken, rc);
+
+	// The D-Trust card stores certificates in a separate DF
+	rc = starcosLoadObjects(ptoken, &starcosApplications[2]);
 
 	if (rc < 0) {
 		freeToken(ptoken);
-		FUNC_FAILS(CKR_DEVICE_ERROR, "Error querying PIN status");
+		FUNC_FAILS(CKR_DEVICE_ERROR, "Error loading objects from token");
 	}
 
-	starcosUpdatePinStatus(ptoken, rc);
-
 	if (slot->primarySlot) {
 		if (slot->primarySlot->hasFeatureVerifyPINDirect) {
 			ptoken->info.flags |= CKF_PROTECTED_AUTHENTICATION_PATH;
@@ -32,6 +32,7 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
 #include "token-starcos.h"
 
 #include <common/bytestring.h>
@@ -47,6 +48,10 @@
 #include <pkcs11/publickeyobject.h>
 #include <pkcs11/strbpcpy.h>
 
+#ifdef ENABLE_LIBCRYPTO
+#include <pkcs11/crypto.h>
+#endif
+
 
 
 static unsigned char algo_PKCS15[] =           { 0x89, 0x02, 0x13, 0x23 };
@@ -135,15 +140,11 @@ int starcosSwitchApplication(struct p11Token_t *token, struct starcosApplication
 	}
 
 	if (application->aidId == *sa) {
-#ifdef DEBUG
 		debug("Application %d already selected\n", *sa);
-#endif
 		return 0;
 	}
 
-#ifdef DEBUG
 		debug("Switch to application %d\n", application->aidId);
-#endif
 
 	rc = transmitAPDU(token->slot, 0x00, 0xA4, 0x04, 0x0C,
 			(int)application->aid.len, application->aid.val,
@@ -198,28 +199,33 @@ int starcosReadTLVEF(struct p11Token_t *token, bytestring fid, unsigned char *co
 		FUNC_FAILS(-1, "File not found");
 	}
 
-	// Read first block to determine tag and length
+	// Restrict the number of bytes in Le to either the maximum APDU size of STARCOS or
+	// the maximum APDU size of the reader, if any.
+	maxapdu = token->drv->maxRAPDU;
+	if (token->slot->maxRAPDU && (token->slot->maxRAPDU < maxapdu))
+		maxapdu = token->slot->maxRAPDU;
+	maxapdu -= 2;		// Accommodate SW1/SW2
+
+	// Read first block to determine tag and length. If card and reader support
+	// responses larger than 256 bytes, a typical certificate is read in one go.
+	ne = 0;
+	if ((maxapdu > 256) && (len > 256))
+		ne = (len < (size_t)maxapdu) ? (int)len : maxapdu;
+
 	rc = transmitAPDU(token->slot, 0x00, 0xB0, 0x00, 0x00,
 			0, NULL,
-			0, content, (int)len, &SW1SW2);
+			ne, content, (int)len, &SW1SW2);
 
 	if (rc < 0) {
 		FUNC_FAILS(rc, "transmitAPDU failed");
 	}
 
-	if (SW1SW2 != 0x9000) {
+	if ((SW1SW2 != 0x9000) && !((SW1SW2 == 0x6282) && (ne > 0))) {
 		FUNC_FAILS(-1, "Read EF failed");
 	}
 
 	ofs = rc;
 
-	// Restrict the number of bytes in Le to either the maximum APDU size of STARCOS or
-	// the maximum APDU size of the reader, if any.
-	maxapdu = token->drv->maxRAPDU;
-	if (token->slot->maxRAPDU && (token->slot->maxRAPDU < maxapdu))
-		maxapdu = token->slot->maxRAPDU;
-	maxapdu -= 2;		// Accommodate SW1/SW2
-
 	le = 65536;			// Read all if no certificate found
 	if ((*content == 0x30) || (*content == 0x5A)) {
 		po = content;
@@ -270,6 +276,13 @@ int starcosReadICCSN(struct p11Token_t *token)
 
 	FUNC_CALLED();
 
+	// Tokens in virtual slots share the card with the base token, so the serial number
+	// is already known. Copying it saves selecting the MF and reselecting the application.
+	if (token->slot->primarySlot && token->slot->primarySlot->token) {
+		memcpy(token->info.serialNumber, getBaseToken(token)->info.serialNumber, sizeof(token->info.serialNumber));
+		return 0;
+	}
+
 	// Clear currently selected application indicator
 	sc = starcosGetPrivateData(token);
 
@@ -395,9 +408,10 @@ int starcosUpdatePinStatus(struct p11Token_t *token, int pinstatus)
 
 int starcosDeterminePinUseCounter(struct p11Token_t *token, unsigned char recref, int *useCounter, int *lifeCycle)
 {
-	int rc,ucpathlen;
+	int rc,fc,ucpathlen;
 	unsigned short SW1SW2;
-	unsigned char rec[256], *p,*fid,*ucpath;
+	unsigned char rec[256], *fid,*ucpath;
+	struct asn1Cursor cur;
 	FUNC_CALLED();
 
 	if (token->info.firmwareVersion.minor >= 5) {
@@ -437,29 +451,28 @@ int starcosDeterminePinUseCounter(struct p11Token_t *token, unsigned char recref
 	}
 
 	rc = asn1Encap(0x30, rec, rc);
-	rc = (int)asn1Validate(rec, rc);
-
-	if (rc > 0) {
-		FUNC_FAILS(rc, "ASN.1 structure invalid");
-	}
 
 	*useCounter = 0;
-	p = asn1Find(rec, ucpath, ucpathlen);
+	asn1InitCursor(&cur, rec, rc);
+	fc = asn1CursorFindPath(&cur, ucpath, ucpathlen);
 
-	if (p) {
-		asn1Tag(&p);
-		asn1Length(&p);
+	if (fc < 0) {
+		FUNC_FAILS(-1, "ASN.1 structure invalid");
+	}
 
-		*useCounter = (*p == 0xFF ? 0 : *p);
+	if ((fc > 0) && (cur.length > 0)) {
+		*useCounter = (*cur.value == 0xFF ? 0 : *cur.value);
 	}
 
-	p = asn1Find(rec, (unsigned char *)"\x30\x8A", 2);
+	asn1InitCursor(&cur, rec, rc);
+	fc = asn1CursorFindPath(&cur, (unsigned char *)"\x30\x8A", 2);
 
-	if (p) {
-		asn1Tag(&p);
-		asn1Length(&p);
+	if (fc < 0) {
+		FUNC_FAILS(-1, "ASN.1 structure invalid");
+	}
 
-		*lifeCycle = *p;
+	if ((fc > 0) && (cur.length > 0)) {
+		*lifeCycle = *cur.value;
 	}
 
 	FUNC_RETURNS(CKR_OK);
@@ -601,12 +614,75 @@ static int getAlgorithmIdForDecryption(struct p11Token_t *token, CK_MECHANISM_TY
 
 
 
+#ifdef ENABLE_LIBCRYPTO
+static int hashOnCard = -1;
+
+
+
+/**
+ * Determine if the message must be hashed completely by the card
+ *
+ * By default only the last block of a message is hashed by the card, continuing from an
+ * intermediate hash value computed on the host. Set PKCS11_STARCOS_HASH=card for card
+ * profiles that mandate the complete message to be hashed on the card.
+ */
+static int isHashOnCard()
+{
+	char *val;
+
+	if (hashOnCard < 0) {
+		val = getenv("PKCS11_STARCOS_HASH");
+		hashOnCard = (val != NULL) && !strcmp(val, "card");
+	}
+	return hashOnCard;
+}
+
+
+
+static CK_MECHANISM_TYPE getHashMechanism(CK_MECHANISM_TYPE mech)
+{
+	switch(mech) {
+	case CKM_SHA1_RSA_PKCS:
+	case CKM_SHA1_RSA_PKCS_PSS:
+		return CKM_SHA_1;
+	case CKM_SHA224_RSA_PKCS:
+	case CKM_SHA224_RSA_PKCS_PSS:
+		return CKM_SHA224;
+	case CKM_SHA256_RSA_PKCS:
+	case CKM_SHA256_RSA_PKCS_PSS:
+		return CKM_SHA256;
+	case CKM_SHA384_RSA_PKCS:
+	case CKM_SHA384_RSA_PKCS_PSS:
+		return CKM_SHA384;
+	default:
+		return CKM_SHA512;
+	}
+}
+#endif
+
+
+
+/**
+ * Hash the message on the card in preparation of a signature
+ *
+ * If available, all but the last block of the message is hashed on the host and
+ * only the intermediate hash value and the last block is send to the card.
+ *
+ * @param token     The token
+ * @param mech      The signature mechanism
+ * @param data      The message
+ * @param len       The length of the message
+ * @return          CKR_OK or any other Cryptoki error code
+ */
 int starcosDigest(struct p11Token_t *token, CK_MECHANISM_TYPE mech, unsigned char *data, size_t len)
 {
-	int rc;
+	int rc, hl;
 	size_t chunk;
 	unsigned short SW1SW2;
 	unsigned char scr[1008],*algo, *po;
+#ifdef ENABLE_LIBCRYPTO
+	CK_ULONG hashed, statelen;
+#endif
 
 	FUNC_CALLED();
 
@@ -632,11 +708,30 @@ int starcosDigest(struct p11Token_t *token, CK_MECHANISM_TYPE mech, unsigned cha
 		FUNC_FAILS(CKR_DEVICE_ERROR, "MANAGE SE failed");
 	}
 
+	// Empty intermediate hash value
+	scr[0] = 0x90;
+	scr[1] = 0x00;
+	hl = 2;
+
+#ifdef ENABLE_LIBCRYPTO
+	if (!isHashOnCard()) {
+		rc = cryptoIntermediateHash(getHashMechanism(mech), data, (CK_ULONG)len, &hashed, scr + 2, &statelen);
+		if (rc != CKR_OK) {
+			FUNC_FAILS(rc, "cryptoIntermediateHash() failed");
+		}
+
+		if (hashed > 0) {
+			scr[1] = (unsigned char)statelen;
+			hl += (int)statelen;
+			data += hashed;
+			len -= hashed;
+		}
+	}
+#endif
+
 	if (len <= 1000) {
-		scr[0] = 0x90;
-		scr[1] = 0x00;
-		memcpy(scr + 2, data, len);
-		rc = asn1Encap(0x80, scr + 2, (int)len) + 2;
+		memcpy(scr + hl, data, len);
+		rc = asn1Encap(0x80, scr + hl, (int)len) + hl;
 
 		rc = transmitAPDU(token->slot, 0x00, 0x2A, 0x90, 0xA0,
 				rc, scr,
@@ -650,9 +745,6 @@ int starcosDigest(struct p11Token_t *token, CK_MECHANISM_TYPE mech, unsigned cha
 			FUNC_FAILS(CKR_DEVICE_ERROR, "Hash operation failed");
 		}
 	} else {
-		scr[0] = 0x90;
-		scr[1] = 0x00;
-
 		rc = transmitAPDU(token->slot, 0x10, 0x2A, 0x90, 0xA0,
 				2, scr,
 				0, NULL, 0, &SW1SW2);
@@ -830,7 +922,7 @@ static int starcos_C_DecryptInit(struct p11Object_t *pObject, CK_MECHANISM_PTR m
 
 
 
-static int starcos_C_Decrypt(struct p11Object_t *pObject, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
+static int starcos_C_Decrypt(struct p11Object_t *pObject, struct p11Session_t *session, CK_MECHANISM_TYPE mech, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, CK_ULONG_PTR pulDataLen)
 {
 	int rc, len;
 	unsigned char *d,*s;
@@ -1048,7 +1140,19 @@ int starcosAddPrivateKeyObject(struct p11Token_t *token, struct p15PrivateKeyDes
 
 
 
-static int loadObjects(struct p11Token_t *token)
+/**
+ * Load certificate, private key and public key objects for the token
+ *
+ * Certificates are read first, all from the same application, so that the application
+ * needs to be selected at most once. Key objects are derived from the certificates and
+ * from the static application description, so they do not require access to the card.
+ * The application of the token is selected again lazily with the next operation.
+ *
+ * @param token     The token to load objects for
+ * @param certapp   The application containing the certificate EFs or NULL for the token application
+ * @return          CKR_OK or any other Cryptoki error code
+ */
+int starcosLoadObjects(struct p11Token_t *token, struct starcosApplication *certapp)
 {
 	struct starcosPrivateData *sc;
 	int rc,i;
@@ -1057,14 +1161,22 @@ static int loadObjects(struct p11Token_t *token)
 
 	sc = starcosGetPrivateData(token);
 
+	if (certapp == NULL)
+		certapp = sc->application;
+
+	if (sc->application->certsLen > 0) {
+		rc = starcosSwitchApplication(token, certapp);
+		if (rc < 0) {
+			FUNC_FAILS(CKR_DEVICE_ERROR, "Could not select application containing certificates");
+		}
+	}
+
 	for (i = 0; i < (int)sc->application->certsLen; i++) {
 		struct p15CertificateDescription *p15 = &sc->application->certs[i];
 
 		rc = starcosAddCertificateObject(token, p15);
 		if (rc != CKR_OK) {
-#ifdef DEBUG
 			debug("addCertificateObject failed with rc=%d\n", rc);
-#endif
 		}
 	}
 
@@ -1073,9 +1185,7 @@ static int loadObjects(struct p11Token_t *token)
 
 		rc = starcosAddPrivateKeyObject(token, p15);
 		if (rc != CKR_OK) {
-#ifdef DEBUG
 			debug("addPrivateKeyObject failed with rc=%d\n", rc);
-#endif
 		}
 	}
 
@@ -1157,9 +1267,7 @@ static int login(struct p11Slot_t *slot, int userType, CK_UTF8CHAR_PTR pin, CK_U
 	} else {
 
 		if ((slot->token->info.flags & CKF_PROTECTED_AUTHENTICATION_PATH) && !pinlen && !pin) {
-#ifdef DEBUG
 			debug("Verify PIN using CKF_PROTECTED_AUTHENTICATION_PATH\n");
-#endif
 			memset(f2b, 0xFF, 8);
 			f2b[0] = 0x20;
 
@@ -1172,9 +1280,7 @@ static int login(struct p11Slot_t *slot, int userType, CK_UTF8CHAR_PTR pin, CK_U
 					0x04 /* bmPINLengthFormat: system units are bits, PIN length position is 4 bits*/
 					);
 		} else {
-#ifdef DEBUG
 			debug("Verify PIN using provided PIN value\n");
-#endif
 			rc = encodeF2B(pin, pinlen, f2b);
 
 			if (rc != CKR_OK) {
@@ -1247,9 +1353,7 @@ static int initpin(struct p11Slot_t *slot, CK_UTF8CHAR_PTR pin, CK_ULONG pinlen)
 	memcpy(data, sc->sopin, sizeof(sc->sopin));
 	pinref = sc->application->pinref;
 
-#ifdef DEBUG
 	debug("Init PIN using provided PIN value\n");
-#endif
 	if (pin) {
 		rc = transmitAPDU(slot, 0x00, 0x2C, 0x00, pinref,
 				sizeof(data), data,
@@ -1337,9 +1441,7 @@ static int setpin(struct p11Slot_t *slot, CK_UTF8CHAR_PTR oldpin, CK_ULONG oldpi
 
 	sc = starcosGetPrivateData(slot->token);
 
-#ifdef DEBUG
 	debug("Set PIN using provided PIN value\n");
-#endif
 	rc = transmitAPDU(slot, 0x00, 0x24, 0x00, sc->application->pinref,
 		sizeof(data), data,
 		0, NULL, 0, &SW1SW2);
@@ -1469,7 +1571,7 @@ int createStarcosToken(struct p11Slot_t *slot, struct p11Token_t **token, struct
 	if (ptoken->pinUseCounter != 1)
 		ptoken->info.flags |= CKF_LOGIN_REQUIRED;
 
-	rc = loadObjects(ptoken);
+	rc = starcosLoadObjects(ptoken, NULL);
 
 	if (rc < 0) {
 		freeToken(ptoken);
@@ -1623,14 +1725,14 @@ struct p11TokenDriver *getStarcosTokenDriver()
 		setpin,
 
 		starcos_C_DecryptInit,		// int (*C_DecryptInit)  (struct p11Object_t *, CK_MECHANISM_PTR);
-		starcos_C_Decrypt,		// int (*C_Decrypt)      (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
-		NULL,				// int (*C_DecryptUpdate)(struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
-		NULL,				// int (*C_DecryptFinal) (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
+		starcos_C_Decrypt,		// int (*C_Decrypt)      (struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+		NULL,				// int (*C_DecryptUpdate)(struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+		NULL,				// int (*C_DecryptFinal) (struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
 
 		starcos_C_SignInit,		// int (*C_SignInit)     (struct p11Object_t *, CK_MECHANISM_PTR);
 		starcos_C_Sign,			// int (*C_Sign)         (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
-		NULL,				// int (*C_SignUpdate)   (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG);
-		NULL,				// int (*C_SignFinal)    (struct p11Object_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
+		NULL,				// int (*C_SignUpdate)   (struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG);
+		NULL,				// int (*C_SignFinal)    (struct p11Object_t *, struct p11Session_t *, CK_MECHANISM_TYPE, CK_BYTE_PTR, CK_ULONG_PTR);
 
 		NULL,
 		NULL,				// int (*C_GenerateKeyPair)  (struct p11Slot_t *, CK_MECHANISM_PTR, CK_ATTRIBUTE_PTR, CK_ULONG, CK_ATTRIBUTE_PTR, CK_ULONG, struct p11Object_t **, struct p11Object_t **);
@@ -73,6 +73,7 @@ int starcosCheckPINStatus(struct p11Slot_t *slot, unsigned char pinref);
 int starcosUpdatePinStatus(struct p11Token_t *token, int pinstatus);
 int starcosAddCertificateObject(struct p11Token_t *token, struct p15CertificateDescription *p15);
 int starcosAddPrivateKeyObject(struct p11Token_t *token, struct p15PrivateKeyDescription *p15);
+int starcosLoadObjects(struct p11Token_t *token, struct starcosApplication *certapp);
 int starcosDigest(struct p11Token_t *token, CK_MECHANISM_TYPE mech, unsigned char *data, size_t len);
 int starcosDeterminePinUseCounter(struct p11Token_t *token, unsigned char recref, int *useCounter, int *lifeCycle);
 int starcosReadICCSN(struct p11Token_t *token);
@@ -42,12 +42,16 @@
 #include <pkcs11/token.h>
 #include <pkcs11/object.h>
 #include <pkcs11/dataobject.h>
+#include <pkcs11/reclaim.h>
+#ifndef MINIDRIVER
+#include <pkcs11/randompool.h>
+#include <pkcs11/keypool.h>
+#include <pkcs11/slot-replay.h>
+#endif
 
 #include <pkcs11/token-sc-hsm.h>
 
-#ifdef DEBUG
 #include <common/debug.h>
-#endif
 
 extern struct p11Context_t *context;
 
@@ -143,6 +147,9 @@ int addObject(struct p11Token_t *token, struct p11Object_t *object, int publicOb
 /**
  * Find public or private object in list of token objects
  *
+ * The lookup does not lock the token. An object removed concurrently remains valid
+ * until the calling thread looks up another object.
+ *
  * @param token     The token whose object shall be searched
  * @param handle    The objects handle
  */
@@ -155,12 +162,15 @@ int findObject(struct p11Token_t *token, CK_OBJECT_HANDLE handle, struct p11Obje
 		return -1;
 	}
 
+	enterReadSection();
 	obj = publicObject == TRUE ? token->tokenObjList : token->tokenPrivObjList;
 	*object = NULL;
 
 	while (obj != NULL) {
 		if (obj->handle == handle) {
 			*object = obj;
+			protectPointer(HAZARD_OBJECT, obj);
+			leaveReadSection();
 			return pos;
 		}
 
@@ -168,6 +178,7 @@ int findObject(struct p11Token_t *token, CK_OBJECT_HANDLE handle, struct p11Obje
 		pos++;
 	}
 
+	leaveReadSection();
 	return -1;
 }
 
@@ -365,18 +376,18 @@ int removeObjectLeavingAttributes(struct p11Token_t *token, CK_OBJECT_HANDLE han
 
 	}
 
-	free(object);
-
 	token->numberOfTokenObjects--;
 
-	if (rc == 0) {      /* We removed the last element from the list */
+	if (rc == 0) {      /* We removed the first element from the list */
 		if (publicObject) {
-			token->tokenObjList = NULL;
+			token->tokenObjList = object->next;
 		} else {
-			token->tokenPrivObjList = NULL;
+			token->tokenPrivObjList = object->next;
 		}
 	}
 
+	retirePointer(object, free);
+
 	return CKR_OK;
 }
 
@@ -663,6 +674,10 @@ int newToken(struct p11Slot_t *slot, unsigned char *atr, size_t atrlen, struct p
 
 	FUNC_CALLED();
 
+#ifndef MINIDRIVER
+	recordATR(slot, atr, atrlen);
+#endif
+
 	for (t = tokenDriver; *t != NULL; t++) {
 		drv = (*t)();
 		if (drv->isCandidate(atr, atrlen)) {
@@ -691,6 +706,11 @@ void freeToken(struct p11Token_t *token)
 		if (token->drv->freeToken)
 			token->drv->freeToken(token);
 
+#ifndef MINIDRIVER
+		freeRandomPool(token);
+		freeKeyPool(token);
+#endif
+
 		removePrivateObjects(token);
 		removePublicObjects(token);
 		p11DestroyMutex(token->mutex);
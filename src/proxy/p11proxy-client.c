@@ -0,0 +1,1614 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    p11proxy-client.c
+ * @author  Andreas Schwier
+ * @brief   PKCS#11 module forwarding calls to the proxy daemon
+ *
+ * The module connects to the socket given in PKCS11_PROXY_SOCKET (default
+ * /run/sc-hsm-pkcs11-proxy/proxy.sock) and forwards all calls to the daemon, which owns the
+ * readers and the enumerated tokens. All calls of a process share one connection.
+ *
+ * Before any request is sent, the module verifies that the daemon runs as root, as the same
+ * user as the calling process or as the user id given in PKCS11_PROXY_DAEMON_UID. This
+ * prevents sending PINs to a process that took over the socket path.
+ *
+ * Only the functions required to use existing keys are forwarded: slot and token information,
+ * sessions, login, object search and attributes, sign, verify, encrypt, decrypt and random
+ * number generation. All other functions return CKR_FUNCTION_NOT_SUPPORTED.
+ *
+ * If the process forks, then the child opens a new connection at the first call. Sessions
+ * opened by the parent are not valid in the child.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <common/mutex.h>
+
+#include <pkcs11/cryptoki.h>
+
+#include "p11proxy.h"
+
+#include <common/debug.h>
+
+static int initialized = FALSE;
+static pid_t initPid;
+static MUTEX proxyMutex;
+static int proxyFd = -1;
+static pid_t proxyPid;
+
+
+
+/**
+ * Verify that the process at the other end of the connection is a trusted daemon
+ *
+ * @return          0 or -1 if the daemon runs under an unexpected user id
+ */
+static int checkDaemon(int fd)
+{
+	uid_t uid;
+	char *val, *end;
+
+	if (getPeerUid(fd, &uid) < 0) {
+		debug("Could not determine user id of proxy daemon\n");
+		return -1;
+	}
+
+	if ((uid == 0) || (uid == geteuid()))
+		return 0;
+
+	val = getenv("PKCS11_PROXY_DAEMON_UID");
+	if (val != NULL) {
+		errno = 0;
+		if ((strtoul(val, &end, 10) == (unsigned long)uid) && !errno && (end != val) && !*end)
+			return 0;
+	}
+
+	debug("Proxy daemon runs with unexpected user id %lu\n", (unsigned long)uid);
+	return -1;
+}
+
+
+
+/**
+ * Connect to the daemon and verify that both sides use the same protocol and ABI
+ *
+ * Must be called with the proxy mutex held.
+ */
+static int connectProxy()
+{
+	struct sockaddr_un addr;
+	struct p11ProxyMessage msg;
+	CK_ULONG code;
+	char *path;
+	int fd;
+
+	path = getenv("PKCS11_PROXY_SOCKET");
+	if (path == NULL)
+		path = P11PROXY_DEFAULT_SOCKET;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		debug("Socket path %s too long\n", path);
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		debug("Could not connect to proxy daemon at %s\n", path);
+		close(fd);
+		return -1;
+	}
+
+	if (checkDaemon(fd) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	initMessage(&msg);
+	putULong(&msg, P11PROXY_VERSION);
+	putULong(&msg, sizeof(CK_ULONG));
+	putULong(&msg, sizeof(CK_TOKEN_INFO));
+
+	if ((sendMessage(fd, P11PROXY_HELLO, &msg) < 0) ||
+		(receiveMessage(fd, &code, &msg) < 0) ||
+		(code != P11PROXY_HELLO) ||
+		(getULong(&msg) != CKR_OK) || msg.failed) {
+		debug("Proxy daemon at %s rejected connection\n", path);
+		freeMessage(&msg);
+		close(fd);
+		return -1;
+	}
+
+	freeMessage(&msg);
+
+	proxyFd = fd;
+	proxyPid = getpid();
+	return 0;
+}
+
+
+
+/**
+ * Send the request in msg to the daemon and replace it with the response
+ *
+ * @param code      The function code
+ * @param msg       The request, replaced by the response with the read position after the return code
+ * @return          The return code from the daemon or CKR_DEVICE_ERROR if the daemon is not reachable
+ */
+static CK_RV proxyCall(CK_ULONG code, struct p11ProxyMessage *msg)
+{
+	CK_ULONG rcode;
+	CK_RV rv;
+
+	if (!initialized)
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+	if (msg->failed)
+		return CKR_HOST_MEMORY;
+
+	mutex_lock(&proxyMutex);
+
+	// The connection inherited from the parent belongs to the parent
+	if ((proxyFd >= 0) && (proxyPid != getpid())) {
+		close(proxyFd);
+		proxyFd = -1;
+	}
+
+	if ((proxyFd < 0) && (connectProxy() < 0)) {
+		mutex_unlock(&proxyMutex);
+		return CKR_DEVICE_ERROR;
+	}
+
+	if ((sendMessage(proxyFd, code, msg) < 0) ||
+		(receiveMessage(proxyFd, &rcode, msg) < 0) ||
+		(rcode != code)) {
+		debug("Connection to proxy daemon failed\n");
+		close(proxyFd);
+		proxyFd = -1;
+		mutex_unlock(&proxyMutex);
+		return CKR_DEVICE_ERROR;
+	}
+
+	mutex_unlock(&proxyMutex);
+
+	rv = getULong(msg);
+	return msg->failed ? CKR_DEVICE_ERROR : rv;
+}
+
+
+
+/**
+ * Decode an output byte string into the caller provided buffer
+ */
+static CK_RV getOutput(struct p11ProxyMessage *msg, CK_RV rv, CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen)
+{
+	unsigned char *p;
+	CK_ULONG len, plen;
+
+	if ((rv != CKR_OK) && (rv != CKR_BUFFER_TOO_SMALL))
+		return rv;
+
+	len = getULong(msg);
+
+	if (pOut && (rv == CKR_OK)) {
+		p = getBytes(msg, &plen);
+		if ((p == NULL) || (plen != len) || (len > *pulOutLen))
+			return CKR_DEVICE_ERROR;
+		memcpy(pOut, p, len);
+	}
+
+	if (msg->failed)
+		return CKR_DEVICE_ERROR;
+
+	*pulOutLen = len;
+	return rv;
+}
+
+
+
+/**
+ * Decode a list of handles or mechanisms into the caller provided array
+ */
+static CK_RV getULongList(struct p11ProxyMessage *msg, CK_RV rv, CK_ULONG_PTR pList, CK_ULONG_PTR pulCount)
+{
+	CK_ULONG i, cnt;
+
+	if ((rv != CKR_OK) && (rv != CKR_BUFFER_TOO_SMALL))
+		return rv;
+
+	cnt = getULong(msg);
+
+	if (pList && (rv == CKR_OK)) {
+		if (cnt > *pulCount)
+			return CKR_DEVICE_ERROR;
+
+		for (i = 0; i < cnt; i++)
+			pList[i] = getULong(msg);
+	}
+
+	if (msg->failed)
+		return CKR_DEVICE_ERROR;
+
+	*pulCount = cnt;
+	return rv;
+}
+
+
+
+/**
+ * Decode a fixed size structure
+ */
+static CK_RV getStruct(struct p11ProxyMessage *msg, CK_RV rv, void *p, size_t size)
+{
+	unsigned char *s;
+	CK_ULONG len;
+
+	if (rv != CKR_OK)
+		return rv;
+
+	s = getBytes(msg, &len);
+	if ((s == NULL) || (len != size))
+		return CKR_DEVICE_ERROR;
+
+	memcpy(p, s, size);
+	return CKR_OK;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_Initialize)(
+		CK_VOID_PTR pInitArgs
+)
+{
+	if (initialized && (initPid == getpid()))
+		return CKR_CRYPTOKI_ALREADY_INITIALIZED;
+
+	// A child process re-initializes the module without using the parent's connection
+	if (initialized && (proxyFd >= 0))
+		close(proxyFd);
+
+	if (mutex_init(&proxyMutex) != 0)
+		return CKR_GENERAL_ERROR;
+
+	initDebug("pkcs11-proxy");
+	initTrace("pkcs11-proxy");
+
+	FUNC_CALLED();
+
+	proxyFd = -1;
+	initPid = getpid();
+	initialized = TRUE;
+
+	// Connect early to report a missing daemon at C_Initialize
+	mutex_lock(&proxyMutex);
+	connectProxy();
+	mutex_unlock(&proxyMutex);
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_Finalize)(
+		CK_VOID_PTR pReserved
+)
+{
+	FUNC_CALLED();
+
+	if (!initialized) {
+		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
+	}
+
+	mutex_lock(&proxyMutex);
+	if ((proxyFd >= 0) && (proxyPid == getpid()))
+		close(proxyFd);
+	proxyFd = -1;
+	initialized = FALSE;
+	mutex_unlock(&proxyMutex);
+
+	mutex_destroy(&proxyMutex);
+
+	termTrace();
+	termDebug();
+	return CKR_OK;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_GetInfo)(
+		CK_INFO_PTR pInfo
+)
+{
+	FUNC_CALLED();
+
+	if (!initialized) {
+		FUNC_FAILS(CKR_CRYPTOKI_NOT_INITIALIZED, "C_Initialize not called");
+	}
+
+	if (pInfo == NULL) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	memset(pInfo, 0, sizeof(CK_INFO));
+
+	pInfo->cryptokiVersion.major = 2;
+	pInfo->cryptokiVersion.minor = 20;
+
+	memset(pInfo->manufacturerID, ' ', sizeof(pInfo->manufacturerID));
+	memcpy(pInfo->manufacturerID, "CardContact (www.cardcontact.de)", 32);
+
+	memset(pInfo->libraryDescription, ' ', sizeof(pInfo->libraryDescription));
+	memcpy(pInfo->libraryDescription, "SmartCard-HSM via proxy daemon", 30);
+
+	pInfo->libraryVersion.major = VERSION_MAJOR;
+	pInfo->libraryVersion.minor = VERSION_MINOR;
+
+	FUNC_RETURNS(CKR_OK);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_GetSlotList)(
+		CK_BBOOL tokenPresent,
+		CK_SLOT_ID_PTR pSlotList,
+		CK_ULONG_PTR pulCount
+)
+{
+	struct p11ProxyMessage msg;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	if (pulCount == NULL) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	initMessage(&msg);
+	putULong(&msg, tokenPresent);
+	putBufferRequest(&msg, pSlotList, pulCount);
+
+	rv = proxyCall(P11PROXY_GET_SLOT_LIST, &msg);
+	rv = getULongList(&msg, rv, pSlotList, pulCount);
+
+	freeMessage(&msg);
+	FUNC_RETURNS(rv);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_GetSlotInfo)(
+		CK_SLOT_ID slotID,
+		CK_SLOT_INFO_PTR pInfo
+)
+{
+	struct p11ProxyMessage msg;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	if (pInfo == NULL) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	initMessage(&msg);
+	putULong(&msg, slotID);
+
+	rv = proxyCall(P11PROXY_GET_SLOT_INFO, &msg);
+	rv = getStruct(&msg, rv, pInfo, sizeof(CK_SLOT_INFO));
+
+	freeMessage(&msg);
+	FUNC_RETURNS(rv);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_GetTokenInfo)(
+		CK_SLOT_ID slotID,
+		CK_TOKEN_INFO_PTR pInfo
+)
+{
+	struct p11ProxyMessage msg;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	if (pInfo == NULL) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	initMessage(&msg);
+	putULong(&msg, slotID);
+
+	rv = proxyCall(P11PROXY_GET_TOKEN_INFO, &msg);
+	rv = getStruct(&msg, rv, pInfo, sizeof(CK_TOKEN_INFO));
+
+	freeMessage(&msg);
+	FUNC_RETURNS(rv);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_GetMechanismList)(
+		CK_SLOT_ID slotID,
+		CK_MECHANISM_TYPE_PTR pMechanismList,
+		CK_ULONG_PTR pulCount
+)
+{
+	struct p11ProxyMessage msg;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	if (pulCount == NULL) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	initMessage(&msg);
+	putULong(&msg, slotID);
+	putBufferRequest(&msg, pMechanismList, pulCount);
+
+	rv = proxyCall(P11PROXY_GET_MECHANISM_LIST, &msg);
+	rv = getULongList(&msg, rv, pMechanismList, pulCount);
+
+	freeMessage(&msg);
+	FUNC_RETURNS(rv);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_GetMechanismInfo)(
+		CK_SLOT_ID slotID,
+		CK_MECHANISM_TYPE type,
+		CK_MECHANISM_INFO_PTR pInfo
+)
+{
+	struct p11ProxyMessage msg;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	if (pInfo == NULL) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	initMessage(&msg);
+	putULong(&msg, slotID);
+	putULong(&msg, type);
+
+	rv = proxyCall(P11PROXY_GET_MECHANISM_INFO, &msg);
+	rv = getStruct(&msg, rv, pInfo, sizeof(CK_MECHANISM_INFO));
+
+	freeMessage(&msg);
+	FUNC_RETURNS(rv);
+}
+
+
+
+/**
+ * Open a session in the daemon
+ *
+ * Notification callbacks are not supported and ignored.
+ */
+CK_DECLARE_FUNCTION(CK_RV, C_OpenSession)(
+		CK_SLOT_ID slotID,
+		CK_FLAGS flags,
+		CK_VOID_PTR pApplication,
+		CK_NOTIFY Notify,
+		CK_SESSION_HANDLE_PTR phSession
+)
+{
+	struct p11ProxyMessage msg;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	if (phSession == NULL) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	initMessage(&msg);
+	putULong(&msg, slotID);
+	putULong(&msg, flags);
+
+	rv = proxyCall(P11PROXY_OPEN_SESSION, &msg);
+	if (rv == CKR_OK) {
+		*phSession = getULong(&msg);
+		if (msg.failed)
+			rv = CKR_DEVICE_ERROR;
+	}
+
+	freeMessage(&msg);
+	FUNC_RETURNS(rv);
+}
+
+
+
+/**
+ * Send a request that only has handles or numbers as arguments and no output
+ */
+static CK_RV proxySimpleCall(CK_ULONG code, int argc, CK_ULONG a0, CK_ULONG a1)
+{
+	struct p11ProxyMessage msg;
+	CK_RV rv;
+
+	initMessage(&msg);
+	putULong(&msg, a0);
+	if (argc > 1)
+		putULong(&msg, a1);
+
+	rv = proxyCall(code, &msg);
+
+	freeMessage(&msg);
+	return rv;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_CloseSession)(
+		CK_SESSION_HANDLE hSession
+)
+{
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	rv = proxySimpleCall(P11PROXY_CLOSE_SESSION, 1, hSession, 0);
+	FUNC_RETURNS(rv);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_CloseAllSessions)(
+		CK_SLOT_ID slotID
+)
+{
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	rv = proxySimpleCall(P11PROXY_CLOSE_ALL_SESSIONS, 1, slotID, 0);
+	FUNC_RETURNS(rv);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_GetSessionInfo)(
+		CK_SESSION_HANDLE hSession,
+		CK_SESSION_INFO_PTR pInfo
+)
+{
+	struct p11ProxyMessage msg;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	if (pInfo == NULL) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	initMessage(&msg);
+	putULong(&msg, hSession);
+
+	rv = proxyCall(P11PROXY_GET_SESSION_INFO, &msg);
+	rv = getStruct(&msg, rv, pInfo, sizeof(CK_SESSION_INFO));
+
+	freeMessage(&msg);
+	FUNC_RETURNS(rv);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_Login)(
+		CK_SESSION_HANDLE hSession,
+		CK_USER_TYPE userType,
+		CK_UTF8CHAR_PTR pPin,
+		CK_ULONG ulPinLen
+)
+{
+	struct p11ProxyMessage msg;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	initMessage(&msg);
+	putULong(&msg, hSession);
+	putULong(&msg, userType);
+	putBytes(&msg, pPin, ulPinLen);
+
+	rv = proxyCall(P11PROXY_LOGIN, &msg);
+
+	freeMessage(&msg);
+	FUNC_RETURNS(rv);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_Logout)(
+		CK_SESSION_HANDLE hSession
+)
+{
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	rv = proxySimpleCall(P11PROXY_LOGOUT, 1, hSession, 0);
+	FUNC_RETURNS(rv);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_GetAttributeValue)(
+		CK_SESSION_HANDLE hSession,
+		CK_OBJECT_HANDLE hObject,
+		CK_ATTRIBUTE_PTR pTemplate,
+		CK_ULONG ulCount
+)
+{
+	struct p11ProxyMessage msg;
+	unsigned char *p;
+	CK_ULONG i, len, plen;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	if ((pTemplate == NULL) && (ulCount > 0)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	initMessage(&msg);
+	putULong(&msg, hSession);
+	putULong(&msg, hObject);
+	putULong(&msg, ulCount);
+	for (i = 0; i < ulCount; i++) {
+		putULong(&msg, pTemplate[i].type);
+		putBufferRequest(&msg, pTemplate[i].pValue, &pTemplate[i].ulValueLen);
+	}
+
+	rv = proxyCall(P11PROXY_GET_ATTRIBUTE_VALUE, &msg);
+
+	if ((rv == CKR_OK) || (rv == CKR_ATTRIBUTE_SENSITIVE) ||
+		(rv == CKR_ATTRIBUTE_TYPE_INVALID) || (rv == CKR_BUFFER_TOO_SMALL)) {
+		for (i = 0; (i < ulCount) && !msg.failed; i++) {
+			len = getULong(&msg);
+			if (pTemplate[i].pValue && (len != (CK_ULONG)-1)) {
+				p = getBytes(&msg, &plen);
+				if ((p == NULL) || (plen != len) || (len > pTemplate[i].ulValueLen)) {
+					rv = CKR_DEVICE_ERROR;
+					break;
+				}
+				memcpy(pTemplate[i].pValue, p, len);
+			}
+			pTemplate[i].ulValueLen = len;
+		}
+		if (msg.failed)
+			rv = CKR_DEVICE_ERROR;
+	}
+
+	freeMessage(&msg);
+	FUNC_RETURNS(rv);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_FindObjectsInit)(
+		CK_SESSION_HANDLE hSession,
+		CK_ATTRIBUTE_PTR pTemplate,
+		CK_ULONG ulCount
+)
+{
+	struct p11ProxyMessage msg;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	if ((pTemplate == NULL) && (ulCount > 0)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	initMessage(&msg);
+	putULong(&msg, hSession);
+	putTemplate(&msg, pTemplate, ulCount);
+
+	rv = proxyCall(P11PROXY_FIND_OBJECTS_INIT, &msg);
+
+	freeMessage(&msg);
+	FUNC_RETURNS(rv);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_FindObjects)(
+		CK_SESSION_HANDLE hSession,
+		CK_OBJECT_HANDLE_PTR phObject,
+		CK_ULONG ulMaxObjectCount,
+		CK_ULONG_PTR pulObjectCount
+)
+{
+	struct p11ProxyMessage msg;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	if ((phObject == NULL) || (pulObjectCount == NULL)) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	initMessage(&msg);
+	putULong(&msg, hSession);
+	putULong(&msg, ulMaxObjectCount);
+
+	rv = proxyCall(P11PROXY_FIND_OBJECTS, &msg);
+
+	*pulObjectCount = ulMaxObjectCount;
+	rv = getULongList(&msg, rv, phObject, pulObjectCount);
+
+	freeMessage(&msg);
+	FUNC_RETURNS(rv);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_FindObjectsFinal)(
+		CK_SESSION_HANDLE hSession
+)
+{
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	rv = proxySimpleCall(P11PROXY_FIND_OBJECTS_FINAL, 1, hSession, 0);
+	FUNC_RETURNS(rv);
+}
+
+
+
+/**
+ * Send a request to initialize an operation with a mechanism and key
+ */
+static CK_RV proxyOperationInit(CK_ULONG code, CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey)
+{
+	struct p11ProxyMessage msg;
+	CK_RV rv;
+
+	if (pMechanism == NULL)
+		return CKR_ARGUMENTS_BAD;
+
+	initMessage(&msg);
+	putULong(&msg, hSession);
+	putMechanism(&msg, pMechanism);
+	putULong(&msg, hKey);
+
+	rv = proxyCall(code, &msg);
+
+	freeMessage(&msg);
+	return rv;
+}
+
+
+
+/**
+ * Send a request with input data and an output buffer
+ */
+static CK_RV proxyOperation(CK_ULONG code, CK_SESSION_HANDLE hSession, CK_BYTE_PTR pIn, CK_ULONG ulInLen, CK_BYTE_PTR pOut, CK_ULONG_PTR pulOutLen)
+{
+	struct p11ProxyMessage msg;
+	CK_RV rv;
+
+	if (pulOutLen == NULL)
+		return CKR_ARGUMENTS_BAD;
+
+	initMessage(&msg);
+	putULong(&msg, hSession);
+	if (code != P11PROXY_SIGN_FINAL)
+		putBytes(&msg, pIn, ulInLen);
+	putBufferRequest(&msg, pOut, pulOutLen);
+
+	rv = proxyCall(code, &msg);
+	rv = getOutput(&msg, rv, pOut, pulOutLen);
+
+	freeMessage(&msg);
+	return rv;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_EncryptInit)(
+		CK_SESSION_HANDLE hSession,
+		CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hKey
+)
+{
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	rv = proxyOperationInit(P11PROXY_ENCRYPT_INIT, hSession, pMechanism, hKey);
+	FUNC_RETURNS(rv);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_Encrypt)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pData,
+		CK_ULONG ulDataLen,
+		CK_BYTE_PTR pEncryptedData,
+		CK_ULONG_PTR pulEncryptedDataLen
+)
+{
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	rv = proxyOperation(P11PROXY_ENCRYPT, hSession, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen);
+	FUNC_RETURNS(rv);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_DecryptInit)(
+		CK_SESSION_HANDLE hSession,
+		CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hKey
+)
+{
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	rv = proxyOperationInit(P11PROXY_DECRYPT_INIT, hSession, pMechanism, hKey);
+	FUNC_RETURNS(rv);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_Decrypt)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pEncryptedData,
+		CK_ULONG ulEncryptedDataLen,
+		CK_BYTE_PTR pData,
+		CK_ULONG_PTR pulDataLen
+)
+{
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	rv = proxyOperation(P11PROXY_DECRYPT, hSession, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen);
+	FUNC_RETURNS(rv);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_SignInit)(
+		CK_SESSION_HANDLE hSession,
+		CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hKey
+)
+{
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	rv = proxyOperationInit(P11PROXY_SIGN_INIT, hSession, pMechanism, hKey);
+	FUNC_RETURNS(rv);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_Sign)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pData,
+		CK_ULONG ulDataLen,
+		CK_BYTE_PTR pSignature,
+		CK_ULONG_PTR pulSignatureLen
+)
+{
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	rv = proxyOperation(P11PROXY_SIGN, hSession, pData, ulDataLen, pSignature, pulSignatureLen);
+	FUNC_RETURNS(rv);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_SignUpdate)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pPart,
+		CK_ULONG ulPartLen
+)
+{
+	struct p11ProxyMessage msg;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	initMessage(&msg);
+	putULong(&msg, hSession);
+	putBytes(&msg, pPart, ulPartLen);
+
+	rv = proxyCall(P11PROXY_SIGN_UPDATE, &msg);
+
+	freeMessage(&msg);
+	FUNC_RETURNS(rv);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_SignFinal)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pSignature,
+		CK_ULONG_PTR pulSignatureLen
+)
+{
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	rv = proxyOperation(P11PROXY_SIGN_FINAL, hSession, NULL, 0, pSignature, pulSignatureLen);
+	FUNC_RETURNS(rv);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_VerifyInit)(
+		CK_SESSION_HANDLE hSession,
+		CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hKey
+)
+{
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	rv = proxyOperationInit(P11PROXY_VERIFY_INIT, hSession, pMechanism, hKey);
+	FUNC_RETURNS(rv);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_Verify)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pData,
+		CK_ULONG ulDataLen,
+		CK_BYTE_PTR pSignature,
+		CK_ULONG ulSignatureLen
+)
+{
+	struct p11ProxyMessage msg;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	initMessage(&msg);
+	putULong(&msg, hSession);
+	putBytes(&msg, pData, ulDataLen);
+	putBytes(&msg, pSignature, ulSignatureLen);
+
+	rv = proxyCall(P11PROXY_VERIFY, &msg);
+
+	freeMessage(&msg);
+	FUNC_RETURNS(rv);
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_GenerateRandom)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR RandomData,
+		CK_ULONG ulRandomLen
+)
+{
+	struct p11ProxyMessage msg;
+	CK_ULONG len;
+	CK_RV rv;
+
+	FUNC_CALLED();
+
+	if (RandomData == NULL) {
+		FUNC_FAILS(CKR_ARGUMENTS_BAD, "Invalid pointer argument");
+	}
+
+	initMessage(&msg);
+	putULong(&msg, hSession);
+	putULong(&msg, ulRandomLen);
+
+	rv = proxyCall(P11PROXY_GENERATE_RANDOM, &msg);
+
+	len = ulRandomLen;
+	rv = getOutput(&msg, rv, RandomData, &len);
+	if ((rv == CKR_OK) && (len != ulRandomLen))
+		rv = CKR_DEVICE_ERROR;
+
+	freeMessage(&msg);
+	FUNC_RETURNS(rv);
+}
+
+
+
+/*
+ * Functions not forwarded to the daemon
+ */
+CK_DECLARE_FUNCTION(CK_RV, C_InitToken)(
+		CK_SLOT_ID slotID,
+		CK_UTF8CHAR_PTR pPin,
+		CK_ULONG ulPinLen,
+		CK_UTF8CHAR_PTR pLabel
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_InitPIN)(
+		CK_SESSION_HANDLE hSession,
+		CK_UTF8CHAR_PTR pPin,
+		CK_ULONG ulPinLen
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_SetPIN)(
+		CK_SESSION_HANDLE hSession,
+		CK_UTF8CHAR_PTR pOldPin,
+		CK_ULONG ulOldLen,
+		CK_UTF8CHAR_PTR pNewPin,
+		CK_ULONG ulNewLen
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_GetOperationState)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pOperationState,
+		CK_ULONG_PTR pulOperationStateLen
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_SetOperationState)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pOperationState,
+		CK_ULONG ulOperationStateLen,
+		CK_OBJECT_HANDLE hEncryptionKey,
+		CK_OBJECT_HANDLE hAuthenticationKey
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_CreateObject)(
+		CK_SESSION_HANDLE hSession,
+		CK_ATTRIBUTE_PTR pTemplate,
+		CK_ULONG ulCount,
+		CK_OBJECT_HANDLE_PTR phObject
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_CopyObject)(
+		CK_SESSION_HANDLE hSession,
+		CK_OBJECT_HANDLE hObject,
+		CK_ATTRIBUTE_PTR pTemplate,
+		CK_ULONG ulCount,
+		CK_OBJECT_HANDLE_PTR phNewObject
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_DestroyObject)(
+		CK_SESSION_HANDLE hSession,
+		CK_OBJECT_HANDLE hObject
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_GetObjectSize)(
+		CK_SESSION_HANDLE hSession,
+		CK_OBJECT_HANDLE hObject,
+		CK_ULONG_PTR pulSize
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_SetAttributeValue)(
+		CK_SESSION_HANDLE hSession,
+		CK_OBJECT_HANDLE hObject,
+		CK_ATTRIBUTE_PTR pTemplate,
+		CK_ULONG ulCount
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_EncryptUpdate)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pPart,
+		CK_ULONG ulPartLen,
+		CK_BYTE_PTR pEncryptedPart,
+		CK_ULONG_PTR pulEncryptedPartLen
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_EncryptFinal)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pLastEncryptedPart,
+		CK_ULONG_PTR pulLastEncryptedPartLen
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_DecryptUpdate)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pEncryptedPart,
+		CK_ULONG ulEncryptedPartLen,
+		CK_BYTE_PTR pPart,
+		CK_ULONG_PTR pulPartLen
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_DecryptFinal)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pLastPart,
+		CK_ULONG_PTR pulLastPartLen
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_DigestInit)(
+		CK_SESSION_HANDLE hSession,
+		CK_MECHANISM_PTR pMechanism
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_Digest)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pData,
+		CK_ULONG ulDataLen,
+		CK_BYTE_PTR pDigest,
+		CK_ULONG_PTR pulDigestLen
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_DigestUpdate)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pPart,
+		CK_ULONG ulPartLen
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_DigestKey)(
+		CK_SESSION_HANDLE hSession,
+		CK_OBJECT_HANDLE hKey
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_DigestFinal)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pDigest,
+		CK_ULONG_PTR pulDigestLen
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_SignRecoverInit)(
+		CK_SESSION_HANDLE hSession,
+		CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hKey
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_SignRecover)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pData,
+		CK_ULONG ulDataLen,
+		CK_BYTE_PTR pSignature,
+		CK_ULONG_PTR pulSignatureLen
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_VerifyUpdate)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pPart,
+		CK_ULONG ulPartLen
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_VerifyFinal)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pSignature,
+		CK_ULONG ulSignatureLen
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_VerifyRecoverInit)(
+		CK_SESSION_HANDLE hSession,
+		CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hKey
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_VerifyRecover)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pSignature,
+		CK_ULONG ulSignatureLen,
+		CK_BYTE_PTR pData,
+		CK_ULONG_PTR pulDataLen
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_DigestEncryptUpdate)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pPart,
+		CK_ULONG ulPartLen,
+		CK_BYTE_PTR pEncryptedPart,
+		CK_ULONG_PTR pulEncryptedPartLen
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_DecryptDigestUpdate)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pEncryptedPart,
+		CK_ULONG ulEncryptedPartLen,
+		CK_BYTE_PTR pPart,
+		CK_ULONG_PTR pulPartLen
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_SignEncryptUpdate)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pPart,
+		CK_ULONG ulPartLen,
+		CK_BYTE_PTR pEncryptedPart,
+		CK_ULONG_PTR pulEncryptedPartLen
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_DecryptVerifyUpdate)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pEncryptedPart,
+		CK_ULONG ulEncryptedPartLen,
+		CK_BYTE_PTR pPart,
+		CK_ULONG_PTR pulPartLen
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_GenerateKey)(
+		CK_SESSION_HANDLE hSession,
+		CK_MECHANISM_PTR pMechanism,
+		CK_ATTRIBUTE_PTR pTemplate,
+		CK_ULONG ulCount,
+		CK_OBJECT_HANDLE_PTR phKey
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_GenerateKeyPair)(
+		CK_SESSION_HANDLE hSession,
+		CK_MECHANISM_PTR pMechanism,
+		CK_ATTRIBUTE_PTR pPublicKeyTemplate,
+		CK_ULONG ulPublicKeyAttributeCount,
+		CK_ATTRIBUTE_PTR pPrivateKeyTemplate,
+		CK_ULONG ulPrivateKeyAttributeCount,
+		CK_OBJECT_HANDLE_PTR phPublicKey,
+		CK_OBJECT_HANDLE_PTR phPrivateKey
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_WrapKey)(
+		CK_SESSION_HANDLE hSession,
+		CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hWrappingKey,
+		CK_OBJECT_HANDLE hKey,
+		CK_BYTE_PTR pWrappedKey,
+		CK_ULONG_PTR pulWrappedKeyLen
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_UnwrapKey)(
+		CK_SESSION_HANDLE hSession,
+		CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hUnwrappingKey,
+		CK_BYTE_PTR pWrappedKey,
+		CK_ULONG ulWrappedKeyLen,
+		CK_ATTRIBUTE_PTR pTemplate,
+		CK_ULONG ulAttributeCount,
+		CK_OBJECT_HANDLE_PTR phKey
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_DeriveKey)(
+		CK_SESSION_HANDLE hSession,
+		CK_MECHANISM_PTR pMechanism,
+		CK_OBJECT_HANDLE hBaseKey,
+		CK_ATTRIBUTE_PTR pTemplate,
+		CK_ULONG ulAttributeCount,
+		CK_OBJECT_HANDLE_PTR phKey
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_SeedRandom)(
+		CK_SESSION_HANDLE hSession,
+		CK_BYTE_PTR pSeed,
+		CK_ULONG ulSeedLen
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_GetFunctionStatus)(
+		CK_SESSION_HANDLE hSession
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_CancelFunction)(
+		CK_SESSION_HANDLE hSession
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_WaitForSlotEvent)(
+		CK_FLAGS flags,
+		CK_SLOT_ID_PTR pSlot,
+		CK_VOID_PTR pRserved
+)
+{
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+
+
+CK_FUNCTION_LIST proxy_function_list = {
+		{ 2, 20 },
+		C_Initialize,
+		C_Finalize,
+		C_GetInfo,
+		C_GetFunctionList,
+		C_GetSlotList,
+		C_GetSlotInfo,
+		C_GetTokenInfo,
+		C_GetMechanismList,
+		C_GetMechanismInfo,
+		C_InitToken,
+		C_InitPIN,
+		C_SetPIN,
+		C_OpenSession,
+		C_CloseSession,
+		C_CloseAllSessions,
+		C_GetSessionInfo,
+		C_GetOperationState,
+		C_SetOperationState,
+		C_Login,
+		C_Logout,
+		C_CreateObject,
+		C_CopyObject,
+		C_DestroyObject,
+		C_GetObjectSize,
+		C_GetAttributeValue,
+		C_SetAttributeValue,
+		C_FindObjectsInit,
+		C_FindObjects,
+		C_FindObjectsFinal,
+		C_EncryptInit,
+		C_Encrypt,
+		C_EncryptUpdate,
+		C_EncryptFinal,
+		C_DecryptInit,
+		C_Decrypt,
+		C_DecryptUpdate,
+		C_DecryptFinal,
+		C_DigestInit,
+		C_Digest,
+		C_DigestUpdate,
+		C_DigestKey,
+		C_DigestFinal,
+		C_SignInit,
+		C_Sign,
+		C_SignUpdate,
+		C_SignFinal,
+		C_SignRecoverInit,
+		C_SignRecover,
+		C_VerifyInit,
+		C_Verify,
+		C_VerifyUpdate,
+		C_VerifyFinal,
+		C_VerifyRecoverInit,
+		C_VerifyRecover,
+		C_DigestEncryptUpdate,
+		C_DecryptDigestUpdate,
+		C_SignEncryptUpdate,
+		C_DecryptVerifyUpdate,
+		C_GenerateKey,
+		C_GenerateKeyPair,
+		C_WrapKey,
+		C_UnwrapKey,
+		C_DeriveKey,
+		C_SeedRandom,
+		C_GenerateRandom,
+		C_GetFunctionStatus,
+		C_CancelFunction,
+		C_WaitForSlotEvent
+};
+
+
+
+CK_DECLARE_FUNCTION(CK_RV, C_GetFunctionList)(
+		CK_FUNCTION_LIST_PTR_PTR ppFunctionList
+)
+{
+	if (ppFunctionList == NULL) {
+		return CKR_ARGUMENTS_BAD;
+	}
+
+	*ppFunctionList = &proxy_function_list;
+
+	return CKR_OK;
+}
@@ -0,0 +1,1538 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    p11proxy-daemon.c
+ * @author  Andreas Schwier
+ * @brief   Daemon serving PKCS#11 calls from the proxy client module
+ *
+ * The daemon loads the PKCS#11 module, which owns the readers and enumerates each token only
+ * once. Client processes using the proxy client module connect via a Unix domain socket.
+ * Each connection is served by a thread, so that requests from all clients are queued per
+ * slot by the scheduler in the module.
+ *
+ * Sessions are owned by the connection that opened them and are closed when the client
+ * disconnects.
+ *
+ * The module has a single login state per token, which the daemon tracks per connection.
+ * A client that did not log in itself can not see or use private objects, even if another
+ * client has logged in. A client logging in to a token already logged in by another client
+ * must present the PIN, which is verified with a context specific login. The token is
+ * logged out when the last client logged in logs out or disconnects.
+ *
+ * The default socket is created in P11PROXY_DEFAULT_DIR, which the daemon creates with mode
+ * 0700. The socket itself is created with mode 0660. Only clients running as the same user
+ * as the daemon, as root or with a user id given with --allow-uid are accepted.
+ *
+ * Usage: sc-hsm-pkcs11-proxy [--module <path>] [--socket <path>] [--allow-uid <uid>]...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <common/mutex.h>
+#include <common/memset_s.h>
+
+#include "p11proxy.h"
+
+#include <common/debug.h>
+
+#ifndef P11LIBNAME
+#define P11LIBNAME "/usr/local/lib/libsc-hsm-pkcs11.so"
+#endif
+
+#define MAX_PARAMETER_SIZE		256
+#define MAX_ALLOWED_UIDS		16
+
+struct proxyClient {
+	int fd;                             /**< Connection to the client process        */
+	pthread_t thread;                   /**< Thread serving the client               */
+	int finished;                       /**< The thread has completed                */
+	CK_SESSION_HANDLE *sessions;        /**< Sessions opened by the client           */
+	int sessionCount;
+	int sessionSize;
+	CK_SLOT_ID *logins;                 /**< Slots the client has logged in to       */
+	int loginCount;
+	int loginSize;
+	struct proxyClient *next;
+};
+
+static CK_FUNCTION_LIST_PTR p11;
+static MUTEX clientsMutex;
+static MUTEX loginMutex;
+static struct proxyClient *clients = NULL;
+static volatile int terminating = FALSE;
+static int listenFd = -1;
+static uid_t allowedUids[MAX_ALLOWED_UIDS];
+static int allowedUidCount = 0;
+
+
+
+static int ownsSession(struct proxyClient *client, CK_SESSION_HANDLE hSession)
+{
+	int i;
+
+	for (i = 0; i < client->sessionCount; i++) {
+		if (client->sessions[i] == hSession)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+
+
+static int addClientSession(struct proxyClient *client, CK_SESSION_HANDLE hSession)
+{
+	CK_SESSION_HANDLE *s;
+
+	if (client->sessionCount == client->sessionSize) {
+		s = (CK_SESSION_HANDLE *)realloc(client->sessions, (client->sessionSize + 16) * sizeof(CK_SESSION_HANDLE));
+		if (s == NULL)
+			return -1;
+		client->sessions = s;
+		client->sessionSize += 16;
+	}
+
+	client->sessions[client->sessionCount++] = hSession;
+	return 0;
+}
+
+
+
+static void removeClientSession(struct proxyClient *client, CK_SESSION_HANDLE hSession)
+{
+	int i;
+
+	for (i = 0; i < client->sessionCount; i++) {
+		if (client->sessions[i] == hSession) {
+			client->sessions[i] = client->sessions[--client->sessionCount];
+			return;
+		}
+	}
+}
+
+
+
+static int findLogin(struct proxyClient *client, CK_SLOT_ID slotID)
+{
+	int i;
+
+	for (i = 0; i < client->loginCount; i++) {
+		if (client->logins[i] == slotID)
+			return i;
+	}
+	return -1;
+}
+
+
+
+/**
+ * Record a login of the client
+ *
+ * Must be called with the clientsMutex locked
+ */
+static int addLogin(struct proxyClient *client, CK_SLOT_ID slotID)
+{
+	CK_SLOT_ID *s;
+
+	if (findLogin(client, slotID) >= 0)
+		return 0;
+
+	if (client->loginCount == client->loginSize) {
+		s = (CK_SLOT_ID *)realloc(client->logins, (client->loginSize + 4) * sizeof(CK_SLOT_ID));
+		if (s == NULL)
+			return -1;
+		client->logins = s;
+		client->loginSize += 4;
+	}
+
+	client->logins[client->loginCount++] = slotID;
+	return 0;
+}
+
+
+
+/**
+ * Remove the logins of all clients for the slot
+ *
+ * Must be called with the clientsMutex locked
+ */
+static void removeAllLogins(CK_SLOT_ID slotID)
+{
+	struct proxyClient *c;
+	int i;
+
+	for (c = clients; c != NULL; c = c->next) {
+		i = findLogin(c, slotID);
+		if (i >= 0)
+			c->logins[i] = c->logins[--c->loginCount];
+	}
+}
+
+
+
+/**
+ * Remove a login of the client
+ *
+ * Must be called with the clientsMutex locked
+ */
+static void removeLogin(struct proxyClient *client, CK_SLOT_ID slotID)
+{
+	int i;
+
+	i = findLogin(client, slotID);
+	if (i >= 0)
+		client->logins[i] = client->logins[--client->loginCount];
+}
+
+
+
+/**
+ * Return TRUE if another client is logged in to the slot
+ *
+ * Must be called with the clientsMutex locked
+ */
+static int isLoggedInByOthers(struct proxyClient *client, CK_SLOT_ID slotID)
+{
+	struct proxyClient *c;
+
+	for (c = clients; c != NULL; c = c->next) {
+		if ((c != client) && (findLogin(c, slotID) >= 0))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+
+
+/**
+ * Return TRUE if the client logged in to the token of the session and the token is still logged in
+ *
+ * A login recorded for the client is dropped if the module lost the login, e.g. because the
+ * token was removed.
+ */
+static int isLoggedIn(struct proxyClient *client, CK_SESSION_HANDLE hSession)
+{
+	CK_SESSION_INFO info;
+	int loggedIn;
+
+	if (p11->C_GetSessionInfo(hSession, &info) != CKR_OK)
+		return FALSE;
+
+	mutex_lock(&clientsMutex);
+
+	loggedIn = findLogin(client, info.slotID) >= 0;
+
+	if (loggedIn && (info.state != CKS_RO_USER_FUNCTIONS) &&
+		(info.state != CKS_RW_USER_FUNCTIONS) && (info.state != CKS_RW_SO_FUNCTIONS)) {
+		removeLogin(client, info.slotID);
+		loggedIn = FALSE;
+	}
+
+	mutex_unlock(&clientsMutex);
+	return loggedIn;
+}
+
+
+
+/**
+ * Return TRUE if the object is private or its attributes can not be read
+ */
+static int isPrivateObject(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject)
+{
+	CK_BBOOL priv;
+	CK_ATTRIBUTE attr = { CKA_PRIVATE, &priv, sizeof(priv) };
+
+	priv = CK_TRUE;
+	if (p11->C_GetAttributeValue(hSession, hObject, &attr, 1) != CKR_OK)
+		return TRUE;
+
+	return priv != CK_FALSE;
+}
+
+
+
+/**
+ * Check that the client may use the object
+ *
+ * Private objects are visible to clients that logged in themselves only.
+ *
+ * @return          CKR_OK or CKR_OBJECT_HANDLE_INVALID
+ */
+static CK_RV checkObjectAccess(struct proxyClient *client, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject)
+{
+	if (isLoggedIn(client, hSession) || !isPrivateObject(hSession, hObject))
+		return CKR_OK;
+
+	return CKR_OBJECT_HANDLE_INVALID;
+}
+
+
+
+/**
+ * Encode the result of a function returning a byte string
+ */
+static void putOutput(struct p11ProxyMessage *rsp, CK_RV rv, int requested, CK_BYTE_PTR out, CK_ULONG len)
+{
+	putULong(rsp, rv);
+
+	if ((rv == CKR_OK) || (rv == CKR_BUFFER_TOO_SMALL)) {
+		putULong(rsp, len);
+		if (requested && (rv == CKR_OK))
+			putBytes(rsp, out, len);
+	}
+}
+
+
+
+/**
+ * Encode the result of a function returning a list of handles or mechanisms
+ */
+static void putULongList(struct p11ProxyMessage *rsp, CK_RV rv, CK_ULONG_PTR list, CK_ULONG count)
+{
+	CK_ULONG i;
+
+	putULong(rsp, rv);
+
+	if ((rv == CKR_OK) || (rv == CKR_BUFFER_TOO_SMALL)) {
+		putULong(rsp, count);
+		if (list && (rv == CKR_OK)) {
+			for (i = 0; i < count; i++)
+				putULong(rsp, list[i]);
+		}
+	}
+}
+
+
+
+static void putStruct(struct p11ProxyMessage *rsp, CK_RV rv, void *p, size_t size)
+{
+	putULong(rsp, rv);
+
+	if (rv == CKR_OK)
+		putBytes(rsp, p, size);
+}
+
+
+
+static int proxyHello(struct proxyClient *client, struct p11ProxyMessage *req, struct p11ProxyMessage *rsp)
+{
+	CK_ULONG version, ulongSize, tokenInfoSize;
+
+	version = getULong(req);
+	ulongSize = getULong(req);
+	tokenInfoSize = getULong(req);
+
+	if (req->failed)
+		return -1;
+
+	if ((version != P11PROXY_VERSION) || (ulongSize != sizeof(CK_ULONG)) || (tokenInfoSize != sizeof(CK_TOKEN_INFO))) {
+		debug("Client uses protocol version %lu with incompatible ABI\n", version);
+		putULong(rsp, CKR_FUNCTION_FAILED);
+		return 0;
+	}
+
+	putULong(rsp, CKR_OK);
+	return 0;
+}
+
+
+
+static int proxyGetSlotList(struct proxyClient *client, struct p11ProxyMessage *req, struct p11ProxyMessage *rsp)
+{
+	CK_SLOT_ID_PTR list;
+	CK_ULONG count;
+	CK_BBOOL tokenPresent;
+	CK_RV rv;
+	int requested;
+
+	tokenPresent = (CK_BBOOL)getULong(req);
+	requested = getBufferRequest(req, &count);
+
+	if (req->failed)
+		return -1;
+
+	list = NULL;
+	if (requested) {
+		list = (CK_SLOT_ID_PTR)calloc(count + 1, sizeof(CK_SLOT_ID));
+		if (list == NULL) {
+			putULong(rsp, CKR_HOST_MEMORY);
+			return 0;
+		}
+	}
+
+	rv = p11->C_GetSlotList(tokenPresent, list, &count);
+
+	putULongList(rsp, rv, list, count);
+	free(list);
+	return 0;
+}
+
+
+
+static int proxyGetSlotInfo(struct proxyClient *client, struct p11ProxyMessage *req, struct p11ProxyMessage *rsp)
+{
+	CK_SLOT_INFO info;
+	CK_SLOT_ID slotID;
+	CK_RV rv;
+
+	slotID = getULong(req);
+
+	if (req->failed)
+		return -1;
+
+	rv = p11->C_GetSlotInfo(slotID, &info);
+
+	putStruct(rsp, rv, &info, sizeof(info));
+	return 0;
+}
+
+
+
+static int proxyGetTokenInfo(struct proxyClient *client, struct p11ProxyMessage *req, struct p11ProxyMessage *rsp)
+{
+	CK_TOKEN_INFO info;
+	CK_SLOT_ID slotID;
+	CK_RV rv;
+
+	slotID = getULong(req);
+
+	if (req->failed)
+		return -1;
+
+	rv = p11->C_GetTokenInfo(slotID, &info);
+
+	putStruct(rsp, rv, &info, sizeof(info));
+	return 0;
+}
+
+
+
+static int proxyGetMechanismList(struct proxyClient *client, struct p11ProxyMessage *req, struct p11ProxyMessage *rsp)
+{
+	CK_MECHANISM_TYPE_PTR list;
+	CK_SLOT_ID slotID;
+	CK_ULONG count;
+	CK_RV rv;
+	int requested;
+
+	slotID = getULong(req);
+	requested = getBufferRequest(req, &count);
+
+	if (req->failed)
+		return -1;
+
+	list = NULL;
+	if (requested) {
+		list = (CK_MECHANISM_TYPE_PTR)calloc(count + 1, sizeof(CK_MECHANISM_TYPE));
+		if (list == NULL) {
+			putULong(rsp, CKR_HOST_MEMORY);
+			return 0;
+		}
+	}
+
+	rv = p11->C_GetMechanismList(slotID, list, &count);
+
+	putULongList(rsp, rv, list, count);
+	free(list);
+	return 0;
+}
+
+
+
+static int proxyGetMechanismInfo(struct proxyClient *client, struct p11ProxyMessage *req, struct p11ProxyMessage *rsp)
+{
+	CK_MECHANISM_INFO info;
+	CK_SLOT_ID slotID;
+	CK_MECHANISM_TYPE type;
+	CK_RV rv;
+
+	slotID = getULong(req);
+	type = getULong(req);
+
+	if (req->failed)
+		return -1;
+
+	rv = p11->C_GetMechanismInfo(slotID, type, &info);
+
+	putStruct(rsp, rv, &info, sizeof(info));
+	return 0;
+}
+
+
+
+static int proxyOpenSession(struct proxyClient *client, struct p11ProxyMessage *req, struct p11ProxyMessage *rsp)
+{
+	CK_SESSION_HANDLE hSession;
+	CK_SLOT_ID slotID;
+	CK_FLAGS flags;
+	CK_RV rv;
+
+	slotID = getULong(req);
+	flags = getULong(req);
+
+	if (req->failed)
+		return -1;
+
+	rv = p11->C_OpenSession(slotID, flags, NULL, NULL, &hSession);
+
+	if ((rv == CKR_OK) && (addClientSession(client, hSession) < 0)) {
+		p11->C_CloseSession(hSession);
+		rv = CKR_HOST_MEMORY;
+	}
+
+	putULong(rsp, rv);
+	if (rv == CKR_OK)
+		putULong(rsp, hSession);
+	return 0;
+}
+
+
+
+static int proxyCloseSession(struct proxyClient *client, struct p11ProxyMessage *req, struct p11ProxyMessage *rsp)
+{
+	CK_SESSION_HANDLE hSession;
+	CK_RV rv;
+
+	hSession = getULong(req);
+
+	if (req->failed)
+		return -1;
+
+	if (!ownsSession(client, hSession)) {
+		putULong(rsp, CKR_SESSION_HANDLE_INVALID);
+		return 0;
+	}
+
+	rv = p11->C_CloseSession(hSession);
+	removeClientSession(client, hSession);
+
+	putULong(rsp, rv);
+	return 0;
+}
+
+
+
+/**
+ * Close the sessions of this client in the given slot
+ *
+ * C_CloseAllSessions in the module would also close the sessions of other clients.
+ */
+static int proxyCloseAllSessions(struct proxyClient *client, struct p11ProxyMessage *req, struct p11ProxyMessage *rsp)
+{
+	CK_SESSION_INFO info;
+	CK_SLOT_ID slotID;
+	int i;
+
+	slotID = getULong(req);
+
+	if (req->failed)
+		return -1;
+
+	i = 0;
+	while (i < client->sessionCount) {
+		if ((p11->C_GetSessionInfo(client->sessions[i], &info) != CKR_OK) || (info.slotID == slotID)) {
+			p11->C_CloseSession(client->sessions[i]);
+			removeClientSession(client, client->sessions[i]);
+		} else {
+			i++;
+		}
+	}
+
+	putULong(rsp, CKR_OK);
+	return 0;
+}
+
+
+
+static int proxyGetSessionInfo(struct proxyClient *client, struct p11ProxyMessage *req, struct p11ProxyMessage *rsp)
+{
+	CK_SESSION_INFO info;
+	CK_SESSION_HANDLE hSession;
+	CK_RV rv;
+
+	hSession = getULong(req);
+
+	if (req->failed)
+		return -1;
+
+	rv = ownsSession(client, hSession) ? p11->C_GetSessionInfo(hSession, &info) : CKR_SESSION_HANDLE_INVALID;
+
+	// Report the login state of this client rather than the state of the token
+	if ((rv == CKR_OK) && !isLoggedIn(client, hSession))
+		info.state = (info.flags & CKF_RW_SESSION) ? CKS_RW_PUBLIC_SESSION : CKS_RO_PUBLIC_SESSION;
+
+	putStruct(rsp, rv, &info, sizeof(info));
+	return 0;
+}
+
+
+
+/**
+ * Log the client in to the token of the session
+ *
+ * If another client has already logged in the user, the PIN is verified with a context
+ * specific login, which leaves the login state of the token unchanged.
+ */
+static int proxyLogin(struct proxyClient *client, struct p11ProxyMessage *req, struct p11ProxyMessage *rsp)
+{
+	CK_SESSION_INFO info;
+	CK_SESSION_HANDLE hSession;
+	CK_USER_TYPE userType;
+	CK_UTF8CHAR_PTR pin;
+	CK_ULONG pinlen;
+	CK_RV rv;
+	int others;
+
+	hSession = getULong(req);
+	userType = getULong(req);
+	pin = getBytes(req, &pinlen);
+
+	if (req->failed)
+		return -1;
+
+	if (!ownsSession(client, hSession)) {
+		putULong(rsp, CKR_SESSION_HANDLE_INVALID);
+		return 0;
+	}
+
+	if (userType == CKU_CONTEXT_SPECIFIC) {
+		rv = isLoggedIn(client, hSession) ? p11->C_Login(hSession, userType, pin, pinlen) : CKR_USER_NOT_LOGGED_IN;
+		putULong(rsp, rv);
+		return 0;
+	}
+
+	mutex_lock(&loginMutex);
+
+	rv = p11->C_GetSessionInfo(hSession, &info);
+
+	if ((rv == CKR_OK) && isLoggedIn(client, hSession))
+		rv = CKR_USER_ALREADY_LOGGED_IN;
+
+	if (rv == CKR_OK) {
+		rv = p11->C_Login(hSession, userType, pin, pinlen);
+
+		// Logins recorded before the module lost its login state are no longer valid
+		if (rv == CKR_OK) {
+			mutex_lock(&clientsMutex);
+			removeAllLogins(info.slotID);
+			mutex_unlock(&clientsMutex);
+		}
+
+		if (rv == CKR_USER_ALREADY_LOGGED_IN) {
+			mutex_lock(&clientsMutex);
+			others = isLoggedInByOthers(client, info.slotID);
+			mutex_unlock(&clientsMutex);
+
+			if (others && (userType == CKU_USER) && (info.state != CKS_RW_SO_FUNCTIONS))
+				rv = p11->C_Login(hSession, CKU_CONTEXT_SPECIFIC, pin, pinlen);
+		}
+	}
+
+	if (rv == CKR_OK) {
+		mutex_lock(&clientsMutex);
+		if (addLogin(client, info.slotID) < 0)
+			rv = CKR_HOST_MEMORY;
+		mutex_unlock(&clientsMutex);
+	}
+
+	mutex_unlock(&loginMutex);
+
+	putULong(rsp, rv);
+	return 0;
+}
+
+
+
+/**
+ * Log the client out and log the token out if no other client is logged in
+ */
+static CK_RV logoutClient(struct proxyClient *client, CK_SESSION_HANDLE hSession, CK_SLOT_ID slotID)
+{
+	int others;
+
+	mutex_lock(&clientsMutex);
+	removeLogin(client, slotID);
+	others = isLoggedInByOthers(client, slotID);
+	mutex_unlock(&clientsMutex);
+
+	return others ? CKR_OK : p11->C_Logout(hSession);
+}
+
+
+
+static int proxyLogout(struct proxyClient *client, struct p11ProxyMessage *req, struct p11ProxyMessage *rsp)
+{
+	CK_SESSION_INFO info;
+	CK_SESSION_HANDLE hSession;
+	CK_RV rv;
+
+	hSession = getULong(req);
+
+	if (req->failed)
+		return -1;
+
+	if (!ownsSession(client, hSession)) {
+		putULong(rsp, CKR_SESSION_HANDLE_INVALID);
+		return 0;
+	}
+
+	mutex_lock(&loginMutex);
+
+	rv = p11->C_GetSessionInfo(hSession, &info);
+
+	if (rv == CKR_OK)
+		rv = isLoggedIn(client, hSession) ? logoutClient(client, hSession, info.slotID) : CKR_USER_NOT_LOGGED_IN;
+
+	mutex_unlock(&loginMutex);
+
+	putULong(rsp, rv);
+	return 0;
+}
+
+
+
+/**
+ * Log out from all tokens the client is logged in to before its sessions are closed
+ */
+static void logoutAll(struct proxyClient *client)
+{
+	CK_SESSION_INFO info;
+	int i;
+
+	mutex_lock(&loginMutex);
+
+	for (i = 0; (i < client->sessionCount) && (client->loginCount > 0); i++) {
+		if ((p11->C_GetSessionInfo(client->sessions[i], &info) == CKR_OK) && (findLogin(client, info.slotID) >= 0))
+			logoutClient(client, client->sessions[i], info.slotID);
+	}
+
+	mutex_lock(&clientsMutex);
+	client->loginCount = 0;
+	mutex_unlock(&clientsMutex);
+
+	mutex_unlock(&loginMutex);
+}
+
+
+
+static int proxyGetAttributeValue(struct proxyClient *client, struct p11ProxyMessage *req, struct p11ProxyMessage *rsp)
+{
+	CK_SESSION_HANDLE hSession;
+	CK_OBJECT_HANDLE hObject;
+	CK_ATTRIBUTE_PTR attr;
+	CK_ULONG i, count, len, total;
+	unsigned char *v;
+	CK_RV rv;
+
+	hSession = getULong(req);
+	hObject = getULong(req);
+	count = getULong(req);
+
+	// Each attribute requires 16 bytes in the request
+	if (req->failed || (count > (req->len - req->pos) / 16))
+		return -1;
+
+	attr = (CK_ATTRIBUTE_PTR)calloc(count + 1, sizeof(CK_ATTRIBUTE));
+	if (attr == NULL) {
+		putULong(rsp, CKR_HOST_MEMORY);
+		return 0;
+	}
+
+	total = 0;
+	for (i = 0; i < count; i++) {
+		attr[i].type = getULong(req);
+		attr[i].pValue = getBufferRequest(req, &len) ? (CK_VOID_PTR)1 : NULL;
+		attr[i].ulValueLen = len;
+		total += (len + sizeof(CK_ULONG) - 1) / sizeof(CK_ULONG) * sizeof(CK_ULONG);
+	}
+
+	if (req->failed || (total > P11PROXY_MAX_MESSAGE)) {
+		free(attr);
+		return -1;
+	}
+
+	v = (unsigned char *)calloc(1, total + 1);
+	if (v == NULL) {
+		free(attr);
+		putULong(rsp, CKR_HOST_MEMORY);
+		return 0;
+	}
+
+	total = 0;
+	for (i = 0; i < count; i++) {
+		if (attr[i].pValue != NULL) {
+			attr[i].pValue = v + total;
+			total += (attr[i].ulValueLen + sizeof(CK_ULONG) - 1) / sizeof(CK_ULONG) * sizeof(CK_ULONG);
+		}
+	}
+
+	rv = ownsSession(client, hSession) ? checkObjectAccess(client, hSession, hObject) : CKR_SESSION_HANDLE_INVALID;
+
+	if (rv == CKR_OK)
+		rv = p11->C_GetAttributeValue(hSession, hObject, attr, count);
+
+	putULong(rsp, rv);
+	if ((rv == CKR_OK) || (rv == CKR_ATTRIBUTE_SENSITIVE) ||
+		(rv == CKR_ATTRIBUTE_TYPE_INVALID) || (rv == CKR_BUFFER_TOO_SMALL)) {
+		for (i = 0; i < count; i++) {
+			putULong(rsp, attr[i].ulValueLen);
+			if (attr[i].pValue && (attr[i].ulValueLen != (CK_ULONG)-1))
+				putBytes(rsp, attr[i].pValue, attr[i].ulValueLen);
+		}
+	}
+
+	memset_s(v, total + 1, 0, total + 1);
+	free(v);
+	free(attr);
+	return 0;
+}
+
+
+
+static int proxyFindObjectsInit(struct proxyClient *client, struct p11ProxyMessage *req, struct p11ProxyMessage *rsp)
+{
+	CK_SESSION_HANDLE hSession;
+	CK_ATTRIBUTE_PTR attr;
+	CK_ULONG count;
+	CK_RV rv;
+
+	hSession = getULong(req);
+	attr = getTemplate(req, &count);
+
+	if (req->failed)
+		return -1;
+
+	rv = ownsSession(client, hSession) ? p11->C_FindObjectsInit(hSession, attr, count) : CKR_SESSION_HANDLE_INVALID;
+
+	free(attr);
+	putULong(rsp, rv);
+	return 0;
+}
+
+
+
+/**
+ * Search objects, skipping private objects
+ *
+ * Used for clients that did not log in, while the token may be logged in by another client.
+ */
+static CK_RV findPublicObjects(CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR list, CK_ULONG max, CK_ULONG_PTR count)
+{
+	CK_ULONG i, n, found;
+	CK_RV rv;
+
+	*count = 0;
+
+	do {
+		rv = p11->C_FindObjects(hSession, list + *count, max - *count, &found);
+
+		if (rv != CKR_OK)
+			return rv;
+
+		n = *count;
+		for (i = 0; i < found; i++) {
+			if (!isPrivateObject(hSession, list[n + i]))
+				list[(*count)++] = list[n + i];
+		}
+	} while ((found > 0) && (*count < max));
+
+	return CKR_OK;
+}
+
+
+
+static int proxyFindObjects(struct proxyClient *client, struct p11ProxyMessage *req, struct p11ProxyMessage *rsp)
+{
+	CK_SESSION_HANDLE hSession;
+	CK_OBJECT_HANDLE_PTR list;
+	CK_ULONG max, count;
+	CK_RV rv;
+
+	hSession = getULong(req);
+	max = getULong(req);
+
+	if (req->failed)
+		return -1;
+
+	if (max > P11PROXY_MAX_MESSAGE / 16)
+		max = P11PROXY_MAX_MESSAGE / 16;
+
+	list = (CK_OBJECT_HANDLE_PTR)calloc(max + 1, sizeof(CK_OBJECT_HANDLE));
+	if (list == NULL) {
+		putULong(rsp, CKR_HOST_MEMORY);
+		return 0;
+	}
+
+	count = 0;
+	if (!ownsSession(client, hSession)) {
+		rv = CKR_SESSION_HANDLE_INVALID;
+	} else if (isLoggedIn(client, hSession)) {
+		rv = p11->C_FindObjects(hSession, list, max, &count);
+	} else {
+		rv = findPublicObjects(hSession, list, max, &count);
+	}
+
+	putULongList(rsp, rv, list, count);
+	free(list);
+	return 0;
+}
+
+
+
+static int proxyFindObjectsFinal(struct proxyClient *client, struct p11ProxyMessage *req, struct p11ProxyMessage *rsp)
+{
+	CK_SESSION_HANDLE hSession;
+	CK_RV rv;
+
+	hSession = getULong(req);
+
+	if (req->failed)
+		return -1;
+
+	rv = ownsSession(client, hSession) ? p11->C_FindObjectsFinal(hSession) : CKR_SESSION_HANDLE_INVALID;
+
+	putULong(rsp, rv);
+	return 0;
+}
+
+
+
+/**
+ * Initialize an encrypt, decrypt, sign or verify operation
+ */
+static int proxyOperationInit(struct proxyClient *client, CK_ULONG code, struct p11ProxyMessage *req, struct p11ProxyMessage *rsp)
+{
+	CK_SESSION_HANDLE hSession;
+	CK_MECHANISM mech;
+	CK_ULONG param[MAX_PARAMETER_SIZE / sizeof(CK_ULONG)];
+	CK_OBJECT_HANDLE hKey;
+	CK_RV rv;
+
+	hSession = getULong(req);
+	getMechanism(req, &mech, param, sizeof(param));
+	hKey = getULong(req);
+
+	if (req->failed)
+		return -1;
+
+	if (!ownsSession(client, hSession)) {
+		putULong(rsp, CKR_SESSION_HANDLE_INVALID);
+		return 0;
+	}
+
+	if (checkObjectAccess(client, hSession, hKey) != CKR_OK) {
+		putULong(rsp, CKR_KEY_HANDLE_INVALID);
+		return 0;
+	}
+
+	switch(code) {
+	case P11PROXY_ENCRYPT_INIT:
+		rv = p11->C_EncryptInit(hSession, &mech, hKey);
+		break;
+	case P11PROXY_DECRYPT_INIT:
+		rv = p11->C_DecryptInit(hSession, &mech, hKey);
+		break;
+	case P11PROXY_SIGN_INIT:
+		rv = p11->C_SignInit(hSession, &mech, hKey);
+		break;
+	default:
+		rv = p11->C_VerifyInit(hSession, &mech, hKey);
+		break;
+	}
+
+	putULong(rsp, rv);
+	return 0;
+}
+
+
+
+/**
+ * Perform an encrypt, decrypt or sign operation with input data and an output buffer
+ */
+static int proxyOperation(struct proxyClient *client, CK_ULONG code, struct p11ProxyMessage *req, struct p11ProxyMessage *rsp)
+{
+	CK_SESSION_HANDLE hSession;
+	CK_BYTE_PTR in, out;
+	CK_ULONG inlen, outlen;
+	CK_RV rv;
+	int requested;
+
+	hSession = getULong(req);
+	in = NULL;
+	inlen = 0;
+	if (code != P11PROXY_SIGN_FINAL)
+		in = getBytes(req, &inlen);
+	requested = getBufferRequest(req, &outlen);
+
+	if (req->failed)
+		return -1;
+
+	if (!ownsSession(client, hSession)) {
+		putULong(rsp, CKR_SESSION_HANDLE_INVALID);
+		return 0;
+	}
+
+	out = NULL;
+	if (requested) {
+		out = (CK_BYTE_PTR)malloc(outlen + 1);
+		if (out == NULL) {
+			putULong(rsp, CKR_HOST_MEMORY);
+			return 0;
+		}
+	}
+
+	switch(code) {
+	case P11PROXY_ENCRYPT:
+		rv = p11->C_Encrypt(hSession, in, inlen, out, &outlen);
+		break;
+	case P11PROXY_DECRYPT:
+		rv = p11->C_Decrypt(hSession, in, inlen, out, &outlen);
+		break;
+	case P11PROXY_SIGN:
+		rv = p11->C_Sign(hSession, in, inlen, out, &outlen);
+		break;
+	default:
+		rv = p11->C_SignFinal(hSession, out, &outlen);
+		break;
+	}
+
+	putOutput(rsp, rv, requested, out, outlen);
+
+	if (out != NULL) {
+		memset_s(out, outlen + 1, 0, outlen + 1);
+		free(out);
+	}
+	return 0;
+}
+
+
+
+static int proxySignUpdate(struct proxyClient *client, struct p11ProxyMessage *req, struct p11ProxyMessage *rsp)
+{
+	CK_SESSION_HANDLE hSession;
+	CK_BYTE_PTR part;
+	CK_ULONG partlen;
+	CK_RV rv;
+
+	hSession = getULong(req);
+	part = getBytes(req, &partlen);
+
+	if (req->failed)
+		return -1;
+
+	rv = ownsSession(client, hSession) ? p11->C_SignUpdate(hSession, part, partlen) : CKR_SESSION_HANDLE_INVALID;
+
+	putULong(rsp, rv);
+	return 0;
+}
+
+
+
+static int proxyVerify(struct proxyClient *client, struct p11ProxyMessage *req, struct p11ProxyMessage *rsp)
+{
+	CK_SESSION_HANDLE hSession;
+	CK_BYTE_PTR data, signature;
+	CK_ULONG datalen, signaturelen;
+	CK_RV rv;
+
+	hSession = getULong(req);
+	data = getBytes(req, &datalen);
+	signature = getBytes(req, &signaturelen);
+
+	if (req->failed)
+		return -1;
+
+	rv = ownsSession(client, hSession) ? p11->C_Verify(hSession, data, datalen, signature, signaturelen) : CKR_SESSION_HANDLE_INVALID;
+
+	putULong(rsp, rv);
+	return 0;
+}
+
+
+
+static int proxyGenerateRandom(struct proxyClient *client, struct p11ProxyMessage *req, struct p11ProxyMessage *rsp)
+{
+	CK_SESSION_HANDLE hSession;
+	CK_BYTE_PTR rnd;
+	CK_ULONG len;
+	CK_RV rv;
+
+	hSession = getULong(req);
+	len = getULong(req);
+
+	if (req->failed || (len > P11PROXY_MAX_MESSAGE / 2))
+		return -1;
+
+	rnd = (CK_BYTE_PTR)malloc(len + 1);
+	if (rnd == NULL) {
+		putULong(rsp, CKR_HOST_MEMORY);
+		return 0;
+	}
+
+	rv = ownsSession(client, hSession) ? p11->C_GenerateRandom(hSession, rnd, len) : CKR_SESSION_HANDLE_INVALID;
+
+	putOutput(rsp, rv, TRUE, rnd, len);
+
+	memset_s(rnd, len + 1, 0, len + 1);
+	free(rnd);
+	return 0;
+}
+
+
+
+/**
+ * Decode the request, call the module and encode the response
+ *
+ * @return          0 or -1 if the request is malformed and the connection must be closed
+ */
+static int handleRequest(struct proxyClient *client, CK_ULONG code, struct p11ProxyMessage *req, struct p11ProxyMessage *rsp)
+{
+	switch(code) {
+	case P11PROXY_GET_SLOT_LIST:
+		return proxyGetSlotList(client, req, rsp);
+	case P11PROXY_GET_SLOT_INFO:
+		return proxyGetSlotInfo(client, req, rsp);
+	case P11PROXY_GET_TOKEN_INFO:
+		return proxyGetTokenInfo(client, req, rsp);
+	case P11PROXY_GET_MECHANISM_LIST:
+		return proxyGetMechanismList(client, req, rsp);
+	case P11PROXY_GET_MECHANISM_INFO:
+		return proxyGetMechanismInfo(client, req, rsp);
+	case P11PROXY_OPEN_SESSION:
+		return proxyOpenSession(client, req, rsp);
+	case P11PROXY_CLOSE_SESSION:
+		return proxyCloseSession(client, req, rsp);
+	case P11PROXY_CLOSE_ALL_SESSIONS:
+		return proxyCloseAllSessions(client, req, rsp);
+	case P11PROXY_GET_SESSION_INFO:
+		return proxyGetSessionInfo(client, req, rsp);
+	case P11PROXY_LOGIN:
+		return proxyLogin(client, req, rsp);
+	case P11PROXY_LOGOUT:
+		return proxyLogout(client, req, rsp);
+	case P11PROXY_GET_ATTRIBUTE_VALUE:
+		return proxyGetAttributeValue(client, req, rsp);
+	case P11PROXY_FIND_OBJECTS_INIT:
+		return proxyFindObjectsInit(client, req, rsp);
+	case P11PROXY_FIND_OBJECTS:
+		return proxyFindObjects(client, req, rsp);
+	case P11PROXY_FIND_OBJECTS_FINAL:
+		return proxyFindObjectsFinal(client, req, rsp);
+	case P11PROXY_ENCRYPT_INIT:
+	case P11PROXY_DECRYPT_INIT:
+	case P11PROXY_SIGN_INIT:
+	case P11PROXY_VERIFY_INIT:
+		return proxyOperationInit(client, code, req, rsp);
+	case P11PROXY_ENCRYPT:
+	case P11PROXY_DECRYPT:
+	case P11PROXY_SIGN:
+	case P11PROXY_SIGN_FINAL:
+		return proxyOperation(client, code, req, rsp);
+	case P11PROXY_SIGN_UPDATE:
+		return proxySignUpdate(client, req, rsp);
+	case P11PROXY_VERIFY:
+		return proxyVerify(client, req, rsp);
+	case P11PROXY_GENERATE_RANDOM:
+		return proxyGenerateRandom(client, req, rsp);
+	}
+
+	debug("Unknown function code %lu\n", code);
+	return -1;
+}
+
+
+
+static void *serveClient(void *arg)
+{
+	struct proxyClient *client = (struct proxyClient *)arg;
+	struct p11ProxyMessage req, rsp;
+	CK_ULONG code;
+	int i, rc;
+
+	initMessage(&req);
+	initMessage(&rsp);
+
+	// The first request must be the handshake
+	rc = (receiveMessage(client->fd, &code, &req) < 0) || (code != P11PROXY_HELLO) ||
+		(proxyHello(client, &req, &rsp) < 0) || (sendMessage(client->fd, code, &rsp) < 0);
+
+	while (!rc && !terminating) {
+		if (receiveMessage(client->fd, &code, &req) < 0)
+			break;
+
+		resetMessage(&rsp);
+
+		if (handleRequest(client, code, &req, &rsp) < 0) {
+			debug("Invalid request %lu from client\n", code);
+			break;
+		}
+
+		if (sendMessage(client->fd, code, &rsp) < 0)
+			break;
+	}
+
+	logoutAll(client);
+
+	for (i = 0; i < client->sessionCount; i++)
+		p11->C_CloseSession(client->sessions[i]);
+
+	freeMessage(&req);
+	freeMessage(&rsp);
+
+	// The descriptor is closed by the main thread after joining this thread
+	shutdown(client->fd, SHUT_RDWR);
+
+	mutex_lock(&clientsMutex);
+	client->finished = TRUE;
+	mutex_unlock(&clientsMutex);
+	return NULL;
+}
+
+
+
+static void handleSignal(int sig)
+{
+	terminating = TRUE;
+	if (listenFd >= 0)
+		shutdown(listenFd, SHUT_RDWR);
+}
+
+
+
+/**
+ * Create the private directory for the default socket
+ *
+ * An existing directory is only used if it is owned by the daemon user and not accessible by others.
+ */
+static int createSocketDir(char *path)
+{
+	struct stat st;
+
+	if ((mkdir(path, 0700) < 0) && (errno != EEXIST)) {
+		perror("mkdir");
+		return -1;
+	}
+
+	if (lstat(path, &st) < 0) {
+		perror("lstat");
+		return -1;
+	}
+
+	if (!S_ISDIR(st.st_mode) || (st.st_uid != geteuid()) || (st.st_mode & 077)) {
+		fprintf(stderr, "%s must be a directory owned by the daemon user with mode 0700\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+
+static int createSocket(char *path)
+{
+	struct sockaddr_un addr;
+	mode_t mask;
+	int fd, rc;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path %s too long\n", path);
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	unlink(path);
+
+	// Create the socket with mode 0660, so that there is no window with wider permissions
+	mask = umask(0117);
+	rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+
+	if (rc < 0) {
+		perror("bind");
+		close(fd);
+		return -1;
+	}
+
+	if (listen(fd, 16) < 0) {
+		perror("listen");
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+
+/**
+ * Return TRUE if the process at the other end of the connection may use the daemon
+ */
+static int isClientAllowed(int fd)
+{
+	uid_t uid;
+	int i;
+
+	if (getPeerUid(fd, &uid) < 0)
+		return FALSE;
+
+	if ((uid == 0) || (uid == geteuid()))
+		return TRUE;
+
+	for (i = 0; i < allowedUidCount; i++) {
+		if (allowedUids[i] == uid)
+			return TRUE;
+	}
+
+	debug("Connection from user id %lu rejected\n", (unsigned long)uid);
+	return FALSE;
+}
+
+
+
+/**
+ * Join the threads of finished clients and release them
+ *
+ * @param all       Wait for all clients, not only the finished ones
+ */
+static void joinClients(int all)
+{
+	struct proxyClient *c, **pc, *done;
+
+	done = NULL;
+
+	mutex_lock(&clientsMutex);
+	pc = &clients;
+	while (*pc != NULL) {
+		c = *pc;
+		if (all || c->finished) {
+			*pc = c->next;
+			c->next = done;
+			done = c;
+		} else {
+			pc = &c->next;
+		}
+	}
+	mutex_unlock(&clientsMutex);
+
+	while (done != NULL) {
+		c = done;
+		done = c->next;
+		pthread_join(c->thread, NULL);
+		close(c->fd);
+		free(c->sessions);
+		free(c->logins);
+		free(c);
+	}
+}
+
+
+
+/**
+ * Close all client connections and wait until the client threads have terminated
+ *
+ * A thread currently calling the module completes that call first, so the module
+ * can be finalized afterwards.
+ */
+static void closeClients()
+{
+	struct proxyClient *c;
+
+	mutex_lock(&clientsMutex);
+	for (c = clients; c != NULL; c = c->next)
+		shutdown(c->fd, SHUT_RDWR);
+	mutex_unlock(&clientsMutex);
+
+	joinClients(TRUE);
+}
+
+
+
+static void usage()
+{
+	printf("Usage: sc-hsm-pkcs11-proxy [--module <path>] [--socket <path>] [--allow-uid <uid>]...\n\n");
+	printf("  --module <path>   PKCS#11 module, default %s\n", P11LIBNAME);
+	printf("  --socket <path>   Socket for clients, default $PKCS11_PROXY_SOCKET or %s\n", P11PROXY_DEFAULT_SOCKET);
+	printf("  --allow-uid <uid> Accept clients running with this user id, in addition to root and the daemon user\n");
+}
+
+
+
+int main(int argc, char *argv[])
+{
+	CK_RV (*C_GetFunctionList)(CK_FUNCTION_LIST_PTR_PTR);
+	CK_C_INITIALIZE_ARGS initArgs;
+	struct proxyClient *client;
+	struct sigaction sa;
+	char *p11libname, *socketPath, *end;
+	void *dlhandle;
+	CK_RV rv;
+	int fd;
+
+	p11libname = P11LIBNAME;
+	socketPath = getenv("PKCS11_PROXY_SOCKET");
+	if (socketPath == NULL)
+		socketPath = P11PROXY_DEFAULT_SOCKET;
+
+	argc--;
+	argv++;
+	while (argc--) {
+		if (!strcmp(*argv, "--module") && (argc > 0)) {
+			argv++;
+			p11libname = *argv;
+			argc--;
+		} else if (!strcmp(*argv, "--socket") && (argc > 0)) {
+			argv++;
+			socketPath = *argv;
+			argc--;
+		} else if (!strcmp(*argv, "--allow-uid") && (argc > 0) && (allowedUidCount < MAX_ALLOWED_UIDS)) {
+			argv++;
+			allowedUids[allowedUidCount++] = (uid_t)strtoul(*argv, &end, 10);
+			if ((end == *argv) || *end) {
+				usage();
+				exit(1);
+			}
+			argc--;
+		} else {
+			usage();
+			exit(1);
+		}
+		argv++;
+	}
+
+	dlhandle = dlopen(p11libname, RTLD_NOW);
+	if (dlhandle == NULL) {
+		fprintf(stderr, "dlopen failed with %s\n", dlerror());
+		exit(1);
+	}
+
+	C_GetFunctionList = (CK_RV (*)(CK_FUNCTION_LIST_PTR_PTR))dlsym(dlhandle, "C_GetFunctionList");
+	if ((C_GetFunctionList == NULL) || (C_GetFunctionList(&p11) != CKR_OK)) {
+		fprintf(stderr, "C_GetFunctionList not found in %s\n", p11libname);
+		exit(1);
+	}
+
+	memset(&initArgs, 0, sizeof(initArgs));
+	initArgs.flags = CKF_OS_LOCKING_OK;
+
+	rv = p11->C_Initialize(&initArgs);
+	if (rv != CKR_OK) {
+		fprintf(stderr, "C_Initialize failed with rv=%lu\n", rv);
+		exit(1);
+	}
+
+	if ((mutex_init(&clientsMutex) != 0) || (mutex_init(&loginMutex) != 0)) {
+		exit(1);
+	}
+
+	if (!strcmp(socketPath, P11PROXY_DEFAULT_SOCKET) && (createSocketDir(P11PROXY_DEFAULT_DIR) < 0)) {
+		p11->C_Finalize(NULL);
+		exit(1);
+	}
+
+	listenFd = createSocket(socketPath);
+	if (listenFd < 0) {
+		p11->C_Finalize(NULL);
+		exit(1);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handleSignal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	initDebug("pkcs11-proxy");
+
+	while (!terminating) {
+		fd = accept(listenFd, NULL, NULL);
+		if (fd < 0) {
+			if ((errno == EINTR) || (errno == ECONNABORTED))
+				continue;
+			if (!terminating)
+				perror("accept");
+			break;
+		}
+
+		joinClients(FALSE);
+
+		// Clients are checked before any request, in particular before a PIN is received
+		if (!isClientAllowed(fd)) {
+			close(fd);
+			continue;
+		}
+
+		client = (struct proxyClient *)calloc(1, sizeof(struct proxyClient));
+		if (client == NULL) {
+			close(fd);
+			continue;
+		}
+		client->fd = fd;
+
+		// The client is linked after the thread was created, so joinClients() never sees it without one
+		mutex_lock(&clientsMutex);
+		if (pthread_create(&client->thread, NULL, serveClient, client) != 0) {
+			mutex_unlock(&clientsMutex);
+			close(fd);
+			free(client);
+			continue;
+		}
+		client->next = clients;
+		clients = client;
+		mutex_unlock(&clientsMutex);
+	}
+
+	close(listenFd);
+	unlink(socketPath);
+
+	closeClients();
+
+	p11->C_Finalize(NULL);
+	termDebug();
+	dlclose(dlhandle);
+	return 0;
+}
@@ -0,0 +1,499 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    p11proxy.c
+ * @author  Andreas Schwier
+ * @brief   Marshalling of PKCS#11 arguments for the proxy protocol
+ *
+ * All integers are encoded as 8 byte values in big endian order. Byte strings are encoded
+ * with their length, followed by the content. A NULL pointer is encoded with the length
+ * P11PROXY_ABSENT and no content.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE					/* struct ucred */
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <common/memset_s.h>
+
+#include "p11proxy.h"
+
+#define P11PROXY_HEADER_SIZE		8
+
+
+
+void initMessage(struct p11ProxyMessage *msg)
+{
+	memset(msg, 0, sizeof(*msg));
+}
+
+
+
+void resetMessage(struct p11ProxyMessage *msg)
+{
+	if (msg->data)
+		memset_s(msg->data, msg->size, 0, msg->len);
+
+	msg->len = 0;
+	msg->pos = 0;
+	msg->failed = 0;
+}
+
+
+
+/**
+ * Release the message buffer
+ *
+ * The buffer is cleared, as messages may contain PINs or plain text.
+ */
+void freeMessage(struct p11ProxyMessage *msg)
+{
+	if (msg->data) {
+		memset_s(msg->data, msg->size, 0, msg->size);
+		free(msg->data);
+	}
+	initMessage(msg);
+}
+
+
+
+static int ensureCapacity(struct p11ProxyMessage *msg, size_t len)
+{
+	unsigned char *p;
+	size_t size;
+
+	if (msg->failed)
+		return -1;
+
+	if ((len > P11PROXY_MAX_MESSAGE) || (msg->len + len > P11PROXY_MAX_MESSAGE)) {
+		msg->failed = 1;
+		return -1;
+	}
+
+	if (msg->len + len <= msg->size)
+		return 0;
+
+	size = msg->size ? msg->size : 256;
+	while (size < msg->len + len)
+		size <<= 1;
+
+	// Don't use realloc, so that the old buffer can be cleared
+	p = (unsigned char *)malloc(size);
+	if (p == NULL) {
+		msg->failed = 1;
+		return -1;
+	}
+
+	if (msg->data) {
+		memcpy(p, msg->data, msg->len);
+		memset_s(msg->data, msg->size, 0, msg->size);
+		free(msg->data);
+	}
+
+	msg->data = p;
+	msg->size = size;
+	return 0;
+}
+
+
+
+static void putValue(struct p11ProxyMessage *msg, unsigned long long val)
+{
+	int i;
+
+	if (ensureCapacity(msg, 8) < 0)
+		return;
+
+	for (i = 7; i >= 0; i--) {
+		msg->data[msg->len + i] = (unsigned char)val;
+		val >>= 8;
+	}
+	msg->len += 8;
+}
+
+
+
+void putULong(struct p11ProxyMessage *msg, CK_ULONG val)
+{
+	putValue(msg, val == (CK_ULONG)-1 ? P11PROXY_ABSENT : val);
+}
+
+
+
+void putBytes(struct p11ProxyMessage *msg, const void *data, CK_ULONG len)
+{
+	if (data == NULL) {
+		putValue(msg, P11PROXY_ABSENT);
+		return;
+	}
+
+	putValue(msg, len);
+
+	if (ensureCapacity(msg, len) < 0)
+		return;
+
+	memcpy(msg->data + msg->len, data, len);
+	msg->len += len;
+}
+
+
+
+/**
+ * Encode the size of an output buffer or P11PROXY_ABSENT if only the length is requested
+ */
+void putBufferRequest(struct p11ProxyMessage *msg, const void *data, CK_ULONG_PTR len)
+{
+	putValue(msg, data ? *len : P11PROXY_ABSENT);
+}
+
+
+
+void putMechanism(struct p11ProxyMessage *msg, CK_MECHANISM_PTR mech)
+{
+	putULong(msg, mech->mechanism);
+	putBytes(msg, mech->pParameter, mech->ulParameterLen);
+}
+
+
+
+void putTemplate(struct p11ProxyMessage *msg, CK_ATTRIBUTE_PTR attr, CK_ULONG count)
+{
+	CK_ULONG i;
+
+	putULong(msg, count);
+	for (i = 0; i < count; i++) {
+		putULong(msg, attr[i].type);
+		putBytes(msg, attr[i].pValue, attr[i].ulValueLen);
+	}
+}
+
+
+
+static unsigned long long getValue(struct p11ProxyMessage *msg)
+{
+	unsigned long long val;
+	int i;
+
+	if (msg->failed || (msg->pos + 8 > msg->len)) {
+		msg->failed = 1;
+		return 0;
+	}
+
+	val = 0;
+	for (i = 0; i < 8; i++)
+		val = (val << 8) | msg->data[msg->pos++];
+
+	return val;
+}
+
+
+
+CK_ULONG getULong(struct p11ProxyMessage *msg)
+{
+	return (CK_ULONG)getValue(msg);
+}
+
+
+
+/**
+ * Decode a byte string
+ *
+ * @param msg       The message
+ * @param len       The variable receiving the length of the byte string
+ * @return          Pointer into the message buffer or NULL if absent
+ */
+unsigned char *getBytes(struct p11ProxyMessage *msg, CK_ULONG *len)
+{
+	unsigned long long l;
+	unsigned char *p;
+
+	*len = 0;
+	l = getValue(msg);
+
+	if (msg->failed || (l == P11PROXY_ABSENT))
+		return NULL;
+
+	if (l > msg->len - msg->pos) {
+		msg->failed = 1;
+		return NULL;
+	}
+
+	p = msg->data + msg->pos;
+	msg->pos += (size_t)l;
+	*len = (CK_ULONG)l;
+	return p;
+}
+
+
+
+/**
+ * Decode the size of an output buffer
+ *
+ * @param msg       The message
+ * @param len       The variable receiving the size of the buffer
+ * @return          1 if an output buffer was provided, 0 if only the length is requested
+ */
+int getBufferRequest(struct p11ProxyMessage *msg, CK_ULONG *len)
+{
+	unsigned long long l;
+
+	*len = 0;
+	l = getValue(msg);
+
+	if (msg->failed || (l == P11PROXY_ABSENT))
+		return 0;
+
+	if (l > P11PROXY_MAX_MESSAGE)
+		l = P11PROXY_MAX_MESSAGE;
+
+	*len = (CK_ULONG)l;
+	return 1;
+}
+
+
+
+/**
+ * Decode a mechanism, copying the parameter into an aligned buffer
+ */
+void getMechanism(struct p11ProxyMessage *msg, CK_MECHANISM_PTR mech, CK_ULONG *param, size_t paramSize)
+{
+	unsigned char *p;
+	CK_ULONG len;
+
+	mech->mechanism = getULong(msg);
+	p = getBytes(msg, &len);
+
+	if (len > paramSize) {
+		msg->failed = 1;
+		p = NULL;
+	}
+
+	if (p != NULL) {
+		memcpy(param, p, len);
+		mech->pParameter = param;
+		mech->ulParameterLen = len;
+	} else {
+		mech->pParameter = NULL;
+		mech->ulParameterLen = 0;
+	}
+}
+
+
+
+/**
+ * Decode a template
+ *
+ * Attribute values are copied into the allocated block, aligned for CK_ULONG values.
+ *
+ * @param msg       The message
+ * @param count     The variable receiving the number of attributes
+ * @return          The template, which must be released with free(), or NULL
+ */
+CK_ATTRIBUTE_PTR getTemplate(struct p11ProxyMessage *msg, CK_ULONG *count)
+{
+	CK_ATTRIBUTE_PTR attr;
+	unsigned char *p, *v;
+	CK_ULONG cnt, i, len;
+
+	*count = 0;
+	cnt = getULong(msg);
+
+	// Each attribute requires at least 16 bytes in the message
+	if (msg->failed || (cnt > (msg->len - msg->pos) / 16)) {
+		msg->failed = 1;
+		return NULL;
+	}
+
+	attr = (CK_ATTRIBUTE_PTR)calloc(1, cnt * (sizeof(CK_ATTRIBUTE) + sizeof(CK_ULONG)) + msg->len - msg->pos + 1);
+	if (attr == NULL) {
+		msg->failed = 1;
+		return NULL;
+	}
+
+	v = (unsigned char *)(attr + cnt);
+	for (i = 0; i < cnt; i++) {
+		attr[i].type = getULong(msg);
+		p = getBytes(msg, &len);
+		if (p != NULL) {
+			memcpy(v, p, len);
+			attr[i].pValue = v;
+			v += (len + sizeof(CK_ULONG) - 1) / sizeof(CK_ULONG) * sizeof(CK_ULONG);
+		}
+		attr[i].ulValueLen = len;
+	}
+
+	if (msg->failed) {
+		free(attr);
+		return NULL;
+	}
+
+	*count = cnt;
+	return attr;
+}
+
+
+
+static int writeAll(int fd, unsigned char *data, size_t len)
+{
+	ssize_t rc;
+	int flags = 0;
+
+#ifdef MSG_NOSIGNAL
+	flags = MSG_NOSIGNAL;
+#endif
+
+	while (len > 0) {
+		rc = send(fd, data, len, flags);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		data += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+
+
+static int readAll(int fd, unsigned char *data, size_t len)
+{
+	ssize_t rc;
+
+	while (len > 0) {
+		rc = recv(fd, data, len, 0);
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (rc == 0)
+			return -1;
+		data += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+
+
+/**
+ * Send a message with the given function code
+ *
+ * @return          0 or -1 if the message is invalid or the connection failed
+ */
+int sendMessage(int fd, CK_ULONG code, struct p11ProxyMessage *msg)
+{
+	unsigned char header[P11PROXY_HEADER_SIZE];
+	size_t len;
+
+	if (msg->failed)
+		return -1;
+
+	len = msg->len;
+	header[0] = (unsigned char)(len >> 24);
+	header[1] = (unsigned char)(len >> 16);
+	header[2] = (unsigned char)(len >> 8);
+	header[3] = (unsigned char)len;
+	header[4] = (unsigned char)(code >> 24);
+	header[5] = (unsigned char)(code >> 16);
+	header[6] = (unsigned char)(code >> 8);
+	header[7] = (unsigned char)code;
+
+	if (writeAll(fd, header, sizeof(header)) < 0)
+		return -1;
+
+	return writeAll(fd, msg->data, len);
+}
+
+
+
+/**
+ * Receive a message, replacing the content of the message buffer
+ *
+ * @return          0 or -1 if the connection was closed or the message exceeds P11PROXY_MAX_MESSAGE
+ */
+int receiveMessage(int fd, CK_ULONG *code, struct p11ProxyMessage *msg)
+{
+	unsigned char header[P11PROXY_HEADER_SIZE];
+	size_t len;
+
+	resetMessage(msg);
+
+	if (readAll(fd, header, sizeof(header)) < 0)
+		return -1;
+
+	len = ((size_t)header[0] << 24) | (header[1] << 16) | (header[2] << 8) | header[3];
+	*code = ((CK_ULONG)header[4] << 24) | (header[5] << 16) | (header[6] << 8) | header[7];
+
+	if (ensureCapacity(msg, len) < 0)
+		return -1;
+
+	if (readAll(fd, msg->data, len) < 0)
+		return -1;
+
+	msg->len = len;
+	return 0;
+}
+
+
+
+/**
+ * Determine the effective user id of the process at the other end of the connection
+ *
+ * @return          0 or -1 if the credentials are not available
+ */
+int getPeerUid(int fd, uid_t *uid)
+{
+#if defined(SO_PEERCRED)
+	struct ucred cred;
+	socklen_t len;
+
+	len = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+		return -1;
+
+	*uid = cred.uid;
+	return 0;
+#else
+	gid_t gid;
+
+	if (getpeereid(fd, uid, &gid) < 0)
+		return -1;
+
+	return 0;
+#endif
+}
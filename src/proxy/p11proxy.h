@@ -0,0 +1,119 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file    p11proxy.h
+ * @author  Andreas Schwier
+ * @brief   Wire protocol between the PKCS#11 proxy client module and the proxy daemon
+ */
+
+#ifndef ___P11PROXY_H_INC___
+#define ___P11PROXY_H_INC___
+
+#include <sys/types.h>
+
+#include <pkcs11/cryptoki.h>
+
+#define P11PROXY_VERSION			1
+#define P11PROXY_DEFAULT_DIR		"/run/sc-hsm-pkcs11-proxy"
+#define P11PROXY_DEFAULT_SOCKET		P11PROXY_DEFAULT_DIR "/proxy.sock"
+#define P11PROXY_MAX_MESSAGE		(1024 * 1024)
+#define P11PROXY_ABSENT				((unsigned long long)-1)
+
+/**
+ * Function codes
+ *
+ * Each request consists of a header with the length of the payload and the function code,
+ * followed by the marshalled arguments. The response has the same header with the function
+ * code of the request. The first element in the response payload is the return value.
+ */
+enum p11ProxyFunction {
+	P11PROXY_HELLO = 1,
+	P11PROXY_GET_SLOT_LIST,
+	P11PROXY_GET_SLOT_INFO,
+	P11PROXY_GET_TOKEN_INFO,
+	P11PROXY_GET_MECHANISM_LIST,
+	P11PROXY_GET_MECHANISM_INFO,
+	P11PROXY_OPEN_SESSION,
+	P11PROXY_CLOSE_SESSION,
+	P11PROXY_CLOSE_ALL_SESSIONS,
+	P11PROXY_GET_SESSION_INFO,
+	P11PROXY_LOGIN,
+	P11PROXY_LOGOUT,
+	P11PROXY_GET_ATTRIBUTE_VALUE,
+	P11PROXY_FIND_OBJECTS_INIT,
+	P11PROXY_FIND_OBJECTS,
+	P11PROXY_FIND_OBJECTS_FINAL,
+	P11PROXY_ENCRYPT_INIT,
+	P11PROXY_ENCRYPT,
+	P11PROXY_DECRYPT_INIT,
+	P11PROXY_DECRYPT,
+	P11PROXY_SIGN_INIT,
+	P11PROXY_SIGN,
+	P11PROXY_SIGN_UPDATE,
+	P11PROXY_SIGN_FINAL,
+	P11PROXY_VERIFY_INIT,
+	P11PROXY_VERIFY,
+	P11PROXY_GENERATE_RANDOM
+};
+
+/**
+ * Growable message buffer with read position
+ *
+ * Put and get functions set the failed flag instead of returning an error, so that
+ * only the final state needs to be checked after a sequence of calls.
+ */
+struct p11ProxyMessage {
+	unsigned char *data;
+	size_t len;
+	size_t size;
+	size_t pos;
+	int failed;
+};
+
+void initMessage(struct p11ProxyMessage *msg);
+void resetMessage(struct p11ProxyMessage *msg);
+void freeMessage(struct p11ProxyMessage *msg);
+
+void putULong(struct p11ProxyMessage *msg, CK_ULONG val);
+void putBytes(struct p11ProxyMessage *msg, const void *data, CK_ULONG len);
+void putBufferRequest(struct p11ProxyMessage *msg, const void *data, CK_ULONG_PTR len);
+void putMechanism(struct p11ProxyMessage *msg, CK_MECHANISM_PTR mech);
+void putTemplate(struct p11ProxyMessage *msg, CK_ATTRIBUTE_PTR attr, CK_ULONG count);
+
+CK_ULONG getULong(struct p11ProxyMessage *msg);
+unsigned char *getBytes(struct p11ProxyMessage *msg, CK_ULONG *len);
+int getBufferRequest(struct p11ProxyMessage *msg, CK_ULONG *len);
+void getMechanism(struct p11ProxyMessage *msg, CK_MECHANISM_PTR mech, CK_ULONG *param, size_t paramSize);
+CK_ATTRIBUTE_PTR getTemplate(struct p11ProxyMessage *msg, CK_ULONG *count);
+
+int sendMessage(int fd, CK_ULONG code, struct p11ProxyMessage *msg);
+int receiveMessage(int fd, CK_ULONG *code, struct p11ProxyMessage *msg);
+
+int getPeerUid(int fd, uid_t *uid);
+
+#endif /* ___P11PROXY_H_INC___ */
@@ -52,6 +52,7 @@ static int optListReaders = 0;
 static char *optReader = NULL;
 static char *optURL = NULL;
 static int optVerbose = 0;
+static int optStreaming = 0;
 
 
 struct localContext {
@@ -192,6 +193,7 @@ void usage()
 	puts("ram-client [option] <URL>\n");
 	puts("  -r, --reader         Select reader name");
 	puts("  -l, --list-readers   List available card readers");
+	puts("  -s, --stream         Process commands while receiving");
 	puts("  -v, --verbose        Tell us what you do");
 }
 
@@ -213,6 +215,8 @@ void decodeArgs(int argc, char **argv)
 			argc--;
 		} else if (!strcmp(*argv, "--list-readers") || !strcmp(*argv, "-l")) {
 			optListReaders = 1;
+		} else if (!strcmp(*argv, "--stream") || !strcmp(*argv, "-s")) {
+			optStreaming = 1;
 		} else if (!strcmp(*argv, "--verbose") || !strcmp(*argv, "-v")) {
 			optVerbose = 1;
 		} else if (**argv == '-') {
@@ -417,6 +421,7 @@ int main(int argc, char **argv)
 		ramSetUserObject(ctx, (void *)&lctx);
 		ramSetURL(ctx, optURL);
 		ramSetATR(ctx, atr, atrlen);
+		ramSetStreaming(ctx, optStreaming);
 		rc = ramConnect(ctx);
 		ramFreeContext(&ctx);
 	} else {
@@ -29,6 +29,13 @@
  * @file ramoverhttp.c
  * @author Andreas Schwier
  * @brief RAMoverHTTP Client
+ *
+ * By default the client receives the complete request template from the server before
+ * processing the contained commands. In streaming mode, enabled with ramSetStreaming(),
+ * each object in the request template is processed as soon as it is received, so that the
+ * card works while the remaining commands are still in transit. The CURL handle is kept in
+ * the context, so that the connection to the server is reused across requests and calls to
+ * ramConnect().
  */
 
 #include <stdio.h>
@@ -40,6 +47,11 @@
 
 #include <curl/curl.h>
 
+/* States for parsing the request template in streaming mode */
+#define RAM_STREAM_HEADER	0			/** Waiting for tag and length of request template */
+#define RAM_STREAM_BODY		1			/** Processing objects in request template */
+#define RAM_STREAM_DONE		2			/** Request template completely processed */
+
 
 
 /**
@@ -254,6 +266,42 @@ static int tlvNext(unsigned char **ref, size_t *reflen, int *tag, size_t *length
 
 
 
+/**
+ * Decode tag and length of a TLV object, which may not yet be completely received
+ *
+ * @param p         Pointer to the first byte of the tag
+ * @param avail     Number of bytes available
+ * @param tag       Pointer to variable updated with the tag value
+ * @param length    Pointer to variable updated with the length value
+ * @param hdrlen    Pointer to variable updated with the length of tag and length field
+ * @return          1 if tag and length were decoded, 0 if more data is required or error code
+ */
+static int tlvHeader(unsigned char *p, size_t avail, int *tag, size_t *length, size_t *hdrlen)
+{
+	size_t c;
+
+	if (avail < 2)
+		return 0;
+
+	*tag = *p;
+	c = 1;
+	if (p[1] & 0x80) {
+		c += p[1] & 0x7F;
+		if ((c == 1) || (c > 3))
+			return RAME_INVALID_TLV;
+	}
+
+	if (avail < 1 + c)
+		return 0;
+
+	p++;
+	*length = tlvLength(&p);
+	*hdrlen = 1 + c;
+	return 1;
+}
+
+
+
 /**
  * Encode a response object with the given tag and data value
  *
@@ -436,6 +484,60 @@ static int encodeInteger(unsigned char *p, int v) {
 
 
 
+/**
+ * Process a single object from the request template
+ *
+ * @param ctx The initialized context
+ * @param tag The tag of the object
+ * @param v The value field
+ * @param tl The length of the value field
+ * @return 0 or error code
+ */
+static int processRequest(struct ramContext *ctx, int tag, unsigned char *v, size_t tl) {
+	int rc = 0;
+
+	switch(tag) {
+	case RAM_CAPDU:
+		rc = processSendApdu(ctx, v, tl);
+		if (rc == 0)
+			ctx->apducnt++;
+		break;
+	case RAM_RESET:
+		rc = processReset(ctx);
+		break;
+	case RAM_NOTIFY:
+		rc = processNotify(ctx, v, tl);
+		break;
+	}
+	return rc;
+}
+
+
+
+/**
+ * Complete the response template with the number of processed APDUs
+ *
+ * @param ctx The initialized context
+ * @return 0 or error code
+ */
+static int finishResponse(struct ramContext *ctx) {
+	unsigned char tmp[4];
+	size_t len;
+	int rc;
+
+	// Number of processed APDUs
+	len = encodeInteger(tmp, ctx->apducnt);
+	rc = encodeResponse(ctx, RAM_NUM_APDU, tmp, len);
+	if (rc < 0)
+		return rc;
+
+	tmp[0] = RAM_RES_TEMPL;
+	len = tlvEncodeLength(tmp + 1, ctx->writebuffer.len);
+	return insertByteBuffer(&ctx->writebuffer, tmp, len + 1);
+}
+
+
+
 /**
  * Process requests received from the server
  *
@@ -444,13 +546,12 @@ static int encodeInteger(unsigned char *p, int v) {
  */
 static int processRequests(struct ramContext *ctx) {
 	unsigned char *p,*v;
-	unsigned char tmp[4];
 	size_t len,tl;
-	int tag,rc,rrc,apducnt;
+	int tag,rc,rrc;
 
 	p = ctx->readbuffer.buffer;
 
-	if (*p != RAM_REQ_TEMPL)
+	if ((ctx->readbuffer.len < 2) || (*p != RAM_REQ_TEMPL))
 		return RAME_INVALID_REQ;
 
 	p++;
@@ -459,40 +560,86 @@ static int processRequests(struct ramContext *ctx) {
 		return RAME_INVALID_REQ;
 
 	rc = 0;
-	apducnt = 0;
+	ctx->apducnt = 0;
 	while (!rc && ((rc = tlvNext(&p, &len, &tag, &tl, &v)) > 0)) {
-		switch(tag) {
-		case RAM_CAPDU:
-			rc = processSendApdu(ctx, v, tl);
-			if (rc == 0)
-				apducnt++;
-			break;
-		case RAM_RESET:
-			rc = processReset(ctx);
-			break;
-		case RAM_NOTIFY:
-			rc = processNotify(ctx, v, tl);
-			break;
-		}
+		rc = processRequest(ctx, tag, v, tl);
 	}
 
 	// Even if processing is aborted, we encode a response template to notify the server
-
-	// Number of processed APDUs
-	tl = encodeInteger(tmp, apducnt);
-	rrc = encodeResponse(ctx, RAM_NUM_APDU, tmp, tl);
+	rrc = finishResponse(ctx);
 	if (rrc < 0)
 		return rrc;
 
-	tmp[0] = RAM_RES_TEMPL;
-	len = tlvEncodeLength(tmp + 1, ctx->writebuffer.len);
-	insertByteBuffer(&ctx->writebuffer, tmp, len + 1);
-
 	return rc;
 }
 
 
 
+/**
+ * Process all objects from the request template that have been completely received
+ *
+ * Processed objects are removed from the read buffer. After the first error, objects
+ * are still consumed but no longer processed.
+ *
+ * @param ctx The initialized context
+ * @return 0 or error code if the request is malformed
+ */
+static int processStream(struct ramContext *ctx) {
+	unsigned char *p;
+	size_t avail,len,hl;
+	int tag,rc;
+
+	p = ctx->readbuffer.buffer;
+	avail = ctx->readbuffer.len;
+
+	if (ctx->streamState == RAM_STREAM_HEADER) {
+		rc = tlvHeader(p, avail, &tag, &len, &hl);
+		if (rc <= 0)
+			return rc;
+
+		if (tag != RAM_REQ_TEMPL)
+			return RAME_INVALID_REQ;
+
+		p += hl;
+		avail -= hl;
+		ctx->streamRemaining = len;
+		ctx->streamState = RAM_STREAM_BODY;
+	}
+
+	while ((ctx->streamState == RAM_STREAM_BODY) && (ctx->streamRemaining > 0)) {
+		rc = tlvHeader(p, avail, &tag, &len, &hl);
+		if (rc < 0)
+			return rc;
+
+		if ((rc == 0) || (hl + len > avail))
+			break;
+
+		if (hl + len > ctx->streamRemaining)
+			return RAME_INVALID_REQ;
+
+		if (ctx->streamRc == 0)
+			ctx->streamRc = processRequest(ctx, tag, p + hl, len);
+
+		p += hl + len;
+		avail -= hl + len;
+		ctx->streamRemaining -= hl + len;
+	}
+
+	if ((ctx->streamState == RAM_STREAM_BODY) && (ctx->streamRemaining == 0))
+		ctx->streamState = RAM_STREAM_DONE;
+
+	// Data following the request template is ignored
+	if (ctx->streamState == RAM_STREAM_DONE)
+		avail = 0;
+
+	memmove(ctx->readbuffer.buffer, p, avail);
+	memset_s(ctx->readbuffer.buffer + avail, ctx->readbuffer.size - avail, 0, ctx->readbuffer.len - avail);
+	ctx->readbuffer.len = avail;
+	return 0;
+}
+
+
+
 /**
  * CURL call-back to process data send by the server
  *
@@ -505,10 +652,25 @@ static int processRequests(struct ramContext *ctx) {
 static size_t write_data(void *buffer, size_t size, size_t nmemb, void *userp) {
 	struct ramContext *c = (struct ramContext *)userp;
 	size_t len = size * nmemb;
+	long httpcode;
+	int rc;
 
 	if (addByteBuffer(&c->readbuffer, buffer, len) < 0)
 		return 0;
 
+	if (c->streaming) {
+		httpcode = 0;
+		curl_easy_getinfo((CURL *)c->curl, CURLINFO_RESPONSE_CODE, &httpcode);
+
+		if (httpcode == 200) {
+			rc = processStream(c);
+			if (rc < 0) {
+				c->streamRc = rc;
+				return 0;				// Abort transfer
+			}
+		}
+	}
+
 	return len;
 }
 
@@ -534,7 +696,8 @@ static size_t write_data(void *buffer, size_t size, size_t nmemb, void *userp) {
  * @return 0 or error code
  */
 int ramConnect(struct ramContext *ctx) {
-	struct curl_slist *headers=NULL;
+	struct curl_slist *headers;
+	struct ramByteBuffer swap;
 	CURLcode res;
 	long httpcode;
 	int rc,excnt;
@@ -546,27 +709,63 @@ int ramConnect(struct ramContext *ctx) {
 	if (!ctx->atr || !ctx->atrlen)
 		return RAME_GENERAL_ERROR;
 
-	curl = curl_easy_init();
-	curl_easy_setopt(curl, CURLOPT_URL, ctx->URL);
-
-	headers = curl_slist_append(headers, "Content-Type: application/org.openscdp-content-mgt-response;version=1.0");
-	headers = curl_slist_append(headers, "Accept: */*");
-	headers = curl_slist_append(headers, "X-Admin-Protocol: globalplatform-remote-admin/1.0");
+	if (ctx->curl == NULL) {
+		ctx->curl = curl_easy_init();
+		if (ctx->curl == NULL)
+			return RAME_CURL_ERROR;
+
+		headers = NULL;
+		headers = curl_slist_append(headers, "Content-Type: application/org.openscdp-content-mgt-response;version=1.0");
+		headers = curl_slist_append(headers, "Accept: */*");
+		headers = curl_slist_append(headers, "X-Admin-Protocol: globalplatform-remote-admin/1.0");
+		// Don't wait for 100-continue before sending larger responses
+		headers = curl_slist_append(headers, "Expect:");
+		ctx->headers = headers;
+	}
+	curl = (CURL *)ctx->curl;
 
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(curl, CURLOPT_URL, ctx->URL);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, (struct curl_slist *)ctx->headers);
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
 	curl_easy_setopt(curl, CURLOPT_WRITEDATA, ctx);
 	curl_easy_setopt(curl, CURLOPT_COOKIEFILE, "");
-	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 20L);
+	// A new session for each card, even if the connection is reused
+	curl_easy_setopt(curl, CURLOPT_COOKIELIST, "ALL");
+	if (ctx->streaming) {
+		// Commands are send to the card from write_data(), so a total timeout would include
+		// the processing time of the card. Only abort if the server stalls instead.
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT, 0L);
+		curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 20L);
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 20L);
+	} else {
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT, 20L);
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 0L);
+		curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 0L);
+	}
+	curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1L);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
 
 	clearByteBuffer(&ctx->writebuffer);
+	clearByteBuffer(&ctx->readbuffer);
 	makeInitiationRequest(ctx);
 
 	rc = 0;
 	excnt = 0;		// Counter number of received requests
 	do {
-		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, (void *)ctx->writebuffer.buffer);
-		curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)ctx->writebuffer.len);
+		// Responses for the next request are collected in the write buffer while sending
+		swap = ctx->postbuffer;
+		ctx->postbuffer = ctx->writebuffer;
+		ctx->writebuffer = swap;
+		clearByteBuffer(&ctx->writebuffer);
+
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, (void *)ctx->postbuffer.buffer);
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)ctx->postbuffer.len);
+
+		ctx->streamState = RAM_STREAM_HEADER;
+		ctx->streamRemaining = 0;
+		ctx->streamRc = 0;
+		ctx->apducnt = 0;
 
 		res = curl_easy_perform(curl);
 
@@ -582,16 +781,33 @@ int ramConnect(struct ramContext *ctx) {
 		case CURLE_COULDNT_CONNECT:
 			rc = RAME_CONNECT_FAILED;
 			break;
+		case CURLE_WRITE_ERROR:
+			rc = ctx->streamRc < 0 ? ctx->streamRc : RAME_CURL_ERROR;
+			break;
 		default:
 			rc = RAME_CURL_ERROR;
 			break;
 		}
 
+		httpcode = 0;
 		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &httpcode);
 
+		if ((httpcode == 200) && (res != CURLE_OK)) {
+			clearByteBuffer(&ctx->readbuffer);
+			break;
+		}
+
 		if (httpcode == 200) {
-			clearByteBuffer(&ctx->writebuffer);
-			rc = processRequests(ctx);
+			if (ctx->streaming) {
+				rc = ctx->streamRc;
+				if ((rc == 0) && (ctx->streamState != RAM_STREAM_DONE))
+					rc = RAME_INVALID_REQ;
+				// Even if processing is aborted, we encode a response template to notify the server
+				if (finishResponse(ctx) < 0)
+					rc = RAME_OUT_OF_MEMORY;
+			} else {
+				rc = processRequests(ctx);
+			}
 			clearByteBuffer(&ctx->readbuffer);
 			if ((rc != 0) && (rc != RAME_CARD_ERROR))
 				break;
@@ -613,11 +829,14 @@ int ramConnect(struct ramContext *ctx) {
 		rc = RAME_INVALID_URL;
 		break;
 	default:
-		printf("Server HTTP code %ld\n", httpcode);
-		rc = RAME_HTTP_CODE;
+		if (rc == 0) {
+			printf("Server HTTP code %ld\n", httpcode);
+			rc = RAME_HTTP_CODE;
+		}
 	}
 
-	curl_easy_cleanup(curl);
+	clearByteBuffer(&ctx->postbuffer);
+	clearByteBuffer(&ctx->readbuffer);
 	return rc;
 }
 
@@ -682,6 +901,12 @@ int ramNewContext(struct ramContext **ctx) {
 		return rc;
 	}
 
+	rc = initByteBuffer(&c->postbuffer, 512);
+	if (rc < 0) {
+		ramFreeContext(&c);
+		return rc;
+	}
+
 	*ctx = c;
 	return 0;
 }
@@ -695,8 +920,14 @@ int ramNewContext(struct ramContext **ctx) {
  * @return 0 or error code
  */
 void ramFreeContext(struct ramContext **ctx) {
+	if ((*ctx)->curl)
+		curl_easy_cleanup((CURL *)(*ctx)->curl);
+	if ((*ctx)->headers)
+		curl_slist_free_all((struct curl_slist *)(*ctx)->headers);
+
 	freeByteBuffer(&(*ctx)->readbuffer);
 	freeByteBuffer(&(*ctx)->writebuffer);
+	freeByteBuffer(&(*ctx)->postbuffer);
 
 	free(*ctx);
 	*ctx = NULL;
@@ -833,3 +1064,19 @@ void ramSetNotifyHandler(struct ramContext *ctx, ramNotify_t notifyHandler) {
 	ctx->notify = notifyHandler;
 }
 
+
+
+
+/**
+ * Enable processing of requests while they are received
+ *
+ * In streaming mode each command in the request template is send to the card as soon as
+ * it was received, rather than after the complete request was received from the server.
+ * This reduces the time required for large requests over slow connections.
+ *
+ * @param ctx The initialized context
+ * @param streaming 1 to enable or 0 to disable streaming
+ */
+void ramSetStreaming(struct ramContext *ctx, int streaming) {
+	ctx->streaming = streaming;
+}
@@ -99,6 +99,14 @@ struct ramContext {
 	ramSendApdu_t sendApdu;
 	ramReset_t reset;
 	ramNotify_t notify;
+	struct ramByteBuffer postbuffer;	// Responses currently send to the server
+	void *curl;					// CURL handle kept to reuse the connection
+	void *headers;				// HTTP header list used with the CURL handle
+	int streaming;				// Process requests while receiving
+	int streamState;			// Parser state for streaming
+	size_t streamRemaining;		// Remaining length of request template
+	int streamRc;				// First error while processing the stream
+	int apducnt;				// Number of processed APDUs
 };
 
 
@@ -112,6 +120,7 @@ void ramSetATR(struct ramContext *, unsigned char *, size_t);
 void ramSetSendApduHandler(struct ramContext *, ramSendApdu_t);
 void ramSetResetHandler(struct ramContext *, ramReset_t);
 void ramSetNotifyHandler(struct ramContext *, ramNotify_t);
+void ramSetStreaming(struct ramContext *, int);
 int ramConnect(struct ramContext *);
 void ramForceClose(struct ramContext *, char *msg);
 
@@ -58,6 +58,9 @@ extern "C" {
 
 #define CKC_CVC_TR3110				CKC_VENDOR_DEFINED + 0x00000001
 
+/* Operation rejected, because the limit of waiting operations for the slot is reached */
+#define CKR_SC_HSM_QUEUE_FULL			CKR_VENDOR_DEFINED + 0x00000001
+
 /* PKCS#1 V2.0 PSS with external calculated hash and MGF1 using the same hash*/
 #define CKM_SC_HSM_PSS_SHA1			CKC_VENDOR_DEFINED + 0x00000001
 #define CKM_SC_HSM_PSS_SHA224			CKC_VENDOR_DEFINED + 0x00000002
@@ -82,3 +85,101 @@ extern "C" {
 #endif
 #endif
 
+/* Vendor extension types require the PKCS#11 types from cryptoki.h ----- */
+
+#if defined(CK_PTR) && !defined(__SC_HSM_PKCS11_TYPES__)
+#define __SC_HSM_PKCS11_TYPES__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Operation queue statistics for a slot, wait times are in microseconds    */
+typedef struct CK_SC_HSM_SLOT_QUEUE_INFO {
+	CK_ULONG ulQueueDepth;			/* Operations currently waiting          */
+	CK_ULONG ulPeakQueueDepth;		/* Maximum number of waiting operations  */
+	CK_ULONG ulMaxQueueDepth;		/* Configured limit for waiting operations */
+	CK_ULONG ulInteractiveOperations;	/* Completed interactive operations      */
+	CK_ULONG ulBulkOperations;		/* Completed bulk operations             */
+	CK_ULONG ulRejectedOperations;		/* Operations rejected due to full queue */
+	CK_ULONG ulInteractiveWaitAvg;
+	CK_ULONG ulInteractiveWaitMax;
+	CK_ULONG ulBulkWaitAvg;
+	CK_ULONG ulBulkWaitMax;
+} CK_SC_HSM_SLOT_QUEUE_INFO;
+
+typedef CK_SC_HSM_SLOT_QUEUE_INFO * CK_SC_HSM_SLOT_QUEUE_INFO_PTR;
+
+/* Obtain queue statistics, exported by the module as SC_HSM_GetSlotQueueInfo */
+typedef CK_RV (*CK_SC_HSM_GETSLOTQUEUEINFO)(CK_SLOT_ID slotID, CK_SC_HSM_SLOT_QUEUE_INFO_PTR pInfo);
+
+/* Latency distribution in microseconds, percentiles are accurate to about 6% */
+typedef struct CK_SC_HSM_LATENCY {
+	CK_ULONG ulCount;			/* Number of samples                     */
+	CK_ULONG ulAverage;
+	CK_ULONG ulMedian;
+	CK_ULONG ulP90;
+	CK_ULONG ulP99;
+	CK_ULONG ulMax;
+} CK_SC_HSM_LATENCY;
+
+/* Performance counters for a slot                                         */
+typedef struct CK_SC_HSM_SLOT_STATISTICS {
+	CK_ULONG ulAPDUs;			/* Command APDUs sent to the card        */
+	CK_ULONG ulBytesSent;			/* Bytes in command APDUs                */
+	CK_ULONG ulBytesReceived;		/* Bytes in response APDUs               */
+	CK_ULONG ulTransmitErrors;		/* APDUs without a valid response        */
+	CK_ULONG ulSWSuccess;			/* SW1/SW2 9000                          */
+	CK_ULONG ulSWWarning;			/* SW1/SW2 61xx, 62xx and 63xx           */
+	CK_ULONG ulSWExecutionError;		/* SW1/SW2 64xx to 66xx                  */
+	CK_ULONG ulSWCheckingError;		/* SW1/SW2 67xx to 6Fxx                  */
+	CK_ULONG ulSWOther;			/* Any other SW1/SW2                     */
+	CK_SC_HSM_LATENCY cardTime;		/* Round trip of APDUs via the reader    */
+	CK_SC_HSM_LATENCY lockWait;		/* Wait for exclusive access to the card */
+	CK_SC_HSM_LATENCY queueWait;		/* Wait for operations of this process   */
+	CK_SC_HSM_LATENCY tokenValidation;	/* Check for token presence and changes  */
+} CK_SC_HSM_SLOT_STATISTICS;
+
+typedef CK_SC_HSM_SLOT_STATISTICS * CK_SC_HSM_SLOT_STATISTICS_PTR;
+
+/* Performance counters for a mechanism used on a slot                    */
+typedef struct CK_SC_HSM_MECHANISM_STATISTICS {
+	CK_ULONG ulOperations;			/* Completed operations                  */
+	CK_ULONG ulErrors;			/* Operations that failed                */
+	CK_SC_HSM_LATENCY latency;		/* Duration including queue and lock wait */
+} CK_SC_HSM_MECHANISM_STATISTICS;
+
+typedef CK_SC_HSM_MECHANISM_STATISTICS * CK_SC_HSM_MECHANISM_STATISTICS_PTR;
+
+/* Obtain slot counters, exported by the module as SC_HSM_GetSlotStatistics */
+typedef CK_RV (*CK_SC_HSM_GETSLOTSTATISTICS)(CK_SLOT_ID slotID, CK_SC_HSM_SLOT_STATISTICS_PTR pInfo);
+
+/* Obtain mechanism counters, exported by the module as SC_HSM_GetMechanismStatistics */
+typedef CK_RV (*CK_SC_HSM_GETMECHANISMSTATISTICS)(CK_SLOT_ID slotID, CK_MECHANISM_TYPE type, CK_SC_HSM_MECHANISM_STATISTICS_PTR pInfo);
+
+/* Supply the PIN to restore a login after the card was reset. On entry *pulPinLen */
+/* contains the size of pPin. Set *pulPinLen to 0 to use the PIN pad of the reader */
+typedef CK_RV (*CK_SC_HSM_RECOVERY_CALLBACK)(CK_SLOT_ID slotID, CK_USER_TYPE userType, CK_UTF8CHAR_PTR pPin, CK_ULONG_PTR pulPinLen, CK_VOID_PTR pApplication);
+
+/* Enable recovery after card reset, exported by the module as SC_HSM_SetResetRecovery */
+typedef CK_RV (*CK_SC_HSM_SETRESETRECOVERY)(CK_SC_HSM_RECOVERY_CALLBACK pCallback, CK_VOID_PTR pApplication);
+
+/* State of the pool of key pairs generated in advance for a token          */
+typedef struct CK_SC_HSM_KEY_POOL_INFO {
+	CK_ULONG ulPoolSize;			/* Configured number of key pairs per type */
+	CK_ULONG ulKeyTypes;			/* Number of configured key types        */
+	CK_ULONG ulAvailable;			/* Key pairs ready to be bound           */
+	CK_ULONG ulGenerated;			/* Key pairs generated in the background */
+	CK_ULONG ulServed;			/* Requests served with a pooled key pair */
+	CK_ULONG ulMissed;			/* Requests generated on demand          */
+} CK_SC_HSM_KEY_POOL_INFO;
+
+typedef CK_SC_HSM_KEY_POOL_INFO * CK_SC_HSM_KEY_POOL_INFO_PTR;
+
+/* Obtain key pool state, exported by the module as SC_HSM_GetKeyPoolInfo   */
+typedef CK_RV (*CK_SC_HSM_GETKEYPOOLINFO)(CK_SLOT_ID slotID, CK_SC_HSM_KEY_POOL_INFO_PTR pInfo);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -2450,6 +2450,162 @@ void decodeArgs(int argc, char **argv)
 }
 
 
+/*
+ * Encrypt and decrypt a message longer than a single APDU in parts of uneven length
+ * with a non-zero IV, using the same buffer for input and output. The result must
+ * match the single-part operation with the same IV.
+ */
+int testAESMultiPart(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session, CK_OBJECT_HANDLE hnd)
+{
+	CK_BYTE iv[16];
+	CK_MECHANISM mech = { CKM_AES_CBC, iv, sizeof(iv) };
+	CK_ULONG parts[] = { 1000, 77, 1, 2018, 0 };
+	CK_BYTE plain[4096], buff[4096], single[4096];
+	CK_ULONG len, outlen, ofs, outofs, i, singlelen;
+	int rc;
+
+	for (i = 0; i < sizeof(iv); i++)
+		iv[i] = (CK_BYTE)(0xA5 ^ i);
+
+	for (i = 0; i < sizeof(plain); i++)
+		plain[i] = (CK_BYTE)(i * 7);
+
+	printf("Calling C_EncryptInit() with IV");
+	rc = p11->C_EncryptInit(session, &mech, hnd);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	printf("Calling C_Encrypt() with %lu bytes", (CK_ULONG)sizeof(plain));
+	singlelen = sizeof(single);
+	rc = p11->C_Encrypt(session, plain, sizeof(plain), single, &singlelen);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict((rc == CKR_OK) && (singlelen == sizeof(plain))));
+
+	memcpy(buff, plain, sizeof(buff));
+
+	printf("Calling C_EncryptInit() with IV");
+	rc = p11->C_EncryptInit(session, &mech, hnd);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	ofs = 0;
+	outofs = 0;
+	for (i = 0; ofs < sizeof(buff); i++) {
+		len = parts[i] ? parts[i] : sizeof(buff) - ofs;
+		printf("Calling C_EncryptUpdate() in place with %lu bytes", len);
+		outlen = sizeof(buff) - outofs;
+		rc = p11->C_EncryptUpdate(session, buff + ofs, len, buff + outofs, &outlen);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+		if (rc != CKR_OK)
+			return rc;
+		ofs += len;
+		outofs += outlen;
+	}
+
+	printf("Calling C_EncryptFinal()");
+	len = sizeof(buff) - outofs;
+	rc = p11->C_EncryptFinal(session, buff + outofs, &len);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+	outofs += len;
+
+	printf("Compare with single-part ciphertext... %s\n", verdict((outofs == singlelen) && !memcmp(buff, single, singlelen)));
+
+	printf("Calling C_DecryptInit() with IV");
+	rc = p11->C_DecryptInit(session, &mech, hnd);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	ofs = 0;
+	outofs = 0;
+	for (i = 0; ofs < sizeof(buff); i++) {
+		len = parts[i] ? parts[i] : sizeof(buff) - ofs;
+		printf("Calling C_DecryptUpdate() in place with %lu bytes", len);
+		outlen = sizeof(buff) - outofs;
+		rc = p11->C_DecryptUpdate(session, buff + ofs, len, buff + outofs, &outlen);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+		if (rc != CKR_OK)
+			return rc;
+		ofs += len;
+		outofs += outlen;
+	}
+
+	printf("Calling C_DecryptFinal()");
+	len = sizeof(buff) - outofs;
+	rc = p11->C_DecryptFinal(session, buff + outofs, &len);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+	outofs += len;
+
+	printf("Verify plaintext... %s\n", verdict((outofs == sizeof(plain)) && !memcmp(buff, plain, sizeof(plain))));
+
+	printf("Calling C_DecryptInit() with IV");
+	rc = p11->C_DecryptInit(session, &mech, hnd);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	printf("Calling C_Decrypt() in place with %lu bytes", singlelen);
+	len = singlelen;
+	rc = p11->C_Decrypt(session, single, singlelen, single, &len);
+	printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+	printf("Verify plaintext... %s\n", verdict((len == sizeof(plain)) && !memcmp(single, plain, sizeof(plain))));
+
+	return rc;
+}
+
+
+
+/*
+ * Calculate the CMAC of messages that are block aligned, not block aligned and longer than
+ * the data sent in a single APDU, both in a single part and in parts of uneven length.
+ * The multi-part result must match the single-part result.
+ */
+int testAESCMACMultiPart(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session, CK_OBJECT_HANDLE hnd)
+{
+	CK_MECHANISM mech = { CKM_AES_CMAC, 0, 0 };
+	CK_ULONG lengths[] = { 64, 100, 4096, 4109 };
+	CK_ULONG parts[] = { 17, 1000, 1, 2018, 77 };
+	CK_BYTE plain[4109], single[16], multi[16];
+	CK_ULONG len, ofs, i, j, singlelen, multilen;
+	int rc = CKR_OK;
+
+	for (i = 0; i < sizeof(plain); i++)
+		plain[i] = (CK_BYTE)(i * 7);
+
+	for (j = 0; j < sizeof(lengths) / sizeof(*lengths); j++) {
+		printf("Calling C_SignInit()");
+		rc = p11->C_SignInit(session, &mech, hnd);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		printf("Calling C_Sign() with %lu bytes", lengths[j]);
+		singlelen = sizeof(single);
+		rc = p11->C_Sign(session, plain, lengths[j], single, &singlelen);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict((rc == CKR_OK) && (singlelen == sizeof(single))));
+
+		printf("Calling C_SignInit()");
+		rc = p11->C_SignInit(session, &mech, hnd);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		ofs = 0;
+		for (i = 0; ofs < lengths[j]; i++) {
+			len = parts[i % (sizeof(parts) / sizeof(*parts))];
+			if (len > lengths[j] - ofs)
+				len = lengths[j] - ofs;
+			printf("Calling C_SignUpdate() with %lu bytes", len);
+			rc = p11->C_SignUpdate(session, plain + ofs, len);
+			printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+			if (rc != CKR_OK)
+				return rc;
+			ofs += len;
+		}
+
+		printf("Calling C_SignFinal()");
+		multilen = sizeof(multi);
+		rc = p11->C_SignFinal(session, multi, &multilen);
+		printf("- %s : %s\n", id2name(p11CKRName, rc, 0, namebuf), verdict(rc == CKR_OK));
+
+		printf("Compare with single-part CMAC... %s\n", verdict((multilen == singlelen) && !memcmp(multi, single, singlelen)));
+	}
+
+	return rc;
+}
+
+
+
 int testAES(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
 {
 	CK_OBJECT_CLASS class = CKO_SECRET_KEY;
@@ -2510,6 +2666,8 @@ int testAES(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
 		printf("Plain:\n%s\n", scr);
 		printf("Verify plaintext... %s\n", verdict(memcmp(ciphertext, tbs, len) == 0));
 
+		testAESMultiPart(p11, session, hnd);
+
 		mech.mechanism = CKM_AES_CMAC;
 
 		printf("Calling C_SignInit()");
@@ -2531,6 +2689,8 @@ int testAES(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
 		bin2str(scr, sizeof(scr), signature, len);
 		printf("Signature:\n%s\n", scr);
 
+		testAESCMACMultiPart(p11, session, hnd);
+
 		keyno++;
 	}
 
@@ -0,0 +1,591 @@
+/**
+ * SmartCard-HSM PKCS#11 Module
+ *
+ * Copyright (c) 2013, CardContact Systems GmbH, Minden, Germany
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of CardContact Systems GmbH nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL CardContact Systems GmbH BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * @file unit-test.c
+ * @author Andreas Schwier
+ * @brief Unit test for decoders and crypto functions that do not require a token
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <common/asn1.h>
+#include <common/cvc.h>
+#include <common/pkcs15.h>
+
+#include <pkcs11/certificateobject.h>
+#include <pkcs11/reclaim.h>
+
+#ifdef ENABLE_LIBCRYPTO
+#include <pkcs11/crypto.h>
+#endif
+
+
+
+static int testscompleted = 0;
+static int testsfailed = 0;
+
+
+
+static char *verdict(int condition) {
+	testscompleted++;
+
+	if (condition) {
+		return "Passed";
+	} else {
+		testsfailed++;
+		return "Failed";
+	}
+}
+
+
+
+/*
+ * Card verifiable certificate with ECC public key, CHR UTTEST00001 and CAR UTCA00001
+ */
+static unsigned char testcvc[] = {
+	0x7F, 0x21, 0x81, 0xB5, 0x7F, 0x4E, 0x6F, 0x5F, 0x29, 0x01, 0x00, 0x42, 0x09, 0x55, 0x54, 0x43,
+	0x41, 0x30, 0x30, 0x30, 0x30, 0x31, 0x7F, 0x49, 0x4F, 0x06, 0x0A, 0x04, 0x00, 0x7F, 0x00, 0x07,
+	0x02, 0x02, 0x02, 0x02, 0x03, 0x86, 0x41, 0x04, 0x03, 0x20, 0x3D, 0x5A, 0x77, 0x94, 0xB1, 0xCE,
+	0xEB, 0x08, 0x25, 0x42, 0x5F, 0x7C, 0x99, 0xB6, 0xD3, 0xF0, 0x0D, 0x2A, 0x47, 0x64, 0x81, 0x9E,
+	0xBB, 0xD8, 0xF5, 0x12, 0x2F, 0x4C, 0x69, 0x86, 0xA3, 0xC0, 0xDD, 0xFA, 0x17, 0x34, 0x51, 0x6E,
+	0x8B, 0xA8, 0xC5, 0xE2, 0xFF, 0x1C, 0x39, 0x56, 0x73, 0x90, 0xAD, 0xCA, 0xE7, 0x04, 0x21, 0x3E,
+	0x5B, 0x78, 0x95, 0xB2, 0xCF, 0xEC, 0x09, 0x26, 0x5F, 0x20, 0x0B, 0x55, 0x54, 0x54, 0x45, 0x53,
+	0x54, 0x30, 0x30, 0x30, 0x30, 0x31, 0x5F, 0x37, 0x40, 0x05, 0x16, 0x27, 0x38, 0x49, 0x5A, 0x6B,
+	0x7C, 0x8D, 0x9E, 0xAF, 0xC0, 0xD1, 0xE2, 0xF3, 0x04, 0x15, 0x26, 0x37, 0x48, 0x59, 0x6A, 0x7B,
+	0x8C, 0x9D, 0xAE, 0xBF, 0xD0, 0xE1, 0xF2, 0x03, 0x14, 0x25, 0x36, 0x47, 0x58, 0x69, 0x7A, 0x8B,
+	0x9C, 0xAD, 0xBE, 0xCF, 0xE0, 0xF1, 0x02, 0x13, 0x24, 0x35, 0x46, 0x57, 0x68, 0x79, 0x8A, 0x9B,
+	0xAC, 0xBD, 0xCE, 0xDF, 0xF0, 0x01, 0x12, 0x23, 0x34
+};
+
+
+
+/*
+ * Self-signed X.509 certificate with ECC prime256v1 key, serial 0123456789ABCDEF and extensions
+ */
+static unsigned char testeccert[] = {
+	0x30, 0x82, 0x01, 0xA0, 0x30, 0x82, 0x01, 0x46, 0xA0, 0x03, 0x02, 0x01, 0x02, 0x02, 0x08, 0x01,
+	0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF, 0x30, 0x0A, 0x06, 0x08, 0x2A, 0x86, 0x48, 0xCE, 0x3D,
+	0x04, 0x03, 0x02, 0x30, 0x2D, 0x31, 0x15, 0x30, 0x13, 0x06, 0x03, 0x55, 0x04, 0x03, 0x0C, 0x0C,
+	0x55, 0x6E, 0x69, 0x74, 0x20, 0x54, 0x65, 0x73, 0x74, 0x20, 0x45, 0x43, 0x31, 0x14, 0x30, 0x12,
+	0x06, 0x03, 0x55, 0x04, 0x0A, 0x0C, 0x0B, 0x43, 0x61, 0x72, 0x64, 0x43, 0x6F, 0x6E, 0x74, 0x61,
+	0x63, 0x74, 0x30, 0x1E, 0x17, 0x0D, 0x32, 0x36, 0x31, 0x30, 0x31, 0x38, 0x31, 0x34, 0x33, 0x33,
+	0x35, 0x31, 0x5A, 0x17, 0x0D, 0x33, 0x36, 0x31, 0x30, 0x31, 0x35, 0x31, 0x34, 0x33, 0x33, 0x35,
+	0x31, 0x5A, 0x30, 0x2D, 0x31, 0x15, 0x30, 0x13, 0x06, 0x03, 0x55, 0x04, 0x03, 0x0C, 0x0C, 0x55,
+	0x6E, 0x69, 0x74, 0x20, 0x54, 0x65, 0x73, 0x74, 0x20, 0x45, 0x43, 0x31, 0x14, 0x30, 0x12, 0x06,
+	0x03, 0x55, 0x04, 0x0A, 0x0C, 0x0B, 0x43, 0x61, 0x72, 0x64, 0x43, 0x6F, 0x6E, 0x74, 0x61, 0x63,
+	0x74, 0x30, 0x59, 0x30, 0x13, 0x06, 0x07, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x02, 0x01, 0x06, 0x08,
+	0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x03, 0x01, 0x07, 0x03, 0x42, 0x00, 0x04, 0x30, 0x69, 0x81, 0xC7,
+	0xF3, 0xDF, 0x9A, 0xDB, 0xD5, 0x39, 0xDE, 0x4C, 0x7E, 0xD6, 0x14, 0x22, 0x8E, 0x7E, 0x34, 0x3D,
+	0x51, 0x76, 0x45, 0x6A, 0x09, 0x7A, 0x44, 0xB4, 0xFE, 0xAE, 0x03, 0x32, 0xDF, 0x34, 0x75, 0x79,
+	0xDE, 0x6A, 0xA0, 0x77, 0xD7, 0xCB, 0xD7, 0xB3, 0x86, 0x13, 0x3B, 0xE8, 0xB1, 0x3C, 0xC6, 0xCD,
+	0x75, 0x72, 0x47, 0x68, 0xFB, 0x5C, 0x1A, 0x57, 0x48, 0xC6, 0x87, 0x20, 0xA3, 0x50, 0x30, 0x4E,
+	0x30, 0x1D, 0x06, 0x03, 0x55, 0x1D, 0x0E, 0x04, 0x16, 0x04, 0x14, 0xE4, 0x74, 0xBE, 0x4C, 0x67,
+	0xE9, 0xEF, 0x7C, 0xC1, 0x77, 0xA4, 0x54, 0x81, 0x36, 0xF6, 0x78, 0xAE, 0x3F, 0x64, 0x25, 0x30,
+	0x1F, 0x06, 0x03, 0x55, 0x1D, 0x23, 0x04, 0x18, 0x30, 0x16, 0x80, 0x14, 0xE4, 0x74, 0xBE, 0x4C,
+	0x67, 0xE9, 0xEF, 0x7C, 0xC1, 0x77, 0xA4, 0x54, 0x81, 0x36, 0xF6, 0x78, 0xAE, 0x3F, 0x64, 0x25,
+	0x30, 0x0C, 0x06, 0x03, 0x55, 0x1D, 0x13, 0x01, 0x01, 0xFF, 0x04, 0x02, 0x30, 0x00, 0x30, 0x0A,
+	0x06, 0x08, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x04, 0x03, 0x02, 0x03, 0x48, 0x00, 0x30, 0x45, 0x02,
+	0x21, 0x00, 0x99, 0x8F, 0x35, 0x5C, 0xF3, 0xB9, 0x91, 0xE7, 0xD8, 0x62, 0xAF, 0x7B, 0x94, 0xF3,
+	0x0F, 0x13, 0xF6, 0x9E, 0xC7, 0x75, 0x05, 0x8B, 0x40, 0x51, 0x0F, 0xA4, 0xB3, 0x44, 0x95, 0xEC,
+	0x1F, 0x7D, 0x02, 0x20, 0x12, 0x17, 0x92, 0x85, 0x65, 0x6F, 0x4D, 0x2A, 0xC2, 0xC8, 0xBB, 0xA8,
+	0xDA, 0xA8, 0x91, 0xFD, 0xBF, 0xF1, 0x2C, 0x18, 0xE2, 0x74, 0x61, 0x85, 0x2B, 0xD1, 0x90, 0x34,
+	0x03, 0xD2, 0xE1, 0x6A
+};
+
+
+
+/*
+ * Self-signed X.509 certificate with RSA 1024 bit key, serial 2 and extensions
+ */
+static unsigned char testrsacert[] = {
+	0x30, 0x82, 0x01, 0xF9, 0x30, 0x82, 0x01, 0x62, 0xA0, 0x03, 0x02, 0x01, 0x02, 0x02, 0x01, 0x02,
+	0x30, 0x0D, 0x06, 0x09, 0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x01, 0x0B, 0x05, 0x00, 0x30,
+	0x18, 0x31, 0x16, 0x30, 0x14, 0x06, 0x03, 0x55, 0x04, 0x03, 0x0C, 0x0D, 0x55, 0x6E, 0x69, 0x74,
+	0x20, 0x54, 0x65, 0x73, 0x74, 0x20, 0x52, 0x53, 0x41, 0x30, 0x1E, 0x17, 0x0D, 0x32, 0x36, 0x31,
+	0x30, 0x31, 0x38, 0x31, 0x34, 0x33, 0x33, 0x35, 0x31, 0x5A, 0x17, 0x0D, 0x33, 0x36, 0x31, 0x30,
+	0x31, 0x35, 0x31, 0x34, 0x33, 0x33, 0x35, 0x31, 0x5A, 0x30, 0x18, 0x31, 0x16, 0x30, 0x14, 0x06,
+	0x03, 0x55, 0x04, 0x03, 0x0C, 0x0D, 0x55, 0x6E, 0x69, 0x74, 0x20, 0x54, 0x65, 0x73, 0x74, 0x20,
+	0x52, 0x53, 0x41, 0x30, 0x81, 0x9F, 0x30, 0x0D, 0x06, 0x09, 0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D,
+	0x01, 0x01, 0x01, 0x05, 0x00, 0x03, 0x81, 0x8D, 0x00, 0x30, 0x81, 0x89, 0x02, 0x81, 0x81, 0x00,
+	0xE7, 0x94, 0x4D, 0xB9, 0xED, 0x46, 0x2C, 0x1F, 0xE4, 0x25, 0xB2, 0x88, 0x4B, 0xE7, 0xDE, 0x90,
+	0x46, 0x5E, 0xBB, 0x7C, 0x56, 0xAC, 0xFD, 0x68, 0x1C, 0xA8, 0xA5, 0x5B, 0xBF, 0x77, 0x04, 0x42,
+	0x33, 0x01, 0x06, 0x24, 0x9F, 0xFC, 0xD4, 0x3B, 0xB7, 0xA2, 0xBC, 0xA7, 0xD3, 0x12, 0xB1, 0xE0,
+	0xC1, 0x48, 0x36, 0xF6, 0x46, 0x5B, 0x0B, 0x04, 0x6F, 0xC1, 0xF2, 0x12, 0x89, 0x80, 0x4E, 0x7A,
+	0x26, 0x6A, 0x41, 0x6D, 0x27, 0xDA, 0xA9, 0xC5, 0x2D, 0xD8, 0x58, 0x26, 0x3C, 0x9D, 0xEE, 0x15,
+	0xFB, 0x3D, 0x4E, 0xF3, 0x72, 0x48, 0x9B, 0xF8, 0x32, 0x51, 0x62, 0x02, 0xD4, 0x6D, 0x2A, 0xA2,
+	0x88, 0x51, 0x1C, 0xBE, 0x0D, 0x12, 0x7D, 0x75, 0x26, 0x2F, 0xD4, 0xA3, 0x3E, 0xE5, 0x5E, 0x3D,
+	0x23, 0x1B, 0xF8, 0xC5, 0xD2, 0x43, 0x6B, 0x98, 0xAA, 0x57, 0xF9, 0x50, 0x73, 0xB2, 0x7C, 0x2D,
+	0x02, 0x03, 0x01, 0x00, 0x01, 0xA3, 0x53, 0x30, 0x51, 0x30, 0x1D, 0x06, 0x03, 0x55, 0x1D, 0x0E,
+	0x04, 0x16, 0x04, 0x14, 0x95, 0x09, 0x5F, 0x4A, 0x96, 0xA5, 0xF7, 0x96, 0x63, 0x0A, 0x33, 0x9D,
+	0x0F, 0x0F, 0x19, 0xC0, 0x03, 0x45, 0x9A, 0x1C, 0x30, 0x1F, 0x06, 0x03, 0x55, 0x1D, 0x23, 0x04,
+	0x18, 0x30, 0x16, 0x80, 0x14, 0x95, 0x09, 0x5F, 0x4A, 0x96, 0xA5, 0xF7, 0x96, 0x63, 0x0A, 0x33,
+	0x9D, 0x0F, 0x0F, 0x19, 0xC0, 0x03, 0x45, 0x9A, 0x1C, 0x30, 0x0F, 0x06, 0x03, 0x55, 0x1D, 0x13,
+	0x01, 0x01, 0xFF, 0x04, 0x05, 0x30, 0x03, 0x01, 0x01, 0xFF, 0x30, 0x0D, 0x06, 0x09, 0x2A, 0x86,
+	0x48, 0x86, 0xF7, 0x0D, 0x01, 0x01, 0x0B, 0x05, 0x00, 0x03, 0x81, 0x81, 0x00, 0x58, 0xE7, 0x06,
+	0xAE, 0xA0, 0xD9, 0xA7, 0xEC, 0xB5, 0xD9, 0x9E, 0x09, 0x85, 0x2D, 0x4D, 0x62, 0xDC, 0x9C, 0x63,
+	0x68, 0x2A, 0x9E, 0x90, 0xA6, 0xF2, 0xC2, 0x7F, 0x50, 0x57, 0xAD, 0x4A, 0xB4, 0x20, 0x17, 0xFE,
+	0x79, 0x47, 0x19, 0x4F, 0x10, 0x18, 0x4A, 0xBF, 0xC0, 0xD1, 0x38, 0xCF, 0xCA, 0xC8, 0xA4, 0xDA,
+	0x3D, 0xEE, 0xAF, 0xB2, 0x59, 0xA6, 0x33, 0x52, 0x28, 0xCB, 0x84, 0x64, 0x69, 0x7D, 0xB0, 0x9A,
+	0x3F, 0x24, 0x4E, 0xF9, 0xE3, 0xBA, 0x4C, 0x6C, 0x3C, 0x2C, 0x4C, 0x70, 0xDC, 0xAB, 0xD3, 0x6D,
+	0xC7, 0xC5, 0x2A, 0x3A, 0x63, 0x06, 0x51, 0x46, 0xEF, 0xFF, 0xC2, 0x8E, 0x04, 0x93, 0xC3, 0x7D,
+	0xBA, 0x5A, 0x06, 0x0E, 0x8C, 0x41, 0xB1, 0xE3, 0x82, 0x4C, 0x45, 0xA5, 0x46, 0x45, 0x3E, 0xA7,
+	0xD3, 0xAE, 0xD1, 0xE5, 0x70, 0xBA, 0xA9, 0xBB, 0x45, 0x52, 0x42, 0xD8, 0xFD
+};
+
+
+
+void testASN1Cursor()
+{
+	unsigned char nested[] = { 0x30, 0x08, 0x30, 0x03, 0x04, 0x01, 0xAA, 0x02, 0x01, 0x05 };
+	unsigned char longform[] = { 0x04, 0x81, 0x80 };
+	unsigned char buff[sizeof(longform) + 0x80];
+	struct asn1Cursor cursor, child;
+	int rc;
+
+	printf("Internal ASN.1 selftest\n");
+	testASN1();
+
+	asn1InitCursor(&cursor, nested, sizeof(nested));
+	rc = asn1CursorFindPath(&cursor, (unsigned char *)"\x30\x02", 2);
+	printf("Find INTEGER after nested SEQUENCE - %d : %s\n", rc, verdict((rc == 1) && (cursor.value == nested + 9) && (cursor.length == 1)));
+
+	rc = asn1CursorNext(&cursor);
+	printf("No sibling after INTEGER - %d : %s\n", rc, verdict(rc == 0));
+
+	asn1InitCursor(&cursor, nested, sizeof(nested));
+	asn1CursorNext(&cursor);
+	asn1CursorEnter(&cursor, &child);
+	asn1CursorNext(&child);
+	asn1CursorEnter(&child, &cursor);
+	rc = asn1CursorNext(&cursor);
+	printf("Enter nested OCTET STRING - %d : %s\n", rc, verdict((rc == 1) && (cursor.tag == 0x04) && (*cursor.value == 0xAA)));
+
+	nested[3] = 0x07;
+	asn1InitCursor(&cursor, nested, sizeof(nested));
+	asn1CursorNext(&cursor);
+	asn1CursorEnter(&cursor, &child);
+	rc = asn1CursorNext(&child);
+	printf("Reject inner object exceeding enclosing object - %d : %s\n", rc, verdict(rc == -1));
+	nested[3] = 0x03;
+
+	memcpy(buff, longform, sizeof(longform));
+	memset(buff + sizeof(longform), 0x55, 0x80);
+	asn1InitCursor(&cursor, buff, sizeof(buff));
+	rc = asn1CursorNext(&cursor);
+	printf("Decode long form length - %d : %s\n", rc, verdict((rc == 1) && (cursor.length == 0x80) && (cursor.next == buff + sizeof(buff))));
+
+	asn1InitCursor(&cursor, buff, sizeof(buff) - 1);
+	rc = asn1CursorNext(&cursor);
+	printf("Reject long form length exceeding buffer - %d : %s\n", rc, verdict(rc == -1));
+}
+
+
+
+void testCVCDecoder()
+{
+	struct cvc cvc;
+	unsigned char scr[sizeof(testcvc)];
+	int rc, len, failed;
+
+	rc = cvcDecode(testcvc, sizeof(testcvc), &cvc);
+	printf("Decode CVC - %d : %s\n", rc, verdict(rc == (int)sizeof(testcvc)));
+	printf("Verify CHR, CAR, public key and signature : %s\n", verdict(
+		(cvc.chr.len == 11) && !memcmp(cvc.chr.val, "UTTEST00001", 11) &&
+		(cvc.car.len == 9) && !memcmp(cvc.car.val, "UTCA00001", 9) &&
+		(cvc.pukoid.len == 10) && (cvc.publicPoint.len == 65) && (*cvc.publicPoint.val == 0x04) &&
+		(cvc.primeOrModulus.val == NULL) && (cvc.signature.len == 64)));
+
+	failed = 0;
+	for (len = 0; len < (int)sizeof(testcvc); len++) {
+		// Copy, so that reading beyond the truncated certificate is detected by memory checkers
+		memcpy(scr, testcvc, len);
+		if (cvcDecode(scr, len, &cvc) >= 0)
+			failed++;
+	}
+	printf("Reject all truncated encodings - %d accepted : %s\n", failed, verdict(failed == 0));
+
+	memcpy(scr, testcvc, sizeof(testcvc));
+	scr[24]++;
+	rc = cvcDecode(scr, sizeof(scr), &cvc);
+	printf("Reject public key exceeding certificate body - %d : %s\n", rc, verdict(rc < 0));
+}
+
+
+
+void testPKCS15Decoder()
+{
+	struct p15PrivateKeyDescription prkd, *pprkd;
+	struct p15CertificateDescription cd, *pcd;
+	struct p15Arena arena;
+	unsigned char buff[512], arenabuff[P15_ARENA_SIZE(sizeof(buff))];
+	struct bytebuffer_s bb = { buff, 0, sizeof(buff) };
+	unsigned char id[] = { 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x5B, 0x5C, 0x5D, 0x5E, 0x5F, 0x60, 0x61, 0x62, 0x63, 0x64 };
+	unsigned char efid[] = { 0xCE, 0x03 };
+	int rc, len, failed;
+
+	memset(&prkd, 0, sizeof(prkd));
+	prkd.keytype = P15_KT_EC;
+	prkd.coa.label = "Test Key";
+	prkd.id.val = id;
+	prkd.id.len = sizeof(id);
+	prkd.usage = P15_SIGN | P15_DERIVE;
+	prkd.keysize = 256;
+
+	rc = encodePrivateKeyDescription(&bb, &prkd);
+	printf("Encode private key description - %d : %s\n", rc, verdict((rc > 0) && !bbHasFailed(&bb)));
+	len = (int)bbGetLength(&bb);
+
+	p15InitArena(&arena, arenabuff, P15_ARENA_SIZE(len));
+	rc = decodePrivateKeyDescriptionInArena(buff, len, &arena, &pprkd);
+	printf("Decode private key description in arena - %d : %s\n", rc, verdict(rc == 0));
+	printf("Verify decoded private key description : %s\n", verdict((rc == 0) &&
+		(pprkd->keytype == P15_KT_EC) && !strcmp(pprkd->coa.label, "Test Key") &&
+		(pprkd->id.len == sizeof(id)) && !memcmp(pprkd->id.val, id, sizeof(id)) &&
+		(pprkd->usage == prkd.usage) && (pprkd->keysize == 256)));
+	printf("Label and id allocated in arena : %s\n", verdict((rc == 0) &&
+		((unsigned char *)pprkd->coa.label > arenabuff) && ((unsigned char *)pprkd->coa.label < arenabuff + arena.used) &&
+		(pprkd->id.val > arenabuff) && (pprkd->id.val < arenabuff + arena.used)));
+
+	p15ReleaseArena(&arena);
+	printf("Release arena : %s\n", verdict(arena.used == 0));
+
+	p15InitArena(&arena, arenabuff, sizeof(struct p15PrivateKeyDescription));
+	rc = decodePrivateKeyDescriptionInArena(buff, len, &arena, &pprkd);
+	printf("Reject exhausted arena - %d : %s\n", rc, verdict(rc < 0));
+
+	rc = decodePrivateKeyDescription(buff, len, &pprkd);
+	printf("Decode private key description on heap - %d : %s\n", rc, verdict((rc == 0) &&
+		!strcmp(pprkd->coa.label, "Test Key") && (pprkd->id.len == sizeof(id)) && !memcmp(pprkd->id.val, id, sizeof(id))));
+	freePrivateKeyDescription(&pprkd);
+
+	failed = 0;
+	p15InitArena(&arena, arenabuff, sizeof(arenabuff));
+	for (rc = 0; rc < len; rc++) {
+		if (decodePrivateKeyDescriptionInArena(buff, rc, &arena, &pprkd) == 0)
+			failed++;
+		p15ReleaseArena(&arena);
+	}
+	printf("Reject all truncated encodings - %d accepted : %s\n", failed, verdict(failed == 0));
+
+	memset(&cd, 0, sizeof(cd));
+	cd.certtype = P15_CT_X509;
+	cd.coa.label = "Test Certificate";
+	cd.id.val = id;
+	cd.id.len = sizeof(id);
+	cd.efidOrPath.val = efid;
+	cd.efidOrPath.len = sizeof(efid);
+
+	rc = encodeCertificateDescription(&bb, &cd);
+	printf("Encode certificate description - %d : %s\n", rc, verdict((rc > 0) && !bbHasFailed(&bb)));
+	len = (int)bbGetLength(&bb);
+
+	p15InitArena(&arena, arenabuff, P15_ARENA_SIZE(len));
+	rc = decodeCertificateDescriptionInArena(buff, len, &arena, &pcd);
+	printf("Decode certificate description in arena - %d : %s\n", rc, verdict((rc == 0) &&
+		(pcd->certtype == P15_CT_X509) && !strcmp(pcd->coa.label, "Test Certificate") &&
+		(pcd->id.len == sizeof(id)) && !memcmp(pcd->id.val, id, sizeof(id))));
+	p15ReleaseArena(&arena);
+}
+
+
+
+static int isField(struct p11CertificateField *field, unsigned int offset, unsigned int length)
+{
+	return (field->offset == offset) && (field->length == length);
+}
+
+
+
+static void initCertificateObject(struct p11Object_t *obj, unsigned char *cert, size_t certlen)
+{
+	CK_ATTRIBUTE attr = { CKA_VALUE, cert, (CK_ULONG)certlen };
+
+	memset(obj, 0, sizeof(*obj));
+	addAttribute(obj, &attr);
+}
+
+
+
+void testCertificateIndex()
+{
+	struct p11Object_t obj;
+	struct p11CertificateIndex *index, *index2;
+	struct p11Attribute_t *pattr;
+	CK_ATTRIBUTE modulus, exponent, ecparams, point;
+	unsigned char encappuk[80];
+	int rc, len, failed;
+
+	initCertificateObject(&obj, testeccert, sizeof(testeccert));
+	rc = getCertificateIndex(&obj, &index);
+	printf("Index ECC certificate - %d : %s\n", rc, verdict(rc == 0));
+	if (rc != 0) {
+		removeAllAttributes(&obj);
+		return;
+	}
+
+	printf("Verify TBS, serial, issuer and subject : %s\n", verdict(
+		isField(&index->tbs, 4, 330) && isField(&index->serial, 13, 10) &&
+		isField(&index->issuer, 35, 47) && isField(&index->subject, 114, 47)));
+	printf("Verify SPKI, parameters, public key and extensions : %s\n", verdict(
+		isField(&index->spki, 161, 91) && isField(&index->parameters, 174, 10) &&
+		isField(&index->publicKey, 186, 66) && isField(&index->extensions, 254, 80)));
+
+	rc = getCertificateIndex(&obj, &index2);
+	printf("Index retained with object - %d : %s\n", rc, verdict((rc == 0) && (index2 == index)));
+
+	rc = decodeECParamsFromSPKI(index, &ecparams);
+	printf("Decode EC parameters - %d : %s\n", rc, verdict((rc == 0) && (ecparams.ulValueLen == 10) &&
+		!memcmp(ecparams.pValue, "\x06\x08\x2A\x86\x48\xCE\x3D\x03\x01\x07", 10)));
+
+	rc = decodeECPointFromSPKI(index, &point, encappuk, sizeof(encappuk));
+	printf("Decode EC point - %d : %s\n", rc, verdict((rc == 0) && (point.ulValueLen == 67) &&
+		!memcmp(encappuk, "\x04\x41\x04", 3) && !memcmp(encappuk + 3, testeccert + 188, 64)));
+
+	rc = decodeModulusExponentFromSPKI(index, &modulus, &exponent);
+	printf("Reject RSA decoding of ECC key - %d : %s\n", rc, verdict(rc < 0));
+
+	rc = populateIssuerSubjectSerial(&obj);
+	printf("Populate issuer, subject and serial - %d : %s\n", rc, verdict((rc == 0) &&
+		(findAttribute(&obj, CKA_SUBJECT, &pattr) >= 0) && (pattr->attrData.ulValueLen == 47) &&
+		!memcmp(pattr->attrData.pValue, testeccert + 114, 47) &&
+		(findAttribute(&obj, CKA_SERIAL_NUMBER, &pattr) >= 0) && (pattr->attrData.ulValueLen == 10) &&
+		!memcmp(pattr->attrData.pValue, testeccert + 13, 10)));
+
+	findAttribute(&obj, CKA_VALUE, &pattr);
+	removeAttribute(&obj, &pattr->attrData);
+	printf("Drop index with CKA_VALUE : %s\n", verdict(obj.certIndex == NULL));
+	removeAllAttributes(&obj);
+
+	initCertificateObject(&obj, testrsacert, sizeof(testrsacert));
+	rc = getCertificateIndex(&obj, &index);
+	printf("Index RSA certificate - %d : %s\n", rc, verdict((rc == 0) &&
+		isField(&index->serial, 13, 3) && isField(&index->parameters, 131, 2) &&
+		isField(&index->publicKey, 136, 141) && isField(&index->extensions, 279, 83)));
+
+	if (rc == 0) {
+		rc = decodeModulusExponentFromSPKI(index, &modulus, &exponent);
+		findAttribute(&obj, CKA_VALUE, &pattr);
+		printf("Decode modulus and exponent - %d : %s\n", rc, verdict((rc == 0) &&
+			(modulus.ulValueLen == 128) && (modulus.pValue == (unsigned char *)pattr->attrData.pValue + 144) &&
+			(exponent.ulValueLen == 3) && !memcmp(exponent.pValue, "\x01\x00\x01", 3)));
+	}
+	removeAllAttributes(&obj);
+
+	failed = 0;
+	for (len = 1; len < (int)sizeof(testeccert); len++) {
+		initCertificateObject(&obj, testeccert, len);
+		if (getCertificateIndex(&obj, &index) == 0)
+			failed++;
+		removeAllAttributes(&obj);
+	}
+	printf("Reject all truncated encodings - %d accepted : %s\n", failed, verdict(failed == 0));
+}
+
+
+/*
+ * Elements released by releaseElement()
+ */
+static int released[4];
+
+
+
+static void releaseElement(void *ptr)
+{
+	(*(int *)ptr)++;
+}
+
+
+
+static void testReclaim()
+{
+	int rc;
+
+	memset(released, 0, sizeof(released));
+	retirePointer(&released[0], releaseElement);
+	printf("Release immediately without initialization : %s\n", verdict(released[0] == 1));
+
+	memset(released, 0, sizeof(released));
+	rc = initReclaim();
+	printf("Initialize reclamation - %d : %s\n", rc, verdict(rc == CKR_OK));
+
+	retirePointer(&released[0], releaseElement);
+	printf("Release immediately without readers : %s\n", verdict(released[0] == 1));
+
+	enterReadSection();
+	enterReadSection();
+	retirePointer(&released[1], releaseElement);
+	leaveReadSection();
+	retirePointer(&released[0], releaseElement);
+	printf("Defer release within nested read section : %s\n", verdict(released[1] == 0));
+	leaveReadSection();
+	retirePointer(&released[0], releaseElement);
+	printf("Release after leaving read section : %s\n", verdict(released[1] == 1));
+
+	protectPointer(HAZARD_OBJECT, &released[2]);
+	retirePointer(&released[2], releaseElement);
+	printf("Defer release of protected element : %s\n", verdict(released[2] == 0));
+
+	rc = enterHazardScope();
+	protectPointer(HAZARD_OBJECT, &released[3]);
+	retirePointer(&released[3], releaseElement);
+	printf("Keep outer protection in hazard scope - %d : %s\n", rc, verdict((rc == CKR_OK) && (released[2] == 0) && (released[3] == 0)));
+	leaveHazardScope();
+	retirePointer(&released[0], releaseElement);
+	printf("Release element protected in hazard scope : %s\n", verdict((released[3] == 1) && (released[2] == 0)));
+
+	protectPointer(HAZARD_OBJECT, NULL);
+	retirePointer(&released[0], releaseElement);
+	printf("Release element after clearing hazard slot : %s\n", verdict(released[2] == 1));
+
+	enterReadSection();
+	retirePointer(&released[1], releaseElement);
+	leaveReadSection();
+	terminateReclaim();
+	printf("Release pending elements on termination : %s\n", verdict(released[1] == 2));
+}
+
+
+
+#ifdef ENABLE_LIBCRYPTO
+/*
+ * Check the intermediate hash value against the digest calculated by libcrypto
+ *
+ * The message is padded as defined for the hash algorithm and followed by one more byte,
+ * so that all padded blocks are hashed. The chaining state is then the digest of the message.
+ */
+static int checkIntermediateHash(CK_MECHANISM_TYPE mech, CK_ULONG bs, CK_ULONG statelen, unsigned char *msg, CK_ULONG len)
+{
+	struct p11Session_t session;
+	CK_MECHANISM mechanism = { mech, NULL, 0 };
+	unsigned char data[1200], state[80], digest[64];
+	CK_ULONG padlen, hashed, slen, dlen, i;
+	unsigned long long bits;
+
+	memcpy(data, msg, len);
+	padlen = len + 1;
+	data[len] = 0x80;
+	while ((padlen % bs) != bs - (bs >> 3))
+		data[padlen++] = 0;
+
+	// Length field, with the upper half of the 128 bit field of SHA-384/512 always zero
+	for (i = 0; i < (bs >> 3) - 8; i++)
+		data[padlen++] = 0;
+	bits = (unsigned long long)len << 3;
+	for (i = 0; i < 8; i++)
+		data[padlen++] = (unsigned char)(bits >> (56 - (i << 3)));
+
+	data[padlen] = 0xA5;
+
+	if (cryptoIntermediateHash(mech, data, padlen + 1, &hashed, state, &slen) != CKR_OK)
+		return 0;
+
+	if ((hashed != padlen) || (slen != statelen))
+		return 0;
+
+	bits = 0;
+	for (i = slen - 8; i < slen; i++)
+		bits = (bits << 8) | state[i];
+
+	if (bits != (unsigned long long)padlen << 3)
+		return 0;
+
+	memset(&session, 0, sizeof(session));
+	dlen = sizeof(digest);
+	if ((cryptoDigestInit(&session, &mechanism) != CKR_OK) ||
+		(cryptoDigest(&session, msg, len, digest, &dlen) != CKR_OK))
+		return 0;
+
+	return !memcmp(state, digest, dlen);
+}
+
+
+
+void testIntermediateHash()
+{
+	static struct {
+		CK_MECHANISM_TYPE mech;
+		char *name;
+		CK_ULONG bs;
+		CK_ULONG statelen;
+	} hashes[] = {
+		{ CKM_SHA_1, "SHA-1", 64, 28 },
+		{ CKM_SHA224, "SHA-224", 64, 40 },
+		{ CKM_SHA256, "SHA-256", 64, 40 },
+		{ CKM_SHA384, "SHA-384", 128, 80 },
+		{ CKM_SHA512, "SHA-512", 128, 80 }
+	};
+	CK_ULONG lengths[] = { 0, 1, 55, 56, 64, 111, 112, 128, 200, 1000 };
+	unsigned char msg[1000], state[80];
+	CK_ULONG hashed, slen;
+	int i, j, rc;
+
+	for (i = 0; i < (int)sizeof(msg); i++)
+		msg[i] = (unsigned char)(i * 13 + 7);
+
+	for (i = 0; i < (int)(sizeof(hashes) / sizeof(*hashes)); i++) {
+		for (j = 0; j < (int)(sizeof(lengths) / sizeof(*lengths)); j++) {
+			rc = checkIntermediateHash(hashes[i].mech, hashes[i].bs, hashes[i].statelen, msg, lengths[j]);
+			printf("%s intermediate hash of %lu byte message : %s\n", hashes[i].name, lengths[j], verdict(rc));
+		}
+
+		rc = cryptoIntermediateHash(hashes[i].mech, msg, hashes[i].bs, &hashed, state, &slen);
+		printf("%s leaves single block unhashed - %lu : %s\n", hashes[i].name, hashed, verdict((rc == CKR_OK) && (hashed == 0) && (slen == hashes[i].statelen)));
+
+		rc = cryptoIntermediateHash(hashes[i].mech, msg, 0, &hashed, state, &slen);
+		printf("%s hashes nothing for empty message - %lu : %s\n", hashes[i].name, hashed, verdict((rc == CKR_OK) && (hashed == 0)));
+
+		rc = cryptoIntermediateHash(hashes[i].mech, msg, sizeof(msg), &hashed, state, &slen);
+		printf("%s leaves last partial block unhashed - %lu : %s\n", hashes[i].name, hashed, verdict((rc == CKR_OK) && (hashed == ((sizeof(msg) - 1) / hashes[i].bs) * hashes[i].bs)));
+	}
+
+	rc = cryptoIntermediateHash(CKM_MD5, msg, sizeof(msg), &hashed, state, &slen);
+	printf("Reject unsupported hash - %d : %s\n", rc, verdict(rc == CKR_MECHANISM_INVALID));
+}
+#endif
+
+
+
+int main(int argc, char *argv[])
+{
+	testASN1Cursor();
+	testCVCDecoder();
+	testPKCS15Decoder();
+	testCertificateIndex();
+	testReclaim();
+#ifdef ENABLE_LIBCRYPTO
+	testIntermediateHash();
+#endif
+
+	printf("Unit test finished.\n");
+	printf("%d tests performed.\n", testscompleted);
+	printf("%d tests failed.\n", testsfailed);
+
+	return testsfailed ? 1 : 0;
+}